@@ -0,0 +1,408 @@
+#include "../src/parser.h"
+#include "../src/executor.h"
+#include "../src/history.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Performance benchmark harness for the mini shell.
+ *
+ * Every benchmark collects a fixed number of samples (after a warm-up) and
+ * reports the median and 99th percentile of the per-sample time, plus a
+ * derived throughput where it makes sense. Results are printed as a table
+ * and written as JSON; with --baseline the medians are compared against a
+ * previous JSON file and the run fails if any benchmark got slower than the
+ * threshold.
+ *
+ * Usage: bench_runner [--shell PATH] [--json FILE] [--baseline FILE]
+ *                     [--threshold PERCENT] [--quick]
+ */
+
+#define MAX_BENCHMARKS 16
+#define PARSE_BATCH 1000
+#define PIPELINE_STAGES 4
+#define PIPELINE_BYTES (8 * 1024 * 1024)
+#define FANOUT_BRANCHES 3
+
+typedef struct
+{
+  const char *name;
+  const char *unit; /* unit of the throughput column, or NULL */
+  double work;      /* units of work per sample, for the throughput */
+  double median_ns;
+  double p99_ns;
+  double throughput;
+  int samples;
+} bench_result_t;
+
+static bench_result_t results[MAX_BENCHMARKS];
+static int result_count = 0;
+static int quick = 0;
+static const char *shell_path = "./shell";
+static char work_dir[] = "/tmp/mini_shell_bench_XXXXXX";
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * record - Sort the samples of one benchmark and store its summary.
+ */
+static void record(const char *name, double *samples, int n, const char *unit, double work)
+{
+  qsort(samples, n, sizeof(double), compare_double);
+
+  bench_result_t *r = &results[result_count++];
+  r->name = name;
+  r->unit = unit;
+  r->work = work;
+  r->samples = n;
+  r->median_ns = samples[n / 2];
+  r->p99_ns = samples[(int)((n - 1) * 0.99)];
+  r->throughput = unit ? work / (r->median_ns / 1e9) : 0;
+}
+
+static int scaled(int samples)
+{
+  return quick ? (samples / 10 > 3 ? samples / 10 : 3) : samples;
+}
+
+/**
+ * bench_parse - parse_command() + free_command() over a mix of lines.
+ */
+static void bench_parse(void)
+{
+  static const char *lines[] = {
+      "ls -la",
+      "grep pattern < input.txt > output.txt",
+      "cat file.txt | grep pattern | sort | uniq -c | wc -l",
+      "gcc -Wall -O2 -o output file.c -lm",
+      "sleep 100 &",
+      "echo \"quoted argument with spaces\" plain $(date)",
+  };
+  int nlines = sizeof(lines) / sizeof(lines[0]);
+  int n = scaled(200);
+  double *samples = malloc(n * sizeof(double));
+
+  for (int s = -n / 10; s < n; s++)
+  {
+    double start = now_ns();
+    for (int i = 0; i < PARSE_BATCH; i++)
+      free_command(parse_command(lines[i % nlines]));
+    if (s >= 0)
+      samples[s] = (now_ns() - start) / PARSE_BATCH;
+  }
+
+  record("parse", samples, n, "lines/s", 1);
+  free(samples);
+}
+
+/**
+ * time_command - Run one command line through execute_command().
+ */
+static double time_command(const char *line)
+{
+  command_t *cmd = parse_command(line);
+  double start = now_ns();
+  execute_command(cmd);
+  double elapsed = now_ns() - start;
+  free_command(cmd);
+  return elapsed;
+}
+
+static void bench_command(const char *name, const char *line, int n, const char *unit, double work)
+{
+  double *samples = malloc(n * sizeof(double));
+
+  for (int s = -3; s < n; s++)
+  {
+    double t = time_command(line);
+    if (s >= 0)
+      samples[s] = t;
+  }
+
+  record(name, samples, n, unit, work);
+  free(samples);
+}
+
+/**
+ * bench_pipeline - Push a file through PIPELINE_STAGES cat stages, and
+ * fan it out to FANOUT_BRANCHES cat branches.
+ */
+static void bench_pipeline(void)
+{
+  char data[PATH_MAX], line[PATH_MAX * 2];
+  snprintf(data, sizeof(data), "%s/pipeline.dat", work_dir);
+
+  char *block = malloc(PIPELINE_BYTES);
+  memset(block, 'x', PIPELINE_BYTES);
+  for (int i = 79; i < PIPELINE_BYTES; i += 80)
+    block[i] = '\n';
+  int fd = open(data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, block, PIPELINE_BYTES) != PIPELINE_BYTES)
+    perror("bench: pipeline data");
+  close(fd);
+  free(block);
+
+  int len = snprintf(line, sizeof(line), "cat < %s", data);
+  for (int i = 1; i < PIPELINE_STAGES; i++)
+    len += snprintf(line + len, sizeof(line) - len, " | cat");
+  snprintf(line + len, sizeof(line) - len, " > /dev/null");
+
+  bench_command("pipeline_4_stage", line, scaled(30), "MB/s", PIPELINE_BYTES / 1e6);
+
+  len = snprintf(line, sizeof(line), "cat < %s", data);
+  for (int i = 0; i < FANOUT_BRANCHES; i++)
+    len += snprintf(line + len, sizeof(line) - len, " |> cat > /dev/null");
+  bench_command("fanout_3_branch", line, scaled(30), "MB/s", PIPELINE_BYTES / 1e6);
+}
+
+/**
+ * bench_history - Append cost and tail-read cost of the history log.
+ */
+static void bench_history(void)
+{
+  int n = scaled(1000);
+  double *samples = malloc(n * sizeof(double));
+
+  for (int s = 0; s < n; s++)
+  {
+    double start = now_ns();
+    add_cmd_history("cat file.txt | grep pattern | wc -l\n", 0, 0, 0);
+    samples[s] = now_ns() - start;
+  }
+  record("history_append", samples, n, "appends/s", 1);
+
+  for (int s = 0; s < n; s++)
+  {
+    double start = now_ns();
+    free(get_cmd_history());
+    samples[s] = now_ns() - start;
+  }
+  record("history_read", samples, n, "reads/s", 1);
+
+  free(samples);
+}
+
+/**
+ * bench_cold_start - Spawn `shell -c true` and wait for it.
+ */
+static void bench_cold_start(void)
+{
+  extern char **environ;
+  int n = scaled(100);
+  double *samples = malloc(n * sizeof(double));
+  char *argv[] = {(char *)shell_path, "-c", "true", NULL};
+
+  if (access(shell_path, X_OK) != 0)
+  {
+    fprintf(stderr, "bench: %s not found, skipping cold_start\n", shell_path);
+    free(samples);
+    return;
+  }
+
+  for (int s = -3; s < n; s++)
+  {
+    pid_t pid;
+    double start = now_ns();
+    int err = posix_spawn(&pid, shell_path, NULL, NULL, argv, environ);
+    if (err != 0)
+    {
+      fprintf(stderr, "bench: spawning %s: %s, skipping cold_start\n", shell_path, strerror(err));
+      free(samples);
+      return;
+    }
+    waitpid(pid, NULL, 0);
+    if (s >= 0)
+      samples[s] = now_ns() - start;
+  }
+
+  record("cold_start", samples, n, NULL, 0);
+  free(samples);
+}
+
+/**
+ * write_json - Write the results as JSON, one benchmark per line.
+ */
+static int write_json(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  if (!out)
+  {
+    perror(path);
+    return -1;
+  }
+
+  fprintf(out, "{\"benchmarks\": [\n");
+  for (int i = 0; i < result_count; i++)
+  {
+    bench_result_t *r = &results[i];
+    fprintf(out, "  {\"name\": \"%s\", \"samples\": %d, \"median_ns\": %.1f, \"p99_ns\": %.1f",
+            r->name, r->samples, r->median_ns, r->p99_ns);
+    if (r->unit)
+      fprintf(out, ", \"throughput\": %.1f, \"unit\": \"%s\"", r->throughput, r->unit);
+    fprintf(out, "}%s\n", i + 1 < result_count ? "," : "");
+  }
+  fprintf(out, "]}\n");
+  return fclose(out);
+}
+
+/**
+ * baseline_median - Find a benchmark's median in a JSON file written by
+ * write_json().
+ *
+ * Return: the median in nanoseconds, or -1 if it is not present.
+ */
+static double baseline_median(const char *json, const char *name)
+{
+  char key[128];
+  snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+  const char *p = strstr(json, key);
+  if (!p)
+    return -1;
+  p = strstr(p, "\"median_ns\": ");
+  return p ? strtod(p + strlen("\"median_ns\": "), NULL) : -1;
+}
+
+/**
+ * read_file - Read a whole file into a NUL-terminated heap string.
+ */
+static char *read_file(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  if (!in)
+  {
+    perror(path);
+    return NULL;
+  }
+
+  char *text = NULL;
+  size_t cap = 0;
+  ssize_t len = getdelim(&text, &cap, '\0', in);
+  fclose(in);
+  if (len < 0)
+  {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/**
+ * compare_baseline - Report the change of every median against a baseline.
+ *
+ * Return: the number of benchmarks that regressed by more than threshold
+ *         percent.
+ */
+static int compare_baseline(const char *json, const char *path, double threshold)
+{
+  int regressions = 0;
+
+  printf("\nComparison with %s (threshold %.0f%%)\n", path, threshold);
+  for (int i = 0; i < result_count; i++)
+  {
+    double base = baseline_median(json, results[i].name);
+    if (base <= 0)
+    {
+      printf("  %-18s   (not in baseline)\n", results[i].name);
+      continue;
+    }
+    double change = (results[i].median_ns - base) * 100.0 / base;
+    int regressed = change > threshold;
+    regressions += regressed;
+    printf("  %-18s %+8.1f%%%s\n", results[i].name, change, regressed ? "  REGRESSION" : "");
+  }
+  return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *json_path = "bench_output.json";
+  const char *baseline = NULL;
+  double threshold = 10;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--shell") == 0 && i + 1 < argc)
+      shell_path = argv[++i];
+    else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+      json_path = argv[++i];
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+      baseline = argv[++i];
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      threshold = atof(argv[++i]);
+    else if (strcmp(argv[i], "--quick") == 0)
+      quick = 1;
+    else
+    {
+      fprintf(stderr, "usage: %s [--shell PATH] [--json FILE] [--baseline FILE] "
+                      "[--threshold PERCENT] [--quick]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  // Read the baseline first: it may be the file this run overwrites
+  char *baseline_json = NULL;
+  if (baseline && !(baseline_json = read_file(baseline)))
+    return 1;
+
+  if (!mkdtemp(work_dir))
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  char history[PATH_MAX];
+  snprintf(history, sizeof(history), "%s/history.bin", work_dir);
+  setenv("HISTFILE", history, 1);
+
+  bench_parse();
+  bench_command("launch", "true", scaled(300), "launches/s", 1);
+  bench_pipeline();
+  bench_command("pipeline_builtin", "history | head -n 5 | wc -l > /dev/null", scaled(300), "pipelines/s", 1);
+  bench_history();
+  bench_cold_start();
+
+  printf("%-18s %8s %14s %14s %16s\n", "benchmark", "samples", "median", "p99", "throughput");
+  for (int i = 0; i < result_count; i++)
+  {
+    bench_result_t *r = &results[i];
+    printf("%-18s %8d %11.2f us %11.2f us", r->name, r->samples, r->median_ns / 1e3, r->p99_ns / 1e3);
+    if (r->unit)
+      printf(" %12.0f %s", r->throughput, r->unit);
+    printf("\n");
+  }
+
+  int rc = write_json(json_path) == 0 ? 0 : 1;
+  if (baseline_json)
+  {
+    if (compare_baseline(baseline_json, baseline, threshold) != 0)
+      rc = 1;
+    free(baseline_json);
+  }
+
+  char data[PATH_MAX];
+  snprintf(data, sizeof(data), "%s/pipeline.dat", work_dir);
+  unlink(data);
+  unlink(history);
+  rmdir(work_dir);
+  return rc;
+}
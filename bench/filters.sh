@@ -0,0 +1,63 @@
+#!/bin/sh
+# Text filter benchmark.
+#
+# Compares the builtin filters (head -n, wc -l, grep -F, cut -f) with the
+# coreutils programs on a large CSV-like file, reading it
+#
+#   file: through `<` (the builtins mmap it)
+#   pipe: from `cat FILE |`
+#
+# coreutils runs with LC_ALL=C, its fastest setting. Output goes to a file,
+# not /dev/null, which grep would notice and stop at the first match. Each
+# figure is the best of R runs, including the shell's startup.
+#
+# Usage: bench/filters.sh [LINES] [R]
+
+LINES=${1:-4000000}
+R=${2:-3}
+SHELL_BIN=${SHELL_BIN:-./shell}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+export HISTFILE="$WORK/history.bin"
+DATA="$WORK/data.csv"
+
+now_ns() {
+  date +%s%N
+}
+
+# best INTERPRETER SCRIPT: prints the fastest of R runs in microseconds
+best() {
+  min=0
+  i=0
+  while [ $i -lt "$R" ]; do
+    start=$(now_ns)
+    "$1" < "$2" > "$WORK/out" 2>&1
+    end=$(now_ns)
+    us=$(( (end - start) / 1000 ))
+    if [ $min -eq 0 ] || [ $us -lt $min ]; then min=$us; fi
+    i=$((i + 1))
+  done
+  echo $min
+}
+
+# run NAME INTERPRETER COMMAND
+run() {
+  echo "$3" > "$WORK/script.sh"
+  us=$(best "$2" "$WORK/script.sh")
+  printf '%-34s %10d us  %8d MB/s\n' "$1" "$us" $(( BYTES / (us + 1) ))
+}
+
+awk -v n="$LINES" 'BEGIN {
+  for (i = 1; i <= n; i++)
+    printf "%d,user%d,%s,%d.%02d,%s\n", i, i % 9973, (i % 97 == 0 ? "needle" : "hay"), i % 1000, i % 100, "some free text field"
+}' > "$DATA"
+BYTES=$(wc -c < "$DATA")
+echo "$LINES lines, $BYTES bytes"
+
+for filter in "wc -l" "head -n $((LINES / 2))" "grep -F needle" "grep -F -c needle" "cut -d , -f 2,4"; do
+  run "builtin file: $filter" "$SHELL_BIN" "$filter < $DATA"
+  run "builtin pipe: $filter" "$SHELL_BIN" "cat $DATA | $filter"
+  run "coreutils file: $filter" sh "LC_ALL=C $filter < $DATA"
+  run "coreutils pipe: $filter" sh "cat $DATA | LC_ALL=C $filter"
+done
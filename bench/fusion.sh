@@ -0,0 +1,55 @@
+#!/bin/sh
+# Pipeline fusion benchmark.
+#
+# Compares builtin-heavy pipelines with fusion on (builtin stages as threads
+# joined by ring buffers), fusion off (every stage forked) and bash (external
+# head/wc).
+#
+#   latency:    N runs of `history | head -n 5 | wc -l`
+#   throughput: `cat FILE | head -n LINES | wc -l` over a large file
+#
+# Usage: bench/fusion.sh [N] [LINES]
+
+N=${1:-300}
+LINES=${2:-2000000}
+SHELL_BIN=${SHELL_BIN:-./shell}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+export HISTFILE="$WORK/history.bin"
+
+now_ns() {
+  date +%s%N
+}
+
+# run NAME INTERPRETER SCRIPT UNITS UNIT_NAME
+run() {
+  start=$(now_ns)
+  "$2" < "$3" > /dev/null 2>&1
+  end=$(now_ns)
+  total_us=$(( (end - start) / 1000 ))
+  printf '%-30s %10d us  %8d %s\n' "$1" "$total_us" $(( $4 * 1000000 / (total_us + 1) )) "$5"
+}
+
+seq 1 "$LINES" > "$WORK/data.txt"
+
+i=0
+while [ $i -lt "$N" ]; do
+  echo 'history | head -n 5 | wc -l' >> "$WORK/latency.sh"
+  i=$((i + 1))
+done
+echo "cat $WORK/data.txt | head -n $LINES | wc -l" > "$WORK/throughput.sh"
+
+for mode in fusion nofusion; do
+  if [ $mode = fusion ]; then opt='set -o fusion'; else opt='set +o fusion'; fi
+  { echo "$opt"; cat "$WORK/latency.sh"; } > "$WORK/latency_$mode.sh"
+  { echo "$opt"; cat "$WORK/throughput.sh"; } > "$WORK/throughput_$mode.sh"
+  run "shell latency ($mode)" "$SHELL_BIN" "$WORK/latency_$mode.sh" "$N" "pipelines/s"
+  run "shell throughput ($mode)" "$SHELL_BIN" "$WORK/throughput_$mode.sh" "$LINES" "lines/s"
+done
+
+if command -v bash > /dev/null; then
+  sed 's/^history/cat \/dev\/null/' "$WORK/latency.sh" > "$WORK/latency_bash.sh"
+  run "bash latency (external)" bash "$WORK/latency_bash.sh" "$N" "pipelines/s"
+  run "bash throughput (external)" bash "$WORK/throughput.sh" "$LINES" "lines/s"
+fi
@@ -0,0 +1,450 @@
+#include "../src/record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Session replay for performance regression testing.
+ *
+ * Reads a session recorded with SHELL_RECORD=FILE and feeds its command
+ * lines to one or two shell builds through their standard input, so they
+ * go through the same read loop as an interactive session. Each build runs
+ * in a fresh sandbox directory (a copy of --dir, if given) with its own
+ * HOME, history and cache, and records the replay itself; the latencies of
+ * the two recordings are then compared: percentiles of the whole session,
+ * the command words whose time changed most, and commands whose exit
+ * status differs.
+ *
+ * With one shell the recorded latencies serve as the baseline. Lines are
+ * sent as fast as the shell reads them, or with --paced at the recorded
+ * pace. With --threshold the run fails if the candidate's median or 90th
+ * percentile got slower by more than PERCENT.
+ *
+ * Usage: replay_runner [--paced] [--dir TEMPLATE] [--runs N]
+ *                      [--threshold PERCENT] SESSION [BASELINE_SHELL] SHELL
+ */
+
+#define TOP_WORDS 10
+#define SHOW_MISMATCHES 5
+
+typedef struct
+{
+  const char *name;
+  double *latency_us; /* run r, command i at [r * session_count + i] */
+  int *status;        /* per command, first run */
+  int count;          /* commands replayed in every run */
+  int runs;
+} build_t;
+
+static record_entry_t *session;
+static int session_count;
+static int paced = 0;
+static const char *template_dir = NULL;
+
+static int64_t monotonic_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * run_tool - Run a helper program (cp, rm) and wait for it.
+ */
+static int run_tool(char *const argv[])
+{
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0)
+    return -1;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * feed - Write the session's lines to the shell's input.
+ */
+static void feed(int fd)
+{
+  int64_t begin = monotonic_us();
+
+  for (int i = 0; i < session_count; i++)
+  {
+    if (paced)
+    {
+      int64_t wait = begin + (session[i].start_us - session[0].start_us) - monotonic_us();
+      if (wait > 0)
+      {
+        struct timespec ts = {wait / 1000000, (wait % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    size_t len = strlen(session[i].line);
+    char *text = malloc(len + 1);
+    memcpy(text, session[i].line, len);
+    text[len] = '\n';
+    ssize_t written = write(fd, text, len + 1);
+    free(text);
+    // The shell has exited (an `exit` in the session)
+    if (written < 0)
+      break;
+  }
+}
+
+/**
+ * replay - Run the session through one shell build once.
+ *
+ * Return: the build's own recording of the replay, or NULL on failure
+ */
+static record_entry_t *replay(const char *shell, int *count)
+{
+  char run_dir[] = "/tmp/mini_shell_replay_XXXXXX";
+  char sandbox[PATH_MAX], path[PATH_MAX];
+
+  if (!mkdtemp(run_dir))
+  {
+    perror("mkdtemp");
+    return NULL;
+  }
+  snprintf(sandbox, sizeof(sandbox), "%s/sandbox", run_dir);
+  mkdir(sandbox, 0700);
+  if (template_dir)
+  {
+    snprintf(path, sizeof(path), "%s/.", template_dir);
+    char *cp[] = {"cp", "-a", path, sandbox, NULL};
+    if (run_tool(cp) != 0)
+      fprintf(stderr, "replay: could not copy %s\n", template_dir);
+  }
+
+  int in[2];
+  if (pipe(in) < 0)
+  {
+    perror("pipe");
+    return NULL;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    snprintf(path, sizeof(path), "%s/output.log", run_dir);
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    dup2(in[0], STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out);
+
+    setenv("HOME", sandbox, 1);
+    snprintf(path, sizeof(path), "%s/history.bin", run_dir);
+    setenv("HISTFILE", path, 1);
+    snprintf(path, sizeof(path), "%s/cache", run_dir);
+    setenv("SHELL_CACHE_DIR", path, 1);
+    snprintf(path, sizeof(path), "%s/replay.rec", run_dir);
+    setenv("SHELL_RECORD", path, 1);
+    unsetenv("SHELL_TRACE");
+    unsetenv("SHELL_METRICS_SOCKET");
+
+    if (chdir(sandbox) == 0)
+      execl(shell, shell, (char *)NULL);
+    perror(shell);
+    _exit(127);
+  }
+
+  close(in[0]);
+  if (pid > 0)
+    feed(in[1]);
+  close(in[1]);
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+
+  snprintf(path, sizeof(path), "%s/replay.rec", run_dir);
+  record_entry_t *entries = record_load(path, count);
+  if (!entries)
+    fprintf(stderr, "replay: %s produced no recording\n", shell);
+
+  char *rm[] = {"rm", "-rf", run_dir, NULL};
+  run_tool(rm);
+  return entries;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * collect - Add one recording's latencies to a build's samples.
+ */
+static void collect(build_t *b, record_entry_t *entries, int count)
+{
+  if (count > session_count)
+    count = session_count;
+  if (b->runs == 0)
+  {
+    b->count = count;
+    b->status = malloc((count + 1) * sizeof(int));
+    for (int i = 0; i < count; i++)
+      b->status[i] = entries[i].status;
+  }
+  else if (count < b->count)
+    b->count = count;
+
+  b->latency_us = realloc(b->latency_us, (b->runs + 1) * session_count * sizeof(double));
+  for (int i = 0; i < count; i++)
+    b->latency_us[b->runs * session_count + i] = entries[i].latency_us;
+  b->runs++;
+}
+
+// Every run's latencies of the commands all runs got to, sorted
+static double *sorted_samples(build_t *b, int *n)
+{
+  double *sorted = malloc((b->runs * b->count + 1) * sizeof(double));
+  *n = 0;
+  for (int r = 0; r < b->runs; r++)
+    for (int i = 0; i < b->count; i++)
+      sorted[(*n)++] = b->latency_us[r * session_count + i];
+  qsort(sorted, *n, sizeof(double), compare_double);
+  return sorted;
+}
+
+// Mean latency of one command over the runs
+static double mean_latency(build_t *b, int i)
+{
+  double sum = 0;
+  for (int r = 0; r < b->runs; r++)
+    sum += b->latency_us[r * session_count + i];
+  return sum / b->runs;
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+  return n ? sorted[(int)((n - 1) * p)] : 0;
+}
+
+static void print_row(const char *name, double a, double b)
+{
+  printf("%-8s %12.0f us %12.0f us %+9.1f%%\n", name, a, b, a > 0 ? (b - a) * 100 / a : 0);
+}
+
+/**
+ * print_distribution - Percentiles of both builds side by side.
+ *
+ * Return: the relative change of the median and of the 90th percentile
+ */
+static void print_distribution(build_t *a, build_t *b, double *p50_change, double *p90_change)
+{
+  int na, nb;
+  double *sa = sorted_samples(a, &na);
+  double *sb = sorted_samples(b, &nb);
+  double total_a = 0, total_b = 0;
+  for (int i = 0; i < na; i++)
+    total_a += sa[i];
+  for (int i = 0; i < nb; i++)
+    total_b += sb[i];
+
+  printf("%-8s %15s %15s %10s\n", "", a->name, b->name, "change");
+  static const struct
+  {
+    const char *name;
+    double p;
+  } rows[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"max", 1}};
+  for (int i = 0; i < 4; i++)
+    print_row(rows[i].name, percentile(sa, na, rows[i].p), percentile(sb, nb, rows[i].p));
+  print_row("mean", na ? total_a / na : 0, nb ? total_b / nb : 0);
+
+  double a50 = percentile(sa, na, 0.5), b50 = percentile(sb, nb, 0.5);
+  double a90 = percentile(sa, na, 0.9), b90 = percentile(sb, nb, 0.9);
+  *p50_change = a50 > 0 ? (b50 - a50) * 100 / a50 : 0;
+  *p90_change = a90 > 0 ? (b90 - a90) * 100 / a90 : 0;
+  free(sa);
+  free(sb);
+}
+
+typedef struct
+{
+  char word[32];
+  double total_a, total_b;
+  int calls;
+} word_t;
+
+static int by_change(const void *x, const void *y)
+{
+  const word_t *a = x, *b = y;
+  double da = a->total_b - a->total_a, db = b->total_b - b->total_a;
+  da = da < 0 ? -da : da;
+  db = db < 0 ? -db : db;
+  return (db > da) - (db < da);
+}
+
+/**
+ * print_words - The command words whose total time changed most.
+ */
+static void print_words(build_t *a, build_t *b)
+{
+  int n = a->count < b->count ? a->count : b->count;
+  word_t *words = calloc(n + 1, sizeof(word_t));
+  int nwords = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    char word[32];
+    const char *line = session[i].line + strspn(session[i].line, " \t");
+    snprintf(word, sizeof(word), "%.*s", (int)strcspn(line, " \t|<>&;"), line);
+
+    int w = 0;
+    while (w < nwords && strcmp(words[w].word, word) != 0)
+      w++;
+    if (w == nwords)
+      strcpy(words[nwords++].word, word);
+    words[w].total_a += mean_latency(a, i);
+    words[w].total_b += mean_latency(b, i);
+    words[w].calls++;
+  }
+
+  qsort(words, nwords, sizeof(word_t), by_change);
+  printf("\n%-16s %6s %15s %15s %10s\n", "command", "calls", a->name, b->name, "change");
+  for (int w = 0; w < nwords && w < TOP_WORDS; w++)
+  {
+    word_t *x = &words[w];
+    printf("%-16s %6d %12.0f us %12.0f us %+9.1f%%\n", x->word, x->calls, x->total_a, x->total_b,
+           x->total_a > 0 ? (x->total_b - x->total_a) * 100 / x->total_a : 0);
+  }
+  free(words);
+}
+
+/**
+ * print_mismatches - Commands that exit differently in the two builds.
+ */
+static void print_mismatches(build_t *a, build_t *b)
+{
+  int n = a->count < b->count ? a->count : b->count, mismatches = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    if (a->status[i] == b->status[i])
+      continue;
+    if (mismatches++ == 0)
+      printf("\nexit status differs:\n");
+    if (mismatches <= SHOW_MISMATCHES)
+      printf("  %d -> %d  %s\n", a->status[i], b->status[i], session[i].line);
+  }
+  if (mismatches > SHOW_MISMATCHES)
+    printf("  ... %d more\n", mismatches - SHOW_MISMATCHES);
+  if (a->count != b->count)
+    printf("\n%s ran %d commands, %s ran %d\n", a->name, a->count, b->name, b->count);
+}
+
+int main(int argc, char *argv[])
+{
+  char shells[2][PATH_MAX];
+  int nshells = 0, runs = 1;
+  double threshold = -1;
+  const char *session_path = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--paced") == 0)
+      paced = 1;
+    else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+      template_dir = argv[++i];
+    else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+      runs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      threshold = atof(argv[++i]);
+    else if (argv[i][0] != '-' && !session_path)
+      session_path = argv[i];
+    else if (argv[i][0] != '-' && nshells < 2)
+    {
+      // The shell runs in its sandbox, so a relative path is resolved here
+      if (!realpath(argv[i], shells[nshells++]))
+      {
+        perror(argv[i]);
+        return 2;
+      }
+    }
+    else
+      nshells = -1;
+  }
+  if (!session_path || nshells < 1 || runs < 1)
+  {
+    fprintf(stderr, "usage: %s [--paced] [--dir TEMPLATE] [--runs N] [--threshold PERCENT] "
+                    "SESSION [BASELINE_SHELL] SHELL\n",
+            argv[0]);
+    return 2;
+  }
+
+  session = record_load(session_path, &session_count);
+  if (!session || session_count == 0)
+  {
+    fprintf(stderr, "replay: %s: %s\n", session_path, session ? "no commands" : strerror(errno));
+    return 1;
+  }
+
+  // A shell that exits early closes the pipe under feed()
+  signal(SIGPIPE, SIG_IGN);
+
+  build_t builds[2] = {{0}, {0}};
+  build_t *base = &builds[0], *cand = &builds[1];
+  if (nshells == 1)
+  {
+    base->name = "recorded";
+    collect(base, session, session_count);
+    cand->name = "replayed";
+  }
+  else
+  {
+    base->name = "baseline";
+    cand->name = "candidate";
+  }
+
+  // Alternate the builds so that drift in the machine's load hits both
+  for (int r = 0; r < runs; r++)
+  {
+    for (int s = 0; s < nshells; s++)
+    {
+      int count;
+      record_entry_t *entries = replay(shells[s], &count);
+      if (!entries)
+        return 1;
+      collect(nshells == 1 ? cand : &builds[s], entries, count);
+      record_free(entries, count);
+    }
+  }
+
+  printf("%d commands, %s, %d run%s\n\n", session_count, paced ? "recorded pace" : "as fast as possible", runs,
+         runs == 1 ? "" : "s");
+  double p50_change, p90_change;
+  print_distribution(base, cand, &p50_change, &p90_change);
+  print_words(base, cand);
+  print_mismatches(base, cand);
+
+  int rc = 0;
+  if (threshold >= 0 && (p50_change > threshold || p90_change > threshold))
+  {
+    printf("\nREGRESSION: p50 %+.1f%%, p90 %+.1f%% (threshold %.1f%%)\n", p50_change, p90_change, threshold);
+    rc = 1;
+  }
+
+  free(base->latency_us);
+  free(base->status);
+  free(cand->latency_us);
+  free(cand->status);
+  record_free(session, session_count);
+  return rc;
+}
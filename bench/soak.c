@@ -0,0 +1,414 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Memory soak test.
+ *
+ * Starts the shell on a pipe and feeds it a long stream of mixed commands
+ * through its read loop: alias and function churn, history listings,
+ * option changes, cd, syntax errors, fused builtin pipelines and the odd
+ * external or background command. Every --commands / --samples lines it
+ * sends `meminfo` and records the heap in use, by subsystem and in all,
+ * along with its resident set size.
+ *
+ * The first samples are warm-up (buffers, caches and tables reaching
+ * their working size). Against the sample taken after warm-up, the run
+ * fails if the live bytes grow by more than --max-growth bytes or the
+ * resident set by more than --max-rss-growth bytes.
+ *
+ * Usage: soak_runner [--commands N] [--samples N] [--max-growth BYTES]
+ *                    [--max-rss-growth BYTES] SHELL
+ */
+
+#define WARMUP_PERCENT 10
+
+typedef struct
+{
+  long long commands; /* sent before the sample */
+  long long bytes;    /* heap in use */
+  long long blocks;
+  long long rss;
+  char part_names[8][16]; /* subsystems, in meminfo order */
+  long long parts[8];     /* live bytes per subsystem */
+  int nparts;
+} sample_t;
+
+static char run_dir[] = "/tmp/mini_shell_soak_XXXXXX";
+
+static int64_t monotonic_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * next_command - Write the i-th command of the mix to buf.
+ *
+ * Each round of 20 commands uses one name from a small set, so every
+ * definition is used, then replaced or removed, and the tables keep a
+ * steady size.
+ */
+static void next_command(char *buf, size_t size, long long i)
+{
+  int n = i / 20 % 64;
+
+  switch (i % 20)
+  {
+  case 0:
+    snprintf(buf, size, "alias a%d=\"cd .\"", n);
+    break;
+  case 1:
+    snprintf(buf, size, "a%d", n);
+    break;
+  case 2:
+    snprintf(buf, size, "unalias a%d", n);
+    break;
+  case 3:
+    snprintf(buf, size, "f%d() { alias t%d=x; unalias t%d; cd $1 }", n, n, n);
+    break;
+  case 4:
+    snprintf(buf, size, "f%d .", n);
+    break;
+  case 5:
+    snprintf(buf, size, "f%d . | wc -l", n);
+    break;
+  case 6:
+    snprintf(buf, size, "unset -f f%d", n);
+    break;
+  case 7:
+    snprintf(buf, size, "history > /dev/null");
+    break;
+  case 8:
+    snprintf(buf, size, "history | head -n 5 | wc -l");
+    break;
+  case 9:
+    snprintf(buf, size, "history -v > /dev/null");
+    break;
+  case 10:
+    snprintf(buf, size, "set -o max_jobs=%d", 1 + n % 4);
+    break;
+  case 11:
+    snprintf(buf, size, "set > /dev/null");
+    break;
+  case 12:
+    snprintf(buf, size, "cd sub");
+    break;
+  case 13:
+    snprintf(buf, size, "cd ..");
+    break;
+  case 14:
+    snprintf(buf, size, n % 2 ? "f%d() {" : "f%d() { }", n);
+    break;
+  case 15:
+    snprintf(buf, size, "stats > /dev/null");
+    break;
+  case 16:
+    snprintf(buf, size, "jobs > /dev/null");
+    break;
+  case 17:
+    snprintf(buf, size, "functions | grep -F f | cut -f 1 | wc -l");
+    break;
+  case 18:
+    snprintf(buf, size, "meminfo > /dev/null");
+    break;
+  default:
+    // One line in a thousand starts a process, half of them in the background
+    if (i % 1000 == 19)
+      snprintf(buf, size, i % 2000 == 19 ? "true &" : "no_such_command_%d", n);
+    else
+      snprintf(buf, size, "unset -f missing");
+    break;
+  }
+}
+
+static void add_part(sample_t *s, const char *name, long long bytes)
+{
+  if (s->nparts == 8)
+    return;
+  strcpy(s->part_names[s->nparts], name);
+  s->parts[s->nparts++] = bytes;
+}
+
+/**
+ * parse_meminfo - Pick a sample out of a meminfo table.
+ *
+ * Return: 1 once the "rss" line (the last one) has been seen
+ */
+static int parse_meminfo(const char *line, sample_t *s)
+{
+  long long bytes, blocks, allocations;
+  char name[16];
+
+  if (sscanf(line, "total %lld %lld %lld", &bytes, &blocks, &allocations) == 3)
+    s->blocks = blocks;
+  else if (sscanf(line, "heap in use %lld", &bytes) == 1)
+    s->bytes = bytes;
+  else if (sscanf(line, "rss %lld", &s->rss) == 1)
+    return 1;
+  else if (sscanf(line, "other %lld", &bytes) == 1)
+    add_part(s, "other", bytes);
+  else if (sscanf(line, "%15s %lld %lld %lld", name, &bytes, &blocks, &allocations) == 4)
+    add_part(s, name, bytes);
+  return 0;
+}
+
+/**
+ * drive - Feed the commands and collect a sample after every batch.
+ *
+ * Writes and reads are interleaved with poll(), since the shell's output
+ * (prompts, pipeline counts) would otherwise fill its pipe and stall it
+ * while the soak is still writing.
+ *
+ * Return: the number of samples taken
+ */
+static int drive(int in, int out, long long commands, int nsamples, sample_t *samples)
+{
+  char pending[4096], buf[65536], line[4096];
+  size_t pending_len = 0, pending_off = 0, line_len = 0;
+  long long sent = 0;
+  long long batch = commands / nsamples;
+  int taken = 0, requested = 0;
+  sample_t current = {0};
+
+  fcntl(in, F_SETFL, O_NONBLOCK);
+
+  while (taken < nsamples)
+  {
+    // Fill the pending buffer with the next command or sample request
+    if (pending_off == pending_len && requested == taken)
+    {
+      pending_off = 0;
+      if (sent > 0 && sent % batch == 0 && sent / batch > taken)
+      {
+        pending_len = snprintf(pending, sizeof(pending), "meminfo\n");
+        requested++;
+      }
+      else
+      {
+        next_command(pending, sizeof(pending) - 1, sent++);
+        pending_len = strlen(pending);
+        pending[pending_len++] = '\n';
+      }
+    }
+
+    struct pollfd fds[2] = {{out, POLLIN, 0}, {in, pending_off < pending_len ? POLLOUT : 0, 0}};
+    if (poll(fds, 2, 10000) <= 0)
+    {
+      fprintf(stderr, "soak: shell stopped responding after %lld commands\n", sent);
+      return taken;
+    }
+
+    if (fds[1].revents & (POLLERR | POLLHUP))
+    {
+      fprintf(stderr, "soak: shell closed its input after %lld commands\n", sent);
+      return taken;
+    }
+    if (fds[1].revents & POLLOUT)
+    {
+      ssize_t n = write(in, pending + pending_off, pending_len - pending_off);
+      if (n > 0)
+        pending_off += n;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP))
+    {
+      ssize_t n = read(out, buf, sizeof(buf));
+      if (n <= 0)
+      {
+        fprintf(stderr, "soak: shell exited after %lld commands\n", sent);
+        return taken;
+      }
+      for (ssize_t i = 0; i < n; i++)
+      {
+        if (buf[i] != '\n')
+        {
+          if (line_len < sizeof(line) - 1)
+            line[line_len++] = buf[i];
+          continue;
+        }
+        line[line_len] = '\0';
+        line_len = 0;
+        if (requested > taken && parse_meminfo(line, &current))
+        {
+          current.commands = sent;
+          samples[taken++] = current;
+          memset(&current, 0, sizeof(current));
+        }
+      }
+    }
+  }
+  return taken;
+}
+
+/**
+ * start_shell - Start the shell in the run directory on two pipes.
+ */
+static pid_t start_shell(const char *shell, int *in, int *out)
+{
+  char path[PATH_MAX];
+  int to[2], from[2];
+
+  if (pipe(to) < 0 || pipe(from) < 0)
+  {
+    perror("pipe");
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(to[0], STDIN_FILENO);
+    dup2(from[1], STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(to[0]);
+    close(to[1]);
+    close(from[0]);
+    close(from[1]);
+    close(null);
+
+    setenv("HOME", run_dir, 1);
+    snprintf(path, sizeof(path), "%s/history.bin", run_dir);
+    setenv("HISTFILE", path, 1);
+    snprintf(path, sizeof(path), "%s/cache", run_dir);
+    setenv("SHELL_CACHE_DIR", path, 1);
+    unsetenv("SHELL_TRACE");
+    unsetenv("SHELL_METRICS_SOCKET");
+    unsetenv("SHELL_RECORD");
+
+    if (chdir(run_dir) == 0)
+      execl(shell, shell, (char *)NULL);
+    perror(shell);
+    _exit(127);
+  }
+
+  close(to[0]);
+  close(from[1]);
+  *in = to[1];
+  *out = from[0];
+  return pid;
+}
+
+int main(int argc, char *argv[])
+{
+  long long commands = 1000000, max_growth = 256 * 1024, max_rss_growth = 4 * 1024 * 1024;
+  int nsamples = 50;
+  char shell[PATH_MAX];
+  const char *shell_arg = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--commands") == 0 && i + 1 < argc)
+      commands = atoll(argv[++i]);
+    else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc)
+      nsamples = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--max-growth") == 0 && i + 1 < argc)
+      max_growth = atoll(argv[++i]);
+    else if (strcmp(argv[i], "--max-rss-growth") == 0 && i + 1 < argc)
+      max_rss_growth = atoll(argv[++i]);
+    else if (argv[i][0] != '-' && !shell_arg)
+      shell_arg = argv[i];
+    else
+      shell_arg = NULL, i = argc;
+  }
+  if (!shell_arg || nsamples < 2 || commands < nsamples)
+  {
+    fprintf(stderr, "usage: %s [--commands N] [--samples N] [--max-growth BYTES] [--max-rss-growth BYTES] SHELL\n",
+            argv[0]);
+    return 2;
+  }
+  // The shell runs in the run directory, so a relative path is resolved here
+  if (!realpath(shell_arg, shell))
+  {
+    perror(shell_arg);
+    return 2;
+  }
+
+  if (!mkdtemp(run_dir))
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  char sub[PATH_MAX];
+  snprintf(sub, sizeof(sub), "%s/sub", run_dir);
+  mkdir(sub, 0700);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  int in, out;
+  pid_t pid = start_shell(shell, &in, &out);
+  if (pid < 0)
+    return 1;
+
+  sample_t *samples = calloc(nsamples, sizeof(sample_t));
+  int64_t begin = monotonic_us();
+  int taken = drive(in, out, commands, nsamples, samples);
+  double seconds = (monotonic_us() - begin) / 1e6;
+
+  close(in);
+  close(out);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  char *rm[] = {"rm", "-rf", run_dir, NULL};
+  if (fork() == 0)
+  {
+    execvp(rm[0], rm);
+    _exit(127);
+  }
+  wait(NULL);
+
+  if (taken < nsamples)
+  {
+    free(samples);
+    return 1;
+  }
+
+  printf("%lld commands in %.1fs (%.0f/s), %d samples\n\n", samples[taken - 1].commands, seconds,
+         samples[taken - 1].commands / seconds, taken);
+  printf("%12s %12s %10s %12s\n", "commands", "live bytes", "blocks", "rss");
+  for (int i = 0; i < taken; i++)
+  {
+    // The first, every tenth and the last sample
+    if (i % 10 == 0 || i == taken - 1)
+      printf("%12lld %12lld %10lld %12lld\n", samples[i].commands, samples[i].bytes, samples[i].blocks,
+             samples[i].rss);
+  }
+
+  const sample_t *base = &samples[taken * WARMUP_PERCENT / 100];
+  long long peak_bytes = 0, peak_rss = 0;
+  for (const sample_t *s = base; s < samples + taken; s++)
+  {
+    if (s->bytes - base->bytes > peak_bytes)
+      peak_bytes = s->bytes - base->bytes;
+    if (s->rss - base->rss > peak_rss)
+      peak_rss = s->rss - base->rss;
+  }
+
+  printf("\nafter warm-up (%lld commands): live bytes %+lld (limit %lld), rss %+lld (limit %lld)\n",
+         base->commands, peak_bytes, max_growth, peak_rss, max_rss_growth);
+
+  int rc = 0;
+  if (peak_bytes > max_growth || peak_rss > max_rss_growth)
+  {
+    const sample_t *last = &samples[taken - 1];
+    printf("\nLEAK: memory kept growing; live bytes by subsystem, warm-up -> end:\n");
+    for (int i = 0; i < last->nparts && i < base->nparts; i++)
+      printf("  %-10s %12lld -> %12lld\n", last->part_names[i], base->parts[i], last->parts[i]);
+    rc = 1;
+  }
+
+  free(samples);
+  return rc;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Command substitution benchmark.
+#
+# Runs N substitution-heavy command lines through ./shell and through bash,
+# and compares them with the temp-file workaround (write the inner command's
+# output to a file, then read it back with xargs).
+#
+# Usage: bench/subst.sh [N]
+
+N=${1:-500}
+SHELL_BIN=${SHELL_BIN:-./shell}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+export HISTFILE="$WORK/history.bin"
+
+now_ns() {
+  date +%s%N
+}
+
+# run NAME INTERPRETER SCRIPT
+run() {
+  start=$(now_ns)
+  "$2" < "$3" > /dev/null 2>&1
+  end=$(now_ns)
+  total_us=$(( (end - start) / 1000 ))
+  printf '%-28s %8d lines  %10d us  %8d us/line\n' "$1" "$N" "$total_us" $(( total_us / N ))
+}
+
+i=0
+while [ $i -lt "$N" ]; do
+  echo 'echo $(echo hello world) > /dev/null' >> "$WORK/external.sh"
+  echo 'echo $(history) > /dev/null' >> "$WORK/builtin.sh"
+  echo "echo hello world > $WORK/tmp" >> "$WORK/tempfile.sh"
+  echo "xargs echo < $WORK/tmp > /dev/null" >> "$WORK/tempfile.sh"
+  i=$((i + 1))
+done
+
+run "shell \$(external)" "$SHELL_BIN" "$WORK/external.sh"
+run "shell \$(builtin)" "$SHELL_BIN" "$WORK/builtin.sh"
+run "shell temp-file workaround" "$SHELL_BIN" "$WORK/tempfile.sh"
+if command -v bash > /dev/null; then
+  run "bash \$(external)" bash "$WORK/external.sh"
+  run "bash temp-file workaround" bash "$WORK/tempfile.sh"
+fi
@@ -1,59 +1,1150 @@
+#define _GNU_SOURCE
 #include "builtins.h"
+#include "executor.h"
+#include "history.h"
+#include "jobs.h"
+#include "memory.h"
+#include "metrics.h"
+#include "names.h"
+#include "options.h"
+#include "resources.h"
+#include "scan.h"
+#include "trace.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/resource.h>
+
+struct builtin
+{
+  const char *name;
+  int (*run)(command_t *cmd, FILE *in, FILE *out, int subshell);
+  int (*claims)(char **argv);
+  int special;
+  int pure;
+};
 
 /**
- * run_builtin - Execute a shell builtin command if applicable.
+ * run_history_option - Handle the maintenance forms of the history builtin.
  *
- * @cmd: Pointer to a command_t describing the parsed command.
+ * @cmd: Pointer to a command_t whose argv[0] is "history".
+ * @out: Stream the builtin writes its output to.
  *
- * Return: 1 if a builtin was recognized and handled (or attempted to be
- *         handled), 0 if no builtin was handled or if input is invalid.
+ * Return: the exit status.
  *
  * Description:
- * This function checks whether the provided command corresponds to a shell
- * builtin and, if so, performs the builtin action in the current process.
+ * Supports:
+ *   history --import FILE   append a plain-text history file to the log
+ *   history --export FILE   write the log as plain text, one command per line
+ *   history --compact       deduplicate the log now
+ *   history -v              show the last commands with timing and status
  */
-int run_builtin(command_t *cmd)
+static int run_history_option(command_t *cmd, FILE *out)
+{
+  const char *opt = cmd->argv[1];
+  const char *file = cmd->argv[2];
+  int status = 0;
+
+  if ((strcmp(opt, "--import") == 0 || strcmp(opt, "--export") == 0) && file)
+  {
+    int n = opt[2] == 'i' ? history_import(file) : history_export(file);
+    if (n < 0)
+    {
+      fprintf(stderr, "history: %s: cannot %s\n", file, opt + 2);
+      status = 1;
+    }
+  }
+  else if (strcmp(opt, "--compact") == 0)
+  {
+    if (history_compact() != 0)
+    {
+      fprintf(stderr, "history: compaction failed\n");
+      status = 1;
+    }
+  }
+  else if (strcmp(opt, "-v") == 0)
+  {
+    history_entry_t *entries;
+    int count = history_load_tail(&entries, 10);
+    for (int i = 0; i < count; i++)
+    {
+      fprintf(out, "%8.3fs  %3d  %s\n", entries[i].duration / 1e6, entries[i].status, entries[i].cmd);
+    }
+    history_free_entries(entries, count);
+  }
+  else
+  {
+    fprintf(stderr, "usage: history [-v | --compact | --import FILE | --export FILE]\n");
+    status = 2;
+  }
+
+  return status;
+}
+
+/**
+ * builtin_exit - Terminate the shell.
+ *
+ * In a subshell (a pipeline stage or $(...)) only the status is set, as a
+ * forked subshell exiting would not end the shell either.
+ */
+static int builtin_exit(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  int status = cmd->argv[1] ? atoi(cmd->argv[1]) : 0;
+  if (subshell)
+    return status;
+  exit(status);
+}
+
+/**
+ * builtin_cd - Change the working directory (HOME by default).
+ */
+static int builtin_cd(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  const char *path = cmd->argv[1] ? cmd->argv[1] : get_home();
+
+  if (subshell)
+    return access(path, X_OK) == 0 ? 0 : 1;
+
+  int status = 0;
+  if (chdir(path) != 0)
+  {
+    fprintf(stderr, "cd: No such file or directory: %s\n", path);
+    status = 1;
+  }
+  set_pwd();
+  return status;
+}
+
+/**
+ * builtin_meminfo - Show the shell's memory use by subsystem.
+ */
+static int builtin_meminfo(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  if (cmd->argv[1])
+  {
+    fprintf(stderr, "usage: meminfo\n");
+    return 2;
+  }
+  meminfo_print(out);
+  return 0;
+}
+
+/**
+ * builtin_set - List or change shell options.
+ *
+ * Usage: set -o               list options
+ *        set -o NAME[=VALUE]  enable an option
+ *        set +o NAME          disable an option
+ */
+static int builtin_set(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  char **argv = cmd->argv;
+
+  if (!argv[1] || (strcmp(argv[1], "-o") == 0 && !argv[2]))
+  {
+    print_options(out);
+    return 0;
+  }
+
+  if ((strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0) || argv[3])
+  {
+    fprintf(stderr, "usage: set [-o NAME[=VALUE] | +o NAME]\n");
+    return 2;
+  }
+
+  if (subshell)
+    return 0;
+
+  if (set_option(argv[2], argv[1][0] == '-') != 0)
+  {
+    fprintf(stderr, "set: %s: invalid option\n", argv[2]);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * builtin_trace - Start, stop or show command tracing.
+ *
+ * Usage: trace on [FILE]  write Chrome trace-event JSON to FILE
+ *                         (default shell_trace.PID.json)
+ *        trace off        flush and close the trace file
+ *        trace            show whether tracing is on
+ */
+static int builtin_trace(command_t *cmd, FILE *in, FILE *out, int subshell)
 {
-  if (!cmd || cmd->is_exec || !cmd->argv[0])
+  char **argv = cmd->argv;
+
+  if (!argv[1])
+  {
+    if (trace_path())
+      fprintf(out, "tracing to %s (%ld events dropped)\n", trace_path(), trace_dropped());
+    else
+      fprintf(out, "tracing off\n");
     return 0;
+  }
 
-  // exit
-  if (strcmp(cmd->argv[0], "exit") == 0)
+  if (strcmp(argv[1], "on") == 0 && (!argv[2] || !argv[3]))
   {
-    exit(0);
+    if (subshell)
+      return 0;
+
+    char path[64];
+    const char *file = argv[2];
+    if (!file)
+    {
+      snprintf(path, sizeof(path), "shell_trace.%d.json", (int)getpid());
+      file = path;
+    }
+    if (trace_start(file) != 0)
+    {
+      fprintf(stderr, "trace: %s: %s\n", file, strerror(errno));
+      return 1;
+    }
+    return 0;
   }
 
-  // cd
-  if (strcmp(cmd->argv[0], "cd") == 0)
+  if (strcmp(argv[1], "off") == 0 && !argv[2])
   {
-    const char *path = cmd->argv[1] ? cmd->argv[1] : get_home();
-    if (chdir(path) != 0)
+    if (!subshell)
+      trace_stop();
+    return 0;
+  }
+
+  fprintf(stderr, "usage: trace [on [FILE] | off]\n");
+  return 2;
+}
+
+/**
+ * print_rlim - Write one limit value in ulimit's units.
+ */
+static void print_rlim(FILE *out, rlim_t value, rlim_t unit)
+{
+  if (value == RLIM_INFINITY)
+    fprintf(out, "unlimited\n");
+  else
+    fprintf(out, "%llu\n", (unsigned long long)(value / unit));
+}
+
+/**
+ * builtin_ulimit - Show or change the shell's resource limits, which every
+ * command it starts inherits.
+ *
+ * Usage: ulimit -a                     show every limit
+ *        ulimit [-S|-H] [-FLAG [VALUE]] show or set one limit (default -f)
+ *
+ * Without -S or -H a new value sets both the soft and the hard limit, and
+ * the soft limit is shown. Sizes are in KiB; VALUE may be "unlimited".
+ */
+static int builtin_ulimit(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  int soft = 1, hard = 1;
+  char flag = 'f';
+  const char *value = NULL;
+  int i = 1;
+
+  for (; cmd->argv[i] && cmd->argv[i][0] == '-' && cmd->argv[i][1] && !cmd->argv[i][2]; i++)
+  {
+    char c = cmd->argv[i][1];
+    if (c == 'S')
+      hard = 0;
+    else if (c == 'H')
+      soft = 0;
+    else
+      flag = c;
+  }
+  if (cmd->argv[i])
+    value = cmd->argv[i++];
+
+  int count;
+  const rlimit_def_t *defs = rlimit_defs(&count);
+  const rlimit_def_t *def = find_rlimit(NULL, flag);
+
+  if (flag == 'a' && !value)
+  {
+    for (int j = 0; j < count; j++)
     {
-      fprintf(stderr, "cd: No such file or directory: %s\n", path);
+      struct rlimit lim;
+      getrlimit(defs[j].resource, &lim);
+      fprintf(out, "%-30s (-%c) ", defs[j].help, defs[j].flag);
+      print_rlim(out, soft ? lim.rlim_cur : lim.rlim_max, defs[j].unit);
     }
-    set_pwd();
+    return 0;
+  }
+
+  if (!def || cmd->argv[i] || (!soft && !hard))
+  {
+    fprintf(stderr, "usage: ulimit [-S|-H] [-a | -FLAG [VALUE]]\n");
+    return 2;
+  }
+
+  struct rlimit lim;
+  getrlimit(def->resource, &lim);
+
+  if (!value)
+  {
+    print_rlim(out, soft ? lim.rlim_cur : lim.rlim_max, def->unit);
+    return 0;
+  }
+
+  rlim_t n;
+  if (parse_rlim(value, def->unit, &n) != 0)
+  {
+    fprintf(stderr, "ulimit: %s: invalid limit\n", value);
     return 1;
   }
+  if (subshell)
+    return 0;
+
+  if (soft)
+    lim.rlim_cur = n;
+  if (hard)
+    lim.rlim_max = n;
+  if (setrlimit(def->resource, &lim) != 0)
+  {
+    fprintf(stderr, "ulimit: %s: %s\n", def->name, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * builtin_stats - Show the shell's metrics or serve them on a socket.
+ *
+ * Usage: stats                counters and latency percentiles
+ *        stats -p             Prometheus text format
+ *        stats --reset        zero every metric
+ *        stats --listen PATH  serve Prometheus text on a Unix socket
+ */
+static int builtin_stats(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  char **argv = cmd->argv;
+
+  if (!argv[1])
+  {
+    metrics_print(out);
+    if (metrics_socket_path())
+      fprintf(out, "\nserving on %s\n", metrics_socket_path());
+    return 0;
+  }
+
+  if (strcmp(argv[1], "-p") == 0 && !argv[2])
+  {
+    metrics_print_prometheus(out);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "--reset") == 0 && !argv[2])
+  {
+    metrics_reset();
+    return 0;
+  }
+
+  if (strcmp(argv[1], "--listen") == 0 && argv[2] && !argv[3])
+  {
+    if (subshell)
+      return 0;
+    if (metrics_listen(argv[2]) != 0)
+    {
+      fprintf(stderr, "stats: %s: %s\n", argv[2], strerror(errno));
+      return 1;
+    }
+    return 0;
+  }
+
+  fprintf(stderr, "usage: stats [-p | --reset | --listen PATH]\n");
+  return 2;
+}
+
+/**
+ * builtin_history - Print the most recent commands.
+ */
+static int builtin_history(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  if (cmd->argv[1])
+    return run_history_option(cmd, out);
+
+  char *cmds = get_cmd_history();
+  if (cmds)
+  {
+    fputs(cmds, out);
+    free(cmds);
+  }
+  return 0;
+}
+
+/**
+ * head_count - Parse the line count of a head invocation.
+ *
+ * Return: the number of lines for `head`, `head -n N`, `head -nN` and
+ *         `head -N`, or -1 for anything else (file operands, other flags),
+ *         which is left to the external head.
+ */
+static long head_count(char **argv)
+{
+  const char *num = NULL;
+
+  if (!argv[1])
+    return 10;
+
+  if (strcmp(argv[1], "-n") == 0 && argv[2] && !argv[3])
+    num = argv[2];
+  else if (strncmp(argv[1], "-n", 2) == 0 && argv[1][2] && !argv[2])
+    num = argv[1] + 2;
+  else if (argv[1][0] == '-' && !argv[2])
+    num = argv[1] + 1;
+  else
+    return -1;
+
+  char *end;
+  long count = strtol(num, &end, 10);
+  if (end == num || *end != '\0' || count < 0)
+    return -1;
+  return count;
+}
+
+static int claims_head(char **argv)
+{
+  return head_count(argv) >= 0;
+}
+
+/**
+ * builtin_head - Copy the first N lines of the input.
+ *
+ * Description:
+ * Finds the N-th newline with scan_nth() and writes everything before it
+ * in one piece. A seekable input is left just after the lines copied.
+ */
+static int builtin_head(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  size_t remaining = head_count(cmd->argv);
+  block_reader_t reader;
+  const char *block;
+  size_t len, unused = 0;
+
+  reader_open(&reader, in, 0);
+  while (remaining > 0 && (len = reader_next(&reader, &block)) > 0)
+  {
+    const char *last = scan_nth(block, len, '\n', &remaining);
+    size_t take = last ? (size_t)(last + 1 - block) : len;
+    unused = len - take;
+    if (fwrite(block, 1, take, out) != take)
+      break;
+  }
+  reader_close(&reader, unused);
+  return 0;
+}
+
+static int claims_wc(char **argv)
+{
+  return argv[1] && strcmp(argv[1], "-l") == 0 && !argv[2];
+}
+
+/**
+ * builtin_wc - Count input lines (`wc -l`).
+ */
+static int builtin_wc(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  block_reader_t reader;
+  const char *block;
+  size_t len, lines = 0;
+
+  reader_open(&reader, in, 1);
+  while ((len = reader_next(&reader, &block)) > 0)
+    lines += scan_count(block, len, '\n');
+  reader_close(&reader, 0);
+
+  if (!reader_interrupted())
+    fprintf(out, "%zu\n", lines);
+  return 0;
+}
+
+typedef struct grep_options
+{
+  const char *pattern;
+  int invert;
+  int count;
+} grep_options_t;
+
+/**
+ * grep_parse - Parse a `grep -F [-v] [-c] PATTERN` invocation.
+ *
+ * Return: 0 if the builtin handles it, -1 for anything else (regular
+ *         expressions, file operands, other flags), which is left to the
+ *         external grep.
+ */
+static int grep_parse(char **argv, grep_options_t *opts)
+{
+  int fixed = 0, i = 1;
+
+  memset(opts, 0, sizeof(*opts));
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+  {
+    for (const char *f = argv[i] + 1; *f; f++)
+    {
+      if (*f == 'F')
+        fixed = 1;
+      else if (*f == 'v')
+        opts->invert = 1;
+      else if (*f == 'c')
+        opts->count = 1;
+      else
+        return -1;
+    }
+  }
+
+  if (!fixed || !argv[i] || argv[i + 1])
+    return -1;
+  opts->pattern = argv[i];
+  return 0;
+}
+
+static int claims_grep(char **argv)
+{
+  grep_options_t opts;
+  return grep_parse(argv, &opts) == 0;
+}
+
+// Write whole lines; the last line of the input may lack its newline. The
+// output stream belongs to one builtin, so stdio's locking is skipped.
+static void write_lines(FILE *out, const char *p, size_t len)
+{
+  fwrite_unlocked(p, 1, len, out);
+  if (len > 0 && p[len - 1] != '\n')
+    fputc_unlocked('\n', out);
+}
+
+static size_t count_lines(const char *p, size_t len)
+{
+  return scan_count(p, len, '\n') + (len > 0 && p[len - 1] != '\n');
+}
+
+/**
+ * builtin_grep - Select lines containing a fixed string (`grep -F`).
+ *
+ * Return: 0 if a line was selected, 1 otherwise, as grep(1).
+ *
+ * Description:
+ * Searches a whole block for the pattern rather than each line in turn,
+ * so the text between matches is only looked at by scan_find(). Only the
+ * matching line is then delimited; with -v, the lines between matches are
+ * copied in one piece.
+ */
+static int builtin_grep(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  grep_options_t opts;
+  if (grep_parse(cmd->argv, &opts) != 0)
+    return 2;
+
+  size_t pattern_len = strlen(opts.pattern);
+  block_reader_t reader;
+  const char *block;
+  size_t len, selected = 0;
+
+  reader_open(&reader, in, 1);
+  while ((len = reader_next(&reader, &block)) > 0)
+  {
+    const char *p = block, *end = block + len;
+    while (p < end)
+    {
+      const char *hit = scan_find(p, end - p, opts.pattern, pattern_len);
+      const char *line = hit, *next = end;
+      if (hit)
+      {
+        const char *nl = memrchr(p, '\n', hit - p);
+        line = nl ? nl + 1 : p;
+        nl = memchr(hit, '\n', end - hit);
+        next = nl ? nl + 1 : end;
+      }
+
+      // Select [p, line) when inverting, the matching line otherwise
+      const char *from = opts.invert ? p : line;
+      const char *to = opts.invert ? (hit ? line : end) : next;
+      if (hit || opts.invert)
+      {
+        if (opts.count)
+          selected += count_lines(from, to - from);
+        else if (to > from)
+        {
+          write_lines(out, from, to - from);
+          selected++;
+        }
+      }
+      p = next;
+    }
+  }
+  reader_close(&reader, 0);
+
+  // A count of part of the input would be wrong
+  if (opts.count && !reader_interrupted())
+    fprintf(out, "%zu\n", selected);
+  return selected > 0 ? 0 : 1;
+}
 
-  // history
-  if (strcmp(cmd->argv[0], "history") == 0)
+#define CUT_MAX_RANGES 32
+#define CUT_OPEN_END ((size_t)-1)
+
+typedef struct cut_options
+{
+  char delim;
+  size_t ranges[CUT_MAX_RANGES][2]; /* inclusive field numbers, from 1 */
+  int range_count;
+  size_t last_field; /* CUT_OPEN_END when a range has no end */
+} cut_options_t;
+
+static int cut_parse_list(const char *list, cut_options_t *opts)
+{
+  const char *p = list;
+  while (*p)
   {
-    char *cmds = get_cmd_history();
-    if (cmd->input_redirect)
+    if (opts->range_count == CUT_MAX_RANGES)
+      return -1;
+
+    char *end;
+    size_t lo = 1, hi;
+    if (*p != '-')
+    {
+      lo = strtoul(p, &end, 10);
+      if (end == p || lo == 0)
+        return -1;
+      p = end;
+    }
+    hi = lo;
+    if (*p == '-')
     {
-      FILE *fptr = fopen("sample.txt", "w");
-      fprintf(fptr, "%s", cmds);
+      p++;
+      hi = CUT_OPEN_END;
+      if (isdigit((unsigned char)*p))
+      {
+        hi = strtoul(p, &end, 10);
+        p = end;
+      }
+      else if (lo == 1 && p == list + 1)
+      {
+        return -1; /* a lone "-" */
+      }
     }
+    if (hi < lo || (*p && *p != ','))
+      return -1;
+
+    opts->ranges[opts->range_count][0] = lo;
+    opts->ranges[opts->range_count][1] = hi;
+    opts->range_count++;
+    if (opts->last_field != CUT_OPEN_END && (hi == CUT_OPEN_END || hi > opts->last_field))
+      opts->last_field = hi;
+    p += *p == ',';
+  }
+  return opts->range_count > 0 ? 0 : -1;
+}
+
+/**
+ * cut_parse - Parse a `cut -f LIST [-d C]` invocation.
+ *
+ * Return: 0 if the builtin handles it, -1 for anything else (byte and
+ *         character lists, file operands, other flags), which is left to
+ *         the external cut.
+ */
+static int cut_parse(char **argv, cut_options_t *opts)
+{
+  const char *list = NULL;
+
+  memset(opts, 0, sizeof(*opts));
+  opts->delim = '\t';
+  for (int i = 1; argv[i]; i++)
+  {
+    const char *arg = argv[i];
+    if (arg[0] != '-' || (arg[1] != 'd' && arg[1] != 'f'))
+      return -1;
+
+    const char *value = arg[2] ? arg + 2 : argv[++i];
+    if (!value)
+      return -1;
+    if (arg[1] == 'f')
+      list = value;
+    else if (strlen(value) == 1 && value[0] != '\n')
+      opts->delim = value[0];
     else
+      return -1;
+  }
+
+  return list ? cut_parse_list(list, opts) : -1;
+}
+
+static int claims_cut(char **argv)
+{
+  cut_options_t opts;
+  return cut_parse(argv, &opts) == 0;
+}
+
+static int cut_selects(const cut_options_t *opts, size_t field)
+{
+  for (int i = 0; i < opts->range_count; i++)
+  {
+    if (field >= opts->ranges[i][0] && field <= opts->ranges[i][1])
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * builtin_cut - Print selected fields of each line (`cut -f`).
+ *
+ * Description:
+ * scan_find2() finds the next delimiter or newline in one step. Once the
+ * last selected field is written, the rest of the line is skipped with
+ * memchr(). Lines without a delimiter are printed whole, as cut(1) does.
+ */
+static int builtin_cut(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  cut_options_t opts;
+  if (cut_parse(cmd->argv, &opts) != 0)
+    return 2;
+
+  block_reader_t reader;
+  const char *block;
+  size_t len;
+
+  reader_open(&reader, in, 1);
+  while ((len = reader_next(&reader, &block)) > 0)
+  {
+    const char *p = block, *end = block + len;
+    while (p < end)
+    {
+      const char *stop = scan_find2(p, end, opts.delim, '\n');
+      if (!stop)
+        stop = end;
+      if (stop == end || *stop == '\n')
+      {
+        // No delimiter: the whole line
+        const char *next = stop < end ? stop + 1 : end;
+        write_lines(out, p, next - p);
+        p = next;
+        continue;
+      }
+
+      size_t field = 1;
+      int first = 1;
+      for (;;)
+      {
+        if (cut_selects(&opts, field))
+        {
+          if (!first)
+            fputc_unlocked(opts.delim, out);
+          fwrite_unlocked(p, 1, stop - p, out);
+          first = 0;
+        }
+        if (stop == end || *stop == '\n' || field == opts.last_field)
+          break;
+        p = stop + 1;
+        stop = scan_find2(p, end, opts.delim, '\n');
+        if (!stop)
+          stop = end;
+        field++;
+      }
+
+      fputc_unlocked('\n', out);
+      const char *nl = stop == end || *stop == '\n' ? stop : memchr(stop, '\n', end - stop);
+      if (!nl)
+        nl = end;
+      p = nl < end ? nl + 1 : end;
+    }
+  }
+  reader_close(&reader, 0);
+  return 0;
+}
+
+/**
+ * builtin_alias - Define or show aliases.
+ *
+ * Usage: alias                      list aliases
+ *        alias NAME=VALUE [...]     define aliases
+ *        alias NAME [...]           show aliases
+ *
+ * Description:
+ * An alias replaces the command word it names when a line is parsed, so
+ * `alias ll="ls -l"` makes `ll /tmp` run `ls -l /tmp`.
+ */
+static int builtin_alias(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  char **argv = cmd->argv;
+  int status = 0;
+
+  if (!argv[1])
+  {
+    names_print_aliases(out);
+    return 0;
+  }
+
+  for (int i = 1; argv[i]; i++)
+  {
+    char *eq = strchr(argv[i], '=');
+    if (!eq)
+    {
+      if (names_print_alias(out, argv[i]) != 0)
+      {
+        fprintf(stderr, "alias: %s: not found\n", argv[i]);
+        status = 1;
+      }
+      continue;
+    }
+
+    const char *bad = strpbrk(argv[i], "/$");
+    if (eq == argv[i] || (bad && bad < eq))
     {
-      fprintf(stdout, "%s", cmds);
+      fprintf(stderr, "alias: %.*s: invalid alias name\n", (int)(eq - argv[i]), argv[i]);
+      status = 1;
+      continue;
     }
+    if (subshell)
+      continue;
+
+    *eq = '\0';
+    names_set_alias(argv[i], eq + 1);
+    *eq = '=';
   }
+  return status;
+}
 
+/**
+ * builtin_unalias - Remove aliases (`unalias NAME...`, `unalias -a`).
+ */
+static int builtin_unalias(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  char **argv = cmd->argv;
+  int status = 0;
+
+  if (!argv[1])
+  {
+    fprintf(stderr, "usage: unalias [-a] NAME...\n");
+    return 2;
+  }
+  if (subshell)
+    return 0;
+
+  if (strcmp(argv[1], "-a") == 0 && !argv[2])
+  {
+    names_clear_aliases();
+    return 0;
+  }
+
+  for (int i = 1; argv[i]; i++)
+  {
+    if (names_unalias(argv[i]) != 0)
+    {
+      fprintf(stderr, "unalias: %s: not found\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+static int claims_unset(char **argv)
+{
+  return argv[1] && strcmp(argv[1], "-f") == 0;
+}
+
+/**
+ * builtin_unset - Remove functions (`unset -f NAME...`).
+ */
+static int builtin_unset(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  for (int i = 2; cmd->argv[i] && !subshell; i++)
+    names_unset_function(cmd->argv[i]);
   return 0;
 }
+
+/**
+ * builtin_functions - List the defined functions.
+ */
+static int builtin_functions(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  names_print_functions(out);
+  return 0;
+}
+
+// Parse a job id or priority; -1 (or INT_MIN for a priority) if malformed
+static long job_number(const char *text, int sign)
+{
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end || (!sign && value <= 0) || value > 1000000 || value < -1000000)
+    return sign ? INT_MIN : -1;
+  return value;
+}
+
+/**
+ * builtin_jobs - Show or reorder the background job queue.
+ *
+ * Usage: jobs                  running and queued background jobs
+ *        jobs -p PRIORITY ID   set a queued job's priority
+ *        jobs -f ID            start a queued job next
+ *        jobs -r ID            remove a queued job without running it
+ */
+static int builtin_jobs(command_t *cmd, FILE *in, FILE *out, int subshell)
+{
+  char **argv = cmd->argv;
+
+  if (!argv[1])
+  {
+    jobs_print(out);
+    return 0;
+  }
+
+  int argc = 0;
+  while (argv[argc])
+    argc++;
+
+  long id = -1, priority = 0;
+  if (strcmp(argv[1], "-p") == 0 && argc == 4)
+  {
+    priority = job_number(argv[2], 1);
+    id = job_number(argv[3], 0);
+  }
+  else if ((strcmp(argv[1], "-f") == 0 || strcmp(argv[1], "-r") == 0) && argc == 3)
+    id = job_number(argv[2], 0);
+
+  if (id < 0 || priority == INT_MIN)
+  {
+    fprintf(stderr, "usage: jobs [-p PRIORITY ID | -f ID | -r ID]\n");
+    return 2;
+  }
+
+  if (subshell)
+    return 0;
+
+  int rc;
+  if (argv[1][1] == 'p')
+    rc = job_set_priority((int)id, (int)priority);
+  else if (argv[1][1] == 'f')
+    rc = job_to_front((int)id);
+  else
+    rc = job_cancel((int)id);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "jobs: %ld: no such queued job\n", id);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Builtin table. `claims` (when set) decides from the arguments whether the
+ * builtin handles this invocation or the external program of the same name
+ * should run. `special` builtins change the shell itself and always run in
+ * the shell process. `pure` builtins print nothing but what their arguments
+ * and input decide, so `cache` may replay them; the others show the
+ * shell's own state.
+ *
+ * The table is a perfect hash: BUILTIN() stores each entry at the hash of
+ * its name's length and first and last characters, which are distinct for
+ * every builtin, so a lookup is one hash and one strcmp. Two names with
+ * the same hash would initialize the same slot, which the pragma turns
+ * into a compile error; the multipliers then need changing. A constant
+ * expression cannot index the name, so the characters are spelled out;
+ * builtins_unreachable() catches entries where they do not match it.
+ */
+#define BUILTIN_SLOTS 32
+#define BUILTIN_HASH(len, first, last) (((len) * 11 + (first) * 7 + (last) * 4) & (BUILTIN_SLOTS - 1))
+#define BUILTIN(name, first, last, run, claims, special, pure) \
+  [BUILTIN_HASH(sizeof(name) - 1, first, last)] = {name, run, claims, special, pure}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const builtin_t builtins[BUILTIN_SLOTS] = {
+    BUILTIN("cd", 'c', 'd', builtin_cd, NULL, 1, 0),
+    BUILTIN("exit", 'e', 't', builtin_exit, NULL, 1, 0),
+    BUILTIN("set", 's', 't', builtin_set, NULL, 1, 0),
+    BUILTIN("trace", 't', 'e', builtin_trace, NULL, 1, 0),
+    BUILTIN("ulimit", 'u', 't', builtin_ulimit, NULL, 1, 0),
+    BUILTIN("alias", 'a', 's', builtin_alias, NULL, 1, 0),
+    BUILTIN("unalias", 'u', 's', builtin_unalias, NULL, 1, 0),
+    BUILTIN("unset", 'u', 't', builtin_unset, claims_unset, 1, 0),
+    BUILTIN("history", 'h', 'y', builtin_history, NULL, 0, 0),
+    BUILTIN("stats", 's', 's', builtin_stats, NULL, 0, 0),
+    BUILTIN("functions", 'f', 's', builtin_functions, NULL, 0, 0),
+    BUILTIN("jobs", 'j', 's', builtin_jobs, NULL, 0, 0),
+    BUILTIN("meminfo", 'm', 'o', builtin_meminfo, NULL, 0, 0),
+    BUILTIN("head", 'h', 'd', builtin_head, claims_head, 0, 1),
+    BUILTIN("wc", 'w', 'c', builtin_wc, claims_wc, 0, 1),
+    BUILTIN("grep", 'g', 'p', builtin_grep, claims_grep, 0, 1),
+    BUILTIN("cut", 'c', 't', builtin_cut, claims_cut, 0, 1),
+};
+#pragma GCC diagnostic pop
+
+/**
+ * builtin_lookup - Find the builtin that handles a command line.
+ *
+ * @argv: NULL-terminated argument vector.
+ *
+ * Return: the builtin, or NULL if the command must be executed (or is a
+ *         function call). The parser stores it in command_t.builtin, so
+ *         running the command does not look it up again.
+ */
+const builtin_t *builtin_lookup(char **argv)
+{
+  const char *name = argv[0];
+  size_t len = name ? strlen(name) : 0;
+  if (len == 0)
+    return NULL;
+
+  const builtin_t *b = &builtins[BUILTIN_HASH(len, (unsigned char)name[0], (unsigned char)name[len - 1])];
+  if (!b->name || strcmp(b->name, name) != 0)
+    return NULL;
+  return !b->claims || b->claims(argv) ? b : NULL;
+}
+
+/**
+ * builtins_unreachable - Count builtin table entries a lookup cannot find.
+ *
+ * Return: the number of entries not stored at the hash of their own name,
+ *         which happens when the characters given to BUILTIN() do not
+ *         match it. Always 0 for a correct table.
+ */
+int builtins_unreachable(void)
+{
+  int unreachable = 0;
+  for (int i = 0; i < BUILTIN_SLOTS; i++)
+  {
+    const char *name = builtins[i].name;
+    size_t len = name ? strlen(name) : 0;
+    if (name && BUILTIN_HASH(len, (unsigned char)name[0], (unsigned char)name[len - 1]) != i)
+      unreachable++;
+  }
+  return unreachable;
+}
+
+/**
+ * builtin_is_special - Check whether a builtin changes the shell itself.
+ */
+int builtin_is_special(const builtin_t *b)
+{
+  return b->special;
+}
+
+/**
+ * builtin_is_pure - Check whether a builtin's output depends only on its
+ * arguments and input.
+ */
+int builtin_is_pure(const builtin_t *b)
+{
+  return b->pure;
+}
+
+/**
+ * is_builtin - Check whether a command line is handled by a builtin.
+ *
+ * @argv: NULL-terminated argument vector.
+ *
+ * Return: 1 if a builtin handles it, 0 if it must be executed.
+ */
+int is_builtin(char **argv)
+{
+  return builtin_lookup(argv) != NULL;
+}
+
+/**
+ * builtin_runs_inline - Check whether a builtin command can run directly
+ * in the shell process.
+ *
+ * @cmd: A single (non-pipeline) builtin command.
+ *
+ * Return: 1 for special builtins and for builtins without annotations,
+ *         background execution or a timeout; 0 when the executor must set
+ *         up a process for it, since a deadline can only stop a process.
+ *         Special builtins ignore annotations. Redirections never
+ *         need a process: run_builtin() applies them in the shell.
+ */
+int builtin_runs_inline(command_t *cmd)
+{
+  const builtin_t *b = cmd->builtin;
+  if (!b || cmd->syntax_error)
+    return 0;
+  return b->special || (!cmd->background && !cmd->resources && cmd->timeout_ms == 0);
+}
+
+/**
+ * run_builtin - Execute a shell builtin command if applicable.
+ *
+ * @cmd: Pointer to a command_t describing the parsed command.
+ *
+ * Return: 1 if a builtin was recognized and handled (or attempted to be
+ *         handled), 0 if no builtin was handled or if input is invalid.
+ *
+ * Description:
+ * This function checks whether the provided command corresponds to a shell
+ * builtin and, if so, performs the builtin action in the current process.
+ * Redirections are applied to the shell's own stdin and stdout for the
+ * duration of the builtin and then undone, so `history > file` does not
+ * fork. The exit status is available through get_last_status().
+ */
+int run_builtin(command_t *cmd)
+{
+  if (!cmd || cmd->is_exec || !cmd->builtin)
+    return 0;
+
+  const builtin_t *b = cmd->builtin;
+
+  saved_fds_t saved;
+  if (redirect_shell(cmd, &saved) != 0)
+  {
+    set_last_status(1);
+    return 1;
+  }
+
+  // A fresh stream for redirected input: stdin's buffer belongs to the
+  // terminal and must neither be read here nor left holding file data
+  FILE *in = stdin;
+  if (cmd->input_redirect || cmd->here_doc)
+    in = fdopen(dup(STDIN_FILENO), "r");
+
+  // Where a program would run, Ctrl-C stops the builtin like one: a filter
+  // reading the terminal or a huge file must not hold the shell hostage
+  if (!b->special)
+    reader_catch_interrupt(1);
+  int status = b->run(cmd, in ? in : stdin, stdout, 0);
+  if (!b->special)
+  {
+    reader_catch_interrupt(0);
+    if (reader_interrupted())
+    {
+      fputc('\n', stderr);
+      status = 130;
+    }
+  }
+  set_last_status(status);
+  fflush(stdout);
+
+  if (in && in != stdin)
+    fclose(in);
+  restore_shell(&saved);
+  return 1;
+}
+
+/**
+ * run_builtin_stage - Execute a builtin as a pipeline stage or subshell.
+ *
+ * @cmd: Pointer to a builtin command_t.
+ * @in: Stream the builtin reads its input from.
+ * @out: Stream that receives the builtin's output.
+ *
+ * Return: the builtin's exit status, or 127 if @cmd is not a builtin.
+ *
+ * Description:
+ * Used for builtins that do not run as the shell itself: pipeline stages
+ * (in a thread or a child) and the inner command of $(...). cd, exit and
+ * set then leave the shell untouched, as they would in a forked subshell.
+ * Safe to call from several threads at once.
+ */
+int run_builtin_stage(command_t *cmd, FILE *in, FILE *out)
+{
+  const builtin_t *b = cmd->builtin;
+  if (!b)
+    return 127;
+  return b->run(cmd, in, out, 1);
+}
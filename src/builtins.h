@@ -1,9 +1,20 @@
 #ifndef BUILTINS_H
 #define BUILTINS_H
 
+#include <stdio.h>
+
 #include "parser.h"
 #include "utility.h"
 
+typedef struct builtin builtin_t;
+
+const builtin_t *builtin_lookup(char **argv);
+int builtins_unreachable(void);
+int builtin_is_special(const builtin_t *b);
+int builtin_is_pure(const builtin_t *b);
+int is_builtin(char **argv);
+int builtin_runs_inline(command_t *cmd);
 int run_builtin(command_t *cmd);
+int run_builtin_stage(command_t *cmd, FILE *in, FILE *out);
 
 #endif
@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "builtins.h"
+#include "options.h"
+#include "utility.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * On-disk layout
+ *
+ * Each entry is a file named after its key in cache_dir():
+ *
+ *   entry_header_t | stdout bytes
+ *
+ * Entries are written to a temporary file and renamed into place, so a
+ * reader never sees a partial entry. The file's mtime is its last use.
+ */
+
+#define CACHE_MAGIC "MSC1"
+#define CACHE_VERSION "mini-shell-cache-1"
+
+// Variables that commonly change what a program prints; SHELL_CACHE_ENV
+// can name more
+static const char *default_env[] = {"LANG", "LC_ALL", "LC_CTYPE", "LC_COLLATE", "LC_NUMERIC", "TZ", NULL};
+
+typedef struct entry_header
+{
+  char magic[4];
+  int32_t status;
+  uint64_t length;
+} entry_header_t;
+
+typedef struct hash
+{
+  unsigned __int128 h;
+} hash_t;
+
+static char cache_path[PATH_MAX] = "";
+
+/*
+ * Running size of the entries, kept across stores so that a store only
+ * scans the directory when the limit is crossed; -1 before the first scan.
+ * Other shells sharing the directory add entries this one does not see,
+ * so it is scanned again every CACHE_RESCAN stores regardless.
+ */
+#define CACHE_RESCAN 64
+static int64_t stored_bytes = -1;
+static int stores_since_scan;
+
+static const unsigned __int128 FNV128_PRIME = ((unsigned __int128)1 << 88) + 0x13b;
+
+static void hash_init(hash_t *hash)
+{
+  hash->h = ((unsigned __int128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL;
+}
+
+static void hash_bytes(hash_t *hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  unsigned __int128 h = hash->h;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= p[i];
+    h *= FNV128_PRIME;
+  }
+  hash->h = h;
+}
+
+// Strings are hashed with their NUL, so ("ab", "c") and ("a", "bc") differ
+static void hash_string(hash_t *hash, const char *s)
+{
+  hash_bytes(hash, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+static void hash_file_identity(hash_t *hash, const struct stat *st)
+{
+  int64_t id[5] = {(int64_t)st->st_dev, (int64_t)st->st_ino, (int64_t)st->st_size,
+                   (int64_t)st->st_mtim.tv_sec, (int64_t)st->st_mtim.tv_nsec};
+  hash_bytes(hash, id, sizeof(id));
+}
+
+static int make_dir(const char *path)
+{
+  return mkdir(path, 0700) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/**
+ * cache_dir
+ *
+ * Return the cache directory, creating it if needed: $SHELL_CACHE_DIR, or
+ * mini-shell under $XDG_CACHE_HOME or $HOME/.cache.
+ */
+const char *cache_dir()
+{
+  if (cache_path[0])
+    return cache_path;
+
+  const char *dir = getenv("SHELL_CACHE_DIR");
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  if (dir && *dir)
+  {
+    snprintf(cache_path, sizeof(cache_path), "%s", dir);
+  }
+  else if (xdg && *xdg)
+  {
+    make_dir(xdg);
+    snprintf(cache_path, sizeof(cache_path), "%s/mini-shell", xdg);
+  }
+  else
+  {
+    char parent[PATH_MAX - 16];
+    snprintf(parent, sizeof(parent), "%s/.cache", get_home());
+    make_dir(parent);
+    snprintf(cache_path, sizeof(cache_path), "%s/mini-shell", parent);
+  }
+
+  make_dir(cache_path);
+  return cache_path;
+}
+
+/**
+ * cache_limit
+ *
+ * Return the size bound of the cache in bytes (`set -o cache_size=MiB`);
+ * 0 disables the cache.
+ */
+size_t cache_limit()
+{
+  return (size_t)get_option(OPT_CACHE_SIZE) << 20;
+}
+
+static void hash_env(hash_t *hash)
+{
+  for (int i = 0; default_env[i]; i++)
+  {
+    hash_string(hash, default_env[i]);
+    hash_string(hash, getenv(default_env[i]));
+  }
+
+  const char *extra = getenv("SHELL_CACHE_ENV");
+  if (!extra)
+    return;
+
+  char name[256];
+  while (*extra)
+  {
+    size_t len = strcspn(extra, ": ");
+    if (len > 0 && len < sizeof(name))
+    {
+      memcpy(name, extra, len);
+      name[len] = '\0';
+      hash_string(hash, name);
+      hash_string(hash, getenv(name));
+    }
+    extra += len + (extra[len] != '\0');
+  }
+}
+
+/**
+ * hash_input
+ *
+ * Hash the identity and whole content of an input file.
+ *
+ * Returns:
+ *   0 on success, -1 if it cannot be read.
+ */
+static int hash_input(hash_t *hash, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  hash_string(hash, path);
+  hash_file_identity(hash, &st);
+
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    hash_bytes(hash, buf, n);
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+/**
+ * stdin_is_null
+ *
+ * Check whether the shell's stdin is /dev/null, the one input that needs
+ * no hashing: anything else a first stage without `<` would read is not in
+ * the key.
+ */
+static int stdin_is_null()
+{
+  struct stat in, null;
+  return fstat(STDIN_FILENO, &in) == 0 && stat("/dev/null", &null) == 0 && S_ISCHR(in.st_mode) &&
+         in.st_rdev == null.st_rdev;
+}
+
+/**
+ * cache_key
+ *
+ * Compute the cache key of an expanded command line.
+ *
+ * Parameters:
+ *   cmd - the command; every stage of a pipeline is covered.
+ *   key - receives the key as hex digits.
+ *
+ * Returns:
+ *   0 on success, -1 if a program cannot be found, a stage calls a shell
+ *   function or a builtin that shows or changes the shell's state, the
+ *   first stage would read the shell's stdin (other than /dev/null), or an
+ *   input cannot be read (the command then runs uncached and reports any
+ *   error itself).
+ */
+int cache_key(command_t *cmd, char key[CACHE_KEY_SIZE])
+{
+  hash_t hash;
+  hash_init(&hash);
+  hash_string(&hash, CACHE_VERSION);
+  hash_string(&hash, get_pwd());
+  hash_env(&hash);
+
+  // Piped or typed input cannot be hashed without consuming it
+  if (!cmd->input_redirect && !cmd->here_doc && !stdin_is_null())
+    return -1;
+
+  for (command_t *cur = cmd; cur; cur = cur->pipe_to)
+  {
+    hash_string(&hash, "|");
+    for (int i = 0; cur->argv[i]; i++)
+      hash_string(&hash, cur->argv[i]);
+
+    if (cur->function)
+    {
+      // What a function runs is not tracked
+      return -1;
+    }
+    else if (cur->is_exec)
+    {
+      char path[PATH_MAX];
+      struct stat st;
+      if (find_program(cur->argv[0], path, sizeof(path), &st) != 0)
+        return -1;
+      hash_file_identity(&hash, &st);
+    }
+    else if (cur->builtin && builtin_is_pure(cur->builtin))
+    {
+      hash_string(&hash, "builtin");
+    }
+    else
+    {
+      // history, jobs, stats and the like print state the key cannot see
+      return -1;
+    }
+
+    if (cur->input_redirect && hash_input(&hash, cur->input_redirect) != 0)
+      return -1;
+    if (cur->here_doc)
+    {
+      hash_string(&hash, "<<");
+      hash_string(&hash, cur->here_doc);
+    }
+  }
+
+  snprintf(key, CACHE_KEY_SIZE, "%016llx%016llx", (unsigned long long)(hash.h >> 64),
+           (unsigned long long)hash.h);
+  return 0;
+}
+
+static void entry_path(char *path, size_t size, const char *name)
+{
+  snprintf(path, size, "%s/%s", cache_dir(), name);
+}
+
+/**
+ * cache_lookup
+ *
+ * Replay a cached entry: copy its stdout to out_fd and mark it as used.
+ *
+ * Returns:
+ *   1 on a hit with the command's exit status in status, 0 on a miss.
+ */
+int cache_lookup(const char *key, int out_fd, int *status)
+{
+  char path[PATH_MAX];
+  entry_path(path, sizeof(path), key);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  entry_header_t header;
+  struct stat st;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, CACHE_MAGIC, 4) != 0 ||
+      fstat(fd, &st) != 0 || (uint64_t)st.st_size != sizeof(header) + header.length)
+  {
+    // Damaged entry: drop it and run the command
+    close(fd);
+    unlink(path);
+    return 0;
+  }
+
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+  {
+    char *p = buf;
+    while (n > 0)
+    {
+      ssize_t w = write(out_fd, p, n);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        break;
+      p += w;
+      n -= w;
+    }
+  }
+
+  // The mtime records the last use, for eviction
+  futimens(fd, NULL);
+  close(fd);
+  *status = header.status;
+  return 1;
+}
+
+typedef struct entry_info
+{
+  char name[CACHE_KEY_SIZE];
+  off_t size;
+  struct timespec used;
+} entry_info_t;
+
+static int older_first(const void *a, const void *b)
+{
+  const struct timespec *x = &((const entry_info_t *)a)->used;
+  const struct timespec *y = &((const entry_info_t *)b)->used;
+  if (x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/**
+ * evict
+ *
+ * Total the entries' sizes and, if the cache holds more than limit bytes,
+ * remove the least recently used entries until it is down to 90% of it.
+ * The result becomes the running size.
+ */
+static void evict(size_t limit)
+{
+  DIR *dir = opendir(cache_dir());
+  if (!dir)
+    return;
+
+  entry_info_t *entries = NULL;
+  size_t count = 0, cap = 0;
+  uint64_t total = 0;
+  struct dirent *d;
+  while ((d = readdir(dir)))
+  {
+    struct stat st;
+    if (strlen(d->d_name) != CACHE_KEY_SIZE - 1 || fstatat(dirfd(dir), d->d_name, &st, 0) != 0 ||
+        !S_ISREG(st.st_mode))
+      continue;
+
+    if (count == cap)
+    {
+      cap = cap ? cap * 2 : 64;
+      entries = realloc(entries, cap * sizeof(entry_info_t));
+    }
+    memcpy(entries[count].name, d->d_name, CACHE_KEY_SIZE);
+    entries[count].size = st.st_size;
+    entries[count].used = st.st_mtim;
+    total += st.st_size;
+    count++;
+  }
+
+  if (total > limit)
+  {
+    qsort(entries, count, sizeof(entry_info_t), older_first);
+    for (size_t i = 0; i < count && total > limit / 10 * 9; i++)
+    {
+      if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+        total -= entries[i].size;
+    }
+  }
+
+  closedir(dir);
+  free(entries);
+  stored_bytes = total;
+  stores_since_scan = 0;
+}
+
+/**
+ * cache_store
+ *
+ * Save a command's stdout and exit status under key. The running size
+ * takes the new entry; once it passes the limit (or on a periodic rescan)
+ * old entries are evicted. Entries larger than a quarter of the limit are
+ * not kept.
+ */
+void cache_store(const char *key, const char *data, size_t len, int status)
+{
+  size_t limit = cache_limit();
+  if (limit == 0 || len + sizeof(entry_header_t) > limit / 4)
+    return;
+
+  char tmp[PATH_MAX], path[PATH_MAX];
+  char name[64];
+  snprintf(name, sizeof(name), ".tmp.%d", (int)getpid());
+  entry_path(tmp, sizeof(tmp), name);
+  entry_path(path, sizeof(path), key);
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return;
+
+  // An entry stored again under the same key replaces the old one
+  struct stat old;
+  int64_t added = sizeof(entry_header_t) + len - (stat(path, &old) == 0 ? old.st_size : 0);
+
+  entry_header_t header = {.status = status, .length = len};
+  memcpy(header.magic, CACHE_MAGIC, 4);
+  int ok = write(fd, &header, sizeof(header)) == sizeof(header);
+  while (ok && len > 0)
+  {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      ok = 0;
+      break;
+    }
+    data += n;
+    len -= n;
+  }
+
+  if (close(fd) != 0 || !ok || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    return;
+  }
+
+  if (stored_bytes >= 0)
+    stored_bytes += added;
+  if (stored_bytes < 0 || stored_bytes > (int64_t)limit || ++stores_since_scan >= CACHE_RESCAN)
+    evict(limit);
+}
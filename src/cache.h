@@ -0,0 +1,27 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#include "parser.h"
+
+/*
+ * Content-addressed output cache for the `cache` prefix. An entry is keyed
+ * by a 128-bit FNV-1a hash of everything that decides what a deterministic
+ * command writes: the working directory, each stage's argv and resolved
+ * program (device, inode, size, mtime), selected environment variables,
+ * and the identity and content of every `<` input. Entries hold the
+ * command's stdout and exit status and live in one directory whose total
+ * size is bounded; a hit refreshes the entry's mtime, and the least
+ * recently used entries are evicted first.
+ */
+
+#define CACHE_KEY_SIZE 33 /* 32 hex digits and a NUL */
+
+const char *cache_dir();
+size_t cache_limit();
+int cache_key(command_t *cmd, char key[CACHE_KEY_SIZE]);
+int cache_lookup(const char *key, int out_fd, int *status);
+void cache_store(const char *key, const char *data, size_t len, int status);
+
+#endif
@@ -0,0 +1,542 @@
+#include "editor.h"
+#include "history.h"
+#include "jobs.h"
+#include "memory.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+#define ESCAPE_TIMEOUT_MS 50
+#define DEFAULT_COLUMNS 80
+
+/* Keys without a control character of their own */
+#define KEY_DELETE 0x100
+#define KEY_WORD_LEFT 0x101
+#define KEY_WORD_RIGHT 0x102
+#define KEY_WORD_RUBOUT 0x103
+
+static int in_fd = -1;
+static int out_fd = -1;
+
+/* History ring: ring_count lines, the oldest at ring[ring_start] */
+static char *ring[EDITOR_HISTORY];
+static int ring_start;
+static int ring_count;
+
+/* Bytes read from the terminal and not yet handled */
+static unsigned char input[256];
+static size_t input_pos;
+static size_t input_len;
+
+typedef struct edit
+{
+  char *buf;        /* the line, not NUL-terminated while editing */
+  size_t len;
+  size_t pos;       /* cursor, as an index into buf */
+  size_t max;       /* longest line that fits the caller's buffer */
+  const char *prompt;
+  size_t width;     /* columns the line may use after the prompt */
+  size_t offset;    /* first byte of buf on screen */
+  char *shown;      /* what the screen shows after the prompt */
+  size_t shown_len;
+  size_t cursor;    /* screen column of the cursor, after the prompt */
+  int hist;         /* ring index being edited; ring_count for a new line */
+  char *draft;      /* the new line, while the history is shown */
+  char *out;        /* output of the current keystroke */
+  size_t out_len;
+  size_t out_cap;
+} edit_t;
+
+static void dispatch_jobs(edit_t *e);
+
+static const char *ring_get(int i)
+{
+  return ring[(ring_start + i) % EDITOR_HISTORY];
+}
+
+/**
+ * editor_add_history
+ *
+ * Append a command line to the history ring, dropping the oldest line when
+ * it is full. Blank lines, repeats of the newest line and lines spanning
+ * several lines are not kept.
+ */
+void editor_add_history(const char *line)
+{
+  size_t len = strcspn(line, "\n");
+  if (len == 0 || line[len + (line[len] == '\n')] != '\0')
+    return;
+  if (ring_count > 0)
+  {
+    const char *newest = ring_get(ring_count - 1);
+    if (strlen(newest) == len && strncmp(newest, line, len) == 0)
+      return;
+  }
+
+  if (ring_count == EDITOR_HISTORY)
+  {
+    mem_free(MEM_HISTORY, ring[ring_start]);
+    ring_start = (ring_start + 1) % EDITOR_HISTORY;
+    ring_count--;
+  }
+  ring[(ring_start + ring_count++) % EDITOR_HISTORY] = mem_strndup(MEM_HISTORY, line, len);
+}
+
+/**
+ * editor_init
+ *
+ * Use the line editor for input from in_fd, echoing to out_fd, if both are
+ * terminals. The history ring is loaded here, from the last EDITOR_HISTORY
+ * records of the history log; the rest of the log is never read.
+ *
+ * Returns:
+ *   1 if editing is on, 0 if the shell should read plain lines.
+ */
+int editor_init(int in, int out)
+{
+  if (!isatty(in) || !isatty(out))
+    return 0;
+  in_fd = in;
+  out_fd = out;
+
+  history_entry_t *entries;
+  int count = history_load_tail(&entries, EDITOR_HISTORY);
+  for (int i = 0; i < count; i++)
+    editor_add_history(entries[i].cmd);
+  history_free_entries(entries, count > 0 ? count : 0);
+  return 1;
+}
+
+/**
+ * next_byte
+ *
+ * Take the next input byte, reading the terminal when none is buffered.
+ * Like the shell's plain line reader it also waits on jobs_fd(), so
+ * deadlines fire and background jobs are reaped while the user types;
+ * the line being edited in e is drawn again below any notice they print.
+ *
+ * Returns:
+ *   The byte, -1 at end of input, or -2 if timeout_ms passed first (a
+ *   negative timeout waits indefinitely).
+ */
+static int next_byte(edit_t *e, int timeout_ms)
+{
+  while (input_pos == input_len)
+  {
+    struct pollfd fds[2] = {{in_fd, POLLIN, 0}, {jobs_fd(), POLLIN, 0}};
+    int ready = poll(fds, fds[1].fd < 0 ? 1 : 2, timeout_ms);
+    if (ready == 0)
+      return -2;
+    if (ready < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    if (fds[1].revents & POLLIN)
+      dispatch_jobs(e);
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      ssize_t n = read(in_fd, input, sizeof(input));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      input_pos = 0;
+      input_len = n;
+    }
+  }
+  return input[input_pos++];
+}
+
+/**
+ * read_escape
+ *
+ * Decode the rest of an escape sequence: cursor keys (CSI and SS3 forms),
+ * Home, End, Delete, Ctrl- and Alt-arrows and Alt-b / Alt-f. Keys with a
+ * control character equivalent are returned as that character.
+ *
+ * Returns:
+ *   The key, or 0 for a lone Escape or a sequence the editor ignores.
+ */
+static int read_escape(edit_t *e)
+{
+  int c = next_byte(e, ESCAPE_TIMEOUT_MS);
+  if (c == 'b')
+    return KEY_WORD_LEFT;
+  if (c == 'f')
+    return KEY_WORD_RIGHT;
+  if (c == 127)
+    return KEY_WORD_RUBOUT;
+  if (c != '[' && c != 'O')
+    return 0;
+
+  int n = 0, modified = 0;
+  c = next_byte(e, ESCAPE_TIMEOUT_MS);
+  if (c >= '0' && c <= '9')
+  {
+    // ESC [ n ~ or ESC [ 1 ; MOD letter
+    for (; c >= '0' && c <= '9'; c = next_byte(e, ESCAPE_TIMEOUT_MS))
+      n = n * 10 + c - '0';
+    if (c == ';')
+    {
+      modified = next_byte(e, ESCAPE_TIMEOUT_MS) > '1';
+      c = next_byte(e, ESCAPE_TIMEOUT_MS);
+    }
+    if (c == '~')
+      return n == 1 || n == 7 ? CTRL_KEY('A') : n == 4 || n == 8 ? CTRL_KEY('E') : n == 3 ? KEY_DELETE : 0;
+  }
+
+  switch (c)
+  {
+  case 'A':
+    return CTRL_KEY('P');
+  case 'B':
+    return CTRL_KEY('N');
+  case 'C':
+    return modified ? KEY_WORD_RIGHT : CTRL_KEY('F');
+  case 'D':
+    return modified ? KEY_WORD_LEFT : CTRL_KEY('B');
+  case 'H':
+    return CTRL_KEY('A');
+  case 'F':
+    return CTRL_KEY('E');
+  }
+  return 0;
+}
+
+static void emit(edit_t *e, const char *s, size_t n)
+{
+  if (e->out_len + n > e->out_cap)
+  {
+    e->out_cap = (e->out_len + n) * 2;
+    e->out = realloc(e->out, e->out_cap);
+  }
+  memcpy(e->out + e->out_len, s, n);
+  e->out_len += n;
+}
+
+static void flush_output(edit_t *e)
+{
+  size_t done = 0;
+  while (done < e->out_len)
+  {
+    ssize_t n = write(out_fd, e->out + done, e->out_len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  e->out_len = 0;
+}
+
+/**
+ * move_to
+ *
+ * Move the screen cursor to a column of the shown line, in as few bytes as
+ * possible: backspaces or rewritten characters for short distances, a CSI
+ * sequence for longer ones.
+ */
+static void move_to(edit_t *e, size_t column)
+{
+  char seq[32];
+
+  if (column < e->cursor)
+  {
+    size_t n = e->cursor - column;
+    if (n <= 4)
+      emit(e, "\b\b\b\b", n);
+    else
+      emit(e, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", n));
+  }
+  else if (column > e->cursor)
+  {
+    size_t n = column - e->cursor;
+    if (n <= 4)
+      emit(e, e->shown + e->cursor, n);
+    else
+      emit(e, seq, snprintf(seq, sizeof(seq), "\x1b[%zuC", n));
+  }
+  e->cursor = column;
+}
+
+/**
+ * refresh
+ *
+ * Bring the screen up to date with the line. Only the text from the first
+ * column that differs from what is shown is written, followed by a clear to
+ * the end of the line if the line got shorter. The visible part scrolls by
+ * half its width when the cursor would leave it.
+ */
+static void refresh(edit_t *e)
+{
+  if (e->pos < e->offset || e->pos - e->offset >= e->width)
+    e->offset = e->pos > e->width / 2 ? e->pos - e->width / 2 : 0;
+
+  const char *visible = e->buf + e->offset;
+  size_t visible_len = e->len - e->offset < e->width ? e->len - e->offset : e->width;
+
+  size_t same = 0;
+  while (same < visible_len && same < e->shown_len && visible[same] == e->shown[same])
+    same++;
+
+  if (same < visible_len || same < e->shown_len)
+  {
+    move_to(e, same);
+    emit(e, visible + same, visible_len - same);
+    if (e->shown_len > visible_len)
+      emit(e, "\x1b[K", 3);
+    memcpy(e->shown + same, visible + same, visible_len - same);
+    e->shown_len = visible_len;
+    e->cursor = visible_len;
+  }
+  move_to(e, e->pos - e->offset);
+  flush_output(e);
+}
+
+// Start a fresh screen line: the prompt, with nothing shown after it
+static void show_prompt(edit_t *e)
+{
+  emit(e, e->prompt, strlen(e->prompt));
+  e->shown_len = 0;
+  e->cursor = 0;
+}
+
+/**
+ * dispatch_jobs
+ *
+ * Run jobs_dispatch() while a line is being edited. Its notices, such as a
+ * queued job starting or a deadline passing, would land in the middle of
+ * the line, so the line is cleared first and drawn again, prompt and all,
+ * on the line below them.
+ */
+static void dispatch_jobs(edit_t *e)
+{
+  emit(e, "\r\x1b[K", 4);
+  flush_output(e);
+  jobs_dispatch();
+  fflush(stdout);
+  show_prompt(e);
+  refresh(e);
+}
+
+static void set_text(edit_t *e, const char *text)
+{
+  size_t len = strlen(text);
+  e->len = len < e->max ? len : e->max;
+  memcpy(e->buf, text, e->len);
+  e->pos = e->len;
+}
+
+// Replace the line with an older (step -1) or newer (step 1) history entry
+static void recall(edit_t *e, int step)
+{
+  int next = e->hist + step;
+  if (next < 0 || next > ring_count)
+    return;
+
+  if (e->hist == ring_count)
+  {
+    free(e->draft);
+    e->draft = strndup(e->buf, e->len);
+  }
+  set_text(e, next == ring_count ? e->draft : ring_get(next));
+  e->hist = next;
+}
+
+static void delete_range(edit_t *e, size_t from, size_t to)
+{
+  memmove(e->buf + from, e->buf + to, e->len - to);
+  e->len -= to - from;
+  e->pos = from;
+}
+
+static size_t word_left(edit_t *e)
+{
+  size_t i = e->pos;
+  while (i > 0 && e->buf[i - 1] == ' ')
+    i--;
+  while (i > 0 && e->buf[i - 1] != ' ')
+    i--;
+  return i;
+}
+
+static size_t word_right(edit_t *e)
+{
+  size_t i = e->pos;
+  while (i < e->len && e->buf[i] == ' ')
+    i++;
+  while (i < e->len && e->buf[i] != ' ')
+    i++;
+  return i;
+}
+
+// Columns a prompt takes up; UTF-8 continuation bytes take none
+static size_t columns(const char *s)
+{
+  size_t n = 0;
+  for (; *s; s++)
+    n += ((unsigned char)*s & 0xc0) != 0x80;
+  return n;
+}
+
+/**
+ * editor_read
+ *
+ * Show the prompt and read one line with editing, in raw mode for the
+ * duration. Input the user typed ahead stays buffered for the next line.
+ *
+ * Parameters:
+ *   prompt - written before the line.
+ *   line   - receives the line and its newline, NUL-terminated.
+ *   size   - size of line; the editor accepts up to size - 2 bytes.
+ *
+ * Returns:
+ *   line, or NULL at end of input (Ctrl-D on an empty line).
+ */
+char *editor_read(const char *prompt, char *line, size_t size)
+{
+  struct termios saved, raw;
+  if (size < 3 || tcgetattr(in_fd, &saved) != 0)
+    return NULL;
+  raw = saved;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cflag |= CS8;
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  // TCSADRAIN, unlike TCSAFLUSH, keeps what was typed ahead
+  tcsetattr(in_fd, TCSADRAIN, &raw);
+
+  struct winsize ws;
+  size_t cols = ioctl(out_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : DEFAULT_COLUMNS;
+  size_t prompt_cols = columns(prompt);
+
+  edit_t e = {0};
+  e.buf = line;
+  e.max = size - 2;
+  e.prompt = prompt;
+  e.width = cols > prompt_cols + 9 ? cols - prompt_cols - 1 : 8;
+  e.shown = malloc(e.width);
+  e.hist = ring_count;
+
+  fflush(stdout);
+  show_prompt(&e);
+  refresh(&e);
+
+  char *result = line;
+  for (;;)
+  {
+    int key = next_byte(&e, -1);
+    if (key == 27)
+      key = read_escape(&e);
+
+    if (key == -1 || (key == CTRL_KEY('D') && e.len == 0))
+    {
+      // End of input; a partial line still counts, as with plain reads
+      if (e.len == 0)
+        result = NULL;
+      break;
+    }
+    if (key == '\r' || key == '\n')
+      break;
+
+    switch (key)
+    {
+    case CTRL_KEY('C'):
+      // Discard the line and start over
+      e.len = e.pos = e.offset = 0;
+      e.hist = ring_count;
+      emit(&e, "^C\r\n", 4);
+      show_prompt(&e);
+      break;
+    case CTRL_KEY('L'):
+      emit(&e, "\x1b[H\x1b[2J", 7);
+      show_prompt(&e);
+      break;
+    case CTRL_KEY('A'):
+      e.pos = 0;
+      break;
+    case CTRL_KEY('E'):
+      e.pos = e.len;
+      break;
+    case CTRL_KEY('B'):
+      if (e.pos > 0)
+        e.pos--;
+      break;
+    case CTRL_KEY('F'):
+      if (e.pos < e.len)
+        e.pos++;
+      break;
+    case KEY_WORD_LEFT:
+      e.pos = word_left(&e);
+      break;
+    case KEY_WORD_RIGHT:
+      e.pos = word_right(&e);
+      break;
+    case CTRL_KEY('P'):
+      recall(&e, -1);
+      break;
+    case CTRL_KEY('N'):
+      recall(&e, 1);
+      break;
+    case 127:
+    case CTRL_KEY('H'):
+      if (e.pos > 0)
+        delete_range(&e, e.pos - 1, e.pos);
+      break;
+    case CTRL_KEY('D'):
+    case KEY_DELETE:
+      if (e.pos < e.len)
+        delete_range(&e, e.pos, e.pos + 1);
+      break;
+    case CTRL_KEY('K'):
+      e.len = e.pos;
+      break;
+    case CTRL_KEY('U'):
+      delete_range(&e, 0, e.pos);
+      break;
+    case CTRL_KEY('W'):
+    case KEY_WORD_RUBOUT:
+      delete_range(&e, word_left(&e), e.pos);
+      break;
+    default:
+      if (key >= ' ' && key <= 0xff && e.len < e.max)
+      {
+        memmove(e.buf + e.pos + 1, e.buf + e.pos, e.len - e.pos);
+        e.buf[e.pos++] = key;
+        e.len++;
+      }
+      break;
+    }
+
+    // A paste arrives in one read; draw it once, after its last byte
+    if (input_pos == input_len)
+      refresh(&e);
+  }
+
+  refresh(&e);
+  emit(&e, "\r\n", 2);
+  flush_output(&e);
+  tcsetattr(in_fd, TCSADRAIN, &saved);
+
+  if (result)
+  {
+    line[e.len] = '\n';
+    line[e.len + 1] = '\0';
+  }
+  free(e.draft);
+  free(e.shown);
+  free(e.out);
+  return result;
+}
@@ -0,0 +1,27 @@
+#ifndef EDITOR_H
+#define EDITOR_H
+
+#include <stddef.h>
+
+/*
+ * Line editor for interactive input. On a terminal the prompt line is read
+ * in raw mode: the cursor moves over the line (arrows, Home / End, Ctrl-A /
+ * Ctrl-E, Ctrl-B / Ctrl-F), text is inserted at the cursor and deleted with
+ * Backspace, Delete, Ctrl-K, Ctrl-U and Ctrl-W, and Up / Down (Ctrl-P /
+ * Ctrl-N) walk an in-memory history ring. The ring is filled once, at
+ * startup, from the tail of the history log and then kept up to date by
+ * the shell, so navigating never reads the file.
+ *
+ * Redrawing sends only what changed: the part of the line after the first
+ * difference from what the terminal shows, plus cursor movement. A line
+ * wider than the terminal scrolls horizontally in half-screen steps, so
+ * most keystrokes cost a few bytes however long the line is.
+ */
+
+#define EDITOR_HISTORY 1000
+
+int editor_init(int in_fd, int out_fd);
+char *editor_read(const char *prompt, char *line, size_t size);
+void editor_add_history(const char *line);
+
+#endif
@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include "executor.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,145 +10,1575 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "parser.h"
 #include "utility.h"
 #include "builtins.h"
+#include "options.h"
+#include "ring.h"
+#include "resources.h"
+#include "trace.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "cache.h"
+#include "names.h"
 
-// Forward declaration
+// Forward declarations
 static void setup_redirection(command_t *cmd);
+static int here_doc_fd(const char *body);
+static int call_function(command_t *cmd);
+static int run_expanded(command_t *cmd);
+static void write_all(int fd, const char *data, size_t len);
+
+// Exit status of the last foreground command, shell style (128+N on signal)
+static int last_status = 0;
+
+// When the latest fork started; the child reports its launch latency
+static int64_t fork_started;
+
+int get_last_status() {
+    return last_status;
+}
+
+void set_last_status(int status) {
+    last_status = status;
+}
+
+static int decode_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return -1;
+}
+
+// The interactive shell keeps SIGCHLD blocked and learns about exits from
+// jobs_fd(); elsewhere it is blocked around each foreground wait so nothing
+// else can reap the child first.
+static void block_sigchld(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+// -----------------------------------------------------------
+// Child process setup
+// -----------------------------------------------------------
+
+// Undo the shell's signal setup in a freshly forked child
+static void reset_child_signals(sigset_t *old_mask) {
+    sigset_t mask = *old_mask;
+    sigdelset(&mask, SIGCHLD);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+}
+
+// Hand the terminal to a foreground job in its own process group, so it
+// can read it and Ctrl-C reaches it; the shell takes it back the same way.
+// SIGTTOU is blocked because the caller may already be in the background.
+static void give_terminal(pid_t pgid) {
+    if (!isatty(STDIN_FILENO)) return;
+
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// A job with a deadline, or in the background, gets a process group of
+// its own that signals can target. The child and the shell both move it
+// there (pgid 0: a new group) so neither can run ahead of the other.
+static void enter_group(pid_t pgid, int foreground) {
+    setpgid(0, pgid);
+    if (foreground) give_terminal(getpgrp());
+}
+
+// Deadline of cmd's job in ms (0: none): its `timeout` prefix or, for a
+// background job, the deadline option
+static int64_t job_deadline(command_t *cmd, int64_t *kill_after) {
+    if (cmd->timeout_ms > 0) {
+        *kill_after = cmd->kill_after_ms;
+        return cmd->timeout_ms;
+    }
+    *kill_after = JOB_KILL_AFTER_MS;
+    return cmd->background ? (int64_t)get_option(OPT_DEADLINE) * 1000 : 0;
+}
+
+// A builtin child never execs, so close what exec would have: the other
+// pipes of its pipeline, fan-out pipes of other branches, and so on
+static void close_cloexec_fds(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        int fd = atoi(entry->d_name);
+        if (fd > STDERR_FILENO && fd != dirfd(dir) && (fcntl(fd, F_GETFD) & FD_CLOEXEC)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+// Run cmd in the current (child) process; never returns
+static void run_child(command_t *cmd) {
+    setup_redirection(cmd);
+    if (resources_apply(cmd->resources) != 0) exit(1);
+
+    if (!cmd->is_exec) {
+        close_cloexec_fds();
+
+        // stdin's buffer may hold input the shell read before forking
+        FILE *in = fdopen(STDIN_FILENO, "r");
+        int status = run_builtin_stage(cmd, in, stdout);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    if (cmd->function) {
+        // A function in a pipeline or the background runs here, in a
+        // subshell set up like the shell: it waits for its own commands
+        sigset_t old;
+        close_cloexec_fds();
+        jobs_forget();
+        block_sigchld(&old);
+        int status = call_function(cmd);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    TRACE_INSTANT("exec", cmd->argv[0], 0);
+    metrics_observe(METRIC_LAUNCH_LATENCY, metrics_now() - fork_started);
+    execvp(cmd->argv[0], cmd->argv);
+    metrics_count(METRIC_EXEC_FAILURES);
+    perror("execvp");
+    exit(1);
+}
 
 // -----------------------------------------------------------
 // Pipeline (cmd1 | cmd2)
 // -----------------------------------------------------------
-static void execute_pipeline(command_t *cmd) {
-    int prev_pipefd[2] = {-1, -1};
-    int pipefd[2] = {-1, -1};
+//
+// External stages are forked. With the `fusion` option on, builtin stages
+// instead run as threads of the shell; two adjacent builtin stages are
+// joined by a ring buffer, and a kernel pipe only appears where a builtin
+// meets an external program.
+//
+// A fan-out (producer |> branch1 |> branch2) feeds the producer's output
+// into a pipe that a tee thread duplicates into every branch with tee(2),
+// so the bytes never pass through the shell. All stages of all branches
+// are forked before the first thread starts.
+
+#define RING_SIZE (64 * 1024)
+#define FANOUT_PIPE_SIZE (1024 * 1024)
+
+typedef struct stage_run {
+    command_t *cmd;
     pid_t pid;
-    command_t *cur = cmd;
-    
-    // Track all children to wait for them later
-    int children_count = 0;
+    int threaded;
+    pthread_t thread;
+    FILE *in;
+    FILE *out;
+    int status;
+} stage_run_t;
+
+// Joins stage i to stage i + 1
+typedef struct pipe_link {
+    ring_t *ring;
+    int fds[2];
+} pipe_link_t;
+
+typedef struct pipeline_run {
+    stage_run_t *stages;
+    pipe_link_t *links;
+    int count;
+    int in_fd;          // first stage's stdin, or -1 for the shell's
+    int out_fd;         // last stage's stdout, or -1 for the shell's
+    int owns_in;        // in_fd is a fan-out pipe to close once started
+    sigset_t old_mask;
+
+    // Fan-out: the last stage writes into tee_fds[1], the tee thread
+    // copies tee_fds[0] into branch_fds[i], which branch i reads
+    struct pipeline_run *branches;
+    int branch_count;
+    int tee_fds[2];
+    int *branch_fds;
+    pthread_t tee_thread;
+
+    // A pipeline with a deadline runs in process group pgid
+    job_t *job;
+    pid_t pgid;
+} pipeline_run_t;
+
+static int count_stages(command_t *cmd) {
+    int stages = 0;
+    for (command_t *cur = cmd; cur; cur = cur->pipe_to) stages++;
+    return stages;
+}
+
+// Replace a threaded stage's stream with a redirection target
+static int redirect_stream(FILE **stream, const char *path, const char *mode) {
+    if (!path) return 0;
+
+    FILE *f = fopen(path, mode);
+    if (!f) {
+        perror("open");
+        return -1;
+    }
+    fclose(*stream);
+    *stream = f;
+    return 0;
+}
+
+// Replace a threaded stage's input with its here-document or input file
+static int redirect_input(stage_run_t *st) {
+    if (!st->cmd->here_doc) return redirect_stream(&st->in, st->cmd->input_redirect, "re");
+
+    int fd = here_doc_fd(st->cmd->here_doc);
+    if (fd < 0) return -1;
+    fclose(st->in);
+    st->in = fdopen(fd, "r");
+    return 0;
+}
+
+static void *stage_thread(void *arg) {
+    stage_run_t *st = arg;
+
+    st->status = 1;
+    if (st->in && st->out && redirect_input(st) == 0 &&
+        redirect_stream(&st->out, st->cmd->output_redirect, "we") == 0) {
+        TRACE_BEGIN("builtin", st->cmd->argv[0]);
+        st->status = run_builtin_stage(st->cmd, st->in, st->out);
+        TRACE_END("builtin");
+    }
+
+    // Closing signals EOF downstream and a broken pipe upstream
+    if (st->out) fclose(st->out);
+    if (st->in) fclose(st->in);
+    return NULL;
+}
+
+static void close_fd(int *fd) {
+    if (*fd != -1) close(*fd);
+    *fd = -1;
+}
+
+static void close_links(pipe_link_t *links, int count) {
+    for (int i = 0; i < count; i++) {
+        close_fd(&links[i].fds[0]);
+        close_fd(&links[i].fds[1]);
+        // A ring no stage took over: drop both of its sides
+        if (links[i].ring) {
+            ring_close_writer(links[i].ring);
+            ring_close_reader(links[i].ring);
+            links[i].ring = NULL;
+        }
+    }
+}
+
+static FILE *dup_stream(int fd, const char *mode) {
+    return fdopen(fcntl(fd, F_DUPFD_CLOEXEC, 0), mode);
+}
+
+// Larger pipes let a fast branch run further ahead of a slow one
+static int grow_pipe(int fd) {
+    fcntl(fd, F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+    return fcntl(fd, F_GETPIPE_SZ);
+}
+
+// Copy the first n bytes of src into buf without consuming them, by way of
+// an empty scratch pipe at least n bytes large
+static int peek_pipe(int src, int scratch[2], char *buf, ssize_t n) {
+    ssize_t copied, got = 0;
+    do {
+        copied = tee(src, scratch[1], n, 0);
+    } while (copied < 0 && errno == EINTR);
+
+    while (got < copied) {
+        ssize_t r = read(scratch[0], buf + got, copied - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        got += r;
+    }
+    return copied == n ? 0 : -1;
+}
+
+// Duplicate everything read from src into every fd in dst. Each round
+// tee()s the same n bytes to every live branch and then drops them from
+// src. A branch whose pipe had room for only part of the round gets the
+// rest written from a copy of the round, so a slow branch costs one copy
+// rather than lost or repeated data. The slowest branch still bounds the
+// producer once its pipe is full; a branch that exits is dropped, and the
+// producer sees EPIPE once every branch is gone.
+static void tee_loop(int src, int *dst, int count) {
+    int round = grow_pipe(src);
+    int live = count;
+    int scratch[2] = {-1, -1};
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    ssize_t *sent = calloc(count, sizeof(ssize_t));
+    char *buf = NULL;
+
+    for (int i = 0; i < count; i++) {
+        int size = grow_pipe(dst[i]);
+        if (size > 0 && size < round) round = size;
+    }
+    if (pipe2(scratch, O_CLOEXEC) == 0) {
+        int size = grow_pipe(scratch[0]);
+        if (size > 0 && size < round) round = size;
+    }
+
+    while (live > 0) {
+        // The first live branch sets the round size, waiting for input
+        ssize_t n = -1;
+        for (int i = 0; i < count; i++) {
+            sent[i] = 0;
+            if (dst[i] == -1) continue;
+
+            ssize_t r;
+            do {
+                r = tee(src, dst[i], n < 0 ? (size_t)round : (size_t)n, 0);
+            } while (r < 0 && errno == EINTR);
+
+            if (r < 0) {
+                close_fd(&dst[i]);
+                live--;
+                continue;
+            }
+            sent[i] = r;
+            if (n < 0) {
+                n = r;
+                if (r == 0) break;      // end of input
+            }
+        }
+        if (n <= 0) break;
+
+        // Copy fallback for branches that took only part of the round
+        int have_copy = 0;
+        for (int i = 0; i < count; i++) {
+            if (dst[i] == -1 || sent[i] == n) continue;
+
+            if (!have_copy) {
+                if (!buf) buf = malloc(round);
+                have_copy = scratch[0] != -1 && peek_pipe(src, scratch, buf, n) == 0;
+            }
+
+            for (ssize_t off = have_copy ? sent[i] : n; off < n;) {
+                ssize_t w = write(dst[i], buf + off, n - off);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) break;
+                off += w;
+                if (off == n) sent[i] = n;
+            }
+            if (sent[i] != n) {
+                close_fd(&dst[i]);
+                live--;
+            }
+        }
+
+        // Drop the round from the producer's pipe
+        for (ssize_t left = n; left > 0;) {
+            ssize_t r = splice(src, NULL, devnull, NULL, left, 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            left -= r;
+        }
+    }
+
+    close_fd(&scratch[0]);
+    close_fd(&scratch[1]);
+    close_fd(&devnull);
+    free(sent);
+    free(buf);
+}
 
-    while (cur) {
-        if (cur->pipe_to) {
-            if (pipe(pipefd) < 0) {
-                perror("pipe");
-                return; // TODO: better error handling cleanup
+static void *tee_thread(void *arg) {
+    pipeline_run_t *run = arg;
+
+    // A branch that exits must show up as EPIPE, not kill the shell
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    tee_loop(run->tee_fds[0], run->branch_fds, run->branch_count);
+
+    // Closing signals EOF to every branch and EPIPE to the producer
+    close_fd(&run->tee_fds[0]);
+    for (int i = 0; i < run->branch_count; i++) close_fd(&run->branch_fds[i]);
+    return NULL;
+}
+
+// Free everything prepare_pipeline() set up, closing any fds still open
+static void release_run(pipeline_run_t *run) {
+    for (int i = 0; i < run->branch_count; i++) {
+        release_run(&run->branches[i]);
+        close_fd(&run->branch_fds[i]);
+    }
+    if (run->owns_in) close_fd(&run->in_fd);
+    close_fd(&run->tee_fds[0]);
+    close_fd(&run->tee_fds[1]);
+    if (run->links) close_links(run->links, run->count - 1);
+    free(run->branches);
+    free(run->branch_fds);
+    free(run->links);
+    free(run->stages);
+    run->branches = NULL;
+    run->branch_fds = NULL;
+    run->links = NULL;
+    run->stages = NULL;
+    run->branch_count = 0;
+    run->count = 0;
+}
+
+// Allocate the stages of cmd, and of every fan-out branch, and create the
+// pipes and rings between them. Nothing is started yet.
+static int prepare_pipeline(command_t *cmd, int in_fd, int out_fd, int timed, pipeline_run_t *run) {
+    int n = count_stages(cmd);
+    int fused = get_option(OPT_FUSION);
+
+    memset(run, 0, sizeof(*run));
+    run->stages = calloc(n, sizeof(stage_run_t));
+    run->links = calloc(n, sizeof(pipe_link_t));
+    run->count = n;
+    run->in_fd = in_fd;
+    run->out_fd = out_fd;
+    run->tee_fds[0] = run->tee_fds[1] = -1;
+
+    command_t *cur = cmd, *last = cmd;
+    for (int i = 0; i < n; i++, cur = cur->pipe_to) {
+        run->stages[i].cmd = cur;
+        run->stages[i].pid = -1;
+        run->stages[i].status = 1;
+        // Annotated stages need a process of their own to carry the
+        // attributes, and a deadline can only stop processes
+        run->stages[i].threaded = fused && !timed && !cur->is_exec && !cur->resources;
+        last = cur;
+    }
+
+    for (int i = 0; i < n - 1; i++) {
+        run->links[i].fds[0] = run->links[i].fds[1] = -1;
+    }
+    for (int i = 0; i < n - 1; i++) {
+        if (run->stages[i].threaded && run->stages[i + 1].threaded) {
+            run->links[i].ring = ring_create(RING_SIZE);
+            if (!run->links[i].ring) {
+                perror("ring");
+                return -1;
             }
+        } else if (pipe2(run->links[i].fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return -1;
+        }
+    }
+
+    if (!last->branches) return 0;
+
+    int count = 0;
+    while (last->branches[count]) count++;
+    run->branches = calloc(count, sizeof(pipeline_run_t));
+    run->branch_fds = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) run->branch_fds[i] = -1;
+
+    if (pipe2(run->tee_fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    run->out_fd = run->tee_fds[1];
+
+    for (int i = 0; i < count; i++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return -1;
         }
+        run->branch_fds[i] = fds[1];
+        run->branch_count = i + 1;
+        int rc = prepare_pipeline(last->branches[i], fds[0], out_fd, timed, &run->branches[i]);
+        run->branches[i].owns_in = 1;
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+// Fork every process stage of run and its branches. With pgid, they all
+// join one process group, led by the first stage forked (*pgid 0 until then).
+static void fork_stages(pipeline_run_t *run, sigset_t *old_mask, pid_t *pgid) {
+    int n = run->count;
+
+    for (int i = 0; i < n; i++) {
+        stage_run_t *st = &run->stages[i];
+        if (st->threaded) continue;
 
-        pid = fork();
+        TRACE_BEGIN("fork", st->cmd->argv[0]);
+        metrics_count(METRIC_FORKS);
+        fork_started = metrics_now();
+        pid_t pid = fork();
         if (pid < 0) {
             perror("fork");
-            return;
+            TRACE_END("fork");
+            continue;
         }
 
         if (pid == 0) {
-            signal(SIGINT, SIG_DFL);
+            if (pgid) enter_group(*pgid, 1);
+            reset_child_signals(old_mask);
 
-            // If there is a previous pipe, read from it
-            if (prev_pipefd[0] != -1) {
-                dup2(prev_pipefd[0], STDIN_FILENO);
-                close(prev_pipefd[0]);
-                close(prev_pipefd[1]);
+            // If there is a previous stage, read from it
+            if (i > 0) {
+                dup2(run->links[i - 1].fds[0], STDIN_FILENO);
+            } else if (run->in_fd != -1) {
+                dup2(run->in_fd, STDIN_FILENO);
             }
 
-            // If there is a next command, write to the current pipe
-            if (cur->pipe_to) {
-                dup2(pipefd[1], STDOUT_FILENO);
-                close(pipefd[0]);
-                close(pipefd[1]);
+            // If there is a next stage, write to it
+            if (i < n - 1) {
+                dup2(run->links[i].fds[1], STDOUT_FILENO);
+            } else if (run->out_fd != -1) {
+                dup2(run->out_fd, STDOUT_FILENO);
             }
 
-            setup_redirection(cur);
-            execvp(cur->argv[0], cur->argv);
-            perror("execvp");
-            exit(1);
+            run_child(st->cmd);
+        }
+
+        if (pgid) {
+            if (*pgid == 0) *pgid = pid;
+            setpgid(pid, *pgid);
+        }
+        st->pid = pid;
+        TRACE_END("fork");
+    }
+
+    for (int i = 0; i < run->branch_count; i++) {
+        fork_stages(&run->branches[i], old_mask, pgid);
+    }
+}
+
+// Start the threaded stages and the tee thread, then close every fd the
+// shell no longer needs
+static void start_threads(pipeline_run_t *run) {
+    int n = run->count;
+    pipe_link_t *links = run->links;
+
+    // Parent keeps only the pipe ends that its threads use
+    for (int i = 0; i < n - 1; i++) {
+        if (links[i].ring) continue;
+        if (!run->stages[i].threaded) close_fd(&links[i].fds[1]);
+        if (!run->stages[i + 1].threaded) close_fd(&links[i].fds[0]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        stage_run_t *st = &run->stages[i];
+        if (!st->threaded) continue;
+
+        // A side that fails to open is closed at once; the stage then
+        // fails without running
+        if (i == 0) {
+            st->in = dup_stream(run->in_fd != -1 ? run->in_fd : STDIN_FILENO, "r");
+        } else if (links[i - 1].ring) {
+            st->in = ring_fopen(links[i - 1].ring, "r");
+            if (!st->in) ring_close_reader(links[i - 1].ring);
         } else {
-            // Parent process
-            children_count++;
+            st->in = fdopen(links[i - 1].fds[0], "r");
+            if (st->in) links[i - 1].fds[0] = -1;
+        }
 
-            // Close previous pipe ends as they are no longer needed by parent
-            if (prev_pipefd[0] != -1) {
-                close(prev_pipefd[0]);
-                close(prev_pipefd[1]);
-            }
+        if (i == n - 1) {
+            st->out = dup_stream(run->out_fd != -1 ? run->out_fd : STDOUT_FILENO, "w");
+        } else if (links[i].ring) {
+            st->out = ring_fopen(links[i].ring, "w");
+            if (!st->out) ring_close_writer(links[i].ring);
+        } else {
+            st->out = fdopen(links[i].fds[1], "w");
+            if (st->out) links[i].fds[1] = -1;
+        }
+        if (!st->in || !st->out) perror(st->cmd->argv[0]);
 
-            // If there is a next command, current pipe becomes previous pipe
-            if (cur->pipe_to) {
-                prev_pipefd[0] = pipefd[0];
-                prev_pipefd[1] = pipefd[1];
-            }
+        pthread_create(&st->thread, NULL, stage_thread, st);
+    }
+
+    // Both sides of every ring belong to the stages' streams now
+    for (int i = 0; i < n - 1; i++) links[i].ring = NULL;
+
+    if (run->owns_in) close_fd(&run->in_fd);
+
+    for (int i = 0; i < run->branch_count; i++) {
+        start_threads(&run->branches[i]);
+    }
+
+    if (run->branch_count > 0) {
+        close_fd(&run->tee_fds[1]);
+        pthread_create(&run->tee_thread, NULL, tee_thread, run);
+    }
+}
+
+// Start every stage of the pipeline. When in_fd / out_fd are not -1 the
+// first stage reads from in_fd and the last stage writes to out_fd instead
+// of the shell's stdin and stdout. SIGCHLD stays blocked until
+// finish_pipeline().
+static void start_pipeline(command_t *cmd, int in_fd, int out_fd, pipeline_run_t *run) {
+    int ok = prepare_pipeline(cmd, in_fd, out_fd, cmd->timeout_ms > 0, run) == 0;
+    int64_t kill_after;
+    int64_t deadline = job_deadline(cmd, &kill_after);
+
+    run->job = NULL;
+    run->pgid = 0;
+    fflush(stdout);
+    block_sigchld(&run->old_mask);
+
+    if (!ok) {
+        release_run(run);
+        return;
+    }
+
+    // Fork the process stages before any thread exists
+    fork_stages(run, &run->old_mask, deadline > 0 ? &run->pgid : NULL);
+    start_threads(run);
+
+    // Threaded stages cannot be signalled; the deadline covers the rest
+    if (run->pgid > 0) {
+        run->job = job_start(run->pgid, cmd->argv[0], 0);
+        job_set_deadline(run->job, deadline, kill_after);
+        give_terminal(run->pgid);
+    }
+}
+
+// Wait for every stage of run and its branches. Returns the status of the
+// last stage, or for a fan-out that of the last branch that failed.
+static int wait_stages(pipeline_run_t *run) {
+    // Processes first: the deadline can only end them while jobs_waitpid()
+    // is running
+    for (int i = 0; i < run->count; i++) {
+        stage_run_t *st = &run->stages[i];
+        int status;
+
+        if (!st->threaded && st->pid > 0 && jobs_waitpid(st->pid, &status) == st->pid) {
+            st->status = decode_status(status);
+            TRACE_INSTANT("reap", st->cmd->argv[0], st->status);
         }
+    }
+    for (int i = 0; i < run->count; i++) {
+        if (run->stages[i].threaded) pthread_join(run->stages[i].thread, NULL);
+    }
 
-        cur = cur->pipe_to;
+    if (run->branch_count == 0) {
+        return run->count > 0 ? run->stages[run->count - 1].status : 1;
     }
 
-    // Wait for all children
-    for (int i = 0; i < children_count; i++) {
-        wait(NULL);
+    pthread_join(run->tee_thread, NULL);
+    int result = 0;
+    for (int i = 0; i < run->branch_count; i++) {
+        int status = wait_stages(&run->branches[i]);
+        if (status != 0) result = status;
     }
+    return result;
+}
+
+static void finish_pipeline(pipeline_run_t *run) {
+    TRACE_BEGIN("wait", NULL);
+    last_status = run->count > 0 ? job_status(run->job, wait_stages(run)) : 1;
+    TRACE_END("wait");
+
+    if (run->job) {
+        give_terminal(getpgrp());
+        job_finish(run->job);
+    }
+
+    sigprocmask(SIG_SETMASK, &run->old_mask, NULL);
+    release_run(run);
+}
+
+static void execute_pipeline(command_t *cmd) {
+    pipeline_run_t run;
+    start_pipeline(cmd, -1, -1, &run);
+    finish_pipeline(&run);
 }
 
 // -----------------------------------------------------------
 // Redirection setup
 // -----------------------------------------------------------
-static void setup_redirection(command_t *cmd) {
-    if (cmd->input_redirect) {
-        int fd = open(cmd->input_redirect, O_RDONLY);
-        if (fd < 0) {
-            perror("open");
-            exit(1);
+static int open_target(const char *path, int output) {
+    int fd = output ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                    : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) perror("open");
+    return fd;
+}
+
+// Here-documents (<<WORD, <<<word) reach the command as an fd holding the
+// body, without touching the filesystem. A body that fits the pipe buffer
+// goes into a pipe, which the write cannot block on; a bigger one is
+// written into a memfd with one write and read back from the start, so it
+// is neither copied twice nor held up by a slow reader.
+static int here_doc_fd(const char *body) {
+    size_t len = strlen(body);
+
+    if (len <= PIPE_BUF) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return -1;
         }
+        write_all(fds[1], body, len);
+        close(fds[1]);
+        return fds[0];
+    }
+
+    int fd = memfd_create("here-document", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    write_all(fd, body, len);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// The fd a command reads: its here-document or its input file
+static int open_input(command_t *cmd) {
+    return cmd->here_doc ? here_doc_fd(cmd->here_doc) : open_target(cmd->input_redirect, 0);
+}
+
+// In a child: apply cmd's redirections, exiting if a target cannot be opened
+static void setup_redirection(command_t *cmd) {
+    if (cmd->input_redirect || cmd->here_doc) {
+        int fd = open_input(cmd);
+        if (fd < 0) exit(1);
         dup2(fd, STDIN_FILENO);
         close(fd);
     }
 
     if (cmd->output_redirect) {
-        int fd = open(cmd->output_redirect, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd < 0) {
-            perror("open");
-            exit(1);
-        }
+        int fd = open_target(cmd->output_redirect, 1);
+        if (fd < 0) exit(1);
         dup2(fd, STDOUT_FILENO);
         close(fd);
     }
 }
 
+// In the shell itself, for a builtin: point stdin / stdout at cmd's
+// redirection targets and keep the originals in saved. Returns -1, with
+// nothing changed, if a target cannot be opened.
+int redirect_shell(command_t *cmd, saved_fds_t *saved) {
+    int in_fd = -1, out_fd = -1;
+    saved->in = saved->out = -1;
+
+    if ((cmd->input_redirect || cmd->here_doc) && (in_fd = open_input(cmd)) < 0) return -1;
+    if (cmd->output_redirect && (out_fd = open_target(cmd->output_redirect, 1)) < 0) {
+        close_fd(&in_fd);
+        return -1;
+    }
+
+    fflush(stdout);
+    if (in_fd != -1) {
+        saved->in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        saved->out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+    return 0;
+}
+
+// Undo redirect_shell()
+void restore_shell(saved_fds_t *saved) {
+    fflush(stdout);
+    if (saved->out != -1) {
+        dup2(saved->out, STDOUT_FILENO);
+        close_fd(&saved->out);
+    }
+    if (saved->in != -1) {
+        dup2(saved->in, STDIN_FILENO);
+        close_fd(&saved->in);
+    }
+}
+
 // -----------------------------------------------------------
-// Simple command execution (no pipeline)
+// Process substitution <(cmd), >(cmd)
 // -----------------------------------------------------------
-static void execute_simple(command_t *cmd) {
+//
+// Each <(...) or >(...) word starts its command line in a subshell with
+// stdout (or stdin) on a pipe, and becomes /dev/fd/N for the shell's end
+// of that pipe. The ends are opened close-on-exec, so a substitution does
+// not inherit the pipes of those started before it, and are made
+// inheritable once every substitution of the command line runs. All the
+// subshells stream at once; run_command() closes the shell's ends when the
+// command is done and waits for them (a background job's are reaped by the
+// job table instead).
+
+typedef struct substitution {
+    int fd;     // the shell's end, /dev/fd/fd
+    pid_t pid;  // the subshell
+} substitution_t;
+
+static substitution_t *substitutions;
+static int substitution_count;
+static int substitution_cap;
+static int substitution_mark;  // first substitution of the running command
+
+// Start text in a subshell; `reads` for <(...), whose output the command
+// reads. Returns the shell's end of the pipe, or -1.
+static int start_substitution(const char *text, int reads) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    int mine = reads ? fds[0] : fds[1];
+    int theirs = reads ? fds[1] : fds[0];
+
+    sigset_t old_mask;
+    fflush(stdout);
+    block_sigchld(&old_mask);
+    metrics_count(METRIC_FORKS);
     pid_t pid = fork();
 
+    if (pid == 0) {
+        reset_child_signals(&old_mask);
+        dup2(theirs, reads ? STDOUT_FILENO : STDIN_FILENO);
+        close_cloexec_fds();
+        jobs_forget();
+
+        sigset_t old;
+        block_sigchld(&old);
+        command_t *cmd = parse_command(text);
+        int status = run_command(cmd);
+        fflush(stdout);
+        _exit(status < 0 ? 1 : status);
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    close(theirs);
     if (pid < 0) {
         perror("fork");
+        close(mine);
+        return -1;
+    }
+
+    if (substitution_count == substitution_cap) {
+        substitution_cap = substitution_cap ? substitution_cap * 2 : 8;
+        substitutions = realloc(substitutions, substitution_cap * sizeof(substitution_t));
+    }
+    substitutions[substitution_count++] = (substitution_t){mine, pid};
+    return mine;
+}
+
+// Let the command inherit the pipes of the substitutions from first on
+static void inherit_substitutions(int first) {
+    for (int i = first; i < substitution_count; i++) {
+        fcntl(substitutions[i].fd, F_SETFD, 0);
+    }
+}
+
+// The command is done with its substitutions: close the shell's ends, so
+// the subshells see EOF or a broken pipe, and wait for them unless the
+// command went to the background
+static void end_substitutions(int wait) {
+    for (int i = substitution_mark; i < substitution_count; i++) {
+        close(substitutions[i].fd);
+    }
+    for (int i = substitution_mark; wait && i < substitution_count; i++) {
+        // The job table may have reaped it already
+        while (waitpid(substitutions[i].pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+    }
+    substitution_count = substitution_mark;
+}
+
+// -----------------------------------------------------------
+// Argument batching (set -o batch=N)
+// -----------------------------------------------------------
+
+// What one string costs in execve()'s argument area, counted the way the
+// kernel does: its bytes with the NUL, plus its pointer
+static size_t arg_cost(const char *s) {
+    return strlen(s) + 1 + sizeof(char *);
+}
+
+// The kernel's limit for argv and envp together: a quarter of the stack
+// limit, at most three quarters of the default 8 MiB stack, and never less
+// than 32 pages (ARG_MAX). sysconf(_SC_ARG_MAX) omits the 6 MiB cap.
+static size_t exec_limit(void) {
+    size_t limit = (8 << 20) / 4 * 3;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < limit) {
+        limit = rl.rlim_cur / 4;
+    }
+    return limit < 131072 ? 131072 : limit;
+}
+
+// Bytes of an exec of program `path` that do not depend on its arguments:
+// the file name, which the kernel copies in too, and the environment
+static size_t exec_base_cost(const char *path) {
+    extern char **environ;
+    size_t cost = strlen(path) + 1;
+    for (char **env = environ; *env; env++) cost += arg_cost(*env);
+    return cost;
+}
+
+// Decide whether cmd is too big to exec in one go. Returns the base cost
+// in *base, or 0 if cmd fits (or is not a program batching can help).
+static int needs_batching(command_t *cmd, size_t *base) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (find_program(cmd->argv[0], path, sizeof(path), &st) != 0) return 0;
+
+    size_t cost = exec_base_cost(path);
+    *base = cost;
+    for (int i = 0; cmd->argv[i]; i++) cost += arg_cost(cmd->argv[i]);
+    return cost > exec_limit();
+}
+
+// Fold one batch's wait status into the overall status like xargs: 123 if
+// any batch failed, 124 if one exited with 255 and 125 if one was killed by
+// a signal. The last two stop further batches from starting.
+static int merge_batch_status(int result, int status, int *stop) {
+    if (WIFSIGNALED(status)) {
+        *stop = 1;
+        return 125;
+    }
+    if (WEXITSTATUS(status) == 255) {
+        *stop = 1;
+        return result == 125 ? result : 124;
+    }
+    if (WEXITSTATUS(status) != 0 && result == 0) return 123;
+    return result;
+}
+
+// Run cmd as several execs, each with as many of the generated arguments
+// as fit, keeping the words before and after them in every batch (so
+// `cp $(list) dest/` works). Up to `batch` run at once. Under a deadline
+// the batches share one foreground process group, so Ctrl-C and the
+// deadline reach all of them, and the deadline covers the whole command.
+static void execute_batched(command_t *cmd, size_t base) {
+    int argc = 0;
+    while (cmd->argv[argc]) argc++;
+
+    int first = cmd->expanded_end > 0 ? cmd->expanded_first : 1;
+    int end = cmd->expanded_end > 0 ? cmd->expanded_end : argc;
+    if (first < 1) first = 1;
+
+    size_t limit = exec_limit();
+    for (int i = 0; i < first; i++) base += arg_cost(cmd->argv[i]);
+    for (int i = end; i < argc; i++) base += arg_cost(cmd->argv[i]);
+
+    // Every batch appends to one output file instead of truncating it
+    int out_fd = -1;
+    if (cmd->output_redirect && (out_fd = open_target(cmd->output_redirect, 1)) < 0) {
+        last_status = 1;
         return;
     }
 
+    int parallel = get_option(OPT_BATCH);
+    pid_t *running = calloc(parallel, sizeof(pid_t));
+    char **argv = malloc((argc + 1) * sizeof(char *));
+    command_t batch = *cmd;
+    batch.argv = argv;
+    batch.output_redirect = NULL;
+    memcpy(argv, cmd->argv, first * sizeof(char *));
+
+    int64_t kill_after;
+    int64_t deadline = job_deadline(cmd, &kill_after);
+    int64_t started = metrics_now();
+    pid_t group = 0;
+    job_t *job = NULL;
+    sigset_t old_mask;
+    fflush(stdout);
+    block_sigchld(&old_mask);
+
+    int next = first, count = 0, result = 0, stop = 0;
+    while ((next < end && !stop) || count > 0) {
+        if (next < end && !stop && count < parallel) {
+            // Take arguments while they fit; a batch always gets at least one
+            int n = first;
+            size_t used = base;
+            while (next < end && (n == first || used + arg_cost(cmd->argv[next]) <= limit)) {
+                used += arg_cost(cmd->argv[next]);
+                argv[n++] = cmd->argv[next++];
+            }
+            for (int i = end; i < argc; i++) argv[n++] = cmd->argv[i];
+            argv[n] = NULL;
+
+            TRACE_BEGIN("fork", cmd->argv[0]);
+            metrics_count(METRIC_FORKS);
+            fork_started = metrics_now();
+            pid_t pid = fork();
+            if (pid == 0) {
+                if (deadline > 0) enter_group(group, 1);
+                reset_child_signals(&old_mask);
+                if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);
+                run_child(&batch);
+            }
+            TRACE_END("fork");
+            if (pid < 0) {
+                perror("fork");
+                result = 125;
+                stop = 1;
+                continue;
+            }
+
+            running[count++] = pid;
+            if (deadline > 0 && group) {
+                setpgid(pid, group);
+            } else if (deadline > 0) {
+                // The group ends with its last batch; a new one gets what is
+                // left of the deadline
+                int64_t left = deadline - (metrics_now() - started) / 1000000;
+                group = pid;
+                setpgid(pid, pid);
+                job = job_start(pid, cmd->argv[0], 0);
+                job_set_deadline(job, left > 0 ? left : 1, kill_after);
+                give_terminal(pid);
+            }
+            continue;
+        }
+
+        // Reap whatever has finished, or sleep until something does
+        int reaped = 0;
+        for (int i = 0; i < count; i++) {
+            int status;
+            if (waitpid(running[i], &status, WNOHANG) != running[i]) continue;
+            TRACE_INSTANT("reap", cmd->argv[0], decode_status(status));
+            result = merge_batch_status(result, status, &stop);
+            running[i--] = running[--count];
+            reaped = 1;
+        }
+        if (group && count == 0) {
+            give_terminal(getpgrp());
+            job_finish(job);
+            job = NULL;
+            group = 0;
+        }
+        if (!reaped) jobs_sleep();
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (out_fd != -1) close(out_fd);
+    free(argv);
+    free(running);
+    last_status = result;
+}
+
+// -----------------------------------------------------------
+// Simple command execution (no pipeline)
+// -----------------------------------------------------------
+
+// Fork cmd; the child runs it and never returns. A grouped job gets a
+// process group of its own, which a foreground job also gets the terminal
+// for. The shell is left with SIGCHLD blocked and the old mask in old_mask.
+static pid_t fork_command(command_t *cmd, int grouped, sigset_t *old_mask) {
+    fflush(stdout);
+    block_sigchld(old_mask);
+
+    TRACE_BEGIN("fork", cmd->argv[0]);
+    metrics_count(METRIC_FORKS);
+    fork_started = metrics_now();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        TRACE_END("fork");
+        sigprocmask(SIG_SETMASK, old_mask, NULL);
+        return -1;
+    }
+
     if (pid == 0) {
-        // Children restore default SIGINT behavior
-        signal(SIGINT, SIG_DFL);
+        if (grouped) enter_group(0, !cmd->background);
+        // Children restore default signal behavior
+        reset_child_signals(old_mask);
+        run_child(cmd);
+    }
+    TRACE_END("fork");
 
-        setup_redirection(cmd);
-        execvp(cmd->argv[0], cmd->argv);
-        perror("execvp");
-        exit(1);
+    if (grouped) setpgid(pid, pid);
+    return pid;
+}
+
+// The command's words, for `jobs`
+static void job_words(command_t *cmd, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; cmd->argv[i] && len + 1 < size; i++) {
+        len += snprintf(buf + len, size - len, i ? " %s" : "%s", cmd->argv[i]);
+    }
+}
+
+// Start cmd as a background job; jobs_dispatch() reaps it and forgets the job
+static void start_background(command_t *cmd) {
+    sigset_t old_mask;
+    int64_t kill_after;
+    int64_t deadline = job_deadline(cmd, &kill_after);
+    char name[256];
+
+    pid_t pid = fork_command(cmd, 1, &old_mask);
+    if (pid < 0) return;
+
+    job_words(cmd, name, sizeof(name));
+    job_t *job = job_start(pid, name, 1);
+    if (deadline > 0) job_set_deadline(job, deadline, kill_after);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    printf("[bg] started PID %d\n", pid);
+    fflush(stdout);
+}
+
+// A queued job's slot came free (see job_enqueue())
+static void launch_queued(void *arg) {
+    start_background(arg);
+}
+
+static void release_queued(void *arg) {
+    free_command(arg);
+}
+
+// Admission control for `&`: start the job if there is a free slot, or
+// queue a copy of it. Its @nice is its priority in the queue.
+static void execute_background(command_t *cmd) {
+    last_status = 0;
+    // Process substitutions run already; their job cannot wait its turn
+    if (jobs_admit() || substitution_count > substitution_mark) {
+        start_background(cmd);
+        return;
+    }
+
+    char name[256];
+    job_words(cmd, name, sizeof(name));
+    int id = job_enqueue(name, -resources_nice(cmd->resources), launch_queued, release_queued,
+                         copy_command(cmd));
+    printf("[bg] queued job %d (%d waiting)\n", id, jobs_queued());
+}
+
+static void execute_simple(command_t *cmd) {
+    size_t base;
+    if (get_option(OPT_BATCH) > 0 && cmd->is_exec && !cmd->function && !cmd->background &&
+        needs_batching(cmd, &base)) {
+        execute_batched(cmd, base);
+        return;
     }
 
     if (cmd->background) {
-        printf("[bg] started PID %d\n", pid);
+        execute_background(cmd);
         return;
     }
 
-    waitpid(pid, NULL, 0);
+    sigset_t old_mask;
+    int64_t kill_after;
+    int64_t deadline = job_deadline(cmd, &kill_after);
+    int grouped = deadline > 0;
+
+    pid_t pid = fork_command(cmd, grouped, &old_mask);
+    if (pid < 0) return;
+
+    job_t *job = NULL;
+    if (grouped) {
+        job = job_start(pid, cmd->argv[0], 0);
+        job_set_deadline(job, deadline, kill_after);
+        give_terminal(pid);
+    }
+
+    int status;
+    TRACE_BEGIN("wait", NULL);
+    if (jobs_waitpid(pid, &status) == pid) {
+        last_status = job_status(job, decode_status(status));
+        TRACE_INSTANT("reap", cmd->argv[0], last_status);
+    }
+    TRACE_END("wait");
+
+    if (grouped) give_terminal(getpgrp());
+    job_finish(job);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+// A stage with an invalid annotation is not run at all
+static int has_syntax_error(command_t *cmd) {
+    for (command_t *cur = cmd; cur; cur = cur->pipe_to) {
+        if (cur->syntax_error) return 1;
+        for (int i = 0; cur->branches && cur->branches[i]; i++) {
+            if (has_syntax_error(cur->branches[i])) return 1;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------
+// Command substitution $(...)
+// -----------------------------------------------------------
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+static void buffer_reserve(buffer_t *b, size_t extra) {
+    if (b->len + extra <= b->cap) return;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra) cap *= 2;
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+}
+
+static void buffer_append(buffer_t *b, const char *src, size_t n) {
+    buffer_reserve(b, n + 1);
+    memcpy(b->data + b->len, src, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+// Run the command line `text` and collect what it writes to stdout.
+// Builtins run in-process and write straight into a memory stream; anything
+// else is forked with its stdout on a pipe that is drained into a growable
+// buffer. Returns a heap string (possibly empty) or NULL on error.
+static char *capture_output(const char *text, size_t *len) {
+    command_t *inner = parse_command(text);
+    buffer_t out = {0};
+
+    if (expand_command(inner) != 0 || has_syntax_error(inner)) {
+        free_command(inner);
+        return NULL;
+    }
+
+    if (!inner->argv[0]) {
+        buffer_reserve(&out, 1);
+        out.data[0] = '\0';
+    } else if (!inner->pipe_to && !inner->branches && !inner->is_exec && !inner->resources &&
+               !inner->input_redirect && !inner->here_doc && !inner->output_redirect) {
+        FILE *stream = open_memstream(&out.data, &out.len);
+        last_status = run_builtin_stage(inner, stdin, stream);
+        fclose(stream);
+    } else {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            free_command(inner);
+            return NULL;
+        }
+
+        pipeline_run_t run;
+        start_pipeline(inner, -1, fds[1], &run);
+        close(fds[1]);
+
+        // Read directly into the buffer's spare capacity
+        for (;;) {
+            buffer_reserve(&out, 4096);
+            ssize_t n = read(fds[0], out.data + out.len, out.cap - out.len - 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            if (out.len == 0) TRACE_INSTANT("first_byte", inner->argv[0], n);
+            out.len += n;
+        }
+        out.data[out.len] = '\0';
+        close(fds[0]);
+
+        finish_pipeline(&run);
+    }
+
+    free_command(inner);
+    *len = out.len;
+    return out.data;
+}
+
+typedef struct {
+    char **argv;
+    int argc;
+    int cap;
+} wordlist_t;
+
+static void wordlist_push(wordlist_t *w, char *word) {
+    if (w->argc + 1 >= w->cap) {
+        w->cap = w->cap ? w->cap * 2 : MAX_TOKENS;
+        w->argv = realloc(w->argv, w->cap * sizeof(char *));
+    }
+    w->argv[w->argc++] = word;
+    w->argv[w->argc] = NULL;
+}
+
+// Does word hold a $(...), <(...) or >(...) substitution?
+static int has_substitution(const char *word) {
+    return strstr(word, "$(") || strstr(word, "<(") || strstr(word, ">(");
+}
+
+// Expand every $(...) in word and append the resulting fields to w. The
+// substituted output loses its trailing newlines and is split on
+// whitespace; literal text around it sticks to the first and last field.
+// A $(...) the tokenizer marked as double-quoted (QUOTE_MARK) is not
+// split: its output, spaces and all, is part of one field.
+// A <(...) or >(...) starts a process substitution and is replaced by its
+// /dev/fd path, unless it was quoted.
+static int expand_word(const char *word, wordlist_t *w) {
+    buffer_t field = {0};
+    int have_field = 0;
+
+    for (int i = 0; word[i];) {
+        int quoted = word[i] == QUOTE_MARK;
+        if (quoted) {
+            i++;
+            have_field = 1;
+            if (!word[i]) break;
+        }
+
+        if (quoted && word[i] != '$') {
+            buffer_append(&field, &word[i++], 1);
+            continue;
+        }
+
+        if ((word[i] == '<' || word[i] == '>') && word[i + 1] == '(') {
+            int close = find_closing_paren(word, i + 1);
+            char *inner = close < 0 ? NULL : strndup(word + i + 2, close - i - 2);
+            int fd = inner ? start_substitution(inner, word[i] == '<') : -1;
+            free(inner);
+            if (fd < 0) {
+                if (close < 0) fprintf(stderr, "syntax error: unterminated %c(\n", word[i]);
+                free(field.data);
+                return -1;
+            }
+
+            char path[32];
+            buffer_append(&field, path, snprintf(path, sizeof(path), "/dev/fd/%d", fd));
+            have_field = 1;
+            i = close + 1;
+            continue;
+        }
+
+        if (word[i] != '$' || word[i + 1] != '(') {
+            buffer_append(&field, &word[i++], 1);
+            have_field = 1;
+            continue;
+        }
+
+        int close = find_closing_paren(word, i + 1);
+        if (close < 0) {
+            fprintf(stderr, "syntax error: unterminated $(\n");
+            free(field.data);
+            return -1;
+        }
+
+        char *inner = strndup(word + i + 2, close - i - 2);
+        size_t len = 0;
+        char *output = capture_output(inner, &len);
+        free(inner);
+        if (!output) {
+            free(field.data);
+            return -1;
+        }
+
+        while (len > 0 && output[len - 1] == '\n') len--;
+
+        for (size_t j = 0; j < len; j++) {
+            if (quoted) {
+                buffer_append(&field, &output[j], 1);
+            } else if (isspace((unsigned char)output[j])) {
+                if (have_field) {
+                    wordlist_push(w, field.data ? field.data : strdup(""));
+                    field = (buffer_t){0};
+                    have_field = 0;
+                }
+            } else {
+                buffer_append(&field, &output[j], 1);
+                have_field = 1;
+            }
+        }
+
+        free(output);
+        i = close + 1;
+    }
+
+    if (have_field) {
+        wordlist_push(w, field.data ? field.data : strdup(""));
+    } else {
+        free(field.data);
+    }
+    return 0;
+}
+
+// Expand the substitutions in a redirection target, such as `< <(cmd)` or
+// `> "$(cmd).log"`; the result must be one word
+static int expand_target(char **path) {
+    if (!*path || !has_substitution(*path)) return 0;
+
+    wordlist_t words = {0};
+    if (expand_word(*path, &words) != 0) return -1;
+    if (words.argc != 1) {
+        fprintf(stderr, "%s: ambiguous redirect\n", *path);
+        for (int i = 0; i < words.argc; i++) free(words.argv[i]);
+        free(words.argv);
+        return -1;
+    }
+    free(*path);
+    *path = words.argv[0];
+    free(words.argv);
+    return 0;
+}
+
+static int expand_stages(command_t *cmd) {
+    for (command_t *cur = cmd; cur; cur = cur->pipe_to) {
+        for (int i = 0; cur->branches && cur->branches[i]; i++) {
+            if (expand_stages(cur->branches[i]) != 0) return -1;
+        }
+
+        if (expand_target(&cur->input_redirect) != 0 || expand_target(&cur->output_redirect) != 0) return -1;
+
+        int needed = 0;
+        for (int i = 0; cur->argv[i]; i++) {
+            if (has_substitution(cur->argv[i])) needed = 1;
+        }
+        if (!needed) continue;
+
+        TRACE_BEGIN("expand", cur->argv[0]);
+        wordlist_t words = {calloc(MAX_TOKENS, sizeof(char *)), 0, MAX_TOKENS};
+
+        for (int i = 0; cur->argv[i]; i++) {
+            int before = words.argc;
+            if (!has_substitution(cur->argv[i])) {
+                wordlist_push(&words, strdup(cur->argv[i]));
+                continue;
+            }
+            if (expand_word(cur->argv[i], &words) != 0) {
+                for (int j = 0; j < words.argc; j++) free(words.argv[j]);
+                free(words.argv);
+                TRACE_END("expand");
+                return -1;
+            }
+
+            // Remember where generated words are, for argument batching
+            if (words.argc > before) {
+                if (cur->expanded_end == 0) cur->expanded_first = before;
+                cur->expanded_end = words.argc;
+            }
+        }
+
+        set_argv(cur, words.argv);
+
+        // The command word itself may have come from a substitution
+        set_exec(cur);
+        TRACE_END("expand");
+    }
+    return 0;
+}
+
+// Expand the substitutions in every stage of a command line. The process
+// substitutions started keep running until run_command() ends them.
+int expand_command(command_t *cmd) {
+    int first = substitution_count;
+    int result = expand_stages(cmd);
+    inherit_substitutions(first);
+    return result;
+}
+
+// -----------------------------------------------------------
+// Output cache (cache cmd ...)
+// -----------------------------------------------------------
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        len -= n;
+    }
+}
+
+// Run cmd with its stdout on a pipe, passing the output on to out_fd and
+// keeping a copy for the cache unless it outgrows what the cache would
+// store anyway
+static void run_and_store(command_t *cmd, const char *key, int out_fd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        last_status = 1;
+        return;
+    }
+
+    pipeline_run_t run;
+    start_pipeline(cmd, -1, fds[1], &run);
+    close(fds[1]);
+
+    buffer_t out = {0};
+    int keep = 1;
+    char chunk[65536];
+    for (;;) {
+        ssize_t n = read(fds[0], chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        write_all(out_fd, chunk, n);
+        if (keep && out.len + n > cache_limit() / 4) {
+            keep = 0;
+            free(out.data);
+            out.data = NULL;
+        }
+        if (keep) buffer_append(&out, chunk, n);
+    }
+    close(fds[0]);
+    finish_pipeline(&run);
+
+    // Killed or timed-out runs say nothing about the command's output
+    int timed_out = cmd->timeout_ms > 0 && last_status == JOB_TIMEOUT_STATUS;
+    if (keep && last_status < 128 && !timed_out) {
+        cache_store(key, out.data ? out.data : "", out.len, last_status);
+    }
+    free(out.data);
+}
+
+// Replay cmd's stored output and status, or run it and store them.
+// Returns 0 if cmd cannot be cached and must run normally.
+static int execute_cached(command_t *cmd) {
+    // A process substitution's output cannot be hashed without consuming it
+    if (cmd->background || cache_limit() == 0 || substitution_count > substitution_mark) return 0;
+    for (command_t *cur = cmd; cur; cur = cur->pipe_to) {
+        if (cur->branches) return 0;
+    }
+
+    char key[CACHE_KEY_SIZE];
+    if (cache_key(cmd, key) != 0) return 0;
+
+    // The output file is the shell's to write, from the run or the cache
+    command_t *last = cmd;
+    while (last->pipe_to) last = last->pipe_to;
+    char *redirect = last->output_redirect;
+    int out_fd = STDOUT_FILENO;
+    if (redirect) {
+        out_fd = open(redirect, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0) {
+            perror("open");
+            last_status = 1;
+            return 1;
+        }
+    }
+
+    fflush(stdout);
+    int status;
+    if (cache_lookup(key, out_fd, &status)) {
+        metrics_count(METRIC_CACHE_HITS);
+        last_status = status;
+    } else {
+        metrics_count(METRIC_CACHE_MISSES);
+        last->output_redirect = NULL;
+        run_and_store(cmd, key, out_fd);
+        last->output_redirect = redirect;
+    }
+
+    if (redirect) close(out_fd);
+    return 1;
 }
 
 int execute_command(command_t *cmd) {
     if (!cmd || !cmd->argv[0]) return 0;
 
-    if (cmd->pipe_to) {
+    if (has_syntax_error(cmd)) {
+        last_status = 2;
+        return 1;
+    }
+
+    if (cmd->cached && execute_cached(cmd)) return 1;
+
+    if (cmd->pipe_to || cmd->branches) {
         if (cmd->background) {
             printf("Warning: pipeline background execution not supported.\n");
             return 0;
@@ -158,3 +1591,182 @@ int execute_command(command_t *cmd) {
     }
     return 0;
 }
+
+// -----------------------------------------------------------
+// Shell functions
+// -----------------------------------------------------------
+//
+// A function's body is parsed once, when it is defined. A call runs a copy
+// of each body command with $0-$9, $# and $@ bound to the call's words,
+// so nothing is tokenized again. A plain foreground call runs in the shell
+// itself; in a pipeline, the background or under a prefix it runs in a
+// child, like a subshell.
+
+// Replace $0-$9 and $# in a word; NULL if there are none
+static char *substitute_params(const char *word, char **args, int argc) {
+    if (!strchr(word, '$')) return NULL;
+
+    char count[16];
+    snprintf(count, sizeof(count), "%d", argc - 1);
+
+    size_t len = 0, cap = strlen(word) + 1;
+    char *out = malloc(cap);
+    for (const char *p = word; *p; p++) {
+        const char *value = NULL;
+        if (p[0] == '$' && isdigit((unsigned char)p[1])) {
+            value = p[1] - '0' < argc ? args[p[1] - '0'] : "";
+        } else if (p[0] == '$' && p[1] == '#') {
+            value = count;
+        }
+
+        size_t n = value ? strlen(value) : 1;
+        if (len + n + 1 > cap) {
+            cap = (len + n + 1) * 2;
+            out = realloc(out, cap);
+        }
+        if (value) {
+            memcpy(out + len, value, n);
+            p++;
+        } else {
+            out[len] = *p;
+        }
+        len += n;
+    }
+    out[len] = '\0';
+    return out;
+}
+
+static void substitute_path(char **path, char **args, int argc) {
+    char *value = *path ? substitute_params(*path, args, argc) : NULL;
+    if (value) set_path(path, value);
+}
+
+// Bind the positional parameters in every word of a body command; a whole
+// $@ or $* word becomes one word per argument
+static void bind_params(command_t *cmd, char **args, int argc) {
+    for (command_t *cur = cmd; cur; cur = cur->pipe_to) {
+        for (int i = 0; cur->branches && cur->branches[i]; i++) {
+            bind_params(cur->branches[i], args, argc);
+        }
+
+        wordlist_t words = {calloc(MAX_TOKENS, sizeof(char *)), 0, MAX_TOKENS};
+        for (int i = 0; cur->argv[i]; i++) {
+            if (strcmp(cur->argv[i], "$@") == 0 || strcmp(cur->argv[i], "$*") == 0) {
+                for (int j = 1; j < argc; j++) wordlist_push(&words, strdup(args[j]));
+                continue;
+            }
+            char *value = substitute_params(cur->argv[i], args, argc);
+            wordlist_push(&words, value ? value : strdup(cur->argv[i]));
+        }
+
+        set_argv(cur, words.argv);
+
+        substitute_path(&cur->input_redirect, args, argc);
+        substitute_path(&cur->here_doc, args, argc);
+        substitute_path(&cur->output_redirect, args, argc);
+    }
+}
+
+// Run the body of the function cmd calls in this process; returns the
+// status of its last command
+static int call_function(command_t *cmd) {
+    static int depth = 0;
+
+    if (depth >= FUNCTION_MAX_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", cmd->argv[0]);
+        return 1;
+    }
+
+    int argc = 0;
+    while (cmd->argv[argc]) argc++;
+
+    // A reference keeps the body alive if the function redefines itself
+    shell_function_t *fn = function_ref(cmd->function);
+    int status = 0;
+
+    depth++;
+    TRACE_BEGIN("function", fn->name);
+    for (int i = 0; fn->body[i]; i++) {
+        command_t *body = copy_command(fn->body[i]);
+        bind_params(body, cmd->argv, argc);
+        resolve_names(body);
+        status = run_command(body);
+        free_command(body);
+    }
+    TRACE_END("function");
+    depth--;
+
+    function_unref(fn);
+    return status < 0 ? 1 : status;
+}
+
+// A function call runs in the shell unless it must be a process of its own
+static int runs_in_shell(command_t *cmd) {
+    return !cmd->pipe_to && !cmd->branches && !cmd->background && !cmd->cached && !cmd->resources &&
+           cmd->timeout_ms == 0 && !cmd->syntax_error;
+}
+
+// Call a function in the shell, with its redirections applied to the
+// shell's own stdin and stdout for the duration
+static int run_function(command_t *cmd) {
+    saved_fds_t saved;
+    if (redirect_shell(cmd, &saved) != 0) {
+        last_status = 1;
+        return 1;
+    }
+
+    int status = call_function(cmd);
+    fflush(stdout);
+    restore_shell(&saved);
+
+    last_status = status;
+    return status;
+}
+
+// -----------------------------------------------------------
+// Running a parsed command line
+// -----------------------------------------------------------
+
+// Expand and run a parsed command line the way the shell does: define a
+// function, call one, run a builtin in the shell or start processes.
+// Returns the exit status, or -1 if the command could not be executed.
+int run_command(command_t *cmd) {
+    if (cmd->defines) {
+        names_set_function(cmd->defines);
+        last_status = 0;
+        return 0;
+    }
+
+    // A function body's commands end their own substitutions
+    int mark = substitution_mark;
+    substitution_mark = substitution_count;
+
+    int status = expand_command(cmd) != 0 ? 2 : run_expanded(cmd);
+
+    end_substitutions(!cmd->background);
+    substitution_mark = mark;
+    return status;
+}
+
+// run_command() once the words are expanded
+static int run_expanded(command_t *cmd) {
+    if (!cmd->argv[0] && !cmd->pipe_to) {
+        // Blank line, a command that expanded to nothing, or a malformed
+        // function definition
+        if (cmd->syntax_error) last_status = 2;
+        return last_status;
+    }
+
+    if (cmd->function && runs_in_shell(cmd)) return run_function(cmd);
+
+    if (cmd->is_exec || cmd->pipe_to || cmd->branches || cmd->cached || !builtin_runs_inline(cmd)) {
+        if (!execute_command(cmd)) {
+            printf("Error occurred while executing the command\n");
+            return -1;
+        }
+        return last_status;
+    }
+
+    run_builtin(cmd);
+    return last_status;
+}
@@ -3,6 +3,19 @@
 
 #include "parser.h"
 
+// The shell's stdin / stdout while a builtin runs with redirections
+typedef struct saved_fds
+{
+  int in;
+  int out;
+} saved_fds_t;
+
+int run_command(command_t *cmd);
 int execute_command(command_t *cmd);
+int expand_command(command_t *cmd);
+int get_last_status();
+void set_last_status(int status);
+int redirect_shell(command_t *cmd, saved_fds_t *saved);
+void restore_shell(saved_fds_t *saved);
 
 #endif
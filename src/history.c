@@ -0,0 +1,777 @@
+#include "history.h"
+#include "memory.h"
+#include "metrics.h"
+#include "utility.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * On-disk layout
+ *
+ * The history log is an append-only binary file shared by every shell of a
+ * user. It starts with an 8 byte magic string followed by records:
+ *
+ *   record_header_t | cwd bytes | cmd bytes | uint32_t length
+ *
+ * `length` is the size of the whole record and is stored both in the header
+ * and in the trailer, so the log can be walked forwards (compaction, export)
+ * and backwards (reading the most recent entries) without an index.
+ *
+ * Each record is emitted with a single write() on an O_APPEND descriptor,
+ * which keeps concurrent appends from interleaving. Appenders hold a shared
+ * flock(); compaction holds an exclusive one and atomically renames a
+ * rewritten log over the old one.
+ */
+
+#define HISTORY_MAGIC "MSHHIST1"
+#define HISTORY_MAGIC_LEN 8
+#define HISTORY_SHOW 10
+#define HISTORY_COMPACT_BYTES (1 << 20)
+#define HISTORY_MAX_RECORD (1 << 20)
+
+typedef struct record_header
+{
+  uint32_t length;
+  uint32_t cwd_len;
+  uint32_t cmd_len;
+  int32_t status;
+  int64_t timestamp;
+  int64_t duration;
+  uint64_t session;
+} record_header_t;
+
+#define RECORD_OVERHEAD (sizeof(record_header_t) + sizeof(uint32_t))
+
+static char history_path[PATH_MAX] = "";
+static uint64_t session_id = 0;
+
+/* Log size at this shell's last background compaction. The next one waits
+ * for the log to double, so a log of mostly distinct commands is not
+ * rewritten on every append. */
+static off_t compacted_at = 0;
+
+/**
+ * get_history_path
+ *
+ * Return the path of the binary history log. $HISTFILE takes precedence,
+ * otherwise the log lives at $HOME/.shell_history.bin.
+ */
+const char *get_history_path()
+{
+  if (history_path[0] == '\0')
+  {
+    const char *env = getenv("HISTFILE");
+    if (env && env[0])
+      snprintf(history_path, sizeof(history_path), "%s", env);
+    else
+      snprintf(history_path, sizeof(history_path), "%s/.shell_history.bin", get_home());
+  }
+  return history_path;
+}
+
+/**
+ * get_session_id
+ *
+ * Return an identifier for this shell session, derived from the pid and the
+ * start time so that it stays unique across pid reuse.
+ */
+uint64_t get_session_id()
+{
+  if (session_id == 0)
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    session_id = ((uint64_t)getpid() << 32) ^ ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+  }
+  return session_id;
+}
+
+/**
+ * open_locked
+ *
+ * Open the history log and take a flock() on it.
+ *
+ * Parameters:
+ *   flags - open(2) flags.
+ *   lock  - LOCK_SH or LOCK_EX, optionally with LOCK_NB.
+ *
+ * Returns:
+ *   A locked file descriptor, or -1 on error. If the log was replaced by a
+ *   compaction while we waited for the lock, the new file is opened instead.
+ */
+static int open_locked(int flags, int lock)
+{
+  const char *path = get_history_path();
+
+  for (;;)
+  {
+    int fd = open(path, flags | O_CLOEXEC, 0600);
+    if (fd < 0)
+      return -1;
+
+    if (flock(fd, lock) != 0)
+    {
+      close(fd);
+      return -1;
+    }
+
+    struct stat held, current;
+    if (fstat(fd, &held) == 0 && stat(path, &current) == 0 &&
+        held.st_dev == current.st_dev && held.st_ino == current.st_ino)
+      return fd;
+
+    close(fd);
+  }
+}
+
+/**
+ * open_appender
+ *
+ * Open the log for appending, writing the magic header if the file is new.
+ * The returned descriptor holds a shared lock.
+ */
+static int open_appender()
+{
+  int fd = open_locked(O_WRONLY | O_APPEND | O_CREAT, LOCK_SH);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size == 0)
+  {
+    // Upgrade while the header is written so two new shells do not both
+    // write it.
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+      if (write(fd, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != HISTORY_MAGIC_LEN)
+      {
+        close(fd);
+        return -1;
+      }
+    }
+    flock(fd, LOCK_SH);
+  }
+  return fd;
+}
+
+/**
+ * encode_record
+ *
+ * Serialize one entry into buf, which must have room for
+ * RECORD_OVERHEAD + strlen(cwd) + strlen(cmd) bytes.
+ *
+ * Returns:
+ *   The encoded length.
+ */
+static size_t encode_record(char *buf, const history_entry_t *e)
+{
+  record_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.cwd_len = strlen(e->cwd);
+  hdr.cmd_len = strlen(e->cmd);
+  hdr.length = RECORD_OVERHEAD + hdr.cwd_len + hdr.cmd_len;
+  hdr.status = e->status;
+  hdr.timestamp = e->timestamp;
+  hdr.duration = e->duration;
+  hdr.session = e->session;
+
+  char *p = buf;
+  memcpy(p, &hdr, sizeof(hdr));
+  p += sizeof(hdr);
+  memcpy(p, e->cwd, hdr.cwd_len);
+  p += hdr.cwd_len;
+  memcpy(p, e->cmd, hdr.cmd_len);
+  p += hdr.cmd_len;
+  memcpy(p, &hdr.length, sizeof(uint32_t));
+  return hdr.length;
+}
+
+/**
+ * decode_record
+ *
+ * Parse the record starting at p.
+ *
+ * Parameters:
+ *   p     - start of a record.
+ *   avail - number of readable bytes at p.
+ *   e     - filled with heap copies of the cwd and command on success; may
+ *           be NULL to only validate the record.
+ *
+ * Returns:
+ *   The record length, or 0 if the bytes do not form a complete record.
+ */
+static size_t decode_record(const char *p, size_t avail, history_entry_t *e)
+{
+  record_header_t hdr;
+  uint32_t trailer;
+
+  if (avail < RECORD_OVERHEAD)
+    return 0;
+
+  memcpy(&hdr, p, sizeof(hdr));
+  if (hdr.length > avail || hdr.length > HISTORY_MAX_RECORD ||
+      (size_t)hdr.cwd_len + hdr.cmd_len + RECORD_OVERHEAD != hdr.length)
+    return 0;
+
+  memcpy(&trailer, p + hdr.length - sizeof(uint32_t), sizeof(uint32_t));
+  if (trailer != hdr.length)
+    return 0;
+
+  if (e)
+  {
+    const char *cwd = p + sizeof(hdr);
+    e->timestamp = hdr.timestamp;
+    e->duration = hdr.duration;
+    e->status = hdr.status;
+    e->session = hdr.session;
+    e->cwd = mem_strndup(MEM_HISTORY, cwd, hdr.cwd_len);
+    e->cmd = mem_strndup(MEM_HISTORY, cwd + hdr.cwd_len, hdr.cmd_len);
+  }
+  return hdr.length;
+}
+
+/**
+ * read_log
+ *
+ * Read the whole log behind fd into memory and check its magic header.
+ *
+ * Returns:
+ *   A heap buffer holding the file (caller frees) with *len set to its size,
+ *   or NULL if the file could not be read or is not a history log.
+ */
+static char *read_log(int fd, size_t *len)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < HISTORY_MAGIC_LEN)
+    return NULL;
+
+  char *buf = mem_malloc(MEM_HISTORY, st.st_size);
+  if (!buf)
+    return NULL;
+
+  size_t done = 0;
+  while (done < (size_t)st.st_size)
+  {
+    ssize_t n = pread(fd, buf + done, st.st_size - done, done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+
+  if (done < HISTORY_MAGIC_LEN || memcmp(buf, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0)
+  {
+    mem_free(MEM_HISTORY, buf);
+    return NULL;
+  }
+
+  *len = done;
+  return buf;
+}
+
+/**
+ * fnv1a
+ *
+ * 64-bit FNV-1a hash of a NULL terminated string.
+ */
+static uint64_t fnv1a(const char *s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *s; s++)
+  {
+    h ^= (unsigned char)*s;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/**
+ * compact_fd
+ *
+ * Rewrite the log behind fd (which must hold LOCK_EX) keeping only the most
+ * recent occurrence of each command. Distinct commands are never dropped.
+ *
+ * Returns:
+ *   0 on success, -1 on error.
+ */
+static int compact_fd(int fd)
+{
+  size_t len;
+  char *buf = read_log(fd, &len);
+  if (!buf)
+    return -1;
+
+  // Index every valid record.
+  size_t cap = 256, count = 0;
+  history_entry_t *entries = mem_malloc(MEM_HISTORY, cap * sizeof(*entries));
+  size_t *offsets = mem_malloc(MEM_HISTORY, cap * sizeof(*offsets));
+
+  size_t off = HISTORY_MAGIC_LEN;
+  while (off < len)
+  {
+    if (count == cap)
+    {
+      cap *= 2;
+      entries = mem_realloc(MEM_HISTORY, entries, cap * sizeof(*entries));
+      offsets = mem_realloc(MEM_HISTORY, offsets, cap * sizeof(*offsets));
+    }
+    size_t n = decode_record(buf + off, len - off, &entries[count]);
+    if (n == 0)
+      break;
+    offsets[count++] = off;
+    off += n;
+  }
+
+  // Walk backwards keeping the newest copy of each command.
+  size_t slots = 16;
+  while (slots < count * 2)
+    slots *= 2;
+  long *seen = mem_malloc(MEM_HISTORY, slots * sizeof(long));
+  for (size_t i = 0; i < slots; i++)
+    seen[i] = -1;
+
+  char *keep = mem_calloc(MEM_HISTORY, count ? count : 1, 1);
+  size_t kept_bytes = 0;
+  for (size_t i = count; i-- > 0;)
+  {
+    size_t rec_len = RECORD_OVERHEAD + strlen(entries[i].cwd) + strlen(entries[i].cmd);
+    size_t slot = fnv1a(entries[i].cmd) & (slots - 1);
+    int duplicate = 0;
+    while (seen[slot] != -1)
+    {
+      if (strcmp(entries[seen[slot]].cmd, entries[i].cmd) == 0)
+      {
+        duplicate = 1;
+        break;
+      }
+      slot = (slot + 1) & (slots - 1);
+    }
+    if (duplicate)
+      continue;
+
+    seen[slot] = i;
+    keep[i] = 1;
+    kept_bytes += rec_len;
+  }
+
+  char tmp_path[PATH_MAX + 32];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", get_history_path(), (int)getpid());
+
+  int rc = -1;
+  int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out >= 0)
+  {
+    char *data = mem_malloc(MEM_HISTORY, HISTORY_MAGIC_LEN + kept_bytes);
+    size_t used = HISTORY_MAGIC_LEN;
+    memcpy(data, HISTORY_MAGIC, HISTORY_MAGIC_LEN);
+    for (size_t i = 0; i < count; i++)
+    {
+      if (keep[i])
+      {
+        size_t n = decode_record(buf + offsets[i], len - offsets[i], NULL);
+        memcpy(data + used, buf + offsets[i], n);
+        used += n;
+      }
+    }
+
+    if (write(out, data, used) == (ssize_t)used && fsync(out) == 0 &&
+        rename(tmp_path, get_history_path()) == 0)
+      rc = 0;
+    else
+      unlink(tmp_path);
+
+    mem_free(MEM_HISTORY, data);
+    close(out);
+  }
+
+  history_free_entries(entries, count);
+  mem_free(MEM_HISTORY, offsets);
+  mem_free(MEM_HISTORY, seen);
+  mem_free(MEM_HISTORY, keep);
+  mem_free(MEM_HISTORY, buf);
+  return rc;
+}
+
+/**
+ * history_compact
+ *
+ * Deduplicate the history log in place. Blocks until no other shell is
+ * appending.
+ *
+ * Returns:
+ *   0 on success, -1 on error.
+ */
+int history_compact()
+{
+  int fd = open_locked(O_RDONLY, LOCK_EX);
+  if (fd < 0)
+    return -1;
+
+  int rc = compact_fd(fd);
+  close(fd);
+  return rc;
+}
+
+/**
+ * compact_in_background
+ *
+ * Compact the log in a grandchild, which init reaps: the child in between
+ * exits at once and is reaped here, so neither is left for the job
+ * table's reaper to find. If another shell is already compacting (or still
+ * appending), the grandchild gives up immediately; a later append will try
+ * again.
+ */
+static void compact_in_background()
+{
+  pid_t pid = fork();
+  if (pid < 0)
+    return;
+  if (pid > 0)
+  {
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+      ;
+    return;
+  }
+  if (fork() != 0)
+    _exit(0);
+
+  int fd = open_locked(O_RDONLY, LOCK_EX | LOCK_NB);
+  if (fd >= 0)
+  {
+    compact_fd(fd);
+    close(fd);
+  }
+  _exit(0);
+}
+
+/**
+ * add_cmd_history
+ *
+ * Append a command to the history log.
+ *
+ * Parameters:
+ *   cmd       - the command line; a trailing newline is not stored.
+ *   timestamp - start time in microseconds since the epoch.
+ *   duration  - wall time in microseconds.
+ *   status    - exit status, or -1 if unknown.
+ */
+void add_cmd_history(const char *cmd, int64_t timestamp, int64_t duration, int status)
+{
+  size_t cmd_len = strcspn(cmd, "\n");
+  if (cmd_len == 0)
+    return;
+
+  history_entry_t e;
+  e.timestamp = timestamp;
+  e.duration = duration;
+  e.status = status;
+  e.session = get_session_id();
+  e.cwd = (char *)get_pwd();
+  e.cmd = mem_strndup(MEM_HISTORY, cmd, cmd_len);
+
+  size_t max_len = RECORD_OVERHEAD + strlen(e.cwd) + cmd_len;
+  if (max_len > HISTORY_MAX_RECORD)
+  {
+    mem_free(MEM_HISTORY, e.cmd);
+    return;
+  }
+
+  char *buf = mem_malloc(MEM_HISTORY, max_len);
+  size_t n = encode_record(buf, &e);
+  mem_free(MEM_HISTORY, e.cmd);
+
+  int fd = open_appender();
+  if (fd < 0)
+  {
+    mem_free(MEM_HISTORY, buf);
+    return;
+  }
+
+  struct stat st;
+  int compact = 0;
+  if (write(fd, buf, n) == (ssize_t)n)
+  {
+    metrics_count(METRIC_HISTORY_WRITES);
+    if (fstat(fd, &st) == 0)
+      compact = st.st_size > HISTORY_COMPACT_BYTES && st.st_size > 2 * compacted_at;
+  }
+
+  close(fd);
+  mem_free(MEM_HISTORY, buf);
+
+  if (compact)
+  {
+    compacted_at = st.st_size;
+    compact_in_background();
+  }
+}
+
+/**
+ * history_load_tail
+ *
+ * Load the most recent entries of the log by walking it backwards from the
+ * end, so the cost depends on `max` and not on the size of the file.
+ *
+ * Parameters:
+ *   entries - set to a heap array of entries, oldest first. Free it with
+ *             history_free_entries().
+ *   max     - maximum number of entries to load.
+ *
+ * Returns:
+ *   The number of entries loaded, or -1 if the log cannot be read.
+ */
+int history_load_tail(history_entry_t **entries, int max)
+{
+  *entries = NULL;
+
+  int fd = open_locked(O_RDONLY, LOCK_SH);
+  if (fd < 0)
+    return -1;
+
+  char magic[HISTORY_MAGIC_LEN];
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      pread(fd, magic, HISTORY_MAGIC_LEN, 0) != HISTORY_MAGIC_LEN ||
+      memcmp(magic, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  history_entry_t *out = mem_calloc(MEM_HISTORY, max > 0 ? max : 1, sizeof(*out));
+  int count = 0;
+  off_t end = st.st_size;
+  char *buf = NULL;
+  size_t buf_cap = 0;
+
+  while (count < max && end - HISTORY_MAGIC_LEN >= (off_t)RECORD_OVERHEAD)
+  {
+    uint32_t len;
+    if (pread(fd, &len, sizeof(len), end - sizeof(len)) != sizeof(len) ||
+        len < RECORD_OVERHEAD || len > end - HISTORY_MAGIC_LEN)
+      break;
+
+    if (len > buf_cap)
+    {
+      buf_cap = len;
+      buf = mem_realloc(MEM_HISTORY, buf, buf_cap);
+    }
+    if (pread(fd, buf, len, end - len) != (ssize_t)len ||
+        decode_record(buf, len, &out[count]) != len)
+      break;
+
+    count++;
+    end -= len;
+  }
+
+  mem_free(MEM_HISTORY, buf);
+  close(fd);
+
+  // Records were collected newest first.
+  for (int i = 0; i < count / 2; i++)
+  {
+    history_entry_t t = out[i];
+    out[i] = out[count - 1 - i];
+    out[count - 1 - i] = t;
+  }
+
+  *entries = out;
+  return count;
+}
+
+/**
+ * history_free_entries
+ *
+ * Free an array returned by history_load_tail().
+ */
+void history_free_entries(history_entry_t *entries, int count)
+{
+  if (!entries)
+    return;
+
+  for (int i = 0; i < count; i++)
+  {
+    mem_free(MEM_HISTORY, entries[i].cwd);
+    mem_free(MEM_HISTORY, entries[i].cmd);
+  }
+  mem_free(MEM_HISTORY, entries);
+}
+
+/**
+ * get_cmd_history
+ *
+ * Return the last HISTORY_SHOW commands, one per line.
+ *
+ * Returns:
+ *   A heap-allocated string the caller must free, or NULL if the log cannot
+ *   be read.
+ */
+char *get_cmd_history()
+{
+  history_entry_t *entries;
+  int count = history_load_tail(&entries, HISTORY_SHOW);
+  if (count < 0)
+    return NULL;
+
+  size_t total_length = 0;
+  for (int i = 0; i < count; i++)
+    total_length += strlen(entries[i].cmd) + 1;
+
+  char *result = malloc(total_length + 1);
+  if (result)
+  {
+    char *p = result;
+    for (int i = 0; i < count; i++)
+    {
+      size_t n = strlen(entries[i].cmd);
+      memcpy(p, entries[i].cmd, n);
+      p[n] = '\n';
+      p += n + 1;
+    }
+    *p = '\0';
+  }
+
+  history_free_entries(entries, count);
+  return result;
+}
+
+/**
+ * history_import
+ *
+ * Append the lines of a plain-text history file to the log. Lines of the
+ * form "#<seconds>" (as written by bash with HISTTIMEFORMAT) set the
+ * timestamp of the command that follows them.
+ *
+ * Parameters:
+ *   path - plain-text file with one command per line.
+ *
+ * Returns:
+ *   The number of commands imported, or -1 on error.
+ */
+int history_import(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return -1;
+
+  int fd = open_appender();
+  if (fd < 0)
+  {
+    fclose(in);
+    return -1;
+  }
+
+  size_t cap = 64 * 1024, used = 0;
+  char *batch = mem_malloc(MEM_HISTORY, cap);
+  char *line = NULL;
+  size_t line_len = 0;
+  int64_t timestamp = 0;
+  int count = 0, rc = 0;
+
+  while (getline(&line, &line_len, in) != -1)
+  {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0')
+      continue;
+
+    if (line[0] == '#')
+    {
+      char *end;
+      long long secs = strtoll(line + 1, &end, 10);
+      if (end != line + 1 && *end == '\0')
+      {
+        timestamp = (int64_t)secs * 1000000;
+        continue;
+      }
+    }
+
+    history_entry_t e = {timestamp, 0, -1, 0, "", line};
+    size_t need = RECORD_OVERHEAD + strlen(line);
+    if (need > HISTORY_MAX_RECORD)
+      continue;
+
+    if (used + need > cap)
+    {
+      // One write per batch keeps each batch contiguous in the log.
+      if (write(fd, batch, used) != (ssize_t)used)
+      {
+        rc = -1;
+        break;
+      }
+      used = 0;
+      if (need > cap)
+      {
+        cap = need;
+        batch = mem_realloc(MEM_HISTORY, batch, cap);
+      }
+    }
+    used += encode_record(batch + used, &e);
+    timestamp = 0;
+    count++;
+  }
+
+  if (rc == 0 && used > 0 && write(fd, batch, used) != (ssize_t)used)
+    rc = -1;
+
+  free(line);
+  mem_free(MEM_HISTORY, batch);
+  close(fd);
+  fclose(in);
+  return rc == 0 ? count : -1;
+}
+
+/**
+ * history_export
+ *
+ * Write every command in the log to a plain-text file, one per line.
+ *
+ * Returns:
+ *   The number of commands exported, or -1 on error.
+ */
+int history_export(const char *path)
+{
+  int fd = open_locked(O_RDONLY, LOCK_SH);
+  if (fd < 0)
+    return -1;
+
+  size_t len;
+  char *buf = read_log(fd, &len);
+  close(fd);
+  if (!buf)
+    return -1;
+
+  FILE *out = fopen(path, "w");
+  if (!out)
+  {
+    mem_free(MEM_HISTORY, buf);
+    return -1;
+  }
+
+  int count = 0;
+  size_t off = HISTORY_MAGIC_LEN;
+  while (off < len)
+  {
+    record_header_t hdr;
+    size_t n = decode_record(buf + off, len - off, NULL);
+    if (n == 0)
+      break;
+    memcpy(&hdr, buf + off, sizeof(hdr));
+    fwrite(buf + off + sizeof(hdr) + hdr.cwd_len, 1, hdr.cmd_len, out);
+    fputc('\n', out);
+    off += n;
+    count++;
+  }
+
+  mem_free(MEM_HISTORY, buf);
+  return fclose(out) == 0 ? count : -1;
+}
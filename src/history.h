@@ -0,0 +1,26 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+typedef struct history_entry
+{
+  int64_t timestamp; /* start time, microseconds since the epoch */
+  int64_t duration;  /* wall time, microseconds */
+  int status;        /* exit status, -1 when unknown */
+  uint64_t session;
+  char *cwd;
+  char *cmd;
+} history_entry_t;
+
+const char *get_history_path();
+uint64_t get_session_id();
+void add_cmd_history(const char *cmd, int64_t timestamp, int64_t duration, int status);
+char *get_cmd_history();
+int history_load_tail(history_entry_t **entries, int max);
+void history_free_entries(history_entry_t *entries, int count);
+int history_import(const char *path);
+int history_export(const char *path);
+int history_compact();
+
+#endif
@@ -0,0 +1,773 @@
+#define _GNU_SOURCE
+#include "jobs.h"
+#include "memory.h"
+#include "options.h"
+#include "wheel.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#define JOB_BUCKETS 1024
+
+struct job
+{
+  timer_node_t timer; /* first member: expired timers cast back to jobs */
+  pid_t pgid;
+  int background;
+  int timed_out;
+  int killed;
+  int64_t kill_after_ms;
+  int64_t started_ms;
+  char *name;
+  struct job *next;    /* hash chain */
+  struct job *bg_next; /* list of running background jobs */
+};
+
+/*
+ * A background job waiting for a slot. The executor hands over what it
+ * needs to start the job later: launch() forks it, release() frees arg.
+ */
+typedef struct queued_job
+{
+  int id;
+  int priority;
+  int64_t seq; /* order among equal priorities; jobs -f makes it smallest */
+  int64_t queued_ms;
+  char *name;
+  void (*launch)(void *arg);
+  void (*release)(void *arg);
+  void *arg;
+  struct queued_job *next;
+} queued_job_t;
+
+static timer_wheel_t wheel;
+static job_t *buckets[JOB_BUCKETS];
+static job_t *background_jobs = NULL;
+static int background_count = 0;
+static queued_job_t *queue = NULL;
+static queued_job_t *queue_tail = NULL;
+static int queue_length = 0;
+static int queue_by_priority = 0; /* the order queue is sorted in */
+static int next_job_id = 1;
+static int64_t next_seq = 1;
+static int64_t front_seq = 0;
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int signal_fd = -1;
+
+static uint64_t now_tick()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / JOB_TICK_MS;
+}
+
+static int64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t ms_to_ticks(int64_t ms)
+{
+  return (ms + JOB_TICK_MS - 1) / JOB_TICK_MS;
+}
+
+/**
+ * jobs_fd
+ *
+ * Return an fd that becomes readable when a deadline is due or a child
+ * has exited, setting everything up on first use. SIGCHLD must be blocked
+ * for the exit notifications to arrive.
+ *
+ * Returns:
+ *   The fd, or -1 if it could not be created.
+ */
+int jobs_fd()
+{
+  if (epoll_fd != -1)
+    return epoll_fd;
+
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  signal_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (epoll_fd < 0 || timer_fd < 0 || signal_fd < 0)
+  {
+    perror("jobs");
+    return -1;
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN};
+  ev.data.fd = timer_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+  ev.data.fd = signal_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+
+  wheel_init(&wheel, now_tick());
+  return epoll_fd;
+}
+
+/**
+ * jobs_forget
+ *
+ * In a forked subshell, drop the shell's jobs fd and table so that the
+ * child sets up its own on first use. The shell's fds are left alone: they
+ * are close-on-exec, and a subshell that does not exec closes them itself.
+ */
+void jobs_forget()
+{
+  epoll_fd = timer_fd = signal_fd = -1;
+  memset(buckets, 0, sizeof(buckets));
+  background_jobs = NULL;
+  background_count = 0;
+  queue = queue_tail = NULL;
+  queue_length = 0;
+}
+
+/**
+ * arm_timer
+ *
+ * Point the timerfd at the wheel's next expiry, or disarm it.
+ */
+static void arm_timer()
+{
+  struct itimerspec its = {0};
+  uint64_t next = wheel_next(&wheel);
+
+  if (next != WHEEL_NEVER)
+  {
+    uint64_t ms = next * JOB_TICK_MS;
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000 + 1; /* never all zero */
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static job_t **bucket(pid_t pgid)
+{
+  return &buckets[(unsigned)pgid % JOB_BUCKETS];
+}
+
+static job_t *find_job(pid_t pgid)
+{
+  for (job_t *job = *bucket(pgid); job; job = job->next)
+  {
+    if (job->pgid == pgid)
+      return job;
+  }
+  return NULL;
+}
+
+/**
+ * expire
+ *
+ * A job's deadline passed: send SIGTERM to its process group and schedule
+ * the SIGKILL, or send the SIGKILL if that time has come too.
+ */
+static void expire(job_t *job)
+{
+  // kill(0) would signal the shell's own group
+  if (job->pgid <= 0)
+    return;
+
+  if (!job->timed_out)
+  {
+    job->timed_out = 1;
+    if (job->background)
+      fprintf(stderr, "[bg] %d (%s): deadline passed, terminating\n", job->pgid, job->name);
+    kill(-job->pgid, SIGTERM);
+    kill(-job->pgid, SIGCONT);
+    if (job->kill_after_ms > 0)
+    {
+      wheel_add(&wheel, &job->timer, now_tick() + ms_to_ticks(job->kill_after_ms));
+      return;
+    }
+  }
+  job->killed = 1;
+  kill(-job->pgid, SIGKILL);
+}
+
+static void run_timers()
+{
+  uint64_t expirations;
+  while (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+    ;
+
+  timer_node_t *t = wheel_advance(&wheel, now_tick());
+  while (t)
+  {
+    timer_node_t *next = t->next;
+    t->next = NULL;
+    expire((job_t *)t);
+    t = next;
+  }
+  arm_timer();
+}
+
+static void drain_signals()
+{
+  struct signalfd_siginfo info;
+  while (read(signal_fd, &info, sizeof(info)) > 0)
+    ;
+}
+
+/**
+ * handle_events
+ *
+ * Wait up to timeout_ms (-1: forever) for the jobs fd, then fire due
+ * deadlines and consume child exit notifications.
+ *
+ * Returns:
+ *   Non-zero if a child exited.
+ */
+static int handle_events(int timeout_ms)
+{
+  struct epoll_event events[2];
+  int exited = 0;
+  int n = epoll_wait(epoll_fd, events, 2, timeout_ms);
+  for (int i = 0; i < n; i++)
+  {
+    if (events[i].data.fd == timer_fd)
+      run_timers();
+    else
+    {
+      drain_signals();
+      exited = 1;
+    }
+  }
+  return exited;
+}
+
+static void start_queued();
+
+/**
+ * reap
+ *
+ * The reaping loop: collect finished background jobs, then start queued
+ * jobs in the slots they freed. With any set every exited child is
+ * reaped, which only the main loop may do; otherwise only background jobs
+ * are, so that a foreground wait keeps the statuses it is waiting for.
+ */
+static void reap(int any)
+{
+  if (any)
+  {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    {
+      job_t *job = find_job(pid);
+      if (job && job->background)
+        job_finish(job);
+    }
+  }
+  else
+  {
+    job_t *job = background_jobs;
+    while (job)
+    {
+      job_t *next = job->bg_next;
+      if (waitpid(job->pgid, NULL, WNOHANG) == job->pgid)
+        job_finish(job);
+      job = next;
+    }
+  }
+  start_queued();
+}
+
+/**
+ * jobs_dispatch
+ *
+ * Fire due deadlines, reap every exited child, forgetting background jobs
+ * that are done, and start queued jobs. Never blocks; meant for the
+ * shell's main loop, where no foreground wait can lose a status to it.
+ */
+void jobs_dispatch()
+{
+  if (jobs_fd() < 0)
+    return;
+
+  handle_events(0);
+  reap(1);
+}
+
+/**
+ * jobs_sleep
+ *
+ * Block until a child exits or a deadline fires, running the deadlines
+ * that are due and starting queued jobs in the slots that finished
+ * background jobs free. The caller reaps its children with
+ * waitpid(WNOHANG) before and after; SIGCHLD must be blocked.
+ */
+void jobs_sleep()
+{
+  if (jobs_fd() < 0)
+  {
+    // No notifications to sleep on: give the children a moment
+    usleep(JOB_TICK_MS * 1000);
+    return;
+  }
+  if (handle_events(-1) && queue)
+    reap(0);
+}
+
+/**
+ * jobs_waitpid
+ *
+ * waitpid(pid, status, 0) that keeps deadlines running, and queued
+ * background jobs starting, while it waits. The caller must have SIGCHLD
+ * blocked. Without pending deadlines or queued jobs this is a plain
+ * blocking waitpid().
+ *
+ * Returns:
+ *   As waitpid().
+ */
+int jobs_waitpid(pid_t pid, int *status)
+{
+  if ((!jobs_pending_deadlines() && !queue) || jobs_fd() < 0)
+    return waitpid(pid, status, 0);
+
+  for (;;)
+  {
+    pid_t r = waitpid(pid, status, WNOHANG);
+    if (r != 0)
+      return r;
+    jobs_sleep();
+  }
+}
+
+/**
+ * job_start
+ *
+ * Add a job to the table.
+ *
+ * Parameters:
+ *   pgid       - the job's process group (its first process).
+ *   name       - command name, for messages.
+ *   background - non-zero for `&` jobs, which jobs_dispatch() reaps.
+ *
+ * Returns:
+ *   The job; release it with job_finish().
+ */
+job_t *job_start(pid_t pgid, const char *name, int background)
+{
+  job_t *job = mem_calloc(MEM_JOBS, 1, sizeof(job_t));
+  job->pgid = pgid;
+  job->background = background;
+  job->started_ms = now_ms();
+  job->name = mem_strdup(MEM_JOBS, name ? name : "");
+
+  job_t **head = bucket(pgid);
+  job->next = *head;
+  *head = job;
+
+  if (background)
+  {
+    job->bg_next = background_jobs;
+    background_jobs = job;
+    background_count++;
+  }
+  return job;
+}
+
+/**
+ * job_set_deadline
+ *
+ * Give a job timeout_ms to finish. kill_after_ms is the grace period
+ * between SIGTERM and SIGKILL (0 sends SIGKILL straight away).
+ */
+void job_set_deadline(job_t *job, int64_t timeout_ms, int64_t kill_after_ms)
+{
+  if (jobs_fd() < 0)
+    return;
+
+  job->kill_after_ms = kill_after_ms;
+  wheel_del(&wheel, &job->timer);
+  wheel_add(&wheel, &job->timer, now_tick() + ms_to_ticks(timeout_ms));
+  arm_timer();
+}
+
+/**
+ * job_status
+ *
+ * Translate the job's exit status the way timeout(1) does: 124 if its
+ * deadline sent SIGTERM, 137 if it also took a SIGKILL, unchanged otherwise.
+ */
+int job_status(const job_t *job, int status)
+{
+  if (!job || !job->timed_out)
+    return status;
+  return job->killed ? 128 + SIGKILL : JOB_TIMEOUT_STATUS;
+}
+
+/**
+ * job_finish
+ *
+ * Cancel the job's deadline and remove it from the table.
+ */
+void job_finish(job_t *job)
+{
+  if (!job)
+    return;
+
+  if (wheel_pending(&job->timer))
+  {
+    wheel_del(&wheel, &job->timer);
+    arm_timer();
+  }
+
+  job_t **link = bucket(job->pgid);
+  while (*link && *link != job)
+    link = &(*link)->next;
+  if (*link)
+    *link = job->next;
+
+  if (job->background)
+  {
+    for (link = &background_jobs; *link && *link != job; link = &(*link)->bg_next)
+      ;
+    if (*link)
+    {
+      *link = job->bg_next;
+      background_count--;
+    }
+  }
+
+  mem_free(MEM_JOBS, job->name);
+  mem_free(MEM_JOBS, job);
+}
+
+/**
+ * jobs_pending_deadlines
+ *
+ * Return the number of deadlines on the wheel.
+ */
+int jobs_pending_deadlines()
+{
+  return epoll_fd == -1 ? 0 : wheel.count;
+}
+
+// Online CPUs this shell may run on
+static int cpu_count()
+{
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    return CPU_COUNT(&set);
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+/**
+ * jobs_limit
+ *
+ * Return how many background jobs may run at once: the max_jobs option,
+ * or the number of CPUs when it is 0.
+ */
+int jobs_limit()
+{
+  int limit = get_option(OPT_MAX_JOBS);
+  return limit > 0 ? limit : cpu_count();
+}
+
+/**
+ * can_start
+ *
+ * Decide whether one more background job may start now. Without an
+ * explicit max_jobs the load average counts too: while the last minute's
+ * load exceeds the CPU count, jobs only start when none of ours is
+ * running, so the queue always makes progress.
+ */
+static int can_start()
+{
+  if (background_count >= jobs_limit())
+    return 0;
+  if (get_option(OPT_MAX_JOBS) > 0 || background_count == 0)
+    return 1;
+
+  double load;
+  return getloadavg(&load, 1) != 1 || load < cpu_count();
+}
+
+/**
+ * jobs_admit
+ *
+ * Return non-zero if a new background job may start right away; if not,
+ * it must wait its turn with job_enqueue(). Jobs that are already queued
+ * keep their place ahead of new ones.
+ */
+int jobs_admit()
+{
+  return !queue && can_start();
+}
+
+// Whether a goes before b in the queue
+static int runs_before(const queued_job_t *a, const queued_job_t *b)
+{
+  if (queue_by_priority && a->priority != b->priority)
+    return a->priority > b->priority;
+  return a->seq < b->seq;
+}
+
+static void insert_queued(queued_job_t *q)
+{
+  queue_length++;
+  if (!queue || !runs_before(q, queue_tail))
+  {
+    q->next = NULL;
+    if (queue_tail)
+      queue_tail->next = q;
+    else
+      queue = q;
+    queue_tail = q;
+    return;
+  }
+
+  queued_job_t **link = &queue;
+  while (!runs_before(q, *link))
+    link = &(*link)->next;
+  q->next = *link;
+  *link = q;
+}
+
+static queued_job_t *remove_queued(int id)
+{
+  queued_job_t *prev = NULL;
+  for (queued_job_t *q = queue; q; prev = q, q = q->next)
+  {
+    if (q->id != id)
+      continue;
+    if (prev)
+      prev->next = q->next;
+    else
+      queue = q->next;
+    if (queue_tail == q)
+      queue_tail = prev;
+    queue_length--;
+    return q;
+  }
+  return NULL;
+}
+
+/**
+ * sort_queue
+ *
+ * Put the queue in the order the job_priority option asks for, if it was
+ * changed since the queue was last sorted.
+ */
+static void sort_queue()
+{
+  if (queue_by_priority == (get_option(OPT_JOB_PRIORITY) != 0))
+    return;
+
+  queue_by_priority = get_option(OPT_JOB_PRIORITY) != 0;
+  queued_job_t *q = queue;
+  queue = queue_tail = NULL;
+  queue_length = 0;
+  while (q)
+  {
+    queued_job_t *next = q->next;
+    insert_queued(q);
+    q = next;
+  }
+}
+
+/**
+ * start_queued
+ *
+ * Start queued jobs, best first, while there are free slots.
+ */
+static void start_queued()
+{
+  sort_queue();
+  while (queue && can_start())
+  {
+    queued_job_t *q = queue;
+    remove_queued(q->id);
+    q->launch(q->arg);
+    q->release(q->arg);
+    mem_free(MEM_JOBS, q->name);
+    mem_free(MEM_JOBS, q);
+  }
+}
+
+/**
+ * job_enqueue
+ *
+ * Queue a background job until a slot is free.
+ *
+ * Parameters:
+ *   name     - command line, for `jobs`.
+ *   priority - larger runs first when job_priority is set.
+ *   launch   - starts the job; called with arg from the reaping loop.
+ *   release  - frees arg once the job started or was cancelled.
+ *
+ * Returns:
+ *   The job's id in the queue.
+ */
+int job_enqueue(const char *name, int priority, void (*launch)(void *arg), void (*release)(void *arg),
+                void *arg)
+{
+  sort_queue();
+
+  queued_job_t *q = mem_calloc(MEM_JOBS, 1, sizeof(queued_job_t));
+  q->id = next_job_id++;
+  q->priority = priority;
+  q->seq = next_seq++;
+  q->queued_ms = now_ms();
+  q->name = mem_strdup(MEM_JOBS, name);
+  q->launch = launch;
+  q->release = release;
+  q->arg = arg;
+  insert_queued(q);
+
+  // Make sure the reaping loop runs when a slot frees up
+  jobs_fd();
+  return q->id;
+}
+
+/**
+ * job_set_priority
+ *
+ * Returns:
+ *   0 on success, -1 if no job with that id is queued.
+ */
+int job_set_priority(int id, int priority)
+{
+  sort_queue();
+  queued_job_t *q = remove_queued(id);
+  if (!q)
+    return -1;
+  q->priority = priority;
+  insert_queued(q);
+  return 0;
+}
+
+/**
+ * job_to_front
+ *
+ * Make a queued job the next one to start, raising its priority to that
+ * of the current first job if needed.
+ *
+ * Returns:
+ *   0 on success, -1 if no job with that id is queued.
+ */
+int job_to_front(int id)
+{
+  sort_queue();
+  queued_job_t *q = remove_queued(id);
+  if (!q)
+    return -1;
+  if (queue && queue->priority > q->priority)
+    q->priority = queue->priority;
+  q->seq = front_seq--;
+  insert_queued(q);
+  return 0;
+}
+
+/**
+ * job_cancel
+ *
+ * Drop a queued job without running it.
+ *
+ * Returns:
+ *   0 on success, -1 if no job with that id is queued.
+ */
+int job_cancel(int id)
+{
+  queued_job_t *q = remove_queued(id);
+  if (!q)
+    return -1;
+  q->release(q->arg);
+  mem_free(MEM_JOBS, q->name);
+  mem_free(MEM_JOBS, q);
+  return 0;
+}
+
+int jobs_running()
+{
+  return background_count;
+}
+
+int jobs_queued()
+{
+  return queue_length;
+}
+
+/**
+ * jobs_print
+ *
+ * List the running background jobs and the queue, in the order the queue
+ * will start.
+ */
+void jobs_print(FILE *out)
+{
+  int64_t now = now_ms();
+  double load;
+  sort_queue();
+
+  fprintf(out, "running %d of %d", background_count, jobs_limit());
+  if (get_option(OPT_MAX_JOBS) == 0 && getloadavg(&load, 1) == 1)
+    fprintf(out, " (load %.2f on %d CPUs)", load, cpu_count());
+  fprintf(out, "\n");
+  for (job_t *job = background_jobs; job; job = job->bg_next)
+    fprintf(out, "  PID %-8d %8.1fs  %s\n", job->pgid, (now - job->started_ms) / 1000.0, job->name);
+
+  fprintf(out, "queued %d (%s)\n", queue_length, queue_by_priority ? "by priority" : "in order");
+  for (queued_job_t *q = queue; q; q = q->next)
+    fprintf(out, "  [%d] %4d %8.1fs  %s\n", q->id, q->priority, (now - q->queued_ms) / 1000.0, q->name);
+}
+
+/**
+ * parse_duration
+ *
+ * Parse a duration such as "10", "1.5", "250ms", "30s", "5m", "2h" or
+ * "1d"; a bare number is in seconds.
+ *
+ * Returns:
+ *   The duration in milliseconds, or -1 if text is malformed.
+ */
+int64_t parse_duration(const char *text)
+{
+  if (!isdigit((unsigned char)text[0]) && text[0] != '.')
+    return -1;
+
+  char *end;
+  errno = 0;
+  double value = strtod(text, &end);
+  if (end == text || errno)
+    return -1;
+
+  double scale;
+  if (strcmp(end, "") == 0 || strcmp(end, "s") == 0)
+    scale = 1000;
+  else if (strcmp(end, "ms") == 0)
+    scale = 1;
+  else if (strcmp(end, "m") == 0)
+    scale = 60 * 1000;
+  else if (strcmp(end, "h") == 0)
+    scale = 3600 * 1000;
+  else if (strcmp(end, "d") == 0)
+    scale = 86400 * 1000;
+  else
+    return -1;
+
+  // A year is plenty, and keeps the tick arithmetic far from overflow
+  if (value * scale > 365.0 * 86400 * 1000)
+    return -1;
+  return (int64_t)(value * scale + 0.5);
+}
@@ -0,0 +1,54 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Job table and deadlines. Every deadline lives on one hierarchical timer
+ * wheel (see wheel.h) whose next expiry arms a single timerfd; together
+ * with a signalfd for SIGCHLD it is watched through one epoll fd, so the
+ * shell sleeps in poll() or epoll_wait() until a deadline or a child exit
+ * actually needs it. A job that reaches its deadline gets SIGTERM sent to
+ * its process group, then SIGKILL if it is still there kill_after later.
+ *
+ * Background jobs are admission controlled: at most jobs_limit() run at
+ * once, and the rest wait in a queue, in submission order or by priority
+ * (option job_priority). The same loop that reaps a finished background
+ * job starts the next queued one, whether the shell is at the prompt or
+ * waiting for a foreground command.
+ */
+
+#define JOB_TICK_MS 10
+#define JOB_KILL_AFTER_MS 5000
+#define JOB_TIMEOUT_STATUS 124
+
+typedef struct job job_t;
+
+int jobs_fd();
+void jobs_forget();
+void jobs_dispatch();
+void jobs_sleep();
+int jobs_waitpid(pid_t pid, int *status);
+
+job_t *job_start(pid_t pgid, const char *name, int background);
+void job_set_deadline(job_t *job, int64_t timeout_ms, int64_t kill_after_ms);
+int job_status(const job_t *job, int status);
+void job_finish(job_t *job);
+int jobs_pending_deadlines();
+
+int jobs_limit();
+int jobs_admit();
+int job_enqueue(const char *name, int priority, void (*launch)(void *arg), void (*release)(void *arg),
+                void *arg);
+int job_set_priority(int id, int priority);
+int job_to_front(int id);
+int job_cancel(int id);
+int jobs_running();
+int jobs_queued();
+void jobs_print(FILE *out);
+
+int64_t parse_duration(const char *text);
+
+#endif
@@ -1,83 +1,292 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
 #include <limits.h>
-#include <sys/wait.h>
+#include <time.h>
+#include <poll.h>
 
 #include "parser.h"
-#include "builtins.h"
 #include "utility.h"
 #include "executor.h"
+#include "history.h"
+#include "trace.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "record.h"
+#include "editor.h"
 
 /**
- * sigchld_handler - Signal handler for SIGCHLD
- * @sig: Signal number (unused)
+ * now_us - Read a clock in microseconds
+ * @clock: Clock to read (CLOCK_REALTIME or CLOCK_MONOTONIC)
+ *
+ * Return: the clock value in microseconds
+ */
+static int64_t now_us(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * run_line - Parse and execute one command line
+ * @line: The command line, with or without a trailing newline
+ *
+ * Return: the exit status of the command, or -1 if it could not be
+ *         executed
+ */
+static int run_line(const char *line)
+{
+  int64_t start = metrics_now();
+  command_t *cmd = parse_command(line);
+  int status = run_command(cmd);
+
+  free_command(cmd);
+  metrics_count(METRIC_COMMANDS);
+  metrics_observe(METRIC_COMMAND_TIME, metrics_now() - start);
+  return status;
+}
+
+/**
+ * read_line - Read one line of input, running job timers while waiting
+ * @line: Buffer for the line, including its newline if it fits
+ * @size: Size of @line; longer lines are returned in pieces, like fgets()
  *
  * Description:
- * Reaps all terminated child processes to prevent them from becoming
- * zombies. Uses WNOHANG flag to non-blocking wait for any child process.
+ * Waits in poll() on both stdin and jobs_fd(), so deadlines fire and
+ * finished background jobs are reaped while the shell sits at the prompt.
+ * Input is buffered here rather than in stdio, which would hide lines it
+ * had already read from poll(). When stdin is a file, whatever was read
+ * past the line is given back with lseek(), so a command that reads the
+ * shell's own input (head -n 1, or an in-process filter) starts right after
+ * the line, as in sh(1). From a pipe it cannot be given back and stays
+ * with the shell.
  *
- * Return: void
+ * Return: @line, or NULL at end of input
  */
-void sigchld_handler(int sig)
+static char *read_line(char *line, size_t size)
 {
-  (void)sig;
-  // Reap all dead children
-  while (waitpid(-1, NULL, WNOHANG) > 0)
-    ;
+  static char input[4096];
+  static size_t input_len;
+  static int at_eof;
+
+  for (;;)
+  {
+    char *newline = memchr(input, '\n', input_len);
+    size_t len = newline ? (size_t)(newline - input) + 1 : input_len;
+
+    if (newline || len >= size - 1 || (at_eof && len > 0))
+    {
+      if (len > size - 1)
+        len = size - 1;
+      memcpy(line, input, len);
+      line[len] = '\0';
+      input_len -= len;
+      memmove(input, input + len, input_len);
+      if (input_len > 0 && lseek(STDIN_FILENO, -(off_t)input_len, SEEK_CUR) >= 0)
+      {
+        input_len = 0;
+        at_eof = 0;
+      }
+      return line;
+    }
+    if (at_eof)
+      return NULL;
+
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {jobs_fd(), POLLIN, 0}};
+    if (poll(fds, fds[1].fd < 0 ? 1 : 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      at_eof = 1;
+      continue;
+    }
+
+    if (fds[1].revents & POLLIN)
+      jobs_dispatch();
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      ssize_t n = read(STDIN_FILENO, input + input_len, sizeof(input) - input_len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        at_eof = 1;
+      else
+        input_len += n;
+    }
+  }
+}
+
+/* Set when stdin and stdout are a terminal and lines are read with the editor */
+static int editing;
+
+/**
+ * read_input - Show a prompt and read one line of input
+ * @prompt: Prompt to show first
+ * @line: Buffer for the line
+ * @size: Size of @line
+ *
+ * Description:
+ * On a terminal the line editor reads the line; otherwise the prompt is
+ * printed and the line read as it comes.
+ *
+ * Return: @line, or NULL at end of input
+ */
+static char *read_input(const char *prompt, char *line, size_t size)
+{
+  if (editing)
+    return editor_read(prompt, line, size);
+
+  fputs(prompt, stdout);
+  fflush(stdout);
+  return read_line(line, size);
+}
+
+/**
+ * read_here_docs - Read the bodies of the here-documents a line starts
+ * @line: The command line
+ * @delimiters: Its here-documents' delimiters, from here_doc_delimiters()
+ *
+ * Description:
+ * Each body is read up to its delimiter line, and the bodies follow one
+ * another in the order their here-documents appear on the line.
+ *
+ * Return: the line followed by the lines read (all remaining input, if a
+ *         delimiter never comes); the caller frees it
+ */
+static char *read_here_docs(const char *line, char **delimiters)
+{
+  size_t len = strlen(line), cap = len + 4096;
+  char *text = malloc(cap);
+  memcpy(text, line, len + 1);
+
+  char more[1024];
+  for (int d = 0; delimiters[d];)
+  {
+    if (!read_input("> ", more, sizeof(more)))
+      break;
+
+    size_t n = strlen(more);
+    if (len + n + 1 > cap)
+    {
+      cap = (len + n + 1) * 2;
+      text = realloc(text, cap);
+    }
+    // A delimiter line starts at the beginning of a line
+    if ((len == 0 || text[len - 1] == '\n') && here_doc_end(more, delimiters[d]))
+      d++;
+    memcpy(text + len, more, n + 1);
+    len += n;
+  }
+  return text;
 }
 
 /**
  * main - Main entry point for the mini Unix shell
+ * @argc: Argument count
+ * @argv: Arguments; `-c COMMAND` runs a single command line and exits
  *
  * Description:
- * Initializes the shell by setting up signal handlers to ignore SIGINT
- * (Ctrl-C) and handle SIGCHLD for reaping zombie processes. Enters an
+ * Initializes the shell by ignoring SIGINT (Ctrl-C) and blocking SIGCHLD,
+ * whose arrivals the job table reads from jobs_fd() instead. Enters an
  * infinite loop to continuously read and process user commands. Maintains
  * the current working directory and displays it in the shell prompt.
  *
- * Return: 0 on successful execution, non-zero on error
+ * Return: 0 on successful execution, non-zero on error; with -c, the exit
+ *         status of the command
  */
-int main()
+int main(int argc, char *argv[])
 {
   // Shell ignores Ctrl-C
   signal(SIGINT, SIG_IGN);
 
-  // Reap zombies
-  signal(SIGCHLD, sigchld_handler);
+  // Builtin pipeline stages run in the shell; a closed reader must not kill it
+  signal(SIGPIPE, SIG_IGN);
+
+  // Child exits are read from jobs_fd(), which reaps the zombies
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, NULL);
+
+  // SHELL_TRACE=FILE traces from the first command on
+  trace_init();
+
+  // SHELL_METRICS_SOCKET=PATH serves the metrics from the start
+  metrics_init();
+
+  // SHELL_RECORD=FILE records the session for bench/replay
+  record_init();
+
+  if (argc > 1 && strcmp(argv[1], "-c") == 0)
+  {
+    if (argc < 3)
+    {
+      fprintf(stderr, "usage: %s [-c COMMAND]\n", argv[0]);
+      return 2;
+    }
+    char cwd[PATH_MAX];
+    snprintf(cwd, sizeof(cwd), "%s", get_pwd());
+    int64_t started_at = now_us(CLOCK_REALTIME);
+    int64_t start = now_us(CLOCK_MONOTONIC);
+    TRACE_BEGIN("command", argv[2]);
+    int status = run_line(argv[2]);
+    TRACE_END("command");
+    record_command(argv[2], started_at, cwd, now_us(CLOCK_MONOTONIC) - start, status);
+    fflush(stdout);
+    return status < 0 ? 1 : status;
+  }
+
+  // On a terminal, lines are edited in place; loads the recent history
+  editing = editor_init(STDIN_FILENO, STDOUT_FILENO);
 
   char line[1024];
+  char prompt[PATH_MAX + 16];
 
   while (1)
   {
-    printf("shell %s > ", get_cwd());
-    fflush(stdout);
+    snprintf(prompt, sizeof(prompt), "shell %s > ", get_cwd());
 
-    if (!fgets(line, sizeof(line), stdin))
+    TRACE_BEGIN("read", NULL);
+    char *got = read_input(prompt, line, sizeof(line));
+    TRACE_END("read");
+    if (!got)
       break;
 
     if (line[0] == '\n')
       continue;
 
-    command_t *cmd = parse_command(line);
-
-    if (cmd->is_exec)
+    // Here-document bodies follow on the next lines of input
+    char *text = line;
+    char **delimiters = here_doc_delimiters(line);
+    if (delimiters)
     {
-      int status = execute_command(cmd);
-      if (status == 0)
-      {
-        printf("Error occurred while executing the command\n");
-      }
-    }
-    else
-    {
-      run_builtin(cmd);
+      text = read_here_docs(line, delimiters);
+      free_tokens(delimiters);
     }
 
-    free_command(cmd);
-    add_cmd_history(line);
+    // The directory the line runs in, before a cd changes it
+    char cwd[PATH_MAX];
+    snprintf(cwd, sizeof(cwd), "%s", get_pwd());
+
+    int64_t started_at = now_us(CLOCK_REALTIME);
+    int64_t start = now_us(CLOCK_MONOTONIC);
+    TRACE_BEGIN("command", line);
+    int status = run_line(text);
+    TRACE_END("command");
+
+    int64_t latency = now_us(CLOCK_MONOTONIC) - start;
+    add_cmd_history(text, started_at, latency, status);
+    if (editing)
+      editor_add_history(text);
+    record_command(text, started_at, cwd, latency, status);
+    if (text != line)
+      free(text);
+    jobs_dispatch();
   }
 
   return 0;
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include "memory.h"
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct mem_counters
+{
+  _Atomic int64_t bytes;
+  _Atomic int64_t blocks;
+  _Atomic int64_t allocations;
+} mem_counters_t;
+
+static mem_counters_t counters[MEM_SUBSYSTEMS];
+
+static const char *subsystem_names[MEM_SUBSYSTEMS] = {
+    [MEM_PARSER] = "parser",
+    [MEM_NAMES] = "names",
+    [MEM_HISTORY] = "history",
+    [MEM_JOBS] = "jobs",
+};
+
+static void add_counts(mem_subsystem_t subsystem, int64_t bytes, int64_t blocks)
+{
+  mem_counters_t *c = &counters[subsystem];
+  atomic_fetch_add_explicit(&c->bytes, bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->blocks, blocks, memory_order_relaxed);
+  if (blocks > 0)
+    atomic_fetch_add_explicit(&c->allocations, blocks, memory_order_relaxed);
+}
+
+/**
+ * mem_adopt
+ *
+ * Count a block from malloc() for a subsystem, which from now on frees it
+ * with mem_free(). The other wrappers allocate through here.
+ */
+void mem_adopt(mem_subsystem_t subsystem, void *ptr)
+{
+  if (ptr)
+    add_counts(subsystem, malloc_usable_size(ptr), 1);
+}
+
+void *mem_malloc(mem_subsystem_t subsystem, size_t size)
+{
+  void *ptr = malloc(size);
+  mem_adopt(subsystem, ptr);
+  return ptr;
+}
+
+void *mem_calloc(mem_subsystem_t subsystem, size_t count, size_t size)
+{
+  void *ptr = calloc(count, size);
+  mem_adopt(subsystem, ptr);
+  return ptr;
+}
+
+char *mem_strdup(mem_subsystem_t subsystem, const char *s)
+{
+  char *copy = strdup(s);
+  mem_adopt(subsystem, copy);
+  return copy;
+}
+
+char *mem_strndup(mem_subsystem_t subsystem, const char *s, size_t n)
+{
+  char *copy = strndup(s, n);
+  mem_adopt(subsystem, copy);
+  return copy;
+}
+
+/**
+ * mem_realloc
+ *
+ * Resize a block of the subsystem's, as realloc() does. A block that grows
+ * in place is still one allocation.
+ */
+void *mem_realloc(mem_subsystem_t subsystem, void *ptr, size_t size)
+{
+  if (!ptr)
+    return mem_malloc(subsystem, size);
+
+  size_t old_size = malloc_usable_size(ptr);
+  void *moved = realloc(ptr, size);
+  if (moved)
+    add_counts(subsystem, (int64_t)malloc_usable_size(moved) - (int64_t)old_size, 0);
+  else if (size == 0)
+    add_counts(subsystem, -(int64_t)old_size, -1);
+  return moved;
+}
+
+void mem_free(mem_subsystem_t subsystem, void *ptr)
+{
+  if (!ptr)
+    return;
+  add_counts(subsystem, -(int64_t)malloc_usable_size(ptr), -1);
+  free(ptr);
+}
+
+/**
+ * mem_usage
+ *
+ * Read one subsystem's counts.
+ */
+void mem_usage(mem_subsystem_t subsystem, mem_usage_t *usage)
+{
+  mem_counters_t *c = &counters[subsystem];
+  usage->bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+  usage->blocks = atomic_load_explicit(&c->blocks, memory_order_relaxed);
+  usage->allocations = atomic_load_explicit(&c->allocations, memory_order_relaxed);
+}
+
+const char *mem_subsystem_name(mem_subsystem_t subsystem)
+{
+  return subsystem_names[subsystem];
+}
+
+// Resident set size in bytes, from /proc
+static long resident_bytes()
+{
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * meminfo_print
+ *
+ * Write the live bytes and blocks of each subsystem, followed by what the
+ * C library's allocator holds, the part of it no subsystem counts, and
+ * the process's resident set size.
+ */
+void meminfo_print(FILE *out)
+{
+  mem_usage_t total = {0, 0, 0};
+
+  fprintf(out, "%-10s %14s %10s %14s\n", "subsystem", "bytes", "blocks", "allocations");
+  for (int i = 0; i < MEM_SUBSYSTEMS; i++)
+  {
+    mem_usage_t u;
+    mem_usage(i, &u);
+    fprintf(out, "%-10s %14lld %10lld %14lld\n", subsystem_names[i], (long long)u.bytes, (long long)u.blocks,
+            (long long)u.allocations);
+    total.bytes += u.bytes;
+    total.blocks += u.blocks;
+    total.allocations += u.allocations;
+  }
+  fprintf(out, "%-10s %14lld %10lld %14lld\n", "total", (long long)total.bytes, (long long)total.blocks,
+          (long long)total.allocations);
+
+  struct mallinfo2 mi = mallinfo2();
+  size_t in_use = mi.uordblks + mi.hblkhd;
+  fprintf(out, "\n%-14s %14zu\n", "heap in use", in_use);
+  fprintf(out, "%-14s %14lld\n", "other", (long long)in_use - (long long)total.bytes);
+  fprintf(out, "%-14s %14zu\n", "heap free", mi.fordblks);
+  fprintf(out, "%-14s %14zu\n", "heap mapped", mi.arena + mi.hblkhd);
+  fprintf(out, "%-14s %14ld\n", "rss", resident_bytes());
+}
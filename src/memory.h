@@ -0,0 +1,45 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Allocator accounting by subsystem. A subsystem allocates the memory it
+ * keeps (parsed commands, the name table, history buffers, the job table)
+ * through the mem_* wrappers below, naming itself, and frees it the same
+ * way. The blocks are plain malloc() blocks and the counts are their
+ * usable sizes, so nothing else in the process is affected: a block freed
+ * with free() by mistake only leaves its bytes on the count. `meminfo`
+ * prints the counts beside what the C library's allocator holds.
+ */
+
+typedef enum mem_subsystem
+{
+  MEM_PARSER,
+  MEM_NAMES,
+  MEM_HISTORY,
+  MEM_JOBS,
+  MEM_SUBSYSTEMS
+} mem_subsystem_t;
+
+typedef struct mem_usage
+{
+  int64_t bytes;       /* live bytes, as usable sizes */
+  int64_t blocks;      /* live blocks */
+  int64_t allocations; /* blocks ever allocated */
+} mem_usage_t;
+
+void *mem_malloc(mem_subsystem_t subsystem, size_t size);
+void *mem_calloc(mem_subsystem_t subsystem, size_t count, size_t size);
+void *mem_realloc(mem_subsystem_t subsystem, void *ptr, size_t size);
+char *mem_strdup(mem_subsystem_t subsystem, const char *s);
+char *mem_strndup(mem_subsystem_t subsystem, const char *s, size_t n);
+void mem_adopt(mem_subsystem_t subsystem, void *ptr);
+void mem_free(mem_subsystem_t subsystem, void *ptr);
+void mem_usage(mem_subsystem_t subsystem, mem_usage_t *usage);
+const char *mem_subsystem_name(mem_subsystem_t subsystem);
+void meminfo_print(FILE *out);
+
+#endif
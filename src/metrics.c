@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Bucket layout: values below SUB_COUNT get a bucket each; above that,
+ * every range [2^e, 2^(e+1)) is split into SUB_COUNT buckets of width
+ * 2^(e - SUB_BITS).
+ */
+#define SUB_BITS 6
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_EXPONENT 47 /* 2^48 ns is about 78 hours */
+#define BUCKETS (SUB_COUNT + (MAX_EXPONENT - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct histogram
+{
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic int64_t max;
+  _Atomic uint64_t buckets[BUCKETS];
+} histogram_t;
+
+typedef struct registry
+{
+  _Atomic uint64_t counters[METRIC_COUNTERS];
+  histogram_t histograms[METRIC_HISTOGRAMS];
+} registry_t;
+
+typedef struct metric_def
+{
+  const char *name;
+  const char *prometheus;
+  const char *help;
+} metric_def_t;
+
+static const metric_def_t counter_defs[METRIC_COUNTERS] = {
+    [METRIC_COMMANDS] = {"commands", "shell_commands_total", "Command lines run."},
+    [METRIC_FORKS] = {"forks", "shell_forks_total", "Processes forked."},
+    [METRIC_EXEC_FAILURES] = {"exec_failures", "shell_exec_failures_total", "Programs that could not be executed."},
+    [METRIC_HISTORY_WRITES] = {"history_writes", "shell_history_writes_total", "Records appended to the history log."},
+    [METRIC_CACHE_HITS] = {"cache_hits", "shell_cache_hits_total", "`cache` commands replayed from the store."},
+    [METRIC_CACHE_MISSES] = {"cache_misses", "shell_cache_misses_total", "`cache` commands that had to run."},
+};
+
+static const metric_def_t histogram_defs[METRIC_HISTOGRAMS] = {
+    [METRIC_PARSE_TIME] = {"parse_time", "shell_parse_duration_seconds", "Time to tokenize and parse a command line."},
+    [METRIC_LAUNCH_LATENCY] = {"launch_latency", "shell_launch_latency_seconds", "Time from fork to exec of a program."},
+    [METRIC_COMMAND_TIME] = {"command_time", "shell_command_duration_seconds", "Wall time of a command line."},
+};
+
+// Prometheus bucket bounds, in seconds
+static const double prometheus_bounds[] = {1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3,
+                                           0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60};
+
+static registry_t *registry;
+static registry_t fallback;
+
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int listen_fd = -1;
+static pid_t owner_pid;
+
+/**
+ * get_registry
+ *
+ * Return the registry, mapping it on first use. The first fork is always
+ * counted first, so every child inherits the shared mapping.
+ */
+static registry_t *get_registry()
+{
+  if (!registry)
+  {
+    void *p = mmap(NULL, sizeof(registry_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    registry = p == MAP_FAILED ? &fallback : p;
+  }
+  return registry;
+}
+
+static int bucket_index(int64_t value)
+{
+  uint64_t v = value < 0 ? 0 : (uint64_t)value;
+  if (v < SUB_COUNT)
+    return (int)v;
+  if (v >= 1ULL << (MAX_EXPONENT + 1))
+    v = (1ULL << (MAX_EXPONENT + 1)) - 1;
+
+  int exponent = 63 - __builtin_clzll(v);
+  int shift = exponent - SUB_BITS;
+  return SUB_COUNT + shift * SUB_COUNT + (int)((v >> shift) - SUB_COUNT);
+}
+
+// Smallest value that falls into bucket index
+static int64_t bucket_low(int index)
+{
+  if (index < SUB_COUNT)
+    return index;
+
+  int shift = (index - SUB_COUNT) / SUB_COUNT;
+  return (int64_t)(SUB_COUNT + (index - SUB_COUNT) % SUB_COUNT) << shift;
+}
+
+// Largest value that falls into bucket index
+static int64_t bucket_high(int index)
+{
+  return bucket_low(index + 1) - 1;
+}
+
+/**
+ * metrics_now
+ *
+ * Return the monotonic clock in nanoseconds, the unit of every histogram.
+ */
+int64_t metrics_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * metrics_count
+ *
+ * Add one to a counter. Safe from any thread and from forked children.
+ */
+void metrics_count(metric_counter_t counter)
+{
+  atomic_fetch_add_explicit(&get_registry()->counters[counter], 1, memory_order_relaxed);
+}
+
+/**
+ * metrics_observe
+ *
+ * Record one latency sample of ns nanoseconds. Safe from any thread and
+ * from forked children.
+ */
+void metrics_observe(metric_histogram_t histogram, int64_t ns)
+{
+  histogram_t *h = &get_registry()->histograms[histogram];
+  if (ns < 0)
+    ns = 0;
+
+  atomic_fetch_add_explicit(&h->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+  int64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, ns, memory_order_relaxed,
+                                                            memory_order_relaxed))
+    ;
+}
+
+/**
+ * metrics_reset
+ *
+ * Zero every counter and histogram.
+ */
+void metrics_reset()
+{
+  registry_t *r = get_registry();
+  for (int i = 0; i < METRIC_COUNTERS; i++)
+    atomic_store(&r->counters[i], 0);
+
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++)
+  {
+    histogram_t *h = &r->histograms[i];
+    for (int b = 0; b < BUCKETS; b++)
+      atomic_store(&h->buckets[b], 0);
+    atomic_store(&h->count, 0);
+    atomic_store(&h->sum, 0);
+    atomic_store(&h->max, 0);
+  }
+}
+
+/**
+ * metrics_counter
+ *
+ * Return the current value of a counter.
+ */
+uint64_t metrics_counter(metric_counter_t counter)
+{
+  return atomic_load(&get_registry()->counters[counter]);
+}
+
+/**
+ * metrics_samples
+ *
+ * Return the number of samples recorded in a histogram.
+ */
+uint64_t metrics_samples(metric_histogram_t histogram)
+{
+  return atomic_load(&get_registry()->histograms[histogram].count);
+}
+
+/**
+ * metrics_percentile
+ *
+ * Estimate a percentile of a histogram.
+ *
+ * Parameters:
+ *   histogram - the histogram.
+ *   percentile - 0 to 100.
+ *
+ * Returns:
+ *   The highest value of the bucket the percentile falls in (never above
+ *   the largest sample), in nanoseconds; 0 if there are no samples.
+ */
+int64_t metrics_percentile(metric_histogram_t histogram, double percentile)
+{
+  histogram_t *h = &get_registry()->histograms[histogram];
+  uint64_t counts[BUCKETS], total = 0;
+
+  // Work on a snapshot so concurrent updates cannot move the target
+  for (int b = 0; b < BUCKETS; b++)
+  {
+    counts[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+    total += counts[b];
+  }
+  if (total == 0)
+    return 0;
+
+  double rank = percentile / 100 * total;
+  uint64_t target = (uint64_t)rank;
+  if (target < rank)
+    target++;
+  if (target < 1)
+    target = 1;
+  if (target > total)
+    target = total;
+
+  int64_t max = atomic_load(&h->max);
+  uint64_t seen = 0;
+  for (int b = 0; b < BUCKETS; b++)
+  {
+    seen += counts[b];
+    if (seen >= target)
+      return bucket_high(b) < max ? bucket_high(b) : max;
+  }
+  return max;
+}
+
+static void print_duration(FILE *out, int64_t ns)
+{
+  if (ns < 1000)
+    fprintf(out, " %8ldns", (long)ns);
+  else if (ns < 1000000)
+    fprintf(out, " %8.1fus", ns / 1e3);
+  else if (ns < 1000000000)
+    fprintf(out, " %8.1fms", ns / 1e6);
+  else
+    fprintf(out, " %9.2fs", ns / 1e9);
+}
+
+/**
+ * metrics_print
+ *
+ * Write the counters and a percentile summary of each histogram.
+ */
+void metrics_print(FILE *out)
+{
+  for (int i = 0; i < METRIC_COUNTERS; i++)
+    fprintf(out, "%-16s %10llu\n", counter_defs[i].name, (unsigned long long)metrics_counter(i));
+
+  fprintf(out, "\n%-16s %10s %10s %10s %10s %10s\n", "", "count", "p50", "p90", "p99", "max");
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++)
+  {
+    fprintf(out, "%-16s %10llu", histogram_defs[i].name, (unsigned long long)metrics_samples(i));
+    print_duration(out, metrics_percentile(i, 50));
+    print_duration(out, metrics_percentile(i, 90));
+    print_duration(out, metrics_percentile(i, 99));
+    print_duration(out, atomic_load(&get_registry()->histograms[i].max));
+    fputc('\n', out);
+  }
+}
+
+/**
+ * metrics_print_prometheus
+ *
+ * Write every metric in the Prometheus text exposition format.
+ */
+void metrics_print_prometheus(FILE *out)
+{
+  for (int i = 0; i < METRIC_COUNTERS; i++)
+  {
+    const metric_def_t *def = &counter_defs[i];
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", def->prometheus, def->help, def->prometheus);
+    fprintf(out, "%s %llu\n", def->prometheus, (unsigned long long)metrics_counter(i));
+  }
+
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++)
+  {
+    const metric_def_t *def = &histogram_defs[i];
+    histogram_t *h = &get_registry()->histograms[i];
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", def->prometheus, def->help, def->prometheus);
+
+    // Buckets are cumulative; the bucket holding a bound counts toward it,
+    // so le may include samples up to the histogram's precision above it
+    uint64_t cumulative = 0;
+    int b = 0;
+    for (size_t k = 0; k < sizeof(prometheus_bounds) / sizeof(prometheus_bounds[0]); k++)
+    {
+      int64_t bound = (int64_t)(prometheus_bounds[k] * 1e9 + 0.5);
+      for (; b < BUCKETS && bucket_low(b) <= bound; b++)
+        cumulative += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+      fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", def->prometheus, prometheus_bounds[k],
+              (unsigned long long)cumulative);
+    }
+    for (; b < BUCKETS; b++)
+      cumulative += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", def->prometheus, (unsigned long long)cumulative);
+    fprintf(out, "%s_sum %.9f\n", def->prometheus, atomic_load(&h->sum) / 1e9);
+    fprintf(out, "%s_count %llu\n", def->prometheus, (unsigned long long)cumulative);
+  }
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * serve_client
+ *
+ * Answer one connection. HTTP clients (a Prometheus scraper, `curl
+ * --unix-socket`) send a request first and get a response with headers;
+ * plain readers such as `socat - UNIX:PATH` get the bare text.
+ */
+static void serve_client(int fd)
+{
+  char request[1024];
+  int http = 0;
+  struct pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, 100) > 0)
+  {
+    ssize_t n = read(fd, request, sizeof(request));
+    http = n >= 4 && memcmp(request, "GET ", 4) == 0;
+  }
+
+  char *body = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&body, &len);
+  if (!out)
+    return;
+  metrics_print_prometheus(out);
+  fclose(out);
+
+  if (http)
+  {
+    char header[128];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                     len);
+    send_all(fd, header, n);
+  }
+  send_all(fd, body, len);
+  free(body);
+}
+
+static void *serve(void *arg)
+{
+  (void)arg;
+  for (;;)
+  {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return NULL;
+    }
+    serve_client(fd);
+    close(fd);
+  }
+}
+
+static void remove_socket()
+{
+  // Forked children exit through here too; only the shell owns the socket
+  if (listen_fd != -1 && getpid() == owner_pid)
+    unlink(socket_path);
+}
+
+/**
+ * metrics_listen
+ *
+ * Serve the metrics on a Unix domain socket at path from a background
+ * thread. The socket is only accessible to the shell's user and is
+ * removed when the shell exits.
+ *
+ * Returns:
+ *   0 on success, -1 with errno set on failure (EBUSY if already
+ *   listening).
+ */
+int metrics_listen(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  if (listen_fd != -1)
+  {
+    errno = EBUSY;
+    return -1;
+  }
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // Replace a socket left behind by an earlier shell
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  mode_t old_umask = umask(0077);
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_umask);
+  if (rc != 0 || listen(fd, 16) != 0)
+  {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+
+  get_registry();
+  listen_fd = fd;
+  owner_pid = getpid();
+  strcpy(socket_path, path);
+
+  // The server thread must not take signals meant for the shell
+  pthread_t server;
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  rc = pthread_create(&server, NULL, serve, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0)
+  {
+    unlink(path);
+    close(fd);
+    listen_fd = -1;
+    errno = rc;
+    return -1;
+  }
+  pthread_detach(server);
+
+  static int registered = 0;
+  if (!registered)
+  {
+    atexit(remove_socket);
+    registered = 1;
+  }
+  return 0;
+}
+
+/**
+ * metrics_socket_path
+ *
+ * Return the socket the metrics are served on, or NULL.
+ */
+const char *metrics_socket_path()
+{
+  return listen_fd != -1 ? socket_path : NULL;
+}
+
+/**
+ * metrics_init
+ *
+ * Set up the registry and, if SHELL_METRICS_SOCKET names a path, start
+ * serving the metrics there.
+ */
+void metrics_init()
+{
+  get_registry();
+
+  const char *path = getenv("SHELL_METRICS_SOCKET");
+  if (path && *path && metrics_listen(path) != 0)
+    fprintf(stderr, "metrics: %s: %s\n", path, strerror(errno));
+}
@@ -0,0 +1,52 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * In-process metrics: a few counters and HDR-style latency histograms
+ * (log-linear buckets, about 1.6% relative precision from 1ns to days).
+ * The registry lives in a MAP_SHARED mapping, so forked children update
+ * the same numbers as the shell and a failed exec is still counted.
+ * Updates are lock-free atomic adds. `stats` prints them; an optional Unix
+ * socket (SHELL_METRICS_SOCKET=PATH or `stats --listen PATH`) serves them
+ * in Prometheus text format.
+ */
+
+typedef enum metric_counter
+{
+  METRIC_COMMANDS,
+  METRIC_FORKS,
+  METRIC_EXEC_FAILURES,
+  METRIC_HISTORY_WRITES,
+  METRIC_CACHE_HITS,
+  METRIC_CACHE_MISSES,
+  METRIC_COUNTERS
+} metric_counter_t;
+
+typedef enum metric_histogram
+{
+  METRIC_PARSE_TIME,
+  METRIC_LAUNCH_LATENCY,
+  METRIC_COMMAND_TIME,
+  METRIC_HISTOGRAMS
+} metric_histogram_t;
+
+int64_t metrics_now();
+void metrics_count(metric_counter_t counter);
+void metrics_observe(metric_histogram_t histogram, int64_t ns);
+void metrics_reset();
+
+uint64_t metrics_counter(metric_counter_t counter);
+uint64_t metrics_samples(metric_histogram_t histogram);
+int64_t metrics_percentile(metric_histogram_t histogram, double percentile);
+
+void metrics_print(FILE *out);
+void metrics_print_prometheus(FILE *out);
+
+void metrics_init();
+int metrics_listen(const char *path);
+const char *metrics_socket_path();
+
+#endif
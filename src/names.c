@@ -0,0 +1,299 @@
+#include "names.h"
+#include "memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 64
+
+static name_entry_t **buckets = NULL;
+static unsigned bucket_count = 0;
+static unsigned entry_count = 0;
+
+// FNV-1a
+static unsigned hash_name(const char *name)
+{
+  unsigned h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+  {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * grow
+ *
+ * Double the bucket array once there are as many entries as buckets, so
+ * chains stay about one entry long.
+ */
+static void grow()
+{
+  unsigned count = bucket_count ? bucket_count * 2 : INITIAL_BUCKETS;
+  name_entry_t **table = mem_calloc(MEM_NAMES, count, sizeof(name_entry_t *));
+
+  for (unsigned i = 0; i < bucket_count; i++)
+  {
+    name_entry_t *e = buckets[i];
+    while (e)
+    {
+      name_entry_t *next = e->next;
+      name_entry_t **head = &table[e->hash & (count - 1)];
+      e->next = *head;
+      *head = e;
+      e = next;
+    }
+  }
+
+  mem_free(MEM_NAMES, buckets);
+  buckets = table;
+  bucket_count = count;
+}
+
+static name_entry_t **find_link(const char *name, unsigned hash)
+{
+  if (!buckets)
+    return NULL;
+
+  name_entry_t **link = &buckets[hash & (bucket_count - 1)];
+  while (*link && ((*link)->hash != hash || strcmp((*link)->name, name) != 0))
+    link = &(*link)->next;
+  return link;
+}
+
+static name_entry_t *find_entry(const char *name)
+{
+  name_entry_t **link = find_link(name, hash_name(name));
+  return link ? *link : NULL;
+}
+
+/**
+ * names_lookup
+ *
+ * Find the alias and function defined for a command word.
+ *
+ * Returns:
+ *   The entry, or NULL if the name is neither.
+ */
+const name_entry_t *names_lookup(const char *name)
+{
+  return find_entry(name);
+}
+
+static name_entry_t *get_entry(const char *name)
+{
+  unsigned hash = hash_name(name);
+  name_entry_t **link = find_link(name, hash);
+  if (link && *link)
+    return *link;
+
+  if (entry_count >= bucket_count)
+    grow();
+
+  name_entry_t *e = mem_calloc(MEM_NAMES, 1, sizeof(name_entry_t));
+  e->name = mem_strdup(MEM_NAMES, name);
+  e->hash = hash;
+  name_entry_t **head = &buckets[hash & (bucket_count - 1)];
+  e->next = *head;
+  *head = e;
+  entry_count++;
+  return e;
+}
+
+static void clear_alias(name_entry_t *e)
+{
+  mem_free(MEM_NAMES, e->alias);
+  for (int i = 0; e->alias_tokens && e->alias_tokens[i]; i++)
+    mem_free(MEM_NAMES, e->alias_tokens[i]);
+  mem_free(MEM_NAMES, e->alias_tokens);
+  e->alias = NULL;
+  e->alias_tokens = NULL;
+}
+
+// Drop an entry that no longer defines anything
+static void drop_if_empty(const char *name)
+{
+  name_entry_t **link = find_link(name, hash_name(name));
+  name_entry_t *e = link ? *link : NULL;
+  if (!e || e->alias || e->function)
+    return;
+
+  *link = e->next;
+  entry_count--;
+  mem_free(MEM_NAMES, e->name);
+  mem_free(MEM_NAMES, e);
+}
+
+/**
+ * names_set_alias
+ *
+ * Define or replace an alias. The value is tokenized here, once.
+ */
+void names_set_alias(const char *name, const char *value)
+{
+  name_entry_t *e = get_entry(name);
+  clear_alias(e);
+  e->alias = mem_strdup(MEM_NAMES, value);
+  e->alias_tokens = tokenize(value);
+  mem_adopt(MEM_NAMES, e->alias_tokens);
+  for (int i = 0; e->alias_tokens[i]; i++)
+    mem_adopt(MEM_NAMES, e->alias_tokens[i]);
+}
+
+/**
+ * names_set_function
+ *
+ * Define or replace a function, taking a reference to it.
+ */
+void names_set_function(shell_function_t *function)
+{
+  name_entry_t *e = get_entry(function->name);
+  function_ref(function);
+  function_unref(e->function);
+  e->function = function;
+}
+
+/**
+ * names_unalias
+ *
+ * Returns:
+ *   0 on success, -1 if name is not an alias.
+ */
+int names_unalias(const char *name)
+{
+  name_entry_t *e = find_entry(name);
+  if (!e || !e->alias)
+    return -1;
+  clear_alias(e);
+  drop_if_empty(name);
+  return 0;
+}
+
+/**
+ * names_unset_function
+ *
+ * Returns:
+ *   0 on success, -1 if name is not a function.
+ */
+int names_unset_function(const char *name)
+{
+  name_entry_t *e = find_entry(name);
+  if (!e || !e->function)
+    return -1;
+  function_unref(e->function);
+  e->function = NULL;
+  drop_if_empty(name);
+  return 0;
+}
+
+/**
+ * names_clear_aliases
+ *
+ * Remove every alias (`unalias -a`).
+ */
+void names_clear_aliases()
+{
+  for (unsigned i = 0; i < bucket_count; i++)
+  {
+    name_entry_t **link = &buckets[i];
+    while (*link)
+    {
+      name_entry_t *e = *link;
+      clear_alias(e);
+      if (e->function)
+      {
+        link = &e->next;
+        continue;
+      }
+      *link = e->next;
+      entry_count--;
+      mem_free(MEM_NAMES, e->name);
+      mem_free(MEM_NAMES, e);
+    }
+  }
+}
+
+static int by_name(const void *a, const void *b)
+{
+  return strcmp((*(name_entry_t *const *)a)->name, (*(name_entry_t *const *)b)->name);
+}
+
+// Collect the entries defining an alias (functions: 0) or a function
+// (functions: 1), sorted by name; the caller frees the array
+static name_entry_t **sorted_entries(int functions, unsigned *count)
+{
+  name_entry_t **list = malloc((entry_count + 1) * sizeof(name_entry_t *));
+  *count = 0;
+  for (unsigned i = 0; i < bucket_count; i++)
+  {
+    for (name_entry_t *e = buckets[i]; e; e = e->next)
+    {
+      if (functions ? e->function != NULL : e->alias != NULL)
+        list[(*count)++] = e;
+    }
+  }
+  qsort(list, *count, sizeof(name_entry_t *), by_name);
+  return list;
+}
+
+/**
+ * names_print_alias
+ *
+ * Print one alias in a form that can be read back.
+ *
+ * Returns:
+ *   0 on success, -1 if name is not an alias.
+ */
+int names_print_alias(FILE *out, const char *name)
+{
+  const name_entry_t *e = names_lookup(name);
+  if (!e || !e->alias)
+    return -1;
+  fprintf(out, "alias %s=\"%s\"\n", e->name, e->alias);
+  return 0;
+}
+
+void names_print_aliases(FILE *out)
+{
+  unsigned count;
+  name_entry_t **list = sorted_entries(0, &count);
+  for (unsigned i = 0; i < count; i++)
+    names_print_alias(out, list[i]->name);
+  free(list);
+}
+
+void names_print_functions(FILE *out)
+{
+  unsigned count;
+  name_entry_t **list = sorted_entries(1, &count);
+  for (unsigned i = 0; i < count; i++)
+    fprintf(out, "%s() { %s }\n", list[i]->name, list[i]->function->source);
+  free(list);
+}
+
+shell_function_t *function_ref(shell_function_t *function)
+{
+  if (function)
+    function->refs++;
+  return function;
+}
+
+/**
+ * function_unref
+ *
+ * Drop a reference to a function, freeing it and its parsed body with the
+ * last one.
+ */
+void function_unref(shell_function_t *function)
+{
+  if (!function || --function->refs > 0)
+    return;
+
+  for (int i = 0; function->body && function->body[i]; i++)
+    free_command(function->body[i]);
+  mem_free(MEM_NAMES, function->body);
+  mem_free(MEM_NAMES, function->source);
+  mem_free(MEM_NAMES, function->name);
+  mem_free(MEM_NAMES, function);
+}
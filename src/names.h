@@ -0,0 +1,49 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <stdio.h>
+
+#include "parser.h"
+
+/*
+ * Aliases and shell functions, kept in one hash table keyed by name so
+ * that the parser resolves a command word with a single lookup. An alias
+ * is stored as the tokens of its value, ready to be spliced into a command
+ * line. A function is stored as its parsed body and is reference counted:
+ * a running call keeps its body alive when the function is redefined.
+ */
+
+#define FUNCTION_MAX_DEPTH 100
+
+typedef struct shell_function
+{
+  int refs;
+  char *name;
+  char *source;     /* body text, for `functions` */
+  command_t **body; /* NULL-terminated pipelines, run in order */
+} shell_function_t;
+
+typedef struct name_entry
+{
+  char *name;
+  unsigned hash;
+  char *alias;         /* alias value, or NULL */
+  char **alias_tokens; /* the value tokenized once */
+  shell_function_t *function;
+  struct name_entry *next;
+} name_entry_t;
+
+const name_entry_t *names_lookup(const char *name);
+void names_set_alias(const char *name, const char *value);
+void names_set_function(shell_function_t *function);
+int names_unalias(const char *name);
+int names_unset_function(const char *name);
+void names_clear_aliases();
+int names_print_alias(FILE *out, const char *name);
+void names_print_aliases(FILE *out);
+void names_print_functions(FILE *out);
+
+shell_function_t *function_ref(shell_function_t *function);
+void function_unref(shell_function_t *function);
+
+#endif
@@ -0,0 +1,91 @@
+#include "options.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct option_def
+{
+  const char *name;
+  int value;
+  const char *help;
+} option_def_t;
+
+/*
+ * Shell options, toggled with `set -o name[=value]` / `set +o name`.
+ * Indexed by shell_option_t.
+ */
+static option_def_t options[OPT_COUNT] = {
+    [OPT_FUSION] = {"fusion", 1, "run adjacent builtin pipeline stages as threads"},
+    [OPT_DEADLINE] = {"deadline", 0, "seconds a background job may run before it is terminated (0: no limit)"},
+    [OPT_CACHE_SIZE] = {"cache_size", 64, "size bound of the `cache` output store in MiB (0: off)"},
+    [OPT_BATCH] = {"batch", 0, "split argument lists too long for exec into batches run N at a time (0: off)"},
+    [OPT_MAX_JOBS] = {"max_jobs", 0, "background jobs run at once, the rest wait in a queue (0: CPU count, fewer under load)"},
+    [OPT_JOB_PRIORITY] = {"job_priority", 0, "start queued background jobs by priority instead of in order"},
+};
+
+/**
+ * get_option
+ *
+ * Return the current value of a shell option (0 when disabled).
+ */
+int get_option(shell_option_t opt)
+{
+  return options[opt].value;
+}
+
+/**
+ * set_option
+ *
+ * Enable or disable an option by name.
+ *
+ * Parameters:
+ *   spec   - option name, optionally followed by "=value" to set a numeric
+ *            value instead of 1.
+ *   enable - non-zero for `set -o`, zero for `set +o`.
+ *
+ * Returns:
+ *   0 on success, -1 if the option is unknown or the value is malformed.
+ */
+int set_option(const char *spec, int enable)
+{
+  size_t len = strcspn(spec, "=");
+
+  for (int i = 0; i < OPT_COUNT; i++)
+  {
+    if (strlen(options[i].name) != len || strncmp(options[i].name, spec, len) != 0)
+      continue;
+
+    if (!enable)
+    {
+      options[i].value = 0;
+      return 0;
+    }
+
+    if (spec[len] == '\0')
+    {
+      options[i].value = 1;
+      return 0;
+    }
+
+    char *end;
+    long value = strtol(spec + len + 1, &end, 10);
+    if (end == spec + len + 1 || *end != '\0' || value < 0)
+      return -1;
+    options[i].value = (int)value;
+    return 0;
+  }
+  return -1;
+}
+
+/**
+ * print_options
+ *
+ * Write every option with its value and a short description.
+ */
+void print_options(FILE *out)
+{
+  for (int i = 0; i < OPT_COUNT; i++)
+  {
+    fprintf(out, "%-12s %-4d %s\n", options[i].name, options[i].value, options[i].help);
+  }
+}
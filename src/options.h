@@ -0,0 +1,21 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdio.h>
+
+typedef enum shell_option
+{
+  OPT_FUSION,
+  OPT_DEADLINE,
+  OPT_CACHE_SIZE,
+  OPT_BATCH,
+  OPT_MAX_JOBS,
+  OPT_JOB_PRIORITY,
+  OPT_COUNT
+} shell_option_t;
+
+int get_option(shell_option_t opt);
+int set_option(const char *spec, int enable);
+void print_options(FILE *out);
+
+#endif
@@ -1,4 +1,10 @@
 #include "parser.h"
+#include "builtins.h"
+#include "jobs.h"
+#include "memory.h"
+#include "metrics.h"
+#include "names.h"
+#include "trace.h"
 
 #include <ctype.h>
 #include <stdio.h>
@@ -17,8 +23,8 @@
  */
 static command_t *alloc_cmd()
 {
-  command_t *cmd = calloc(1, sizeof(command_t));
-  cmd->argv = calloc(MAX_TOKENS, sizeof(char *));
+  command_t *cmd = mem_calloc(MEM_PARSER, 1, sizeof(command_t));
+  cmd->argv = mem_calloc(MEM_PARSER, MAX_TOKENS, sizeof(char *));
   return cmd;
 }
 
@@ -56,7 +62,7 @@ static char *copy_token(const char *start, int len)
  *   - Frees each non-NULL string tokens[i] and then frees the array itself.
  *   - Safe to call with tokens == NULL (no-op).
  */
-static void free_tokens(char **tokens)
+void free_tokens(char **tokens)
 {
   for (int i = 0; tokens[i]; i++)
   {
@@ -65,6 +71,189 @@ static void free_tokens(char **tokens)
   free(tokens);
 }
 
+/**
+ * parse_timeout
+ *
+ * Recognise the `timeout [-k DURATION] DURATION` prefix of a command line.
+ *
+ * Parameters:
+ *   tokens - the tokens following the word "timeout".
+ *   cmd    - command that receives the deadline.
+ *
+ * Returns:
+ *   The number of tokens consumed, or 0 if this is not a timeout prefix
+ *   followed by a command (the external timeout then runs as usual).
+ */
+static int parse_timeout(char **tokens, command_t *cmd)
+{
+  int i = 0;
+  int64_t kill_after = JOB_KILL_AFTER_MS;
+
+  if (tokens[i] && strcmp(tokens[i], "-k") == 0)
+  {
+    if (!tokens[i + 1] || (kill_after = parse_duration(tokens[i + 1])) < 0)
+      return 0;
+    i += 2;
+  }
+
+  int64_t timeout = tokens[i] ? parse_duration(tokens[i]) : -1;
+  if (timeout < 0 || !tokens[i + 1])
+    return 0;
+
+  cmd->timeout_ms = timeout;
+  cmd->kill_after_ms = kill_after;
+  return i + 1;
+}
+
+#define MAX_ALIAS_DEPTH 16
+
+/**
+ * splice_alias
+ *
+ * Build the token list with tokens[i], an alias, replaced by the tokens of
+ * its value. Only pointers are copied: the strings stay owned by the
+ * original list and the alias.
+ *
+ * Returns:
+ *   A new array for the caller to free (not its strings).
+ */
+static char **splice_alias(char **tokens, int i, char **alias)
+{
+  int alias_count = 0, rest = 0;
+  while (alias[alias_count])
+    alias_count++;
+  while (tokens[i + 1 + rest])
+    rest++;
+
+  char **spliced = calloc(alias_count + rest + 1, sizeof(char *));
+  memcpy(spliced, alias, alias_count * sizeof(char *));
+  memcpy(spliced + alias_count, tokens + i + 1, rest * sizeof(char *));
+  return spliced;
+}
+
+/**
+ * delimiter_word
+ *
+ * The word that ends a here-document: its operand with any single quotes
+ * removed (the tokenizer has already removed double quotes). Nothing in it
+ * is expanded.
+ *
+ * Returns:
+ *   A heap-allocated copy for the caller to free.
+ */
+static char *delimiter_word(const char *token)
+{
+  char *word = malloc(strlen(token) + 1);
+  int len = 0;
+  for (; *token; token++)
+  {
+    if (*token != '\'' && *token != QUOTE_MARK)
+      word[len++] = *token;
+  }
+  word[len] = '\0';
+  return word;
+}
+
+/**
+ * here_doc_end
+ *
+ * Check whether a line ends a here-document: it holds the delimiter alone,
+ * up to its newline or the end of the text.
+ */
+int here_doc_end(const char *line, const char *delimiter)
+{
+  size_t len = strlen(delimiter);
+  return strncmp(line, delimiter, len) == 0 && (line[len] == '\0' || line[len] == '\n');
+}
+
+/**
+ * take_body
+ *
+ * Cut the next here-document body off the text that follows a command
+ * line: the lines up to the one holding only the delimiter.
+ *
+ * Parameters:
+ *   rest      - the remaining text; advanced past the delimiter line.
+ *   delimiter - the word that ends the body.
+ *
+ * Returns:
+ *   The body, each line with its newline, for the caller to free. If no
+ *   line ends it, the body is the rest of the text, as in other shells.
+ */
+static char *take_body(const char **rest, const char *delimiter)
+{
+  const char *start = *rest;
+
+  for (const char *p = start; *p;)
+  {
+    const char *newline = strchr(p, '\n');
+    const char *next = newline ? newline + 1 : p + strlen(p);
+    if (here_doc_end(p, delimiter))
+    {
+      *rest = next;
+      return copy_token(start, p - start);
+    }
+    p = next;
+  }
+
+  fprintf(stderr, "warning: here-document delimited by end of input (wanted '%s')\n", delimiter);
+  *rest = start + strlen(start);
+  return strdup(start);
+}
+
+/**
+ * here_doc_delimiters
+ *
+ * List the here-documents a command line starts, so that the caller can
+ * read their bodies from the lines that follow.
+ *
+ * Returns:
+ *   NULL if the line starts none, otherwise a NULL-terminated array of
+ *   their delimiters in order, to be freed with free_tokens().
+ */
+char **here_doc_delimiters(const char *line)
+{
+  if (!strstr(line, "<<"))
+    return NULL;
+
+  char **tokens = tokenize(line);
+  int count = 0;
+  while (tokens[count])
+    count++;
+  char **delimiters = calloc(count / 2 + 1, sizeof(char *));
+  count = 0;
+  for (int i = 0; tokens[i]; i++)
+  {
+    if (strcmp(tokens[i], "<<") == 0 && tokens[i + 1])
+      delimiters[count++] = delimiter_word(tokens[++i]);
+  }
+  free_tokens(tokens);
+
+  if (count == 0)
+  {
+    free(delimiters);
+    return NULL;
+  }
+  return delimiters;
+}
+
+/**
+ * set_input
+ *
+ * Make a stage read a file or a here-document body; the last of its input
+ * redirections counts. The stage takes over path and here_doc, from
+ * malloc().
+ */
+static void set_input(command_t *cmd, char *path, char *here_doc)
+{
+  mem_free(MEM_PARSER, cmd->input_redirect);
+  mem_free(MEM_PARSER, cmd->here_doc);
+  mem_adopt(MEM_PARSER, path);
+  mem_adopt(MEM_PARSER, here_doc);
+  cmd->input_redirect = path;
+  cmd->here_doc = here_doc;
+}
+
 /**
  * parse_tokens
  *
@@ -72,18 +261,29 @@ static void free_tokens(char **tokens)
  *
  * Parameters:
  *   tokens - NULL-terminated array of token strings.
+ *   bodies - the text after the command line, where the bodies of its
+ *            here-documents are taken from in order.
  *
  * Returns:
  *   A pointer to the head of a command_t structure representing the parsed
  *   command pipeline. Memory for command nodes and duplicated strings is
  *   allocated by parse_tokens and must be freed using free_command().
  */
-static command_t *parse_tokens(char **tokens)
+static command_t *parse_tokens(char **tokens, const char *bodies)
 {
   command_t *cmd = alloc_cmd();
   int argc = 0;
+  int argv_size = MAX_TOKENS; /* size of cur->argv */
 
   command_t *cur = cmd;
+  command_t *producer = NULL;
+  int branches = 0;
+
+  // Aliases being expanded for the current command word, which are not
+  // expanded again (alias ls="ls -F")
+  const name_entry_t *expanding[MAX_ALIAS_DEPTH];
+  int depth = 0;
+  char **spliced = NULL;
 
   for (int i = 0; tokens[i]; i++)
   {
@@ -94,13 +294,43 @@ static command_t *parse_tokens(char **tokens)
       break;
     }
 
-    if (strcmp(t, "<") == 0 && tokens[i + 1])
+    int consumed;
+    if (cur == cmd && argc == 0 && strcmp(t, "timeout") == 0 &&
+        (consumed = parse_timeout(tokens + i + 1, cur)) > 0)
+    {
+      i += consumed;
+    }
+    else if (cur == cmd && argc == 0 && strcmp(t, "cache") == 0 && tokens[i + 1])
+    {
+      cur->cached = 1;
+    }
+    else if (strcmp(t, "<") == 0 && tokens[i + 1])
     {
-      cur->input_redirect = strdup(tokens[++i]);
+      set_input(cur, strdup(tokens[++i]), NULL);
+    }
+    else if (strcmp(t, "<<") == 0 && tokens[i + 1])
+    {
+      char *delimiter = delimiter_word(tokens[++i]);
+      set_input(cur, NULL, take_body(&bodies, delimiter));
+      free(delimiter);
+    }
+    else if (strcmp(t, "<<<") == 0 && tokens[i + 1])
+    {
+      // A here-string is its word, taken literally, and a newline
+      char *body = malloc(strlen(tokens[++i]) + 2);
+      int len = 0;
+      for (const char *c = tokens[i]; *c; c++)
+      {
+        if (*c != QUOTE_MARK)
+          body[len++] = *c;
+      }
+      strcpy(body + len, "\n");
+      set_input(cur, NULL, body);
     }
     else if (strcmp(t, ">") == 0 && tokens[i + 1])
     {
-      cur->output_redirect = strdup(tokens[++i]);
+      mem_free(MEM_PARSER, cur->output_redirect);
+      cur->output_redirect = mem_strdup(MEM_PARSER, tokens[++i]);
     }
     else if (strcmp(t, "&") == 0)
     {
@@ -112,36 +342,221 @@ static command_t *parse_tokens(char **tokens)
       cur->pipe_to = alloc_cmd();
       cur = cur->pipe_to;
       argc = 0;
+      argv_size = MAX_TOKENS;
+    }
+    else if (strcmp(t, "|>") == 0)
+    {
+      // The stage before the first |> is the producer; every |> starts
+      // one more branch reading a copy of its output
+      cur->argv[argc] = NULL;
+      if (!producer)
+        producer = cur;
+      producer->branches = mem_realloc(MEM_PARSER, producer->branches, (branches + 2) * sizeof(command_t *));
+      cur = producer->branches[branches++] = alloc_cmd();
+      producer->branches[branches] = NULL;
+      argc = 0;
+      argv_size = MAX_TOKENS;
+    }
+    else if (argc == 0 && is_annotation(t))
+    {
+      // @name=value words in front of a stage set its process attributes
+      if (resources_add(&cur->resources, t) != 0)
+      {
+        fprintf(stderr, "syntax error: invalid annotation '%s'\n", t);
+        cur->syntax_error = 1;
+      }
     }
     else
     {
-      cur->argv[argc++] = strdup(t);
+      // The command word: one lookup finds its alias and its function
+      const name_entry_t *entry = argc == 0 ? names_lookup(t) : NULL;
+      if (entry && entry->alias)
+      {
+        int seen = 0;
+        for (int k = 0; k < depth; k++)
+          seen |= expanding[k] == entry;
+
+        char **next = NULL;
+        if (!seen && depth == MAX_ALIAS_DEPTH)
+        {
+          fprintf(stderr, "syntax error: alias '%s' expands too far\n", t);
+          cur->syntax_error = 1;
+        }
+        else if (!seen)
+        {
+          next = splice_alias(tokens, i, entry->alias_tokens);
+        }
+        if (next)
+        {
+          expanding[depth++] = entry;
+          free(spliced);
+          tokens = spliced = next;
+          i = -1;
+          continue;
+        }
+      }
+
+      if (argc == 0)
+      {
+        cur->function = entry ? function_ref(entry->function) : NULL;
+        depth = 0;
+      }
+      // Long lines and alias values may need more than MAX_TOKENS words
+      if (argc + 1 >= argv_size)
+      {
+        argv_size *= 2;
+        cur->argv = mem_realloc(MEM_PARSER, cur->argv, argv_size * sizeof(char *));
+      }
+      cur->argv[argc++] = mem_strdup(MEM_PARSER, t);
     }
   }
   cur->argv[argc] = NULL;
 
+  free(spliced);
   return cmd;
 }
 
+/**
+ * classify
+ *
+ * Decide how a command runs once cmd->function is known: a function call
+ * takes precedence over a builtin of the same name, except over the
+ * special builtins (cd, exit, set, ...).
+ */
+static void classify(command_t *cmd)
+{
+  cmd->builtin = builtin_lookup(cmd->argv);
+  if (cmd->function && cmd->builtin && builtin_is_special(cmd->builtin))
+  {
+    function_unref(cmd->function);
+    cmd->function = NULL;
+  }
+  if (cmd->function)
+    cmd->builtin = NULL;
+}
+
 /**
  * set_exec
  *
  * Mark whether a command should be executed via exec (external) or is a
- * builtin that should be handled internally.
+ * builtin that should be handled internally, looking its command word up
+ * again (for words that changed after parsing, such as a $(...) result).
  *
  * Parameters:
  *   cmd - pointer to a command_t whose argv[0] names the command.
  *
  * Behavior:
- *   - Sets cmd->is_exec to 0 for builtins "cd" and "exit", otherwise sets
- *     cmd->is_exec to 1.
+ *   - Sets cmd->builtin and cmd->function to what runs the command.
+ *   - Sets cmd->is_exec to 0 when a builtin handles the command (see
+ *     is_builtin()), otherwise sets cmd->is_exec to 1. A function call
+ *     counts as external: where it cannot run in the shell itself, it runs
+ *     in a child process like a program.
+ *   - An empty command (argv[0] == NULL) is treated as external; the
+ *     executor rejects it.
  */
-static void set_exec(command_t *cmd)
+void set_exec(command_t *cmd)
 {
-  if (strcmp(cmd->argv[0], "cd") == 0 || strcmp(cmd->argv[0], "exit") == 0 || strcmp(cmd->argv[0], "history") == 0)
-    cmd->is_exec = 0;
-  else
-    cmd->is_exec = 1;
+  const name_entry_t *entry = cmd->argv[0] ? names_lookup(cmd->argv[0]) : NULL;
+
+  function_unref(cmd->function);
+  cmd->function = entry ? function_ref(entry->function) : NULL;
+  classify(cmd);
+  cmd->is_exec = cmd->builtin == NULL;
+}
+
+/**
+ * mark_exec
+ *
+ * Classify every stage of a freshly parsed pipeline, fan-out branches
+ * included. The parser has already looked the command words up.
+ */
+static void mark_exec(command_t *cmd)
+{
+  for (command_t *cur = cmd; cur; cur = cur->pipe_to)
+  {
+    classify(cur);
+    cur->is_exec = cur->builtin == NULL;
+    for (int i = 0; cur->branches && cur->branches[i]; i++)
+      mark_exec(cur->branches[i]);
+  }
+}
+
+/**
+ * resolve_names
+ *
+ * Call set_exec() on every stage of a pipeline, fan-out branches included,
+ * so that a stored function body calls what is defined now.
+ */
+void resolve_names(command_t *cmd)
+{
+  for (command_t *cur = cmd; cur; cur = cur->pipe_to)
+  {
+    set_exec(cur);
+    for (int i = 0; cur->branches && cur->branches[i]; i++)
+      resolve_names(cur->branches[i]);
+  }
+}
+
+/**
+ * skip_quoted
+ *
+ * Find the double quote that closes the one at s[open]. A $(...) inside
+ * the quotes is skipped whole, so it may hold quotes of its own.
+ *
+ * Returns:
+ *   The index of the closing '"', or -1 if it is missing.
+ */
+static int skip_quoted(const char *s, int open)
+{
+  for (int i = open + 1; s[i]; i++)
+  {
+    if (s[i] == '"')
+      return i;
+    if (s[i] == '$' && s[i + 1] == '(')
+    {
+      i = find_closing_paren(s, i + 1);
+      if (i < 0)
+        return -1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * find_closing_paren
+ *
+ * Find the parenthesis matching the one at s[open], skipping nested pairs
+ * and double-quoted text (with any $(...) nested in it).
+ *
+ * Parameters:
+ *   s    - NULL terminated string.
+ *   open - index of a '(' in s.
+ *
+ * Returns:
+ *   The index of the matching ')', or -1 if it is missing.
+ */
+int find_closing_paren(const char *s, int open)
+{
+  int depth = 0;
+
+  for (int i = open; s[i]; i++)
+  {
+    if (s[i] == '"')
+    {
+      i = skip_quoted(s, i);
+      if (i < 0)
+        return -1;
+    }
+    else if (s[i] == '(')
+    {
+      depth++;
+    }
+    else if (s[i] == ')' && --depth == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
 }
 
 /**
@@ -158,53 +573,94 @@ static void set_exec(command_t *cmd)
  *   Each token is heap-allocated and the array itself is heap-allocated.
  *   The caller must free the result with free_tokens().
  */
-static char **tokenize(const char *input)
+char **tokenize(const char *input)
 {
-  char **tokens = calloc(MAX_TOKENS, sizeof(char *));
+  int size = MAX_TOKENS;
+  char **tokens = calloc(size, sizeof(char *));
   int t = 0;
 
   int i = 0, n = strlen(input);
 
   while (i < n)
   {
+    // Room for one more token and the NULL; the line may hold any number
+    if (t + 1 >= size)
+    {
+      size *= 2;
+      tokens = realloc(tokens, size * sizeof(char *));
+    }
+
     while (isspace(input[i]))
       i++;
 
     if (i == n)
       break;
 
-    // special operators
-    if (input[i] == '&' || input[i] == '|' || input[i] == '<' || input[i] == '>')
+    // special operators; "|>" fans a pipeline out to several branches
+    if (input[i] == '|' && input[i + 1] == '>')
+    {
+      tokens[t++] = copy_token(&input[i], 2);
+      i += 2;
+      continue;
+    }
+    // "<<" starts a here-document, "<<<" a here-string
+    if (input[i] == '<' && input[i + 1] == '<')
+    {
+      int len = input[i + 2] == '<' ? 3 : 2;
+      tokens[t++] = copy_token(&input[i], len);
+      i += len;
+      continue;
+    }
+    if (input[i] == '&' || input[i] == '|' || ((input[i] == '<' || input[i] == '>') && input[i + 1] != '('))
     {
       tokens[t++] = copy_token(&input[i], 1);
       i++;
       continue;
     }
 
-    // quoted string
-    if (input[i] == '"')
+    // a word; double-quoted parts may hold spaces and operators
+    // (alias ll="ls -l"), and $(...), <(...) and >(...) substitutions are
+    // kept whole and expanded later by the executor. Inside double quotes a
+    // $(...) gets a QUOTE_MARK in front, so that it expands to one field,
+    // and so does a <( or >(, which then stays literal text.
+    char *word = malloc(2 * (n - i) + 1);
+    int len = 0;
+    int quoted = 0;
+    while (i < n &&
+           (quoted ||
+            (!isspace(input[i]) &&
+             input[i] != '&' &&
+             input[i] != '|' &&
+             ((input[i] != '<' && input[i] != '>') || input[i + 1] == '('))))
     {
-      int start = ++i;
-      while (i < n && input[i] != '"')
+      if (input[i] == '"')
       {
+        quoted = !quoted;
         i++;
+        continue;
       }
-      tokens[t++] = copy_token(input + start, i - start);
-      i++;
-      continue;
+      if (quoted && (input[i] == '<' || input[i] == '>') && input[i + 1] == '(')
+      {
+        word[len++] = QUOTE_MARK;
+        word[len++] = input[i++];
+        continue;
+      }
+      if ((input[i] == '$' || input[i] == '<' || input[i] == '>') && input[i + 1] == '(')
+      {
+        int close = find_closing_paren(input, i + 1);
+        int end = close < 0 ? n : close + 1;
+        if (quoted)
+          word[len++] = QUOTE_MARK;
+        memcpy(word + len, input + i, end - i);
+        len += end - i;
+        i = end;
+        continue;
+      }
+      word[len++] = input[i++];
     }
 
-    // normal word
-    int start = i;
-    while (i < n &&
-           !isspace(input[i]) &&
-           input[i] != '&' &&
-           input[i] != '|' &&
-           input[i] != '<' &&
-           input[i] != '>')
-      i++;
-
-    tokens[t++] = copy_token(input + start, i - start);
+    word[len] = '\0';
+    tokens[t++] = word;
   }
 
   tokens[t] = NULL;
@@ -220,8 +676,10 @@ static char **tokenize(const char *input)
  *   cmd - pointer to the command_t to free (may be NULL).
  *
  * Behavior:
- *   - Frees argv strings, the argv array, input_redirect, output_redirect.
- *   - Recursively frees cmd->pipe_to (if non-NULL).
+ *   - Frees argv strings, the argv array, input_redirect, here_doc,
+ *     output_redirect and resources, and drops its function references.
+ *   - Recursively frees cmd->pipe_to (if non-NULL) and every fan-out
+ *     branch.
  *   - Finally frees the command_t itself.
  */
 void free_command(command_t *cmd)
@@ -230,26 +688,241 @@ void free_command(command_t *cmd)
     return;
 
   for (int i = 0; cmd->argv && cmd->argv[i]; i++)
-    free(cmd->argv[i]);
+    mem_free(MEM_PARSER, cmd->argv[i]);
 
-  free(cmd->argv);
-  free(cmd->input_redirect);
-  free(cmd->output_redirect);
+  mem_free(MEM_PARSER, cmd->argv);
+  mem_free(MEM_PARSER, cmd->input_redirect);
+  mem_free(MEM_PARSER, cmd->here_doc);
+  mem_free(MEM_PARSER, cmd->output_redirect);
+  resources_free(cmd->resources);
+  function_unref(cmd->function);
+  function_unref(cmd->defines);
 
   if (cmd->pipe_to)
     free_command(cmd->pipe_to);
 
-  free(cmd);
+  for (int i = 0; cmd->branches && cmd->branches[i]; i++)
+    free_command(cmd->branches[i]);
+  mem_free(MEM_PARSER, cmd->branches);
+
+  mem_free(MEM_PARSER, cmd);
+}
+
+/**
+ * set_argv
+ *
+ * Replace a stage's words, as after expansion. The stage takes over argv,
+ * a NULL-terminated array of strings from malloc(), and frees it with the
+ * rest of the command.
+ */
+void set_argv(command_t *cmd, char **argv)
+{
+  for (int i = 0; cmd->argv[i]; i++)
+    mem_free(MEM_PARSER, cmd->argv[i]);
+  mem_free(MEM_PARSER, cmd->argv);
+
+  cmd->argv = argv;
+  mem_adopt(MEM_PARSER, argv);
+  for (int i = 0; argv[i]; i++)
+    mem_adopt(MEM_PARSER, argv[i]);
+}
+
+/**
+ * set_path
+ *
+ * Replace one of a stage's redirection strings with value, from malloc().
+ */
+void set_path(char **path, char *value)
+{
+  mem_free(MEM_PARSER, *path);
+  mem_adopt(MEM_PARSER, value);
+  *path = value;
+}
+
+static char *copy_string(const char *s)
+{
+  return s ? mem_strdup(MEM_PARSER, s) : NULL;
+}
+
+/**
+ * copy_command
+ *
+ * Deep-copy a parsed command, pipeline stages and fan-out branches
+ * included, without tokenizing anything again.
+ *
+ * Returns:
+ *   The copy; free it with free_command().
+ */
+command_t *copy_command(const command_t *cmd)
+{
+  command_t *copy = mem_malloc(MEM_PARSER, sizeof(command_t));
+  *copy = *cmd;
+
+  int argc = 0;
+  while (cmd->argv[argc])
+    argc++;
+  copy->argv = mem_calloc(MEM_PARSER, argc < MAX_TOKENS ? MAX_TOKENS : argc + 1, sizeof(char *));
+  for (int i = 0; i < argc; i++)
+    copy->argv[i] = mem_strdup(MEM_PARSER, cmd->argv[i]);
+
+  copy->input_redirect = copy_string(cmd->input_redirect);
+  copy->here_doc = copy_string(cmd->here_doc);
+  copy->output_redirect = copy_string(cmd->output_redirect);
+  copy->resources = resources_copy(cmd->resources);
+  copy->function = function_ref(cmd->function);
+  copy->defines = function_ref(cmd->defines);
+  copy->pipe_to = cmd->pipe_to ? copy_command(cmd->pipe_to) : NULL;
+
+  if (cmd->branches)
+  {
+    int count = 0;
+    while (cmd->branches[count])
+      count++;
+    copy->branches = mem_calloc(MEM_PARSER, count + 1, sizeof(command_t *));
+    for (int i = 0; i < count; i++)
+      copy->branches[i] = copy_command(cmd->branches[i]);
+  }
+  return copy;
+}
+
+/**
+ * split_body
+ *
+ * Split a function body at the semicolons that are outside double quotes
+ * and $(...), <(...) and >(...) substitutions.
+ *
+ * Returns:
+ *   A NULL-terminated array of heap-allocated pieces, empty ones left out;
+ *   free it with free_tokens().
+ */
+static char **split_body(const char *body, int len)
+{
+  char **pieces = calloc(len / 2 + 2, sizeof(char *));
+  int count = 0, start = 0;
+
+  for (int i = 0; i <= len; i++)
+  {
+    if (i < len && body[i] == '"')
+    {
+      int close = skip_quoted(body, i);
+      i = close < 0 || close >= len ? len - 1 : close;
+    }
+    else if (i < len && (body[i] == '$' || body[i] == '<' || body[i] == '>') && body[i + 1] == '(')
+    {
+      int close = find_closing_paren(body, i + 1);
+      i = close < 0 || close >= len ? len - 1 : close;
+    }
+    else if (i == len || body[i] == ';')
+    {
+      int from = start, to = i;
+      while (from < to && isspace((unsigned char)body[from]))
+        from++;
+      while (to > from && isspace((unsigned char)body[to - 1]))
+        to--;
+      if (to > from)
+        pieces[count++] = copy_token(body + from, to - from);
+      start = i + 1;
+    }
+  }
+  return pieces;
+}
+
+/**
+ * parse_function
+ *
+ * Recognise a function definition, `NAME() { CMD; CMD; ... }`, on one
+ * line. Each command of the body is parsed here, once; calls run copies of
+ * the parsed commands.
+ *
+ * Returns:
+ *   NULL if input is not a definition. Otherwise a command whose defines
+ *   field holds the function, or which has syntax_error set.
+ */
+static command_t *parse_function(const char *input)
+{
+  const char *p = input;
+  while (isspace((unsigned char)*p))
+    p++;
+
+  const char *name = p;
+  if (!isalpha((unsigned char)*p) && *p != '_')
+    return NULL;
+  while (isalnum((unsigned char)*p) || *p == '_' || *p == '-')
+    p++;
+  int name_len = p - name;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (p[0] != '(' || p[1] != ')')
+    return NULL;
+  p += 2;
+  while (isspace((unsigned char)*p))
+    p++;
+
+  command_t *cmd = alloc_cmd();
+  const char *close = strrchr(p, '}');
+  const char *end = close ? close + 1 : NULL;
+  while (end && isspace((unsigned char)*end))
+    end++;
+  if (*p != '{' || !close || *end)
+  {
+    fprintf(stderr, "syntax error: expected NAME() { COMMANDS }\n");
+    cmd->syntax_error = 1;
+    return cmd;
+  }
+
+  char **pieces = split_body(p + 1, close - (p + 1));
+  int count = 0;
+  while (pieces[count])
+    count++;
+
+  // The definition belongs to the name table, which frees it
+  shell_function_t *fn = mem_calloc(MEM_NAMES, 1, sizeof(shell_function_t));
+  fn->refs = 1;
+  fn->name = mem_strndup(MEM_NAMES, name, name_len);
+  fn->body = mem_calloc(MEM_NAMES, count + 1, sizeof(command_t *));
+  for (int i = 0; i < count; i++)
+  {
+    fn->body[i] = parse_command(pieces[i]);
+    if (fn->body[i]->syntax_error || fn->body[i]->defines)
+      cmd->syntax_error = 1;
+  }
+
+  // The source, normalized to "CMD; CMD;", for listing
+  size_t size = 1;
+  for (int i = 0; i < count; i++)
+    size += strlen(pieces[i]) + 2;
+  fn->source = mem_calloc(MEM_NAMES, size, 1);
+  for (int i = 0; i < count; i++)
+  {
+    strcat(fn->source, pieces[i]);
+    strcat(fn->source, i + 1 < count ? "; " : ";");
+  }
+  free_tokens(pieces);
+
+  if (count == 0 || cmd->syntax_error)
+  {
+    if (count == 0)
+      fprintf(stderr, "syntax error: empty function body\n");
+    cmd->syntax_error = 1;
+    function_unref(fn);
+    return cmd;
+  }
+
+  cmd->defines = fn;
+  return cmd;
 }
 
 /**
  * parse_command
  *
  * High-level helper: tokenize an input string and parse it into a
- * command_t pipeline structure.
+ * command_t pipeline structure, or parse a function definition.
  *
  * Parameters:
- *   input - NULL terminated input command line string.
+ *   input - NULL terminated input command line string. If the line
+ *           starts here-documents, their bodies follow it on the next
+ *           lines of input, each ended by its delimiter line.
  *
  * Returns:
  *   A pointer to the parsed command_t structure (head of pipeline). The
@@ -257,16 +930,37 @@ void free_command(command_t *cmd)
  */
 command_t *parse_command(const char *input)
 {
-  char **tokens = tokenize(input);
-  command_t *cmd = parse_tokens(tokens);
+  int64_t start = metrics_now();
 
-  command_t *cur = cmd;
-  while (cur)
+  command_t *definition = parse_function(input);
+  if (definition)
   {
-    set_exec(cur);
-    cur = cur->pipe_to;
+    metrics_observe(METRIC_PARSE_TIME, metrics_now() - start);
+    return definition;
+  }
+
+  // Here-document bodies are not tokenized; they start on the next line
+  const char *bodies = "";
+  char *line = NULL;
+  const char *newline = strstr(input, "<<") ? strchr(input, '\n') : NULL;
+  if (newline)
+  {
+    line = copy_token(input, newline - input);
+    bodies = newline + 1;
   }
 
+  TRACE_BEGIN("tokenize", NULL);
+  char **tokens = tokenize(line ? line : input);
+  TRACE_END("tokenize");
+  free(line);
+
+  TRACE_BEGIN("parse", NULL);
+  command_t *cmd = parse_tokens(tokens, bodies);
+
+  mark_exec(cmd);
+  TRACE_END("parse");
+
   free_tokens(tokens);
+  metrics_observe(METRIC_PARSE_TIME, metrics_now() - start);
   return cmd;
 }
@@ -1,19 +1,51 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <stdint.h>
+
+#include "resources.h"
+
 #define MAX_TOKENS 128
 
+/* tokenize() puts this in front of a $(...), <( or >( inside double quotes */
+#define QUOTE_MARK '\x01'
+
+struct builtin;
+struct shell_function;
+
 typedef struct command
 {
   char **argv;
   char *input_redirect;
+  char *here_doc; /* body of a <<WORD here-document or <<< here-string */
   char *output_redirect;
   int background;
   int is_exec;
+  int syntax_error;
+  resources_t *resources;
+  int64_t timeout_ms;    /* `timeout` prefix: deadline of the whole job */
+  int64_t kill_after_ms; /* SIGTERM to SIGKILL grace period */
+  int cached;            /* `cache` prefix: replay stored output */
+  int expanded_first;    /* argv[expanded_first, expanded_end) came */
+  int expanded_end;      /* from $(...) substitutions */
+  const struct builtin *builtin;     /* builtin that runs it, if any */
+  struct shell_function *function;   /* function it calls, if any */
+  struct shell_function *defines;    /* `name() { ... }`: function to define */
   struct command *pipe_to;
+  struct command **branches; /* NULL-terminated fan-out (|>) consumers */
 } command_t;
 
 command_t *parse_command(const char *input);
 void free_command(command_t *cmd);
+command_t *copy_command(const command_t *cmd);
+void set_argv(command_t *cmd, char **argv);
+void set_path(char **path, char *value);
+void set_exec(command_t *cmd);
+void resolve_names(command_t *cmd);
+char **tokenize(const char *input);
+void free_tokens(char **tokens);
+int find_closing_paren(const char *s, int open);
+char **here_doc_delimiters(const char *line);
+int here_doc_end(const char *line, const char *delimiter);
 
 #endif
@@ -0,0 +1,210 @@
+#include "record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int record_fd = -1;
+
+/**
+ * record_start
+ *
+ * Start appending commands to a recording, stopping any current one.
+ *
+ * Returns:
+ *   0 on success, -1 with errno set if the file cannot be opened.
+ */
+int record_start(const char *path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+
+  record_stop();
+  record_fd = fd;
+  dprintf(record_fd, "# session pid %d\n", (int)getpid());
+  return 0;
+}
+
+void record_stop()
+{
+  if (record_fd >= 0)
+    close(record_fd);
+  record_fd = -1;
+}
+
+/**
+ * record_init
+ *
+ * Start recording to $SHELL_RECORD, if it is set.
+ */
+void record_init()
+{
+  const char *path = getenv("SHELL_RECORD");
+  if (path && path[0] && record_start(path) != 0)
+    fprintf(stderr, "record: %s: %s\n", path, strerror(errno));
+}
+
+// Append s to buf with \\, \t and \n escaped, up to a trailing newline
+static size_t escape(char *buf, const char *s)
+{
+  size_t len = 0;
+  for (; *s && !(*s == '\n' && s[1] == '\0'); s++)
+  {
+    if (*s == '\\' || *s == '\t' || *s == '\n')
+    {
+      buf[len++] = '\\';
+      buf[len++] = *s == '\t' ? 't' : *s == '\n' ? 'n' : '\\';
+    }
+    else
+      buf[len++] = *s;
+  }
+  return len;
+}
+
+/**
+ * record_command
+ *
+ * Append one command to the recording, if one is active. The record is
+ * written with a single write() so that shells sharing a file do not
+ * interleave their records.
+ *
+ * Parameters:
+ *   line       - the command line, with or without its trailing newline.
+ *   start_us   - wall-clock start time in microseconds.
+ *   cwd        - directory the command ran in.
+ *   latency_us - time until the shell was ready for the next command.
+ *   status     - exit status, or -1 if the command could not be executed.
+ */
+void record_command(const char *line, int64_t start_us, const char *cwd, int64_t latency_us, int status)
+{
+  if (record_fd < 0)
+    return;
+
+  char *buf = malloc(64 + 2 * (strlen(line) + strlen(cwd)));
+  size_t len = sprintf(buf, "%" PRId64 "\t%" PRId64 "\t%d\t", start_us, latency_us, status);
+  len += escape(buf + len, cwd);
+  buf[len++] = '\t';
+  len += escape(buf + len, line);
+  buf[len++] = '\n';
+
+  if (write(record_fd, buf, len) != (ssize_t)len)
+    fprintf(stderr, "record: write failed: %s\n", strerror(errno));
+  free(buf);
+}
+
+// Undo escape() in place
+static void unescape(char *s)
+{
+  char *out = s;
+  for (; *s; s++)
+  {
+    if (*s == '\\' && s[1])
+    {
+      s++;
+      *out++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+    }
+    else
+      *out++ = *s;
+  }
+  *out = '\0';
+}
+
+/**
+ * record_parse
+ *
+ * Parse one line of a recording in place. entry->cwd and entry->line point
+ * into text afterwards.
+ *
+ * Returns:
+ *   0 on success, -1 for a comment or a malformed line.
+ */
+int record_parse(char *text, record_entry_t *entry)
+{
+  char *fields[5];
+  text[strcspn(text, "\n")] = '\0';
+  if (text[0] == '#')
+    return -1;
+
+  for (int i = 0; i < 5; i++)
+  {
+    fields[i] = text;
+    text = i < 4 ? strchr(text, '\t') : NULL;
+    if (i < 4 && !text)
+      return -1;
+    if (text)
+      *text++ = '\0';
+  }
+
+  char *end;
+  entry->start_us = strtoll(fields[0], &end, 10);
+  if (*end)
+    return -1;
+  entry->latency_us = strtoll(fields[1], &end, 10);
+  if (*end)
+    return -1;
+  entry->status = strtol(fields[2], &end, 10);
+  if (*end)
+    return -1;
+  unescape(fields[3]);
+  unescape(fields[4]);
+  entry->cwd = fields[3];
+  entry->line = fields[4];
+  return 0;
+}
+
+/**
+ * record_load
+ *
+ * Read a whole recording, skipping comments and malformed lines.
+ *
+ * Returns:
+ *   The entries in file order, to be released with record_free(), or NULL
+ *   with errno set if the file cannot be read.
+ */
+record_entry_t *record_load(const char *path, int *count)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+
+  int cap = 64;
+  record_entry_t *entries = malloc(cap * sizeof(record_entry_t));
+  char *text = NULL;
+  size_t size = 0;
+  *count = 0;
+
+  while (getline(&text, &size, f) >= 0)
+  {
+    record_entry_t e;
+    if (record_parse(text, &e) != 0)
+      continue;
+    if (*count == cap)
+    {
+      cap *= 2;
+      entries = realloc(entries, cap * sizeof(record_entry_t));
+    }
+    e.cwd = strdup(e.cwd);
+    e.line = strdup(e.line);
+    entries[(*count)++] = e;
+  }
+
+  free(text);
+  fclose(f);
+  return entries;
+}
+
+void record_free(record_entry_t *entries, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    free(entries[i].cwd);
+    free(entries[i].line);
+  }
+  free(entries);
+}
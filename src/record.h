@@ -0,0 +1,39 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+/*
+ * Session recording for replay-based regression tests. With
+ * SHELL_RECORD=FILE every command line the shell runs is appended to FILE
+ * together with its start time, working directory, latency and exit
+ * status. bench/replay.c feeds a recording back through the shell and
+ * compares the latencies two builds produce.
+ *
+ * The file is text, one command per line:
+ *
+ *   START_US <TAB> LATENCY_US <TAB> STATUS <TAB> CWD <TAB> LINE
+ *
+ * START_US is wall-clock time in microseconds. In CWD and LINE a
+ * backslash, tab or newline is written as \\, \t or \n. Lines starting
+ * with '#' are comments.
+ */
+
+typedef struct record_entry
+{
+  int64_t start_us;
+  int64_t latency_us;
+  int status;
+  char *cwd;
+  char *line; /* without its trailing newline */
+} record_entry_t;
+
+void record_init();
+int record_start(const char *path);
+void record_stop();
+void record_command(const char *line, int64_t start_us, const char *cwd, int64_t latency_us, int status);
+int record_parse(char *text, record_entry_t *entry);
+record_entry_t *record_load(const char *path, int *count);
+void record_free(record_entry_t *entries, int count);
+
+#endif
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include "resources.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_LIMITS 16
+
+// From linux/ioprio.h, which older kernel headers lack
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+struct resources
+{
+  int has_cpus;
+  cpu_set_t cpus;
+  int has_nice;
+  int nice;
+  int ioprio; /* 0 when unset */
+  int limit_count;
+  struct
+  {
+    int resource;
+    struct rlimit value;
+  } limits[MAX_LIMITS];
+};
+
+/*
+ * Resource limits known to `ulimit` and @limit=, with the unit `ulimit`
+ * uses for them (bytes are given in KiB, as in bash).
+ */
+static const rlimit_def_t rlimits[] = {
+    {"core", 'c', RLIMIT_CORE, 1024, "core file size (KiB)"},
+    {"data", 'd', RLIMIT_DATA, 1024, "data segment size (KiB)"},
+    {"nice", 'e', RLIMIT_NICE, 1, "scheduling priority ceiling"},
+    {"fsize", 'f', RLIMIT_FSIZE, 1024, "file size (KiB)"},
+    {"memlock", 'l', RLIMIT_MEMLOCK, 1024, "locked memory (KiB)"},
+    {"rss", 'm', RLIMIT_RSS, 1024, "resident set size (KiB)"},
+    {"nofile", 'n', RLIMIT_NOFILE, 1, "open files"},
+    {"rtprio", 'r', RLIMIT_RTPRIO, 1, "real-time priority"},
+    {"stack", 's', RLIMIT_STACK, 1024, "stack size (KiB)"},
+    {"cpu", 't', RLIMIT_CPU, 1, "CPU time (seconds)"},
+    {"nproc", 'u', RLIMIT_NPROC, 1, "processes"},
+    {"as", 'v', RLIMIT_AS, 1024, "virtual memory (KiB)"},
+};
+
+/**
+ * rlimit_defs
+ *
+ * Return the table of known resource limits and its length.
+ */
+const rlimit_def_t *rlimit_defs(int *count)
+{
+  *count = sizeof(rlimits) / sizeof(rlimits[0]);
+  return rlimits;
+}
+
+/**
+ * find_rlimit
+ *
+ * Look up a resource limit by name (when name is not NULL) or by its
+ * `ulimit` flag letter.
+ *
+ * Returns:
+ *   The limit's definition, or NULL if it is unknown.
+ */
+const rlimit_def_t *find_rlimit(const char *name, char flag)
+{
+  for (size_t i = 0; i < sizeof(rlimits) / sizeof(rlimits[0]); i++)
+  {
+    if (name ? strcmp(rlimits[i].name, name) == 0 : rlimits[i].flag == flag)
+      return &rlimits[i];
+  }
+  return NULL;
+}
+
+/**
+ * parse_rlim
+ *
+ * Parse a limit value: a non-negative number in the given unit, or
+ * "unlimited".
+ *
+ * Returns:
+ *   0 on success, -1 if text is malformed.
+ */
+int parse_rlim(const char *text, rlim_t unit, rlim_t *value)
+{
+  if (strcmp(text, "unlimited") == 0)
+  {
+    *value = RLIM_INFINITY;
+    return 0;
+  }
+
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(text, &end, 10);
+  if (end == text || *end != '\0' || errno || !isdigit((unsigned char)text[0]))
+    return -1;
+  *value = n > RLIM_INFINITY / unit ? RLIM_INFINITY : (rlim_t)n * unit;
+  return 0;
+}
+
+/**
+ * parse_cpus
+ *
+ * Parse a CPU list such as "0,2-3" into set.
+ *
+ * Returns:
+ *   0 on success, -1 if the list is malformed or names no CPU.
+ */
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+  CPU_ZERO(set);
+
+  const char *p = list;
+  while (*p)
+  {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0)
+      return -1;
+    p = end;
+
+    if (*p == '-')
+    {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first)
+        return -1;
+      p = end;
+    }
+    if (last >= CPU_SETSIZE)
+      return -1;
+
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/**
+ * parse_ioprio
+ *
+ * Parse "rt[:LEVEL]", "be[:LEVEL]" or "idle" into an ioprio_set() value.
+ *
+ * Returns:
+ *   The value, or -1 if spec is malformed.
+ */
+static int parse_ioprio(const char *spec)
+{
+  static const char *classes[] = {"rt", "be", "idle"};
+  size_t len = strcspn(spec, ":");
+  int level = 4;
+
+  if (spec[len] == ':')
+  {
+    const char *num = spec + len + 1;
+    if (!isdigit((unsigned char)num[0]) || num[1] || num[0] > '7')
+      return -1;
+    level = num[0] - '0';
+  }
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (strlen(classes[i]) == len && strncmp(classes[i], spec, len) == 0)
+      return ((i + 1) << IOPRIO_CLASS_SHIFT) | (i == 2 ? 0 : level);
+  }
+  return -1;
+}
+
+/**
+ * parse_limit
+ *
+ * Parse "NAME:SOFT[:HARD]". A missing HARD sets both limits to SOFT.
+ *
+ * Returns:
+ *   0 on success, -1 if spec is malformed.
+ */
+static int parse_limit(const char *spec, int *resource, struct rlimit *value)
+{
+  char copy[64];
+  if (strlen(spec) >= sizeof(copy))
+    return -1;
+  strcpy(copy, spec);
+
+  char *soft = strchr(copy, ':');
+  if (!soft)
+    return -1;
+  *soft++ = '\0';
+  char *hard = strchr(soft, ':');
+  if (hard)
+    *hard++ = '\0';
+
+  const rlimit_def_t *def = find_rlimit(copy, 0);
+  if (!def || parse_rlim(soft, def->unit, &value->rlim_cur) != 0)
+    return -1;
+  value->rlim_max = value->rlim_cur;
+  if (hard && parse_rlim(hard, def->unit, &value->rlim_max) != 0)
+    return -1;
+  if (value->rlim_cur > value->rlim_max)
+    return -1;
+
+  *resource = def->resource;
+  return 0;
+}
+
+/**
+ * is_annotation
+ *
+ * Check whether a word is a resource annotation (@name=value).
+ */
+int is_annotation(const char *word)
+{
+  return word[0] == '@' && isalpha((unsigned char)word[1]) && strchr(word, '=');
+}
+
+/**
+ * resources_add
+ *
+ * Parse one annotation and merge it into *res, allocating it on first use.
+ * A later annotation of the same kind overrides an earlier one.
+ *
+ * Parameters:
+ *   res        - pointer to the command's resources (may point to NULL).
+ *   annotation - a word for which is_annotation() is true.
+ *
+ * Returns:
+ *   0 on success, -1 if the annotation is unknown or malformed.
+ */
+int resources_add(resources_t **res, const char *annotation)
+{
+  if (!*res)
+    *res = calloc(1, sizeof(resources_t));
+  resources_t *r = *res;
+
+  const char *value = strchr(annotation, '=') + 1;
+  size_t len = value - annotation - 2;
+  const char *name = annotation + 1;
+
+  if (len == 4 && strncmp(name, "cpus", 4) == 0)
+  {
+    if (parse_cpus(value, &r->cpus) != 0)
+      return -1;
+    r->has_cpus = 1;
+  }
+  else if (len == 4 && strncmp(name, "nice", 4) == 0)
+  {
+    char *end;
+    long nice = strtol(value, &end, 10);
+    if (end == value || *end || nice < -20 || nice > 19)
+      return -1;
+    r->nice = nice;
+    r->has_nice = 1;
+  }
+  else if (len == 6 && strncmp(name, "ioprio", 6) == 0)
+  {
+    int ioprio = parse_ioprio(value);
+    if (ioprio < 0)
+      return -1;
+    r->ioprio = ioprio;
+  }
+  else if (len == 5 && strncmp(name, "limit", 5) == 0)
+  {
+    int resource;
+    struct rlimit limit;
+    if (parse_limit(value, &resource, &limit) != 0)
+      return -1;
+
+    int i = 0;
+    while (i < r->limit_count && r->limits[i].resource != resource)
+      i++;
+    if (i == MAX_LIMITS)
+      return -1;
+    if (i == r->limit_count)
+      r->limit_count++;
+    r->limits[i].resource = resource;
+    r->limits[i].value = limit;
+  }
+  else
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * resources_apply
+ *
+ * Apply the attributes to the calling process. Meant for a freshly forked
+ * child, between setup_redirection() and exec; the shell itself is never
+ * changed.
+ *
+ * Returns:
+ *   0 on success, -1 on the first failure (errno is set and a message has
+ *   been written to stderr).
+ */
+int resources_apply(const resources_t *res)
+{
+  if (!res)
+    return 0;
+
+  if (res->has_cpus && sched_setaffinity(0, sizeof(res->cpus), &res->cpus) != 0)
+  {
+    perror("@cpus");
+    return -1;
+  }
+
+  if (res->has_nice && setpriority(PRIO_PROCESS, 0, res->nice) != 0)
+  {
+    perror("@nice");
+    return -1;
+  }
+
+  if (res->ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, res->ioprio) != 0)
+  {
+    perror("@ioprio");
+    return -1;
+  }
+
+  for (int i = 0; i < res->limit_count; i++)
+  {
+    if (setrlimit(res->limits[i].resource, &res->limits[i].value) != 0)
+    {
+      perror("@limit");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * resources_copy
+ *
+ * Duplicate a set of resources (NULL gives NULL).
+ */
+resources_t *resources_copy(const resources_t *res)
+{
+  if (!res)
+    return NULL;
+
+  resources_t *copy = malloc(sizeof(resources_t));
+  *copy = *res;
+  return copy;
+}
+
+/**
+ * resources_nice
+ *
+ * Return the @nice value of a set of resources, 0 if it has none.
+ */
+int resources_nice(const resources_t *res)
+{
+  return res && res->has_nice ? res->nice : 0;
+}
+
+/**
+ * resources_free
+ *
+ * Free resources returned through resources_add() (NULL is a no-op).
+ */
+void resources_free(resources_t *res)
+{
+  free(res);
+}
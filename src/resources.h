@@ -0,0 +1,38 @@
+#ifndef RESOURCES_H
+#define RESOURCES_H
+
+#include <sys/resource.h>
+
+/*
+ * Per-command process attributes, written as annotations in front of a
+ * command or pipeline stage and applied in the child before exec:
+ *
+ *   @cpus=LIST                  CPU affinity, taskset -c style (0,2-3)
+ *   @nice=N                     scheduling priority (-20..19)
+ *   @ioprio=CLASS[:LEVEL]       I/O priority: rt, be or idle; level 0-7
+ *   @limit=NAME:SOFT[:HARD]     resource limit, NAME as in `ulimit -a`
+ */
+
+typedef struct resources resources_t;
+
+typedef struct rlimit_def
+{
+  const char *name;
+  char flag;
+  int resource;
+  rlim_t unit;
+  const char *help;
+} rlimit_def_t;
+
+int is_annotation(const char *word);
+int resources_add(resources_t **res, const char *annotation);
+int resources_apply(const resources_t *res);
+resources_t *resources_copy(const resources_t *res);
+int resources_nice(const resources_t *res);
+void resources_free(resources_t *res);
+
+const rlimit_def_t *rlimit_defs(int *count);
+const rlimit_def_t *find_rlimit(const char *name, char flag);
+int parse_rlim(const char *text, rlim_t unit, rlim_t *value);
+
+#endif
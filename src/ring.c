@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include "ring.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define RING_SPIN 128
+
+/*
+ * Single-producer/single-consumer byte ring.
+ *
+ * `head` is only advanced by the producer and `tail` only by the consumer,
+ * both as free-running byte counters, so the fast path is lock free. A side
+ * that finds the ring full (or empty) spins briefly and then sleeps on a
+ * condition variable; the other side only takes the mutex when `sleepers`
+ * says someone is actually waiting.
+ *
+ * The ring is freed when both sides have closed it.
+ */
+struct ring
+{
+  char *buf;
+  size_t cap;
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  _Atomic int writer_closed;
+  _Atomic int reader_closed;
+  _Atomic int sleepers;
+  _Atomic int refs;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/**
+ * ring_create
+ *
+ * Allocate a ring.
+ *
+ * Parameters:
+ *   capacity - buffer size in bytes, rounded up to a power of two.
+ *
+ * Returns:
+ *   A new ring with one reference for each side, or NULL on allocation
+ *   failure.
+ */
+ring_t *ring_create(size_t capacity)
+{
+  size_t cap = 4096;
+  while (cap < capacity)
+    cap *= 2;
+
+  ring_t *r = calloc(1, sizeof(*r));
+  if (!r)
+    return NULL;
+
+  r->buf = malloc(cap);
+  if (!r->buf)
+  {
+    free(r);
+    return NULL;
+  }
+
+  r->cap = cap;
+  atomic_init(&r->refs, 2);
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  return r;
+}
+
+static void ring_unref(ring_t *r)
+{
+  if (atomic_fetch_sub(&r->refs, 1) == 1)
+  {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->buf);
+    free(r);
+  }
+}
+
+/**
+ * ring_wake
+ *
+ * Wake the other side if it is asleep. Must be called after publishing a
+ * new head/tail or a close flag.
+ */
+static void ring_wake(ring_t *r)
+{
+  if (atomic_load(&r->sleepers) > 0)
+  {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+/**
+ * ring_wait
+ *
+ * Block until *idx moves away from `seen` or either side closes.
+ */
+static void ring_wait(ring_t *r, _Atomic size_t *idx, size_t seen)
+{
+  for (int i = 0; i < RING_SPIN; i++)
+  {
+    if (atomic_load_explicit(idx, memory_order_acquire) != seen ||
+        atomic_load(&r->writer_closed) || atomic_load(&r->reader_closed))
+      return;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  atomic_fetch_add(&r->sleepers, 1);
+  while (atomic_load(idx) == seen && !atomic_load(&r->writer_closed) && !atomic_load(&r->reader_closed))
+    pthread_cond_wait(&r->cond, &r->lock);
+  atomic_fetch_sub(&r->sleepers, 1);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * ring_write
+ *
+ * Copy n bytes into the ring, blocking while it is full.
+ *
+ * Returns:
+ *   The number of bytes written; less than n only if the reader closed.
+ */
+size_t ring_write(ring_t *r, const void *src, size_t n)
+{
+  const char *p = src;
+  size_t done = 0;
+
+  while (done < n)
+  {
+    if (atomic_load(&r->reader_closed))
+      break;
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t space = r->cap - (head - tail);
+    if (space == 0)
+    {
+      ring_wait(r, &r->tail, tail);
+      continue;
+    }
+
+    size_t chunk = n - done < space ? n - done : space;
+    size_t at = head & (r->cap - 1);
+    size_t first = chunk < r->cap - at ? chunk : r->cap - at;
+    memcpy(r->buf + at, p + done, first);
+    memcpy(r->buf, p + done + first, chunk - first);
+
+    if (head == 0)
+      TRACE_INSTANT("first_byte", "ring", chunk);
+    atomic_store(&r->head, head + chunk);
+    ring_wake(r);
+    done += chunk;
+  }
+  return done;
+}
+
+/**
+ * ring_read
+ *
+ * Copy up to n bytes out of the ring, blocking while it is empty.
+ *
+ * Returns:
+ *   The number of bytes read, or 0 once the writer has closed and the ring
+ *   is drained.
+ */
+size_t ring_read(ring_t *r, void *dst, size_t n)
+{
+  char *p = dst;
+
+  for (;;)
+  {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (head != tail)
+    {
+      size_t avail = head - tail;
+      size_t chunk = n < avail ? n : avail;
+      size_t at = tail & (r->cap - 1);
+      size_t first = chunk < r->cap - at ? chunk : r->cap - at;
+      memcpy(p, r->buf + at, first);
+      memcpy(p + first, r->buf, chunk - first);
+
+      atomic_store(&r->tail, tail + chunk);
+      ring_wake(r);
+      return chunk;
+    }
+
+    if (atomic_load(&r->writer_closed))
+    {
+      // The writer may have published data just before closing
+      if (atomic_load(&r->head) == tail)
+        return 0;
+      continue;
+    }
+
+    ring_wait(r, &r->head, head);
+  }
+}
+
+/**
+ * ring_close_writer
+ *
+ * Signal end of data. Drops the writer's reference.
+ */
+void ring_close_writer(ring_t *r)
+{
+  atomic_store(&r->writer_closed, 1);
+  ring_wake(r);
+  ring_unref(r);
+}
+
+/**
+ * ring_close_reader
+ *
+ * Stop consuming; further writes fail as with a broken pipe. Drops the
+ * reader's reference.
+ */
+void ring_close_reader(ring_t *r)
+{
+  atomic_store(&r->reader_closed, 1);
+  ring_wake(r);
+  ring_unref(r);
+}
+
+static ssize_t cookie_read(void *cookie, char *buf, size_t size)
+{
+  return ring_read(cookie, buf, size);
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+  size_t n = ring_write(cookie, buf, size);
+  if (n < size)
+  {
+    errno = EPIPE;
+    return -1;
+  }
+  return n;
+}
+
+static int cookie_close_reader(void *cookie)
+{
+  ring_close_reader(cookie);
+  return 0;
+}
+
+static int cookie_close_writer(void *cookie)
+{
+  ring_close_writer(cookie);
+  return 0;
+}
+
+/**
+ * ring_fopen
+ *
+ * Wrap one side of the ring in a stdio stream so builtins can use it like
+ * any other FILE. Closing the stream closes that side of the ring.
+ *
+ * Parameters:
+ *   r    - the ring.
+ *   mode - "r" for the consumer side, "w" for the producer side.
+ *
+ * Returns:
+ *   A FILE* or NULL on error.
+ */
+FILE *ring_fopen(ring_t *r, const char *mode)
+{
+  cookie_io_functions_t io = {0};
+
+  if (mode[0] == 'r')
+  {
+    io.read = cookie_read;
+    io.close = cookie_close_reader;
+  }
+  else
+  {
+    io.write = cookie_write;
+    io.close = cookie_close_writer;
+  }
+  return fopencookie(r, mode, io);
+}
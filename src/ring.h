@@ -0,0 +1,16 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct ring ring_t;
+
+ring_t *ring_create(size_t capacity);
+size_t ring_write(ring_t *r, const void *src, size_t n);
+size_t ring_read(ring_t *r, void *dst, size_t n);
+void ring_close_writer(ring_t *r);
+void ring_close_reader(ring_t *r);
+FILE *ring_fopen(ring_t *r, const char *mode);
+
+#endif
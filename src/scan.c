@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include "scan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#define AVX2 __attribute__((target("avx2,popcnt")))
+#endif
+
+#define READ_SIZE (1 << 20)
+#define STREAM_READ_SIZE (64 * 1024)
+#define MAP_BLOCK (16 << 20)
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+#ifdef SCAN_X86
+static int have_avx2()
+{
+  // Racing threads store the same value
+  static int cached = -1;
+  if (cached < 0)
+    cached = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+  return cached;
+}
+#endif
+
+/**
+ * match_bits
+ *
+ * Return a word with the high bit set in every byte of word that equals c
+ * (the other bits clear). Exact, unlike the usual has-zero-byte test,
+ * because the low seven bits are added without carrying into the next byte.
+ */
+static uint64_t match_bits(uint64_t word, char c)
+{
+  uint64_t x = word ^ (ONES * (unsigned char)c);
+  uint64_t t = ((x & ~HIGHS) + ~HIGHS) | x;
+  return ~t & HIGHS;
+}
+
+static size_t count_scalar(const char *p, size_t len, char c)
+{
+  size_t count = 0, i = 0;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, p + i, 8);
+    count += __builtin_popcountll(match_bits(word, c));
+  }
+  for (; i < len; i++)
+    count += p[i] == c;
+  return count;
+}
+
+#ifdef SCAN_X86
+AVX2 static size_t count_avx2(const char *p, size_t len, char c)
+{
+  const __m256i needle = _mm256_set1_epi8(c);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t count = 0, i = 0;
+
+  while (len - i >= 32)
+  {
+    // Each byte lane counts up to 255 matches before it is summed
+    size_t blocks = (len - i) / 32;
+    if (blocks > 255)
+      blocks = 255;
+
+    __m256i lanes = zero;
+    for (size_t b = 0; b < blocks; b++, i += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(v, needle));
+    }
+
+    __m256i sums = _mm256_sad_epu8(lanes, zero);
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) + _mm256_extract_epi64(sums, 2) +
+             _mm256_extract_epi64(sums, 3);
+  }
+  return count + count_scalar(p + i, len - i, c);
+}
+#endif
+
+/**
+ * scan_count
+ *
+ * Count the bytes equal to c in p[0..len).
+ */
+size_t scan_count(const char *p, size_t len, char c)
+{
+#ifdef SCAN_X86
+  if (have_avx2())
+    return count_avx2(p, len, c);
+#endif
+  return count_scalar(p, len, c);
+}
+
+static const char *nth_scalar(const char *p, size_t len, char c, size_t *n)
+{
+  const char *end = p + len;
+  while (*n > 0 && (p = memchr(p, c, end - p)))
+  {
+    if (--*n == 0)
+      return p;
+    p++;
+  }
+  return NULL;
+}
+
+#ifdef SCAN_X86
+AVX2 static const char *nth_avx2(const char *p, size_t len, char c, size_t *n)
+{
+  const __m256i needle = _mm256_set1_epi8(c);
+  size_t i = 0;
+
+  for (; i + 32 <= len && *n > 0; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+    size_t found = __builtin_popcount(mask);
+    if (found < *n)
+    {
+      *n -= found;
+      continue;
+    }
+
+    // Drop the matches before the one wanted
+    for (size_t k = 1; k < *n; k++)
+      mask &= mask - 1;
+    *n = 0;
+    return p + i + __builtin_ctz(mask);
+  }
+  return nth_scalar(p + i, len - i, c, n);
+}
+#endif
+
+/**
+ * scan_nth
+ *
+ * Find the *n-th byte equal to c in p[0..len).
+ *
+ * Returns:
+ *   A pointer to it with *n set to 0, or NULL with *n reduced by the
+ *   number of matches seen, so the search can go on in the next block.
+ */
+const char *scan_nth(const char *p, size_t len, char c, size_t *n)
+{
+  if (*n == 0)
+    return NULL;
+#ifdef SCAN_X86
+  if (have_avx2())
+    return nth_avx2(p, len, c, n);
+#endif
+  return nth_scalar(p, len, c, n);
+}
+
+#ifdef SCAN_X86
+/*
+ * Substring search: compare the needle's first and last bytes against 32
+ * candidate positions at once and check the middle only where both match.
+ * Rare byte pairs make false candidates rare, so most of the input is
+ * skipped 32 bytes at a time.
+ */
+AVX2 static const char *find_avx2(const char *p, size_t len, const char *needle, size_t needle_len)
+{
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+  size_t i = 0;
+
+  for (; i + needle_len - 1 + 32 <= len; i += 32)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + needle_len - 1));
+    uint32_t mask =
+        (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+    while (mask)
+    {
+      const char *candidate = p + i + __builtin_ctz(mask);
+      if (memcmp(candidate + 1, needle + 1, needle_len - 2) == 0)
+        return candidate;
+      mask &= mask - 1;
+    }
+  }
+  return memmem(p + i, len - i, needle, needle_len);
+}
+#endif
+
+/**
+ * scan_find
+ *
+ * Find the first occurrence of needle in p[0..len).
+ *
+ * Returns:
+ *   A pointer to it, or NULL. An empty needle matches at p.
+ */
+const char *scan_find(const char *p, size_t len, const char *needle, size_t needle_len)
+{
+  if (needle_len == 0)
+    return p;
+  if (needle_len == 1)
+    return memchr(p, needle[0], len);
+  if (needle_len > len)
+    return NULL;
+#ifdef SCAN_X86
+  if (have_avx2())
+    return find_avx2(p, len, needle, needle_len);
+#endif
+  return memmem(p, len, needle, needle_len);
+}
+
+static const char *find2_scalar(const char *p, const char *end, char a, char b)
+{
+  for (; p + 8 <= end; p += 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    uint64_t bits = match_bits(word, a) | match_bits(word, b);
+    if (bits)
+    {
+      for (int k = 0; k < 8; k++)
+      {
+        if (p[k] == a || p[k] == b)
+          return p + k;
+      }
+    }
+  }
+  for (; p < end; p++)
+  {
+    if (*p == a || *p == b)
+      return p;
+  }
+  return NULL;
+}
+
+#ifdef SCAN_X86
+AVX2 static const char *find2_avx2(const char *p, const char *end, char a, char b)
+{
+  const __m256i va = _mm256_set1_epi8(a);
+  const __m256i vb = _mm256_set1_epi8(b);
+
+  for (; end - p >= 32; p += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t mask =
+        (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return find2_scalar(p, end, a, b);
+}
+#endif
+
+/**
+ * scan_find2
+ *
+ * Find the first byte in [p, end) equal to a or b, such as the next field
+ * delimiter or newline.
+ *
+ * Returns:
+ *   A pointer to it, or NULL.
+ */
+const char *scan_find2(const char *p, const char *end, char a, char b)
+{
+#ifdef SCAN_X86
+  if (have_avx2())
+    return find2_avx2(p, end, a, b);
+#endif
+  return find2_scalar(p, end, a, b);
+}
+
+/*
+ * Interrupting readers. The shell ignores SIGINT, so a filter that runs in
+ * the shell process catches it instead, for as long as it runs: the
+ * handler sets a flag and writes to a pipe that blocking reads also wait
+ * on, whichever thread the signal is delivered to. The pipe is made the
+ * first time a read could block and kept from then on.
+ */
+static volatile sig_atomic_t interrupted;
+static int catching;
+static int interrupt_pipe[2] = {-1, -1};
+static volatile int interrupt_fd = -1; /* write end, once the pipe exists */
+static struct sigaction saved_sigint;
+
+static void on_interrupt(int sig)
+{
+  int saved_errno = errno;
+  interrupted = 1;
+  // Fails only when the pipe is full of earlier interrupts
+  if (interrupt_fd >= 0)
+    write(interrupt_fd, "", 1);
+  errno = saved_errno;
+}
+
+/**
+ * reader_catch_interrupt
+ *
+ * Start (on != 0) or stop letting SIGINT end the input of every reader.
+ * While it is on, a Ctrl-C makes reader_next() return 0 as if the input
+ * had ended.
+ */
+void reader_catch_interrupt(int on)
+{
+  if (!on)
+  {
+    if (catching)
+      sigaction(SIGINT, &saved_sigint, NULL);
+    catching = 0;
+    return;
+  }
+
+  char drain[64];
+  while (interrupt_pipe[0] >= 0 && read(interrupt_pipe[0], drain, sizeof(drain)) > 0)
+    ;
+  interrupted = 0;
+
+  // No SA_RESTART: a blocked read returns early
+  struct sigaction sa = {0};
+  sa.sa_handler = on_interrupt;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &saved_sigint);
+  catching = 1;
+}
+
+/**
+ * reader_interrupted
+ *
+ * Returns:
+ *   Non-zero if SIGINT arrived since reader_catch_interrupt() turned on.
+ */
+int reader_interrupted()
+{
+  return interrupted;
+}
+
+/**
+ * reader_open
+ *
+ * Start reading in. A regular file with at least READ_SIZE bytes left is
+ * mapped from its current offset; otherwise the fd is read directly, or
+ * the stream itself when it has no fd. Input already buffered in the
+ * stream is not seen, so in must be fresh.
+ *
+ * Parameters:
+ *   r     - the reader.
+ *   in    - the input.
+ *   whole - non-zero if the caller reads all the input; a mapping is then
+ *           populated up front instead of faulting in page by page.
+ */
+void reader_open(block_reader_t *r, FILE *in, int whole)
+{
+  memset(r, 0, sizeof(*r));
+  r->stream = in;
+  r->fd = fileno(in);
+
+  struct stat st;
+  off_t offset;
+  if (r->fd < 0 || fstat(r->fd, &st) != 0)
+    return;
+  r->may_block = !S_ISREG(st.st_mode);
+  if (r->may_block || (offset = lseek(r->fd, 0, SEEK_CUR)) < 0 || st.st_size - offset < READ_SIZE)
+    return;
+
+  // Populating the whole mapping up front cannot be interrupted; while
+  // interrupts are caught, each block is populated as it is handed out
+  off_t aligned = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+  int flags = MAP_PRIVATE | (whole && !catching ? MAP_POPULATE : 0);
+  r->populate = whole && catching;
+  void *map = mmap(NULL, st.st_size - aligned, PROT_READ, flags, r->fd, aligned);
+  if (map == MAP_FAILED)
+    return;
+
+  madvise(map, st.st_size - aligned, MADV_SEQUENTIAL);
+  r->map = map;
+  r->map_size = st.st_size - aligned;
+  r->map_data = r->map + (offset - aligned);
+  r->map_len = st.st_size - offset;
+  r->map_offset = offset;
+}
+
+static ssize_t read_more(block_reader_t *r, char *dst, size_t size)
+{
+  if (r->fd < 0)
+  {
+    // stdio waits for a full buffer; keep requests small to keep streaming
+    size_t n = fread(dst, 1, size < STREAM_READ_SIZE ? size : STREAM_READ_SIZE, r->stream);
+    return n > 0 ? (ssize_t)n : -1;
+  }
+
+  ssize_t n;
+  do
+  {
+    if (catching && r->may_block && (interrupt_pipe[0] >= 0 || pipe2(interrupt_pipe, O_CLOEXEC | O_NONBLOCK) == 0))
+    {
+      // Wait for input or an interrupt, whichever comes first. One that
+      // came before the pipe existed has set the flag.
+      interrupt_fd = interrupt_pipe[1];
+      struct pollfd fds[2] = {{r->fd, POLLIN, 0}, {interrupt_pipe[0], POLLIN, 0}};
+      if (!interrupted && poll(fds, 2, -1) < 0 && errno != EINTR)
+        return -1;
+    }
+    if (interrupted)
+      return -1;
+    n = read(r->fd, dst, size);
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+/**
+ * reader_next
+ *
+ * Return the next block of input in *block. A block ends just after a
+ * newline, except for the last one when the input does not end in a
+ * newline; it stays valid until the next call.
+ *
+ * Returns:
+ *   The block's length, 0 at the end of the input.
+ */
+size_t reader_next(block_reader_t *r, const char **block)
+{
+  if (interrupted)
+    return 0;
+
+  if (r->map)
+  {
+    // MAP_BLOCK at a time, so that an interrupt is seen between blocks
+    size_t left = r->map_len - r->map_pos;
+    if (left == 0)
+      return 0;
+    const char *start = r->map_data + r->map_pos;
+    size_t len = left;
+    if (left > MAP_BLOCK)
+    {
+      const char *nl = memrchr(start, '\n', MAP_BLOCK);
+      if (!nl)
+        nl = memchr(start + MAP_BLOCK, '\n', left - MAP_BLOCK);
+      len = nl ? (size_t)(nl + 1 - start) : left;
+    }
+#ifdef MADV_POPULATE_READ
+    if (r->populate)
+    {
+      uintptr_t page = sysconf(_SC_PAGESIZE), from = (uintptr_t)start & ~(page - 1);
+      madvise((void *)from, (uintptr_t)start + len - from, MADV_POPULATE_READ);
+    }
+#endif
+    r->map_pos += len;
+    *block = start;
+    return len;
+  }
+
+  // Keep the partial last line of the previous block; it has no newline
+  if (r->start > 0)
+  {
+    memmove(r->buf, r->buf + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+  }
+  size_t scanned = r->len;
+
+  for (;;)
+  {
+    const char *nl = r->len > scanned ? memrchr(r->buf + scanned, '\n', r->len - scanned) : NULL;
+    if (nl || (r->eof && r->len > 0))
+    {
+      r->start = nl ? nl + 1 - r->buf : r->len;
+      *block = r->buf;
+      return r->start;
+    }
+    if (r->eof)
+      return 0;
+
+    // One line longer than the buffer: grow it
+    if (r->len == r->cap)
+    {
+      r->cap = r->cap ? r->cap * 2 : READ_SIZE;
+      r->buf = realloc(r->buf, r->cap);
+    }
+
+    scanned = r->len;
+    ssize_t n = read_more(r, r->buf + r->len, r->cap - r->len);
+    if (n <= 0)
+      r->eof = 1;
+    else
+      r->len += n;
+  }
+}
+
+/**
+ * reader_close
+ *
+ * Release the reader. When the input is seekable, its offset is moved back
+ * over the last unused bytes of the last block and anything read past it,
+ * so a following command reads on from there (as after head(1)).
+ */
+void reader_close(block_reader_t *r, size_t unused)
+{
+  if (r->map)
+  {
+    lseek(r->fd, r->map_offset + r->map_pos - unused, SEEK_SET);
+    munmap(r->map, r->map_size);
+  }
+  else if (r->fd >= 0 && unused + (r->len - r->start) > 0)
+  {
+    // Fails harmlessly on pipes
+    lseek(r->fd, -(off_t)(unused + (r->len - r->start)), SEEK_CUR);
+  }
+  free(r->buf);
+}
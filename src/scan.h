@@ -0,0 +1,51 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Byte scanning kernels and block input for the text-filter builtins
+ * (head, wc, grep -F, cut). On x86-64 the kernels use AVX2 when the CPU
+ * has it, 32 bytes per step; elsewhere they fall back to word-at-a-time
+ * code and the C library's memchr/memmem.
+ *
+ * A block reader hands out input in large blocks that always end at a line
+ * boundary: a regular file is mmap'd and returned as one block, anything
+ * else is read in 1 MiB chunks, or through stdio when the stream has no
+ * fd (a fused pipeline's ring buffer). A large mapping is handed out in
+ * 16 MiB blocks.
+ */
+
+size_t scan_count(const char *p, size_t len, char c);
+const char *scan_nth(const char *p, size_t len, char c, size_t *n);
+const char *scan_find(const char *p, size_t len, const char *needle, size_t needle_len);
+const char *scan_find2(const char *p, const char *end, char a, char b);
+
+typedef struct block_reader
+{
+  FILE *stream;
+  int fd;
+  off_t map_offset; /* file offset of map_data, for giving back unused input */
+  char *map;
+  size_t map_size;
+  const char *map_data;
+  size_t map_len;
+  size_t map_pos; /* bytes of the mapping handed out */
+  int populate;   /* populate each block of the mapping as it goes out */
+  int may_block;  /* fd is a pipe, terminal or the like, not a file */
+  char *buf;
+  size_t cap;
+  size_t len;   /* bytes in buf */
+  size_t start; /* start of the part of buf not yet returned */
+  int eof;
+} block_reader_t;
+
+void reader_open(block_reader_t *r, FILE *in, int whole);
+size_t reader_next(block_reader_t *r, const char **block);
+void reader_close(block_reader_t *r, size_t unused);
+void reader_catch_interrupt(int on);
+int reader_interrupted();
+
+#endif
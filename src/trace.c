@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Events go into a bounded multi-producer ring (Vyukov style: every slot
+ * carries a sequence number) that lives in a MAP_SHARED mapping, so forked
+ * children can still record events such as "exec" right before execvp().
+ * Producers never block: when the ring is full the event is dropped and
+ * counted. A flusher thread in the shell drains the ring to the JSON file
+ * every TRACE_FLUSH_MS, or sooner after every half ring of events, keeping file
+ * I/O off the command path.
+ */
+
+#define TRACE_CAPACITY 65536
+#define TRACE_DETAIL 24
+#define TRACE_FLUSH_MS 100
+
+typedef struct trace_event
+{
+  _Atomic uint64_t seq;
+  uint64_t ts_ns;
+  const char *name;
+  long long arg;
+  int32_t pid;
+  int32_t tid;
+  char phase;
+  char detail[TRACE_DETAIL];
+} trace_event_t;
+
+typedef struct trace_ring
+{
+  _Atomic uint64_t write_pos;
+  _Atomic long dropped;
+  trace_event_t events[TRACE_CAPACITY];
+} trace_ring_t;
+
+volatile int trace_enabled = 0;
+
+static trace_ring_t *ring = NULL;
+static uint64_t read_pos = 0;
+static FILE *trace_file = NULL;
+static char trace_file_path[PATH_MAX];
+static pid_t owner_pid = 0;
+static int first_event = 1;
+
+static pthread_t flusher;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_stop = 0;
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * trace_record
+ *
+ * Append one event to the ring. Safe from any thread and from forked
+ * children; never blocks.
+ *
+ * Parameters:
+ *   phase  - Chrome trace phase: 'B' begin, 'E' end, 'i' instant.
+ *   name   - static event name.
+ *   detail - optional text (command name, ...), truncated to fit.
+ *   arg    - numeric argument shown with instant events.
+ */
+void trace_record(char phase, const char *name, const char *detail, long long arg)
+{
+  if (!ring)
+    return;
+
+  uint64_t pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+  trace_event_t *ev;
+
+  for (;;)
+  {
+    ev = &ring->events[pos & (TRACE_CAPACITY - 1)];
+    uint64_t seq = atomic_load_explicit(&ev->seq, memory_order_acquire);
+    int64_t diff = (int64_t)(seq - pos);
+
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&ring->write_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      atomic_fetch_add(&ring->dropped, 1);
+      return;
+    }
+    else
+    {
+      pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    }
+  }
+
+  ev->ts_ns = monotonic_ns();
+  ev->name = name;
+  ev->arg = arg;
+  ev->pid = getpid();
+  ev->tid = syscall(SYS_gettid);
+  ev->phase = phase;
+  ev->detail[0] = '\0';
+  if (detail)
+  {
+    strncpy(ev->detail, detail, TRACE_DETAIL - 1);
+    ev->detail[TRACE_DETAIL - 1] = '\0';
+  }
+  atomic_store_explicit(&ev->seq, pos + 1, memory_order_release);
+
+  // Nudge the flusher every half ring; only the shell process has one
+  if ((pos + 1) % (TRACE_CAPACITY / 2) == 0 && getpid() == owner_pid)
+    pthread_cond_signal(&flush_cond);
+}
+
+/**
+ * write_json_string
+ *
+ * Write s as a JSON string literal.
+ */
+static void write_json_string(FILE *out, const char *s)
+{
+  fputc('"', out);
+  for (; *s; s++)
+  {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+/**
+ * drain
+ *
+ * Write every completed event to the trace file. Called by the flusher
+ * thread (or by trace_stop() once it has exited) with flush_lock held.
+ */
+static void drain()
+{
+  for (;;)
+  {
+    trace_event_t *ev = &ring->events[read_pos & (TRACE_CAPACITY - 1)];
+    if (atomic_load_explicit(&ev->seq, memory_order_acquire) != read_pos + 1)
+      break;
+
+    fprintf(trace_file, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d",
+            first_event ? "" : ",", ev->name, ev->phase, ev->ts_ns / 1000.0, owner_pid, ev->tid);
+    first_event = 0;
+
+    if (ev->phase == 'i')
+      fprintf(trace_file, ", \"s\": \"t\"");
+    if (ev->detail[0] || ev->phase == 'i')
+    {
+      fprintf(trace_file, ", \"args\": {\"detail\": ");
+      write_json_string(trace_file, ev->detail);
+      fprintf(trace_file, ", \"value\": %lld, \"pid\": %d}", ev->arg, ev->pid);
+    }
+    fputc('}', trace_file);
+
+    atomic_store_explicit(&ev->seq, read_pos + TRACE_CAPACITY, memory_order_release);
+    read_pos++;
+  }
+}
+
+static void *flush_thread(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&flush_lock);
+  while (!flusher_stop)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&flush_cond, &flush_lock, &deadline);
+    drain();
+    fflush(trace_file);
+  }
+  pthread_mutex_unlock(&flush_lock);
+  return NULL;
+}
+
+/**
+ * trace_start
+ *
+ * Start tracing into path (truncated). Restarting while already tracing
+ * closes the previous file first.
+ *
+ * Returns:
+ *   0 on success, -1 on error (errno is set).
+ */
+int trace_start(const char *path)
+{
+  if (trace_file)
+    trace_stop();
+
+  if (!ring)
+  {
+    // Kept for the life of the shell: children forked while tracing may
+    // still write into it after tracing stops.
+    ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+      ring = NULL;
+      return -1;
+    }
+    for (uint64_t i = 0; i < TRACE_CAPACITY; i++)
+      atomic_init(&ring->events[i].seq, i);
+  }
+
+  trace_file = fopen(path, "we");
+  if (!trace_file)
+    return -1;
+
+  static int registered = 0;
+  if (!registered)
+  {
+    atexit(trace_stop);
+    registered = 1;
+  }
+
+  snprintf(trace_file_path, sizeof(trace_file_path), "%s", path);
+  owner_pid = getpid();
+  first_event = 1;
+  fprintf(trace_file, "{\"traceEvents\": [");
+  fprintf(trace_file, "\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"shell\"}}", owner_pid);
+  first_event = 0;
+
+  // Skip whatever an earlier session left unflushed
+  read_pos = atomic_load(&ring->write_pos);
+  for (uint64_t i = 0; i < TRACE_CAPACITY; i++)
+    atomic_store(&ring->events[(read_pos + i) & (TRACE_CAPACITY - 1)].seq, read_pos + i);
+
+  // The flusher must not take signals meant for the shell (SIGCHLD is read
+  // from a signalfd, which only sees signals every thread blocks)
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  flusher_stop = 0;
+  int rc = pthread_create(&flusher, NULL, flush_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0)
+  {
+    fclose(trace_file);
+    trace_file = NULL;
+    return -1;
+  }
+
+  trace_enabled = 1;
+  return 0;
+}
+
+/**
+ * trace_stop
+ *
+ * Stop tracing, flush the remaining events and close the file. Does
+ * nothing in forked children or when tracing is off.
+ */
+void trace_stop()
+{
+  if (!trace_file || getpid() != owner_pid)
+    return;
+
+  trace_enabled = 0;
+
+  pthread_mutex_lock(&flush_lock);
+  flusher_stop = 1;
+  pthread_cond_signal(&flush_cond);
+  pthread_mutex_unlock(&flush_lock);
+  pthread_join(flusher, NULL);
+
+  drain();
+  fprintf(trace_file, "\n],\n\"otherData\": {\"dropped_events\": %ld}}\n", atomic_load(&ring->dropped));
+  fclose(trace_file);
+  trace_file = NULL;
+}
+
+/**
+ * trace_init
+ *
+ * Start tracing if SHELL_TRACE names an output file.
+ */
+void trace_init()
+{
+  const char *path = getenv("SHELL_TRACE");
+  if (path && path[0] && trace_start(path) != 0)
+    fprintf(stderr, "trace: %s: %s\n", path, strerror(errno));
+}
+
+/**
+ * trace_path
+ *
+ * Return the current trace file, or NULL when tracing is off.
+ */
+const char *trace_path()
+{
+  return trace_file ? trace_file_path : NULL;
+}
+
+/**
+ * trace_dropped
+ *
+ * Return the number of events dropped because the ring was full.
+ */
+long trace_dropped()
+{
+  return ring ? atomic_load(&ring->dropped) : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Opt-in tracing of the phases of each command, written as Chrome /
+ * Perfetto trace-event JSON. Enabled with SHELL_TRACE=FILE or the
+ * `trace on [FILE]` builtin. When tracing is off each probe costs one load
+ * and a branch.
+ */
+
+extern volatile int trace_enabled;
+
+void trace_init();
+int trace_start(const char *path);
+void trace_stop();
+const char *trace_path();
+long trace_dropped();
+void trace_record(char phase, const char *name, const char *detail, long long arg);
+
+#define TRACE_BEGIN(name, detail)                    \
+  do                                                 \
+  {                                                  \
+    if (trace_enabled)                               \
+      trace_record('B', (name), (detail), 0);        \
+  } while (0)
+
+#define TRACE_END(name)                              \
+  do                                                 \
+  {                                                  \
+    if (trace_enabled)                               \
+      trace_record('E', (name), NULL, 0);            \
+  } while (0)
+
+#define TRACE_INSTANT(name, detail, arg)             \
+  do                                                 \
+  {                                                  \
+    if (trace_enabled)                               \
+      trace_record('i', (name), (detail), (arg));    \
+  } while (0)
+
+#endif
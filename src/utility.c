@@ -6,11 +6,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/stat.h>
 
 static char cwd[256] = "";
 static char home[PATH_MAX] = "";
 static char pwd[PATH_MAX] = "";
-static char history_path[PATH_MAX] = "";
 
 /**
  * get_cwd
@@ -95,106 +95,39 @@ void set_pwd()
 }
 
 /**
- * @brief Adds a command to the command history.
+ * find_program
  *
- * @param cmd A pointer to a null-terminated string containing the command to add.
+ * Find the file execvp() would run for name: name itself if it contains a
+ * slash, otherwise the first executable regular file in $PATH.
  *
- * @return void
+ * Parameters:
+ *   name - command word.
+ *   path - receives the file's path.
+ *   size - size of path.
+ *   st   - receives the file's stat.
+ *
+ * Returns:
+ *   0 on success, -1 if there is no such program.
  */
-void add_cmd_history(const char *cmd)
-{
-  if (history_path[0] == '\0')
-  {
-    const char *home = get_home();
-    snprintf(history_path, sizeof(history_path), "%s/.shell_history", home);
-  }
-
-  FILE *history_file = fopen(history_path, "a");
-  if (history_file)
-  {
-    fprintf(history_file, "%s", cmd);
-    fclose(history_file);
-  }
-}
-
-char *get_cmd_history()
+int find_program(const char *name, char *path, size_t size, struct stat *st)
 {
-  if (history_path[0] == '\0')
-  {
-    const char *home = get_home();
-    snprintf(history_path, sizeof(history_path), "%s/.shell_history", home);
-  }
-  FILE *fptr = fopen(history_path, "r");
-  if (!fptr)
+  if (strchr(name, '/'))
   {
-    return NULL;
+    snprintf(path, size, "%s", name);
+    return stat(name, st);
   }
 
-  char *lines[10] = {NULL};
-  int line_count = 0;
-  int current_idx = 0;
-  char *line_buf = NULL;
-  size_t line_len = 0;
-  ssize_t read_bytes;
+  const char *dirs = getenv("PATH");
+  if (!dirs)
+    dirs = "/usr/bin:/bin";
 
-  while ((read_bytes = getline(&line_buf, &line_len, fptr)) != -1)
+  while (*dirs)
   {
-    if (lines[current_idx] != NULL)
-    {
-      free(lines[current_idx]);
-    }
-    lines[current_idx] = strdup(line_buf);
-    if (lines[current_idx] == NULL)
-    {
-      // Handle allocation error
-      for (int i = 0; i < 10; ++i)
-      {
-        if (lines[i] != NULL)
-        {
-          free(lines[i]);
-        }
-      }
-      free(line_buf);
-      fclose(fptr);
-      return NULL;
-    }
-    current_idx = (current_idx + 1) % 10;
-    if (line_count < 10)
-    {
-      line_count++;
-    }
+    size_t len = strcspn(dirs, ":");
+    snprintf(path, size, "%.*s/%s", (int)len, len ? dirs : ".", name);
+    if (access(path, X_OK) == 0 && stat(path, st) == 0 && S_ISREG(st->st_mode))
+      return 0;
+    dirs += len + (dirs[len] == ':');
   }
-
-  free(line_buf);
-  fclose(fptr);
-
-  // Calculate total length for the result string
-  size_t total_length = 0;
-  int start_idx = (line_count < 10) ? 0 : current_idx;
-  for (int i = 0; i < line_count; ++i)
-  {
-    total_length += strlen(lines[(start_idx + i) % 10]);
-  }
-
-  char *result = malloc(total_length + 1); // +1 for null terminator
-  if (result == NULL)
-  {
-    for (int i = 0; i < 10; ++i)
-    {
-      if (lines[i] != NULL)
-      {
-        free(lines[i]);
-      }
-    }
-    return NULL;
-  }
-  result[0] = '\0'; // Initialize as empty string
-
-  for (int i = 0; i < line_count; ++i)
-  {
-    strcat(result, lines[(start_idx + i) % 10]);
-    free(lines[(start_idx + i) % 10]); // Free memory after copying
-  }
-
-  return result;
-}
\ No newline at end of file
+  return -1;
+}
@@ -1,11 +1,13 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 
+#include <stddef.h>
+#include <sys/stat.h>
+
 const char *get_home();
 const char *get_pwd();
 const char *get_cwd();
 void set_pwd();
-void add_cmd_history(const char *cmd);
-char *get_cmd_history();
+int find_program(const char *name, char *path, size_t size, struct stat *st);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,211 @@
+#include "wheel.h"
+
+#include <stddef.h>
+
+#define LEVEL_SHIFT(level) ((level) * WHEEL_BITS)
+#define TOP_LEVEL (WHEEL_LEVELS - 1)
+
+/**
+ * wheel_init
+ *
+ * Prepare an empty wheel whose clock starts at tick now.
+ */
+void wheel_init(timer_wheel_t *w, uint64_t now)
+{
+  w->current = now;
+  w->count = 0;
+  for (int l = 0; l < WHEEL_LEVELS; l++)
+  {
+    w->occupied[l] = 0;
+    for (int s = 0; s < WHEEL_SLOTS; s++)
+      w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+  }
+}
+
+/**
+ * place
+ *
+ * Link t into the slot its expiry belongs to relative to the wheel's
+ * current tick. Expiries in the past fire on the next tick; expiries
+ * beyond the top level's range park in its furthest slot and are placed
+ * again when they get there.
+ */
+static void place(timer_wheel_t *w, timer_node_t *t)
+{
+  uint64_t expires = t->expires < w->current ? w->current : t->expires;
+  int level = 0, slot;
+
+  while (level < TOP_LEVEL &&
+         (expires >> LEVEL_SHIFT(level + 1)) != (w->current >> LEVEL_SHIFT(level + 1)))
+    level++;
+
+  uint64_t top_distance = (expires >> LEVEL_SHIFT(TOP_LEVEL)) - (w->current >> LEVEL_SHIFT(TOP_LEVEL));
+  if (level == TOP_LEVEL && top_distance >= WHEEL_SLOTS)
+    slot = ((w->current >> LEVEL_SHIFT(TOP_LEVEL)) + WHEEL_SLOTS - 1) & (WHEEL_SLOTS - 1);
+  else
+    slot = (expires >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1);
+
+  timer_node_t *head = &w->slots[level][slot];
+  t->level = level;
+  t->slot = slot;
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+  w->occupied[level] |= 1ULL << slot;
+}
+
+static void unlink_node(timer_wheel_t *w, timer_node_t *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+
+  timer_node_t *head = &w->slots[t->level][t->slot];
+  if (head->next == head)
+    w->occupied[t->level] &= ~(1ULL << t->slot);
+}
+
+/**
+ * wheel_add
+ *
+ * Schedule t to expire at tick expires. t must not be pending already.
+ */
+void wheel_add(timer_wheel_t *w, timer_node_t *t, uint64_t expires)
+{
+  t->expires = expires;
+  place(w, t);
+  w->count++;
+}
+
+/**
+ * wheel_del
+ *
+ * Cancel t. Does nothing if it is not pending.
+ */
+void wheel_del(timer_wheel_t *w, timer_node_t *t)
+{
+  if (!wheel_pending(t))
+    return;
+  unlink_node(w, t);
+  w->count--;
+}
+
+/**
+ * wheel_pending
+ *
+ * Return non-zero if t is scheduled and has not fired yet.
+ */
+int wheel_pending(const timer_node_t *t)
+{
+  // Linked nodes always have prev; expired lists only use next
+  return t->prev != NULL;
+}
+
+/**
+ * wheel_next
+ *
+ * Return the first tick at which the wheel has work: a timer to fire or a
+ * slot to move down a level. Timers never fire before it, so a timerfd set
+ * to this tick wakes the shell only when needed.
+ *
+ * Returns:
+ *   The tick, or WHEEL_NEVER if no timer is pending.
+ */
+uint64_t wheel_next(const timer_wheel_t *w)
+{
+  if (w->count == 0)
+    return WHEEL_NEVER;
+
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+  {
+    int shift = LEVEL_SHIFT(level);
+    unsigned cur = (w->current >> shift) & (WHEEL_SLOTS - 1);
+    uint64_t bits = w->occupied[level];
+    if (!bits)
+      continue;
+
+    // Lower levels hold slots inside the current block, after the current
+    // one (or at it, while the wheel stands on its first tick); the top
+    // level wraps around
+    unsigned first = (w->current & ((1ULL << shift) - 1)) == 0 ? cur : cur + 1;
+    uint64_t ahead = first < WHEEL_SLOTS ? bits >> first : 0;
+    if (level < TOP_LEVEL && !ahead)
+      continue;
+
+    uint64_t block = (w->current >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS);
+    if (ahead)
+    {
+      unsigned slot = first + __builtin_ctzll(ahead);
+      return block + ((uint64_t)slot << shift);
+    }
+
+    // Top level, wrapped: the next occupied slot is in the following block
+    unsigned slot = __builtin_ctzll(bits);
+    return block + ((uint64_t)WHEEL_SLOTS << shift) + ((uint64_t)slot << shift);
+  }
+  return WHEEL_NEVER;
+}
+
+/**
+ * process_tick
+ *
+ * Move the slots that start at the current tick down a level, then detach
+ * the level 0 slot for this tick onto the expired list.
+ */
+static void process_tick(timer_wheel_t *w, timer_node_t **expired)
+{
+  for (int level = TOP_LEVEL; level > 0; level--)
+  {
+    if (w->current & ((1ULL << LEVEL_SHIFT(level)) - 1))
+      continue;
+
+    int slot = (w->current >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1);
+    timer_node_t *head = &w->slots[level][slot];
+    while (head->next != head)
+    {
+      timer_node_t *t = head->next;
+      unlink_node(w, t);
+      place(w, t);
+    }
+  }
+
+  timer_node_t *head = &w->slots[0][w->current & (WHEEL_SLOTS - 1)];
+  while (head->next != head)
+  {
+    timer_node_t *t = head->next;
+    unlink_node(w, t);
+    w->count--;
+    t->next = *expired;
+    *expired = t;
+  }
+}
+
+/**
+ * wheel_advance
+ *
+ * Run the wheel's clock up to and including tick now, skipping straight
+ * over ticks with no work.
+ *
+ * Returns:
+ *   The timers that expired, linked through next (in no particular order).
+ *   They are no longer pending; the caller may add them again.
+ */
+timer_node_t *wheel_advance(timer_wheel_t *w, uint64_t now)
+{
+  timer_node_t *expired = NULL;
+
+  while (w->current <= now)
+  {
+    uint64_t next = wheel_next(w);
+    if (next > now)
+    {
+      w->current = now + 1;
+      break;
+    }
+    w->current = next;
+    process_tick(w, &expired);
+    w->current++;
+  }
+  return expired;
+}
@@ -0,0 +1,43 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel. Time is counted in ticks; level L has
+ * WHEEL_SLOTS slots each WHEEL_SLOTS^L ticks wide, and a timer sits in the
+ * lowest level whose current block contains its expiry. Timers move down a
+ * level when the wheel reaches their slot, so add and delete are O(1) and
+ * the occupancy bitmaps find the next expiry without scanning slots.
+ */
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_NEVER UINT64_MAX
+
+typedef struct timer_node
+{
+  struct timer_node *next;
+  struct timer_node *prev;
+  uint64_t expires;
+  int level;
+  int slot;
+} timer_node_t;
+
+typedef struct timer_wheel
+{
+  uint64_t current;
+  uint64_t occupied[WHEEL_LEVELS];
+  timer_node_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  int count;
+} timer_wheel_t;
+
+void wheel_init(timer_wheel_t *w, uint64_t now);
+void wheel_add(timer_wheel_t *w, timer_node_t *t, uint64_t expires);
+void wheel_del(timer_wheel_t *w, timer_node_t *t);
+int wheel_pending(const timer_node_t *t);
+uint64_t wheel_next(const timer_wheel_t *w);
+timer_node_t *wheel_advance(timer_wheel_t *w, uint64_t now);
+
+#endif
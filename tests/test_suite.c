@@ -1,9 +1,37 @@
+#define _GNU_SOURCE
 #include "test.h"
 #include "../src/parser.h"
 #include "../src/utility.h"
+#include "../src/history.h"
+#include "../src/executor.h"
+#include "../src/options.h"
+#include "../src/ring.h"
+#include "../src/trace.h"
+#include "../src/resources.h"
+#include "../src/builtins.h"
+#include "../src/wheel.h"
+#include "../src/jobs.h"
+#include "../src/metrics.h"
+#include "../src/cache.h"
+#include "../src/scan.h"
+#include "../src/names.h"
+#include "../src/record.h"
+#include "../src/memory.h"
+#include "../src/editor.h"
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 
 test_stats_t test_stats = {0, 0, 0};
 
@@ -166,6 +194,20 @@ void test_parser_multiple_arguments(void)
   TEST_NULL(cmd->argv[7], "Arguments terminate properly");
 
   free_command(cmd);
+
+  // Far more words than MAX_TOKENS, none of them dropped
+  char line[4096] = "echo";
+  for (int i = 0; i < 3 * MAX_TOKENS; i++)
+    sprintf(line + strlen(line), " w%d", i);
+  strcat(line, " > out.txt");
+  cmd = parse_command(line);
+  int argc = 0;
+  while (cmd->argv[argc])
+    argc++;
+  TEST_EQUAL(argc, 3 * MAX_TOKENS + 1, "Long line keeps every word");
+  TEST_STRING_EQUAL(cmd->argv[3 * MAX_TOKENS], "w383", "Last word is kept");
+  TEST_STRING_EQUAL(cmd->output_redirect, "out.txt", "Redirection after many words is parsed");
+  free_command(cmd);
 }
 
 /**
@@ -203,6 +245,1565 @@ void test_parser_flags_and_options(void)
   free_command(cmd);
 }
 
+/**
+ * Test Suite 11: History - Binary Log Append and Tail Read
+ */
+void test_history_log(void)
+{
+  char path[] = "/tmp/mini_shell_history_XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  unlink(path);
+  setenv("HISTFILE", path, 1);
+
+  add_cmd_history("echo one\n", 1000, 10, 0);
+  add_cmd_history("false\n", 2000, 20, 1);
+  add_cmd_history("echo one\n", 3000, 30, 0);
+
+  history_entry_t *entries;
+  int count = history_load_tail(&entries, 10);
+  TEST_EQUAL(count, 3, "All records read back");
+  TEST_STRING_EQUAL(entries[0].cmd, "echo one", "Oldest record first, newline stripped");
+  TEST_EQUAL(entries[1].status, 1, "Exit status stored");
+  TEST_EQUAL((int)entries[2].duration, 30, "Duration stored");
+  TEST_EQUAL(entries[2].session == get_session_id(), 1, "Session id stored");
+  history_free_entries(entries, count);
+
+  count = history_load_tail(&entries, 2);
+  TEST_EQUAL(count, 2, "Tail read honours the limit");
+  TEST_STRING_EQUAL(entries[0].cmd, "false", "Tail read returns the newest records");
+  history_free_entries(entries, count);
+
+  char *text = get_cmd_history();
+  TEST_STRING_EQUAL(text, "echo one\nfalse\necho one\n", "get_cmd_history() formats one command per line");
+  free(text);
+
+  TEST_EQUAL(history_compact(), 0, "Compaction succeeds");
+  count = history_load_tail(&entries, 10);
+  TEST_EQUAL(count, 2, "Compaction drops the older duplicate");
+  TEST_STRING_EQUAL(entries[0].cmd, "false", "Compaction keeps the newest copy");
+  history_free_entries(entries, count);
+
+  char text_path[] = "/tmp/mini_shell_history_text_XXXXXX";
+  fd = mkstemp(text_path);
+  close(fd);
+  TEST_EQUAL(history_export(text_path), 2, "Export writes every command");
+  TEST_EQUAL(history_import(text_path), 2, "Import reads the exported text back");
+  count = history_load_tail(&entries, 10);
+  TEST_EQUAL(count, 4, "Imported commands are appended");
+  history_free_entries(entries, count);
+
+  // Past 1 MiB the log is compacted in the background; distinct commands
+  // are all kept, however many there are
+  char line[128];
+  for (int i = 0; i < 12000; i++)
+  {
+    snprintf(line, sizeof(line), "echo distinct command number %d of a long history\n", i);
+    add_cmd_history(line, 4000 + i, 1, 0);
+  }
+  TEST_EQUAL(history_compact(), 0, "Compaction waits for the background one");
+  TEST_ASSERT(waitpid(-1, NULL, WNOHANG) <= 0, "Background compaction leaves no child to reap");
+  TEST_EQUAL(history_export(text_path), 12002, "Compaction keeps every distinct command");
+
+  unlink(text_path);
+  unlink(path);
+}
+
+/**
+ * Test Suite 12: Command Substitution
+ */
+void test_command_substitution(void)
+{
+  command_t *cmd = parse_command("echo pre$(echo a | tr a b)post > out.txt");
+
+  TEST_STRING_EQUAL(cmd->argv[1], "pre$(echo a | tr a b)post", "Substitution is tokenized as one word");
+  TEST_NULL(cmd->pipe_to, "Pipe inside $(...) does not split the command");
+  TEST_STRING_EQUAL(cmd->output_redirect, "out.txt", "Redirection after substitution still parsed");
+  free_command(cmd);
+
+  cmd = parse_command("echo x$(echo one   two)y $(true) z");
+  TEST_EQUAL(expand_command(cmd), 0, "Expansion succeeds");
+  TEST_STRING_EQUAL(cmd->argv[1], "xone", "Literal prefix joins the first field");
+  TEST_STRING_EQUAL(cmd->argv[2], "twoy", "Literal suffix joins the last field");
+  TEST_STRING_EQUAL(cmd->argv[3], "z", "Empty substitution produces no field");
+  TEST_NULL(cmd->argv[4], "Expanded argv is NULL-terminated");
+  free_command(cmd);
+
+  cmd = parse_command("$(echo history)");
+  expand_command(cmd);
+  TEST_STRING_EQUAL(cmd->argv[0], "history", "Command word can come from a substitution");
+  TEST_EQUAL(cmd->is_exec, 0, "Substituted builtin name is classified as builtin");
+  free_command(cmd);
+
+  cmd = parse_command("echo $(echo");
+  TEST_EQUAL(expand_command(cmd), -1, "Unterminated substitution is an error");
+  free_command(cmd);
+
+  cmd = parse_command("echo \"<$(printf \"a   b\")>\" $(printf \"c   d\")");
+  TEST_EQUAL(expand_command(cmd), 0, "Quotes nested in a quoted substitution parse");
+  TEST_STRING_EQUAL(cmd->argv[1], "<a   b>", "Quoted substitution is one field");
+  TEST_STRING_EQUAL(cmd->argv[2], "c", "Unquoted substitution is still split");
+  TEST_STRING_EQUAL(cmd->argv[3], "d", "Unquoted substitution is still split");
+  free_command(cmd);
+
+  cmd = parse_command("echo \"$(true)\" x");
+  expand_command(cmd);
+  TEST_STRING_EQUAL(cmd->argv[1], "", "Empty quoted substitution is an empty field");
+  TEST_STRING_EQUAL(cmd->argv[2], "x", "Words after it are kept");
+  free_command(cmd);
+
+  cmd = parse_command("echo \"$(echo \"$(echo \")\")\")\"");
+  TEST_EQUAL(expand_command(cmd), 0, "Nested quoted substitutions parse");
+  TEST_STRING_EQUAL(cmd->argv[1], ")", "Nested quoted substitutions expand");
+  free_command(cmd);
+}
+
+static void *ring_producer(void *arg)
+{
+  FILE *out = ring_fopen(arg, "w");
+  for (int i = 0; i < 100000; i++)
+  {
+    if (fprintf(out, "%d\n", i) < 0)
+      break;
+  }
+  fclose(out);
+  return NULL;
+}
+
+/**
+ * Test Suite 13: Pipeline Fusion - Ring Buffer and Builtin Stages
+ */
+void test_pipeline_fusion(void)
+{
+  ring_t *ring = ring_create(4096);
+  pthread_t producer;
+  pthread_create(&producer, NULL, ring_producer, ring);
+
+  FILE *in = ring_fopen(ring, "r");
+  char line[32];
+  int lines = 0, in_order = 1;
+  while (fgets(line, sizeof(line), in))
+  {
+    if (atoi(line) != lines)
+      in_order = 0;
+    lines++;
+  }
+  fclose(in);
+  pthread_join(producer, NULL);
+  TEST_EQUAL(lines, 100000, "Every line crosses a ring smaller than the data");
+  TEST_EQUAL(in_order, 1, "Lines arrive in order");
+
+  ring = ring_create(4096);
+  pthread_create(&producer, NULL, ring_producer, ring);
+  in = ring_fopen(ring, "r");
+  fgets(line, sizeof(line), in);
+  fclose(in);
+  pthread_join(producer, NULL);
+  TEST_ASSERT(1, "Producer stops once the reader closes early");
+
+  command_t *cmd = parse_command("history | head -n 5 | wc -l | sort");
+  TEST_EQUAL(cmd->is_exec, 0, "history stage is a builtin");
+  TEST_EQUAL(cmd->pipe_to->is_exec, 0, "head -n N stage is a builtin");
+  TEST_EQUAL(cmd->pipe_to->pipe_to->is_exec, 0, "wc -l stage is a builtin");
+  TEST_EQUAL(cmd->pipe_to->pipe_to->pipe_to->is_exec, 1, "sort stage is external");
+  free_command(cmd);
+
+  cmd = parse_command("head -c 5 file.txt");
+  TEST_EQUAL(cmd->is_exec, 1, "Unsupported head arguments fall back to the external head");
+  free_command(cmd);
+
+  TEST_EQUAL(get_option(OPT_FUSION), 1, "Fusion is enabled by default");
+  TEST_EQUAL(set_option("fusion", 0), 0, "Fusion can be disabled");
+  TEST_EQUAL(get_option(OPT_FUSION), 0, "Fusion option reads back disabled");
+  TEST_EQUAL(set_option("no_such_option", 1), -1, "Unknown options are rejected");
+  set_option("fusion", 1);
+}
+
+/**
+ * Test Suite 14: Tracing - Chrome Trace Events
+ */
+void test_tracing(void)
+{
+  char path[] = "/tmp/mini_shell_trace_XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+
+  TEST_EQUAL(trace_enabled, 0, "Tracing is off by default");
+  TEST_EQUAL(trace_start(path), 0, "Tracing starts");
+  TEST_ASSERT(trace_path() && strcmp(trace_path(), path) == 0, "Trace file is reported");
+
+  command_t *cmd = parse_command("echo \"quoted\" | wc -l > /dev/null");
+  execute_command(cmd);
+  free_command(cmd);
+  trace_stop();
+  TEST_EQUAL(trace_enabled, 0, "Tracing stops");
+
+  FILE *in = fopen(path, "r");
+  char *text = NULL;
+  size_t cap = 0;
+  getdelim(&text, &cap, '\0', in);
+  fclose(in);
+  unlink(path);
+
+  TEST_ASSERT(strncmp(text, "{\"traceEvents\": [", 17) == 0, "File is a trace-event document");
+  TEST_ASSERT(strstr(text, "\"name\": \"parse\", \"ph\": \"B\""), "Parse span recorded");
+  TEST_ASSERT(strstr(text, "\"name\": \"fork\"") && strstr(text, "\"detail\": \"echo\""), "Fork span names the command");
+  TEST_ASSERT(strstr(text, "\"name\": \"exec\""), "Exec recorded by the child");
+  TEST_ASSERT(strstr(text, "\"name\": \"reap\""), "Reap recorded with the status");
+  TEST_ASSERT(strstr(text, "\"dropped_events\": 0}}"), "Document is closed and nothing was dropped");
+  free(text);
+}
+
+/**
+ * Test Suite 15: Resource Annotations
+ */
+void test_resource_annotations(void)
+{
+  command_t *cmd = parse_command("@cpus=0 @nice=5 cat | @ioprio=be:2 @limit=nofile:64:128 wc -l");
+  TEST_STRING_EQUAL(cmd->argv[0], "cat", "Annotations are not part of argv");
+  TEST_ASSERT(cmd->resources != NULL, "First stage carries its annotations");
+  TEST_ASSERT(cmd->pipe_to->resources != NULL, "Second stage carries its annotations");
+  TEST_EQUAL(cmd->pipe_to->is_exec, 0, "Annotated builtin stage is still a builtin");
+  TEST_EQUAL(builtin_runs_inline(cmd->pipe_to), 0, "Annotated builtin needs a process");
+  free_command(cmd);
+
+  cmd = parse_command("echo @cpus=0");
+  TEST_EQUAL(cmd->resources == NULL, 1, "Annotations only count before the command word");
+  free_command(cmd);
+
+  cmd = parse_command("@cpus=x echo hi");
+  TEST_EQUAL(cmd->syntax_error, 1, "Malformed annotation is a syntax error");
+  execute_command(cmd);
+  TEST_EQUAL(get_last_status(), 2, "Command with a bad annotation is not run");
+  free_command(cmd);
+
+  cmd = parse_command("@limit=nofile:10:5 true");
+  TEST_EQUAL(cmd->syntax_error, 1, "Soft limit above hard limit is rejected");
+  free_command(cmd);
+
+  cmd = parse_command("@nice=10 @cpus=0 true");
+  execute_command(cmd);
+  TEST_EQUAL(get_last_status(), 0, "Annotated command runs");
+  free_command(cmd);
+
+  cmd = parse_command("@limit=fsize:0 echo too big > /tmp/mini_shell_fsize_test");
+  execute_command(cmd);
+  TEST_EQUAL(get_last_status(), 128 + SIGXFSZ, "Limit applies to the child only");
+  free_command(cmd);
+  unlink("/tmp/mini_shell_fsize_test");
+
+  rlim_t value;
+  const rlimit_def_t *def = find_rlimit(NULL, 'n');
+  TEST_ASSERT(def && strcmp(def->name, "nofile") == 0, "ulimit flags map to limits");
+  TEST_ASSERT(parse_rlim("8", 1024, &value) == 0 && value == 8192, "Sizes are scaled to bytes");
+  TEST_ASSERT(parse_rlim("unlimited", 1, &value) == 0 && value == RLIM_INFINITY, "unlimited is accepted");
+  TEST_EQUAL(parse_rlim("-1", 1, &value), -1, "Negative limits are rejected");
+}
+
+static char *read_text(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return NULL;
+  char *text = NULL;
+  size_t cap = 0;
+  if (getdelim(&text, &cap, '\0', in) < 0)
+  {
+    free(text);
+    text = strdup("");
+  }
+  fclose(in);
+  return text;
+}
+
+/**
+ * Test Suite 16: Fan-out Pipelines
+ */
+void test_fanout(void)
+{
+  command_t *cmd = parse_command("cat log | grep x |> wc -l |> sort | uniq");
+  TEST_ASSERT(cmd->branches == NULL, "Only the producer's last stage fans out");
+  command_t *producer = cmd->pipe_to;
+  TEST_ASSERT(producer->branches && producer->branches[0] && producer->branches[1] && !producer->branches[2],
+              "Two branches parsed");
+  TEST_STRING_EQUAL(producer->branches[0]->argv[0], "wc", "First branch command");
+  TEST_EQUAL(producer->branches[0]->is_exec, 0, "Branch stages are classified too");
+  TEST_STRING_EQUAL(producer->branches[1]->pipe_to->argv[0], "uniq", "A branch can be a pipeline");
+  TEST_ASSERT(producer->pipe_to == NULL, "Branches are not part of the producer chain");
+  free_command(cmd);
+
+  char data[] = "/tmp/mini_shell_fanout_XXXXXX";
+  int fd = mkstemp(data);
+  for (int i = 0; i < 50000; i++)
+    dprintf(fd, "line %d\n", i);
+  close(fd);
+
+  char line[512];
+  snprintf(line, sizeof(line),
+           "cat < %s |> wc -l > %s.a |> cat > %s.b |> head -n 1 > %s.c |> false", data, data, data, data);
+  cmd = parse_command(line);
+  execute_command(cmd);
+  free_command(cmd);
+  TEST_EQUAL(get_last_status(), 1, "Fan-out status reports a failing branch");
+
+  char path[128];
+  snprintf(path, sizeof(path), "%s.a", data);
+  char *text = read_text(path);
+  TEST_STRING_EQUAL(text, "50000\n", "Builtin branch sees every line");
+  free(text);
+  unlink(path);
+
+  snprintf(path, sizeof(path), "%s.b", data);
+  char *copy = read_text(path), *orig = read_text(data);
+  TEST_ASSERT(copy && orig && strcmp(copy, orig) == 0, "External branch gets an exact copy");
+  free(copy);
+  free(orig);
+  unlink(path);
+
+  snprintf(path, sizeof(path), "%s.c", data);
+  text = read_text(path);
+  TEST_STRING_EQUAL(text, "line 0\n", "Branch that stops early does not stall the others");
+  free(text);
+  unlink(path);
+  unlink(data);
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Test Suite 17: Timeouts and the Timer Wheel
+ */
+void test_timeouts(void)
+{
+  static timer_wheel_t w;
+  timer_node_t near = {0}, far = {0}, cancelled = {0}, huge = {0};
+  wheel_init(&w, 1000);
+  wheel_add(&w, &near, 1005);
+  wheel_add(&w, &far, 1000 + 5000);
+  wheel_add(&w, &cancelled, 1003);
+  wheel_add(&w, &huge, 1000 + (1ULL << 30));
+  wheel_del(&w, &cancelled);
+  TEST_EQUAL(wheel_pending(&cancelled), 0, "Deleted timer is no longer pending");
+  TEST_EQUAL((int)wheel_next(&w), 1005, "Next expiry is the nearest timer");
+  TEST_ASSERT(wheel_advance(&w, 1004) == NULL, "Nothing fires early");
+  TEST_ASSERT(wheel_advance(&w, 1005) == &near && !near.next, "Near timer fires on its tick");
+  TEST_ASSERT(wheel_advance(&w, 5999) == NULL, "Far timer cascades without firing early");
+  TEST_ASSERT(wheel_advance(&w, 6000) == &far, "Far timer fires on its tick");
+  TEST_ASSERT(wheel_advance(&w, 1000 + (1ULL << 30)) == &huge, "Timer beyond the wheel's range fires on time");
+  TEST_ASSERT(wheel_next(&w) == WHEEL_NEVER, "Empty wheel has no expiry");
+
+  TEST_EQUAL((int)parse_duration("1.5"), 1500, "Bare durations are seconds");
+  TEST_EQUAL((int)parse_duration("250ms"), 250, "Millisecond suffix");
+  TEST_EQUAL((int)parse_duration("2m"), 120000, "Minute suffix");
+  TEST_EQUAL((int)parse_duration("-1"), -1, "Negative durations are rejected");
+  TEST_EQUAL((int)parse_duration("5x"), -1, "Unknown suffixes are rejected");
+
+  command_t *cmd = parse_command("timeout -k 1 2.5 sleep 9 | cat");
+  TEST_STRING_EQUAL(cmd->argv[0], "sleep", "timeout prefix is not part of argv");
+  TEST_EQUAL((int)cmd->timeout_ms, 2500, "Deadline parsed");
+  TEST_EQUAL((int)cmd->kill_after_ms, 1000, "Kill-after parsed");
+  free_command(cmd);
+
+  cmd = parse_command("timeout --help");
+  TEST_STRING_EQUAL(cmd->argv[0], "timeout", "Anything else runs the timeout program");
+  free_command(cmd);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cmd = parse_command("timeout 0.2 sleep 5");
+  execute_command(cmd);
+  free_command(cmd);
+  TEST_EQUAL(get_last_status(), JOB_TIMEOUT_STATUS, "Job past its deadline gets SIGTERM");
+  TEST_ASSERT(elapsed_since(&start) < 2, "Deadline fires on time");
+
+  cmd = parse_command("timeout 5 sh -c \"exit 3\"");
+  execute_command(cmd);
+  free_command(cmd);
+  TEST_EQUAL(get_last_status(), 3, "Job within its deadline keeps its status");
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cmd = parse_command("timeout -k 0.1 0.1 sh -c \"trap '' TERM; sleep 5\" | cat");
+  execute_command(cmd);
+  free_command(cmd);
+  TEST_EQUAL(get_last_status(), 128 + SIGKILL, "Job ignoring SIGTERM gets SIGKILL");
+  TEST_ASSERT(elapsed_since(&start) < 2, "SIGKILL follows after the grace period");
+
+  /* Builtins reading a pipe nobody writes to must still meet the deadline */
+  int saved_in = dup(STDIN_FILENO), stalled[2];
+  if (pipe(stalled) == 0)
+  {
+    dup2(stalled[0], STDIN_FILENO);
+    close(stalled[0]);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cmd = parse_command("timeout 0.2 wc -l");
+    execute_command(cmd);
+    free_command(cmd);
+    TEST_EQUAL(get_last_status(), JOB_TIMEOUT_STATUS, "Timed builtin reading a stalled pipe is stopped");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cmd = parse_command("timeout 0.2 head -n 1 | wc -l > /dev/null");
+    execute_command(cmd);
+    free_command(cmd);
+    TEST_EQUAL(get_last_status(), JOB_TIMEOUT_STATUS, "Timed builtin pipeline is not fused into threads");
+    TEST_ASSERT(elapsed_since(&start) < 2, "Builtin stages meet the deadline");
+    close(stalled[1]);
+    dup2(saved_in, STDIN_FILENO);
+  }
+  close(saved_in);
+  TEST_EQUAL(jobs_pending_deadlines(), 0, "Finished jobs leave no deadlines behind");
+}
+
+/**
+ * Test Suite 18: Metrics
+ */
+void test_metrics(void)
+{
+  metrics_reset();
+  for (int i = 1; i <= 1000; i++)
+    metrics_observe(METRIC_COMMAND_TIME, i * 1000);
+  int64_t p50 = metrics_percentile(METRIC_COMMAND_TIME, 50);
+  int64_t p99 = metrics_percentile(METRIC_COMMAND_TIME, 99);
+  TEST_EQUAL((int)metrics_samples(METRIC_COMMAND_TIME), 1000, "Every sample is counted");
+  TEST_ASSERT(p50 >= 500000 && p50 <= 500000 * 1.02, "p50 within the histogram's precision");
+  TEST_ASSERT(p99 >= 990000 && p99 <= 990000 * 1.02, "p99 within the histogram's precision");
+  TEST_EQUAL((int)metrics_percentile(METRIC_COMMAND_TIME, 100), 1000000, "p100 is the largest sample");
+  TEST_EQUAL((int)metrics_percentile(METRIC_LAUNCH_LATENCY, 50), 0, "Empty histogram reports 0");
+
+  command_t *cmd = parse_command("true");
+  execute_command(cmd);
+  free_command(cmd);
+  cmd = parse_command("/nonexistent/program");
+  execute_command(cmd);
+  free_command(cmd);
+  TEST_EQUAL((int)metrics_counter(METRIC_FORKS), 2, "Forks are counted");
+  TEST_EQUAL((int)metrics_counter(METRIC_EXEC_FAILURES), 1, "A child's failed exec reaches the shell's registry");
+  TEST_EQUAL((int)metrics_samples(METRIC_LAUNCH_LATENCY), 2, "Children record their launch latency");
+  TEST_EQUAL((int)metrics_samples(METRIC_PARSE_TIME), 2, "Parse time recorded per command line");
+
+  char *text = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&text, &len);
+  metrics_print_prometheus(out);
+  fclose(out);
+  TEST_ASSERT(strstr(text, "shell_forks_total 2\n") != NULL, "Prometheus counter line");
+  TEST_ASSERT(strstr(text, "shell_command_duration_seconds_bucket{le=\"1e-06\"} 1\n") != NULL,
+              "Prometheus bucket bounds are inclusive");
+  TEST_ASSERT(strstr(text, "shell_command_duration_seconds_bucket{le=\"0.001\"} 1000\n") != NULL,
+              "Prometheus buckets are cumulative");
+  TEST_ASSERT(strstr(text, "shell_command_duration_seconds_count 1000\n") != NULL, "Prometheus sample count");
+  free(text);
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/mini_shell_metrics_%d.sock", (int)getpid());
+  TEST_EQUAL(metrics_listen(path), 0, "Exporter listens on a Unix socket");
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  TEST_EQUAL(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0, "Exporter accepts connections");
+  const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+  write(fd, request, strlen(request));
+  char reply[8192];
+  size_t got = 0;
+  ssize_t n;
+  while (got < sizeof(reply) - 1 && (n = read(fd, reply + got, sizeof(reply) - 1 - got)) > 0)
+    got += n;
+  reply[got] = '\0';
+  close(fd);
+  TEST_ASSERT(strncmp(reply, "HTTP/1.0 200 OK", 15) == 0, "HTTP scrapers get a response header");
+  TEST_ASSERT(strstr(reply, "shell_exec_failures_total 1\n") != NULL, "Socket serves the metrics");
+}
+
+// Parse and run one command line the way the shell does; returns its status
+static int run_line(const char *line)
+{
+  command_t *cmd = parse_command(line);
+  int status = run_command(cmd);
+  free_command(cmd);
+  return status;
+}
+
+/**
+ * Test Suite 19: Output Cache
+ */
+void test_output_cache(void)
+{
+  char dir[] = "/tmp/mini_shell_cache_XXXXXX";
+  mkdtemp(dir);
+  setenv("SHELL_CACHE_DIR", dir, 1);
+  TEST_STRING_EQUAL(cache_dir(), dir, "Cache directory from SHELL_CACHE_DIR");
+
+  command_t *cmd = parse_command("cache sort -r < in.txt");
+  TEST_EQUAL(cmd->cached, 1, "cache prefix parsed");
+  TEST_STRING_EQUAL(cmd->argv[0], "sort", "cache prefix is not part of argv");
+  free_command(cmd);
+
+  char input[256], counter[256], output[256], line[1024];
+  snprintf(input, sizeof(input), "%s/in.txt", dir);
+  snprintf(counter, sizeof(counter), "%s/runs", dir);
+  snprintf(output, sizeof(output), "%s/out.txt", dir);
+  FILE *f = fopen(input, "w");
+  fputs("b\na\nc\n", f);
+  fclose(f);
+
+  // The command leaves a mark each time it really runs
+  snprintf(line, sizeof(line), "cache sh -c \"echo x >> %s; sort; exit 3\" < %s > %s", counter, input, output);
+  uint64_t misses = metrics_counter(METRIC_CACHE_MISSES);
+  TEST_EQUAL(run_line(line), 3, "First run reports the command's status");
+  TEST_EQUAL(run_line(line), 3, "Replay reports the stored status");
+  char *text = read_text(output);
+  TEST_STRING_EQUAL(text, "a\nb\nc\n", "Replay writes the stored output");
+  free(text);
+  text = read_text(counter);
+  TEST_STRING_EQUAL(text, "x\n", "Second run came from the cache");
+  free(text);
+  TEST_EQUAL((int)(metrics_counter(METRIC_CACHE_MISSES) - misses), 1, "One miss counted");
+
+  // Changed input content means a new key
+  f = fopen(input, "a");
+  fputs("d\n", f);
+  fclose(f);
+  run_line(line);
+  text = read_text(output);
+  TEST_STRING_EQUAL(text, "a\nb\nc\nd\n", "Changed input runs the command again");
+  free(text);
+
+  setenv("SHELL_CACHE_ENV", "MINI_SHELL_TEST_MODE", 1);
+  setenv("MINI_SHELL_TEST_MODE", "1", 1);
+  run_line(line);
+  text = read_text(counter);
+  TEST_STRING_EQUAL(text, "x\nx\nx\n", "Selected environment is part of the key");
+  free(text);
+  unsetenv("SHELL_CACHE_ENV");
+  unsetenv("MINI_SHELL_TEST_MODE");
+
+  // Input piped to the shell is not in the key, so it is never cached
+  int saved_stdin = dup(STDIN_FILENO);
+  const char *piped[] = {"x\n", "a\nb\nc\nd\n"};
+  const char *counts[] = {"1\n", "4\n"};
+  snprintf(line, sizeof(line), "cache wc -l > %s", output);
+  for (int i = 0; i < 2; i++)
+  {
+    int fds[2];
+    pipe(fds);
+    write(fds[1], piped[i], strlen(piped[i]));
+    close(fds[1]);
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    run_line(line);
+    text = read_text(output);
+    TEST_STRING_EQUAL(text, counts[i], i ? "Different piped input is counted again" : "Piped input is counted");
+    free(text);
+  }
+  dup2(saved_stdin, STDIN_FILENO);
+  close(saved_stdin);
+
+  // Builtins that print the shell's state are never replayed
+  char key[CACHE_KEY_SIZE];
+  const char *stateful[] = {"cache history", "cache jobs", "cache stats | wc -l", "cache cd /", NULL};
+  int refused = 1;
+  for (int i = 0; stateful[i]; i++)
+  {
+    cmd = parse_command(stateful[i]);
+    refused &= cache_key(cmd, key) == -1;
+    free_command(cmd);
+  }
+  TEST_ASSERT(refused, "Stateful builtins are not cached");
+  cmd = parse_command("cache grep -F a < /dev/null | cut -d , -f 1 | wc -l");
+  TEST_EQUAL(cache_key(cmd, key), 0, "Text filters are cached");
+  free_command(cmd);
+
+  snprintf(line, sizeof(line), "cache stats > %s", output);
+  misses = metrics_counter(METRIC_CACHE_MISSES);
+  run_line(line);
+  char *before = read_text(output);
+  metrics_count(METRIC_COMMANDS);
+  run_line(line);
+  text = read_text(output);
+  TEST_ASSERT(before && text && strcmp(before, text) != 0, "cache stats shows the current counts");
+  TEST_EQUAL((int)(metrics_counter(METRIC_CACHE_MISSES) - misses), 0, "Uncacheable command is no miss");
+  free(before);
+  free(text);
+
+  // A 1 MiB store keeps entries up to 256 KiB; filling it evicts the oldest
+  set_option("cache_size=1", 1);
+  for (int i = 0; i < 8; i++)
+  {
+    snprintf(line, sizeof(line), "cache sh -c \"head -c 200000 /dev/zero\" %d < /dev/null > /dev/null", i);
+    run_line(line);
+  }
+  long total = 0;
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  while ((entry = readdir(d)))
+  {
+    struct stat st;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (strlen(entry->d_name) == CACHE_KEY_SIZE - 1 && stat(path, &st) == 0)
+      total += st.st_size;
+  }
+  closedir(d);
+  TEST_ASSERT(total > 0 && total <= 1 << 20, "Store stays within its size bound");
+  set_option("cache_size=64", 1);
+
+  char cleanup[512];
+  snprintf(cleanup, sizeof(cleanup), "rm -rf %s", dir);
+  system(cleanup);
+  unsetenv("SHELL_CACHE_DIR");
+}
+
+static int count_open_fds(void)
+{
+  int count = 0;
+  DIR *d = opendir("/proc/self/fd");
+  while (d && readdir(d))
+    count++;
+  if (d)
+    closedir(d);
+  return count;
+}
+
+/**
+ * Test Suite 20: Builtin Redirection
+ */
+void test_builtin_redirection(void)
+{
+  char in_path[] = "/tmp/mini_shell_redir_XXXXXX";
+  int fd = mkstemp(in_path);
+  dprintf(fd, "one\ntwo\nthree\n");
+  close(fd);
+  char out_path[64];
+  snprintf(out_path, sizeof(out_path), "%s.out", in_path);
+
+  struct stat before, after;
+  fstat(STDOUT_FILENO, &before);
+  int open_fds = count_open_fds();
+  uint64_t forks = metrics_counter(METRIC_FORKS);
+
+  char line[256];
+  snprintf(line, sizeof(line), "head -n 2 < %s > %s", in_path, out_path);
+  command_t *cmd = parse_command(line);
+  TEST_EQUAL(builtin_runs_inline(cmd), 1, "Redirected builtin runs in the shell");
+  run_builtin(cmd);
+  free_command(cmd);
+  TEST_EQUAL(get_last_status(), 0, "Redirected builtin succeeds");
+
+  char *text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "one\ntwo\n", "Builtin reads and writes the redirection targets");
+  free(text);
+  TEST_EQUAL((int)(metrics_counter(METRIC_FORKS) - forks), 0, "No process was forked");
+
+  fstat(STDOUT_FILENO, &after);
+  TEST_ASSERT(before.st_ino == after.st_ino && before.st_dev == after.st_dev, "Shell's stdout is restored");
+  TEST_EQUAL(count_open_fds(), open_fds, "Saved descriptors are closed");
+
+  cmd = parse_command("wc -l < /nonexistent/input");
+  run_builtin(cmd);
+  free_command(cmd);
+  TEST_EQUAL(get_last_status(), 1, "Unreadable input fails without running the builtin");
+
+  cmd = parse_command("wc -l &");
+  TEST_EQUAL(builtin_runs_inline(cmd), 0, "Background builtins still need a process");
+  free_command(cmd);
+
+  // No descriptor left for the pipe after the ring between the two
+  // builtins: nothing starts, and the ring is freed with the rest
+  int lowest_free = dup(STDIN_FILENO);
+  close(lowest_free);
+  struct rlimit saved_limit, no_fds;
+  getrlimit(RLIMIT_NOFILE, &saved_limit);
+  no_fds = saved_limit;
+  no_fds.rlim_cur = lowest_free;
+  size_t heap_before = mallinfo2().uordblks;
+  setrlimit(RLIMIT_NOFILE, &no_fds);
+  int status = run_line("head -n 1 | wc -l | cat");
+  setrlimit(RLIMIT_NOFILE, &saved_limit);
+  TEST_EQUAL(status, 1, "Pipeline that cannot be set up fails");
+  TEST_ASSERT(mallinfo2().uordblks < heap_before + 32768, "Ring of an unstarted pipeline is freed");
+  TEST_EQUAL(count_open_fds(), open_fds, "Unstarted pipeline closes its descriptors");
+
+  unlink(out_path);
+  unlink(in_path);
+}
+
+/**
+ * Test Suite 21: Argument Batching
+ */
+void test_argument_batching(void)
+{
+  char out[] = "/tmp/mini_shell_batch_XXXXXX";
+  close(mkstemp(out));
+  char line[256];
+  snprintf(line, sizeof(line), "printf %%s\\n $(seq 1 400000) END > %s", out);
+
+  command_t *cmd = parse_command(line);
+  expand_command(cmd);
+  TEST_EQUAL(cmd->expanded_first, 2, "Generated words start after the fixed prefix");
+  TEST_EQUAL(cmd->expanded_end, 400002, "Generated words end before the fixed suffix");
+  execute_command(cmd);
+  TEST_ASSERT(get_last_status() != 0, "Without batching the list is too long to exec");
+
+  set_option("batch=1", 1);
+  execute_command(cmd);
+  free_command(cmd);
+  TEST_EQUAL(get_last_status(), 0, "Batched run succeeds");
+
+  FILE *f = fopen(out, "r");
+  char word[32];
+  long lines = 0, ends = 0, expect = 1, in_order = 1;
+  while (fscanf(f, "%31s", word) == 1)
+  {
+    lines++;
+    if (strcmp(word, "END") == 0)
+      ends++;
+    else if (atol(word) != expect++)
+      in_order = 0;
+  }
+  fclose(f);
+  TEST_EQUAL((int)(lines - ends), 400000, "Every argument is passed exactly once");
+  TEST_ASSERT(ends > 1 && ends < 10, "Arguments split into a few maximal batches");
+  TEST_EQUAL((int)in_order, 1, "Sequential batches keep the argument order");
+
+  set_option("batch=4", 1);
+  TEST_EQUAL(run_line("sh -c \"exit 0\" $(seq 1 400000)"), 0, "Parallel batches succeed");
+  TEST_EQUAL(run_line("sh -c \"exit 1\" $(seq 1 400000)"), 123, "A failing batch gives 123");
+  TEST_EQUAL(run_line("sh -c \"exit 255\" $(seq 1 400000)"), 124, "Exit 255 gives 124");
+  char script[] = "/tmp/mini_shell_batch_kill_XXXXXX";
+  int fd = mkstemp(script);
+  dprintf(fd, "#!/bin/sh\nkill -9 $$\n");
+  close(fd);
+  chmod(script, 0700);
+  snprintf(line, sizeof(line), "%s $(seq 1 400000)", script);
+  TEST_EQUAL(run_line(line), 125, "A killed batch gives 125");
+
+  // Under a deadline every batch joins one process group, which the deadline ends
+  fd = open(script, O_WRONLY | O_TRUNC);
+  dprintf(fd, "#!/bin/sh\ncut -d' ' -f5 /proc/$$/stat >> %s\n", out);
+  close(fd);
+  truncate(out, 0);
+  snprintf(line, sizeof(line), "timeout 5 %s $(seq 1 400000)", script);
+  TEST_EQUAL(run_line(line), 0, "Batches within their deadline succeed");
+  f = fopen(out, "r");
+  long pgid, group = 0, groups = 0;
+  for (lines = 0; fscanf(f, "%ld", &pgid) == 1; lines++)
+  {
+    groups += pgid != group;
+    group = pgid;
+  }
+  fclose(f);
+  TEST_ASSERT(lines > 1 && groups == 1 && group != getpgrp(), "Batches share a process group of their own");
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  TEST_EQUAL(run_line("timeout 0.2 sh -c \"sleep 5\" $(seq 1 400000)"), 125, "Deadline stops every batch");
+  TEST_ASSERT(elapsed_since(&start) < 3, "Batches end at the deadline");
+  unlink(script);
+  set_option("batch", 0);
+  unlink(out);
+}
+
+static void *send_interrupt(void *arg)
+{
+  usleep(100000);
+  kill(getpid(), SIGINT);
+  return NULL;
+}
+
+// Run a builtin line in the shell process, interrupting it after 100 ms
+static int64_t interrupt_builtin_line(const char *line)
+{
+  pthread_t sender;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_create(&sender, NULL, send_interrupt, NULL);
+  run_line(line);
+  pthread_join(sender, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+/**
+ * Test Suite 22: Text Filters
+ */
+void test_text_filters(void)
+{
+  // Kernels against byte-at-a-time answers, across the vector and lane
+  // boundaries (32 bytes, 255 * 32 bytes)
+  size_t size = 20000;
+  char *buf = malloc(size);
+  srand(22);
+  for (size_t i = 0; i < size; i++)
+    buf[i] = "ab\n,cd"[rand() % 6];
+
+  int counts_ok = 1, nth_ok = 1, find_ok = 1, find2_ok = 1;
+  for (size_t len = 0; len <= size; len += len < 100 ? 1 : 997)
+  {
+    size_t newlines = 0;
+    const char *first_either = NULL, *first_match = NULL;
+    for (size_t i = 0; i < len; i++)
+    {
+      newlines += buf[i] == '\n';
+      if (!first_either && (buf[i] == ',' || buf[i] == 'd'))
+        first_either = buf + i;
+      if (!first_match && i + 5 <= len && memcmp(buf + i, "cd\nab", 5) == 0)
+        first_match = buf + i;
+    }
+    counts_ok &= scan_count(buf, len, '\n') == newlines;
+    find2_ok &= scan_find2(buf, buf + len, ',', 'd') == first_either;
+    find_ok &= scan_find(buf, len, "cd\nab", 5) == first_match;
+
+    size_t want = newlines / 2 + 1, seen = 0;
+    const char *expected = NULL;
+    for (size_t i = 0; i < len && !expected; i++)
+    {
+      if (buf[i] == '\n' && ++seen == want)
+        expected = buf + i;
+    }
+    size_t n = want;
+    nth_ok &= scan_nth(buf, len, '\n', &n) == expected && n == (expected ? 0 : want - newlines);
+  }
+  free(buf);
+  TEST_ASSERT(counts_ok, "scan_count matches a plain count");
+  TEST_ASSERT(nth_ok, "scan_nth finds the n-th newline or reports what is left");
+  TEST_ASSERT(find_ok, "scan_find finds the first occurrence");
+  TEST_ASSERT(find2_ok, "scan_find2 finds the first of two bytes");
+
+  char *argv_regex[] = {"grep", "needle", NULL};
+  char *argv_file[] = {"grep", "-F", "needle", "file", NULL};
+  char *argv_chars[] = {"cut", "-c", "1-3", NULL};
+  char *argv_cut[] = {"cut", "-d", ",", "-f", "1,3-", NULL};
+  TEST_ASSERT(!is_builtin(argv_regex), "grep without -F runs the program");
+  TEST_ASSERT(!is_builtin(argv_file), "grep with a file operand runs the program");
+  TEST_ASSERT(!is_builtin(argv_chars), "cut -c runs the program");
+  TEST_ASSERT(is_builtin(argv_cut), "cut -d , -f LIST is a builtin");
+
+  char in_path[] = "/tmp/mini_shell_filter_XXXXXX";
+  int fd = mkstemp(in_path);
+  dprintf(fd, "1,ann,needle\n2,bob,hay\n3,cy\nplain\n4,dee,needle,x");
+  close(fd);
+  char out_path[64], line[256];
+  snprintf(out_path, sizeof(out_path), "%s.out", in_path);
+
+  snprintf(line, sizeof(line), "grep -F needle < %s > %s", in_path, out_path);
+  run_line(line);
+  char *text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "1,ann,needle\n4,dee,needle,x\n", "grep -F prints matching lines");
+  free(text);
+  TEST_EQUAL(get_last_status(), 0, "grep -F succeeds on a match");
+
+  snprintf(line, sizeof(line), "grep -Fvc needle < %s > %s", in_path, out_path);
+  run_line(line);
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "3\n", "grep -F -v -c counts the other lines");
+  free(text);
+
+  snprintf(line, sizeof(line), "grep -F absent < %s > %s", in_path, out_path);
+  run_line(line);
+  TEST_EQUAL(get_last_status(), 1, "grep -F fails without a match");
+
+  snprintf(line, sizeof(line), "cut -d , -f 1,3- < %s > %s", in_path, out_path);
+  run_line(line);
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "1,needle\n2,hay\n3\nplain\n4,needle,x\n", "cut keeps selected fields in order");
+  free(text);
+
+  // Over a MiB: the mmap'd path, ending without a newline
+  fd = open(in_path, O_WRONLY | O_TRUNC);
+  for (int i = 0; i < 300000; i++)
+    dprintf(fd, i < 299999 ? "line %d\n" : "line %d", i);
+  close(fd);
+
+  snprintf(line, sizeof(line), "wc -l < %s > %s", in_path, out_path);
+  run_line(line);
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "299999\n", "wc -l counts newlines of a mapped file");
+  free(text);
+
+  snprintf(line, sizeof(line), "head -n 150000 < %s | grep -F 9 | wc -l > %s", in_path, out_path);
+  run_line(line);
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "58146\n", "Fused filter pipeline");
+  free(text);
+
+  // Builtins run in the shell, which ignores SIGINT; Ctrl-C still stops
+  // them. The FIFO never reaches end of input: its writer stays open.
+  char fifo[] = "/tmp/mini_shell_fifo_XXXXXX";
+  close(mkstemp(fifo));
+  unlink(fifo);
+  mkfifo(fifo, 0600);
+  int writer = open(fifo, O_RDWR);
+  signal(SIGINT, SIG_IGN);
+
+  write(writer, "one\n", 4);
+  snprintf(line, sizeof(line), "head -n 5 < %s > %s", fifo, out_path);
+  TEST_ASSERT(interrupt_builtin_line(line) < 2000, "Ctrl-C stops head waiting for input");
+  TEST_EQUAL(get_last_status(), 130, "Interrupted builtin exits with 128 + SIGINT");
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "one\n", "head keeps what it copied before the interrupt");
+  free(text);
+
+  snprintf(line, sizeof(line), "wc -l < %s > %s", fifo, out_path);
+  TEST_ASSERT(interrupt_builtin_line(line) < 2000, "Ctrl-C stops wc -l");
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "", "Interrupted wc -l prints no partial count");
+  free(text);
+
+  snprintf(line, sizeof(line), "grep -F one < %s > %s", fifo, out_path);
+  write(writer, "one\ntwo\n", 8);
+  TEST_ASSERT(interrupt_builtin_line(line) < 2000, "Ctrl-C stops grep -F");
+  TEST_EQUAL(get_last_status(), 130, "Interrupted grep -F exits with 130");
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "one\n", "grep -F keeps the matches before the interrupt");
+  free(text);
+
+  snprintf(line, sizeof(line), "cut -d , -f 2 < %s > %s", fifo, out_path);
+  write(writer, "a,b\n", 4);
+  TEST_ASSERT(interrupt_builtin_line(line) < 2000, "Ctrl-C stops cut");
+  TEST_EQUAL(get_last_status(), 130, "Interrupted cut exits with 130");
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "b\n", "cut keeps the fields before the interrupt");
+  free(text);
+
+  struct sigaction action;
+  sigaction(SIGINT, NULL, &action);
+  TEST_ASSERT(action.sa_handler == SIG_IGN, "SIGINT is ignored again afterwards");
+  run_line("history > /dev/null");
+  TEST_EQUAL(get_last_status(), 0, "Next builtin is not interrupted");
+
+  signal(SIGINT, SIG_DFL);
+  close(writer);
+  unlink(fifo);
+
+  // A filter without < shares stdin with the shell, which reads its lines
+  // with read() and gives back what it read past them. The filter reads
+  // the fd too, never the stdio buffer, and leaves the offset just after
+  // what it used, so the shell reads on from there: on the read path and
+  // on the mapped one.
+  int saved_stdin = dup(STDIN_FILENO);
+  for (int mapped = 0; mapped <= 1; mapped++)
+  {
+    fd = open(in_path, O_WRONLY | O_TRUNC);
+    dprintf(fd, "head -n 2\n");
+    for (int i = 0; i < (mapped ? 300000 : 3); i++)
+      dprintf(fd, "line %d\n", i);
+    close(fd);
+
+    fd = open(in_path, O_RDONLY);
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+    char script_line[16] = "";
+    read(STDIN_FILENO, script_line, 10);
+    script_line[strcspn(script_line, "\n")] = '\0';
+
+    snprintf(line, sizeof(line), "%s > %s", script_line, out_path);
+    run_line(line);
+    text = read_text(out_path);
+    TEST_STRING_EQUAL(text, "line 0\nline 1\n", mapped ? "Mapped shared stdin: head reads its lines" : "Shared stdin: head reads its lines");
+    free(text);
+
+    char rest[8] = "";
+    read(STDIN_FILENO, rest, 7);
+    TEST_STRING_EQUAL(rest, "line 2\n", mapped ? "Mapped shared stdin: the shell reads on after head" : "Shared stdin: the shell reads on after head");
+  }
+  dup2(saved_stdin, STDIN_FILENO);
+  close(saved_stdin);
+
+  unlink(out_path);
+  unlink(in_path);
+}
+
+/**
+ * Test Suite 23: Aliases and Functions
+ */
+void test_names(void)
+{
+  // Every builtin is found by the perfect hash, other words are not
+  const char *lines[] = {"cd /", "exit", "set -e", "trace on", "ulimit -n", "alias", "unalias -a",
+                         "unset -f f", "history", "stats", "functions", "jobs", "meminfo", "head -n 1",
+                         "wc -l", "grep -F x", "cut -f 1", NULL};
+  int found = 1;
+  for (int i = 0; lines[i]; i++)
+  {
+    char **argv = tokenize(lines[i]);
+    found &= builtin_lookup(argv) != NULL;
+    free_tokens(argv);
+  }
+  TEST_ASSERT(found, "Every builtin name is found");
+  TEST_EQUAL(builtins_unreachable(), 0, "Every table entry sits at the hash of its name");
+  char *ls_argv[] = {"ls", "-l", NULL};
+  char *echo_argv[] = {"echo", NULL};
+  char *grep_argv[] = {"grep", "-E", "x", NULL};
+  TEST_ASSERT(builtin_lookup(ls_argv) == NULL, "ls is not a builtin");
+  TEST_ASSERT(builtin_lookup(echo_argv) == NULL, "echo is not a builtin");
+  TEST_ASSERT(builtin_lookup(grep_argv) == NULL, "grep without -F is left to the program");
+
+  // Aliases are spliced at parse time, recursion stops at the alias itself
+  run_line("alias greet=\"echo hi  there\"");
+  command_t *cmd = parse_command("greet you");
+  TEST_ASSERT(cmd->argv[3] && !cmd->argv[4], "Alias value is spliced before the arguments");
+  TEST_STRING_EQUAL(cmd->argv[0], "echo", "Alias replaces the command word");
+  TEST_STRING_EQUAL(cmd->argv[3], "you", "Arguments follow the alias value");
+  free_command(cmd);
+
+  run_line("alias ls=\"ls -d\"");
+  cmd = parse_command("ls /tmp | ls");
+  TEST_ASSERT(cmd->argv[2] && !cmd->argv[3], "Self-referencing alias expands once");
+  TEST_ASSERT(cmd->pipe_to->argv[1] && !cmd->pipe_to->argv[2], "Alias expands in every pipeline stage");
+  free_command(cmd);
+
+  run_line("alias loop1=loop2");
+  run_line("alias loop2=loop1");
+  cmd = parse_command("loop1");
+  TEST_STRING_EQUAL(cmd->argv[0], "loop1", "Alias loop ends at the first repeated name");
+  free_command(cmd);
+
+  cmd = parse_command("echo greet");
+  TEST_STRING_EQUAL(cmd->argv[1], "greet", "Only the command word is an alias");
+  free_command(cmd);
+
+  run_line("unalias greet");
+  TEST_EQUAL(get_last_status(), 0, "unalias removes an alias");
+  run_line("unalias greet");
+  TEST_EQUAL(get_last_status(), 1, "unalias fails for an unknown name");
+  run_line("unalias -a");
+  TEST_ASSERT(names_lookup("ls") == NULL, "unalias -a removes every alias");
+
+  // Functions are parsed once and called without a process
+  char out_path[] = "/tmp/mini_shell_names_XXXXXX";
+  close(mkstemp(out_path));
+  char line[256];
+
+  cmd = parse_command("show() { echo $0 $1 of $#; echo all $@ }");
+  TEST_ASSERT(cmd->defines != NULL, "Definition is recognized");
+  TEST_EQUAL(run_command(cmd), 0, "Definition succeeds");
+  free_command(cmd);
+  const name_entry_t *entry = names_lookup("show");
+  TEST_ASSERT(entry && entry->function && entry->function->body[1] && !entry->function->body[2],
+              "Body is stored as two parsed commands");
+
+  cmd = parse_command("show a b");
+  TEST_ASSERT(cmd->function == entry->function, "Command word resolves to the function");
+  TEST_EQUAL(cmd->is_exec, 1, "A call is not a builtin");
+  free_command(cmd);
+
+  snprintf(line, sizeof(line), "show a b > %s", out_path);
+  pid_t shell_pid = getpid();
+  run_line(line);
+  TEST_EQUAL(getpid(), shell_pid, "Call returns to the shell");
+  char *text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "show a of 2\nall a b\n", "Positional parameters are bound");
+  free(text);
+
+  snprintf(line, sizeof(line), "show x y z | wc -l > %s", out_path);
+  run_line(line);
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "2\n", "Function runs as a pipeline stage");
+  free(text);
+
+  // Redefinition, calls between functions, nesting limit
+  run_line("show() { echo new $1 }");
+  run_line("twice() { show $1; show $1 }");
+  snprintf(line, sizeof(line), "twice z > %s", out_path);
+  run_line(line);
+  text = read_text(out_path);
+  TEST_STRING_EQUAL(text, "new z\nnew z\n", "Functions call the current definitions");
+  free(text);
+
+  run_line("forever() { forever }");
+  TEST_EQUAL(run_line("forever"), 1, "Runaway recursion stops at the nesting limit");
+
+  // A function never shadows a special builtin
+  run_line("cd() { echo shadow }");
+  cmd = parse_command("cd /");
+  TEST_ASSERT(cmd->function == NULL && cmd->builtin != NULL, "cd stays a builtin");
+  free_command(cmd);
+
+  cmd = parse_command("bad() { echo");
+  TEST_ASSERT(cmd->syntax_error, "Unterminated definition is a syntax error");
+  free_command(cmd);
+
+  run_line("unset -f show");
+  TEST_ASSERT(names_lookup("show") == NULL, "unset -f removes a function");
+  run_line("unset -f twice");
+  run_line("unset -f forever");
+  run_line("unset -f cd");
+  unlink(out_path);
+}
+
+/**
+ * Test Suite 24: Session Recording
+ */
+void test_session_recording(void)
+{
+  char path[] = "/tmp/mini_shell_record_XXXXXX";
+  close(mkstemp(path));
+
+  TEST_EQUAL(record_start(path), 0, "Recording starts");
+  record_command("ls -l\n", 1000, "/home/u", 250, 0);
+  record_command("echo \"a\tb\\c\"", 2000, "/tmp/with\ttab", 75, 1);
+  record_stop();
+  record_command("not recorded", 3000, "/", 1, 0);
+
+  int fd = open(path, O_WRONLY | O_APPEND);
+  dprintf(fd, "garbage without fields\n");
+  close(fd);
+
+  int count = 0;
+  record_entry_t *entries = record_load(path, &count);
+  TEST_ASSERT(entries != NULL, "Recording loads");
+  TEST_EQUAL(count, 2, "Comments, malformed lines and stopped recording are skipped");
+  TEST_STRING_EQUAL(entries[0].line, "ls -l", "Trailing newline is dropped");
+  TEST_STRING_EQUAL(entries[0].cwd, "/home/u", "Working directory is stored");
+  TEST_ASSERT(entries[0].start_us == 1000 && entries[0].latency_us == 250, "Times are stored");
+  TEST_STRING_EQUAL(entries[1].line, "echo \"a\tb\\c\"", "Tabs and backslashes round-trip");
+  TEST_STRING_EQUAL(entries[1].cwd, "/tmp/with\ttab", "Escaped directory round-trips");
+  TEST_EQUAL(entries[1].status, 1, "Exit status is stored");
+  record_free(entries, count);
+
+  char *text = read_text(path);
+  int lines = 0;
+  for (char *p = text; *p; p++)
+    lines += *p == '\n';
+  TEST_EQUAL(lines, 4, "One line per record");
+  free(text);
+  unlink(path);
+}
+
+// Run the reaping loop until the queue is empty and every job finished
+static int drain_jobs(double seconds)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (jobs_queued() > 0 || jobs_running() > 0)
+  {
+    if (elapsed_since(&start) > seconds)
+      return -1;
+    jobs_dispatch();
+    usleep(5000);
+  }
+  return 0;
+}
+
+/**
+ * Test Suite 25: Background Job Queue
+ */
+void test_job_queue(void)
+{
+  char dir[] = "/tmp/mini_shell_jobs_XXXXXX";
+  mkdtemp(dir);
+  char line[512], path[256];
+
+  set_option("max_jobs=1", 1);
+  TEST_EQUAL(jobs_limit(), 1, "max_jobs sets the limit");
+  TEST_EQUAL(jobs_admit(), 1, "A free slot admits a job");
+
+  run_line("sleep 0.3 &");
+  TEST_EQUAL(jobs_running(), 1, "First job starts at once");
+  TEST_EQUAL(jobs_admit(), 0, "Full slots admit nothing");
+
+  // Queued in order 1, 2, 3; each appends its name when it runs
+  snprintf(path, sizeof(path), "%s/order", dir);
+  const char *names[] = {"first", "second", "third"};
+  for (int i = 0; i < 3; i++)
+  {
+    snprintf(line, sizeof(line), "sh -c \"echo %s >> %s\" &", names[i], path);
+    run_line(line);
+  }
+  TEST_EQUAL(jobs_queued(), 3, "Jobs beyond the limit are queued");
+  TEST_EQUAL(jobs_running(), 1, "Queued jobs do not run");
+
+  run_line("jobs -f 3");
+  TEST_EQUAL(get_last_status(), 0, "jobs -f moves a queued job");
+  run_line("jobs -r 2");
+  TEST_EQUAL(jobs_queued(), 2, "jobs -r removes a queued job");
+  run_line("jobs -r 2");
+  TEST_EQUAL(get_last_status(), 1, "Unknown job id is an error");
+  run_line("jobs -p x 1");
+  TEST_EQUAL(get_last_status(), 2, "Malformed priority is a usage error");
+
+  // A foreground command's wait starts queued jobs as slots free up
+  run_line("sleep 1");
+  TEST_EQUAL(jobs_queued(), 0, "Queue drains during a foreground wait");
+  TEST_EQUAL(drain_jobs(5), 0, "Every job finishes");
+  char *text = read_text(path);
+  TEST_STRING_EQUAL(text, "third\nfirst\n", "Queue runs in its order, without removed jobs");
+  free(text);
+  unlink(path);
+
+  // Priority order: @nice, then jobs -p
+  set_option("job_priority", 1);
+  run_line("sleep 0.2 &");
+  snprintf(line, sizeof(line), "sh -c \"echo low >> %s\" &", path);
+  run_line(line);
+  snprintf(line, sizeof(line), "@nice=5 sh -c \"echo nicest >> %s\" &", path);
+  run_line(line);
+  snprintf(line, sizeof(line), "sh -c \"echo raised >> %s\" &", path);
+  run_line(line);
+  // Ids count on from the first three queued jobs: "raised" is job 6
+  run_line("jobs -p 3 6");
+  TEST_EQUAL(get_last_status(), 0, "jobs -p sets a queued job's priority");
+  TEST_EQUAL(drain_jobs(5), 0, "Prioritized jobs finish");
+  text = read_text(path);
+  TEST_STRING_EQUAL(text, "raised\nlow\nnicest\n", "Higher priority starts first");
+  free(text);
+  unlink(path);
+
+  set_option("job_priority", 0);
+  set_option("max_jobs", 0);
+  TEST_ASSERT(jobs_limit() >= 1, "Default limit follows the CPU count");
+  rmdir(dir);
+}
+
+// Live bytes attributed to a subsystem
+static int live_bytes(mem_subsystem_t subsystem)
+{
+  mem_usage_t u;
+  mem_usage(subsystem, &u);
+  return (int)u.bytes;
+}
+
+/**
+ * Test Suite 26: Memory Accounting
+ */
+void test_memory_accounting(void)
+{
+  int before = live_bytes(MEM_JOBS);
+  char *p = mem_malloc(MEM_JOBS, 100);
+  int usable = (int)malloc_usable_size(p);
+  TEST_ASSERT(usable >= 100, "Tracked block is a plain malloc() block");
+  TEST_EQUAL(live_bytes(MEM_JOBS) - before, usable, "Allocation counts its usable size for the subsystem");
+
+  char *q = malloc(10);
+  TEST_EQUAL(live_bytes(MEM_JOBS) - before, usable, "malloc() is not counted");
+
+  p = mem_realloc(MEM_JOBS, p, 5000);
+  p[4999] = 'x';
+  TEST_EQUAL(live_bytes(MEM_JOBS) - before, (int)malloc_usable_size(p), "mem_realloc moves the count with the block");
+  mem_free(MEM_JOBS, p);
+  free(q);
+  TEST_EQUAL(live_bytes(MEM_JOBS), before, "mem_free returns the bytes");
+
+  p = mem_realloc(MEM_JOBS, NULL, 50);
+  TEST_EQUAL(live_bytes(MEM_JOBS) - before, (int)malloc_usable_size(p), "mem_realloc of NULL allocates");
+  mem_free(MEM_JOBS, p);
+
+  // The C library's allocator is left alone
+  void *aligned = NULL;
+  TEST_EQUAL(posix_memalign(&aligned, 256, 1000), 0, "posix_memalign succeeds");
+  TEST_EQUAL((int)((uintptr_t)aligned % 256), 0, "posix_memalign honours the alignment");
+  free(aligned);
+  aligned = aligned_alloc(64, 128);
+  TEST_ASSERT(aligned && (uintptr_t)aligned % 64 == 0, "aligned_alloc honours the alignment");
+  free(aligned);
+  p = realloc(NULL, 30);
+  TEST_ASSERT(p && malloc_usable_size(p) >= 30, "realloc of NULL allocates");
+  free(p);
+  TEST_EQUAL(live_bytes(MEM_JOBS), before, "System allocations are not counted");
+
+  // Parsing and freeing a command leaves the parser where it started
+  int parser = live_bytes(MEM_PARSER);
+  command_t *cmd = parse_command("grep -F a < in.txt | wc -l > out.txt &");
+  TEST_ASSERT(live_bytes(MEM_PARSER) > parser, "Parsed command counts for the parser");
+  free_command(cmd);
+  TEST_EQUAL(live_bytes(MEM_PARSER), parser, "free_command releases the parser's bytes");
+  cmd = parse_command("echo $(echo a b) c");
+  expand_command(cmd);
+  free_command(cmd);
+  TEST_EQUAL(live_bytes(MEM_PARSER), parser, "Words from expansion are freed with the command");
+
+  int names = live_bytes(MEM_NAMES);
+  run_line("alias mem_test=\"ls -l\"");
+  TEST_ASSERT(live_bytes(MEM_NAMES) > names, "Alias counts for the name table");
+  run_line("unalias mem_test");
+  TEST_EQUAL(live_bytes(MEM_NAMES), names, "unalias releases it");
+
+  char path[] = "/tmp/mini_shell_meminfo_XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  char line[256];
+  snprintf(line, sizeof(line), "meminfo > %s", path);
+  run_line(line);
+  char *text = read_text(path);
+  TEST_ASSERT(text && strstr(text, "\nparser ") && strstr(text, "\nhistory ") && strstr(text, "\njobs "),
+              "meminfo lists the subsystems");
+  TEST_ASSERT(text && strstr(text, "\ntotal ") && strstr(text, "\nrss "), "meminfo shows totals and rss");
+  free(text);
+  run_line("meminfo extra");
+  TEST_EQUAL(get_last_status(), 2, "meminfo takes no arguments");
+  unlink(path);
+}
+
+/**
+ * Test Suite 27: Here-Documents
+ */
+void test_here_documents(void)
+{
+  command_t *cmd = parse_command("cat <<EOF > out.txt\nfirst\n  second\nEOF\n");
+  TEST_STRING_EQUAL(cmd->here_doc, "first\n  second\n", "Body runs up to the delimiter line");
+  TEST_ASSERT(cmd->input_redirect == NULL, "No input file");
+  TEST_STRING_EQUAL(cmd->output_redirect, "out.txt", "Other redirections still apply");
+  TEST_ASSERT(cmd->argv[1] == NULL, "Body is not tokenized");
+  free_command(cmd);
+
+  cmd = parse_command("cat <<'END' | wc -l <<< \"two words\"\n$(x) EOF\nEND\n");
+  TEST_STRING_EQUAL(cmd->here_doc, "$(x) EOF\n", "Quoted delimiter is unquoted");
+  TEST_STRING_EQUAL(cmd->pipe_to->here_doc, "two words\n", "Here-string is its word and a newline");
+  free_command(cmd);
+
+  cmd = parse_command("cat <<A <<B < in.txt\na\nA\nb\nB\n");
+  TEST_ASSERT(cmd->here_doc == NULL, "Last input redirection wins");
+  TEST_STRING_EQUAL(cmd->input_redirect, "in.txt", "Input file replaces the here-documents");
+  free_command(cmd);
+
+  cmd = parse_command("cat <<EOF\nno end\n");
+  TEST_STRING_EQUAL(cmd->here_doc, "no end\n", "Missing delimiter takes the rest of the input");
+  free_command(cmd);
+
+  char **delimiters = here_doc_delimiters("cat <<A | sort <<\"B\" <<< c\n");
+  TEST_ASSERT(delimiters && delimiters[0] && delimiters[1] && !delimiters[2], "Each here-document is listed");
+  TEST_ASSERT(delimiters && strcmp(delimiters[1], "B") == 0, "Delimiters come unquoted, in order");
+  free_tokens(delimiters);
+  TEST_ASSERT(here_doc_delimiters("wc -l <<< text\n") == NULL, "Here-string needs no body");
+  TEST_ASSERT(here_doc_end("EOF\n", "EOF") && !here_doc_end("EOF \n", "EOF"), "Delimiter line matches exactly");
+
+  char dir[] = "/tmp/mini_shell_heredoc_XXXXXX";
+  mkdtemp(dir);
+  char path[256], line[512];
+  snprintf(path, sizeof(path), "%s/out", dir);
+  int fds = count_open_fds();
+
+  snprintf(line, sizeof(line), "cat <<EOF > %s\nhello\nEOF\n", path);
+  run_line(line);
+  char *text = read_text(path);
+  TEST_STRING_EQUAL(text, "hello\n", "External command reads a small body");
+  free(text);
+
+  // Past the pipe buffer the body goes through a memfd
+  size_t size = 200000;
+  char *big = malloc(size + 128);
+  int len = snprintf(big, 128, "wc -c <<EOF > %s\n", path);
+  memset(big + len, 'x', size - 1);
+  strcpy(big + len + size - 1, "\nEOF\n");
+  run_line(big);
+  free(big);
+  text = read_text(path);
+  TEST_ASSERT(text && atoi(text) == (int)size, "Large body reaches the command whole");
+  free(text);
+
+  snprintf(line, sizeof(line), "head -n 1 <<< \"in shell\" > %s", path);
+  run_line(line);
+  text = read_text(path);
+  TEST_STRING_EQUAL(text, "in shell\n", "Builtin in the shell reads a here-string");
+  free(text);
+
+  snprintf(line, sizeof(line), "grep -F b <<EOF | wc -l > %s\na\nb\nab\nEOF\n", path);
+  run_line(line);
+  text = read_text(path);
+  TEST_ASSERT(text && atoi(text) == 2, "Threaded builtin stage reads a here-document");
+  free(text);
+
+  TEST_EQUAL(count_open_fds(), fds, "Here-document fds are closed");
+  unlink(path);
+  rmdir(dir);
+}
+
+/**
+ * Test Suite 28: Process Substitution
+ */
+void test_process_substitution(void)
+{
+  char **tokens = tokenize("diff <(sort \"a b\") >(wc -c) --in=<(ls | head)");
+  TEST_STRING_EQUAL(tokens[1], "<(sort \"a b\")", "<(...) is one word");
+  TEST_STRING_EQUAL(tokens[2], ">(wc -c)", ">(...) is one word");
+  TEST_STRING_EQUAL(tokens[3], "--in=<(ls | head)", "Substitution can end a word");
+  TEST_ASSERT(tokens[4] == NULL, "Nothing else");
+  free_tokens(tokens);
+
+  command_t *cmd = parse_command("wc -l < <(seq 3)");
+  TEST_STRING_EQUAL(cmd->input_redirect, "<(seq 3)", "Redirection target can be a substitution");
+  free_command(cmd);
+
+  char dir[] = "/tmp/mini_shell_procsub_XXXXXX";
+  mkdtemp(dir);
+  char path[256], line[512];
+  snprintf(path, sizeof(path), "%s/out", dir);
+  int fds = count_open_fds();
+
+  snprintf(line, sizeof(line), "cat <(echo one) <(sh -c \"sleep 0.1; echo two\") > %s", path);
+  run_line(line);
+  char *text = read_text(path);
+  TEST_STRING_EQUAL(text, "one\ntwo\n", "Command reads each substitution through /dev/fd");
+  free(text);
+
+  snprintf(line, sizeof(line), "wc -l < <(seq 1 100) > %s", path);
+  run_line(line);
+  text = read_text(path);
+  TEST_ASSERT(text && atoi(text) == 100, "Builtin reads a substitution as its input");
+  free(text);
+
+  snprintf(line, sizeof(line), "echo written > >(cat > %s)", path);
+  run_line(line);
+  text = read_text(path);
+  TEST_STRING_EQUAL(text, "written\n", ">(...) has finished when the command returns");
+  free(text);
+
+  snprintf(line, sizeof(line), "cmp <(head -c 1000000 /dev/zero) <(head -c 1000000 /dev/zero) > %s", path);
+  TEST_EQUAL(run_line(line), 0, "Producers stream side by side");
+  snprintf(line, sizeof(line), "head -n 1 <(yes) > %s", path);
+  TEST_EQUAL(run_line(line), 0, "Endless producer stops when the command is done");
+
+  cmd = parse_command("echo \"<(echo hi)\" x\">(y)\" \"<$(echo \"<(z)\")\"");
+  int started = count_open_fds();
+  TEST_EQUAL(expand_command(cmd), 0, "Quoted <( and >( expand");
+  TEST_STRING_EQUAL(cmd->argv[1], "<(echo hi)", "Quoted <(...) is literal text");
+  TEST_STRING_EQUAL(cmd->argv[2], "x>(y)", "Quoted >(...) is literal text");
+  TEST_STRING_EQUAL(cmd->argv[3], "<<(z)", "Quoted <(...) inside $(...) is literal text");
+  TEST_EQUAL(count_open_fds(), started, "Quoted substitution starts nothing");
+  free_command(cmd);
+
+  TEST_EQUAL(run_line("cat <(echo x"), 2, "Unterminated substitution is an error");
+  TEST_EQUAL(count_open_fds(), fds, "Substitution pipes are closed");
+  unlink(path);
+  rmdir(dir);
+}
+
+/* Keys typed at the line editor; PAUSE splits them into separate reads */
+#define PAUSE "\x1f"
+
+typedef struct editor_pty
+{
+  int master;
+  int slave;
+  const char *keys;
+  size_t drained; /* output after the first read of keys, up to the last */
+} editor_pty_t;
+
+static size_t drain_pty(int master)
+{
+  char buf[4096];
+  size_t total = 0;
+  ssize_t n;
+  while ((n = read(master, buf, sizeof(buf))) > 0)
+    total += n;
+  return total;
+}
+
+static void *type_keys(void *arg)
+{
+  editor_pty_t *t = arg;
+  const char *keys = t->keys;
+  for (int i = 0;; i++)
+  {
+    size_t n = strcspn(keys, PAUSE);
+    usleep(20000);
+    if (i == 1)
+      drain_pty(t->master);
+    if (!keys[n])
+      t->drained = drain_pty(t->master);
+    write(t->master, keys, n);
+    if (!keys[n])
+      break;
+    keys += n + 1;
+  }
+  return NULL;
+}
+
+// Read one line with the editor while a thread types the keys
+static char *edit_line(editor_pty_t *t, char *line, size_t size, const char *keys)
+{
+  pthread_t writer;
+  t->keys = keys;
+  pthread_create(&writer, NULL, type_keys, t);
+  char *got = editor_read("$ ", line, size);
+  pthread_join(writer, NULL);
+  drain_pty(t->master);
+  return got;
+}
+
+/**
+ * Test Suite 29: Line Editor
+ */
+void test_line_editor(void)
+{
+  int pipefd[2];
+  pipe(pipefd);
+  TEST_EQUAL(editor_init(pipefd[0], pipefd[1]), 0, "No editing unless on a terminal");
+  close(pipefd[0]);
+  close(pipefd[1]);
+
+  editor_pty_t t = {0};
+  t.master = posix_openpt(O_RDWR | O_NOCTTY);
+  TEST_ASSERT(t.master >= 0 && grantpt(t.master) == 0 && unlockpt(t.master) == 0, "Opened a pty");
+  t.slave = open(ptsname(t.master), O_RDWR | O_NOCTTY);
+  fcntl(t.master, F_SETFL, O_NONBLOCK);
+
+  // Keys must reach the editor as typed, before it switches to raw mode
+  struct termios before, after;
+  tcgetattr(t.slave, &before);
+  cfmakeraw(&before);
+  tcsetattr(t.slave, TCSANOW, &before);
+  struct winsize ws = {.ws_row = 24, .ws_col = 80};
+  ioctl(t.master, TIOCSWINSZ, &ws);
+
+  TEST_EQUAL(editor_init(t.slave, t.slave), 1, "Editing on a terminal");
+
+  char line[1024];
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "echo hi\r"), "echo hi\n", "Line is returned");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "wrld\x1b[D\x1b[D\x1b[Do\r"), "world\n",
+                    "Insert at the cursor");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "bc\x01" "a\x05" "d\r"), "abcd\n", "Ctrl-A and Ctrl-E");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "ab\x1b[Hx\x1b[F\x7fy\r"), "xay\n", "Home, End, Backspace");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "abc\x1b[D\x1b[D\x1b[3~\r"), "ac\n", "Delete");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "one two\x17three\r"), "one three\n", "Ctrl-W");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "one two\x1b[D\x1b[D\x0b\x15x\r"), "x\n",
+                    "Ctrl-K and Ctrl-U");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "cd one two\x1b[1;5D\x1b[1;5Dx\r"), "cd xone two\n",
+                    "Word moves");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "gone\x03" PAUSE "kept\r"), "kept\n", "Ctrl-C discards the line");
+
+  editor_add_history("first\n");
+  editor_add_history("second\n");
+  editor_add_history("second\n");
+  editor_add_history("cat <<EOF\nbody\nEOF\n");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "\x1b[A\r"), "second\n", "Up recalls the last line");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "\x1b[A\x1b[A\r"), "first\n",
+                    "Repeats and multi-line entries are not kept");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "draft\x1b[A\x1b[A\x1b[B\x1b[B\r"), "draft\n",
+                    "Down returns to the new line");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "\x10!\r"), "second!\n", "Recalled line can be edited");
+
+  char small[8];
+  TEST_STRING_EQUAL(edit_line(&t, small, sizeof(small), "0123456789\r"), "012345\n", "Line fits the buffer");
+  TEST_ASSERT(edit_line(&t, line, sizeof(line), "\x04") == NULL, "Ctrl-D on an empty line is end of input");
+
+  // A deadline passing mid-line prints a notice; the line is drawn again below it
+  run_line("timeout 0.1 sleep 5 &");
+  TEST_STRING_EQUAL(edit_line(&t, line, sizeof(line), "ab" PAUSE PAUSE PAUSE PAUSE PAUSE PAUSE PAUSE PAUSE PAUSE "c\r"),
+                    "abc\n", "Line survives a job notice");
+  TEST_ASSERT(t.drained >= strlen("\r\x1b[K$ ab"), "Prompt and line are redrawn after the notice");
+  TEST_EQUAL(drain_jobs(2), 0, "Timed-out background job is reaped");
+
+  // Forty edits on a long line send less than four redraws of the screen line would
+  char keys[512];
+  memset(keys, 'x', 200);
+  size_t len = 200;
+  for (int i = 0; i < 20; i++)
+    len += sprintf(keys + len, PAUSE "y" PAUSE "\x1b[D");
+  strcpy(keys + len, PAUSE "\r");
+  edit_line(&t, line, sizeof(line), keys);
+  TEST_EQUAL((int)strlen(line), 221, "Long line is read whole");
+  TEST_ASSERT(t.drained < 300, "Edits on a long line redraw only what changed");
+
+  tcgetattr(t.slave, &after);
+  TEST_ASSERT(after.c_lflag == before.c_lflag && after.c_iflag == before.c_iflag, "Terminal modes are restored");
+  close(t.slave);
+  close(t.master);
+}
+
 int main(void)
 {
   printf("Mini Unix Shell - Comprehensive Test Suite\n");
@@ -218,6 +1819,25 @@ int main(void)
   RUN_TEST_SUITE("Test 8: Parser - Multiple Arguments", test_parser_multiple_arguments);
   RUN_TEST_SUITE("Test 9: Parser - Both Redirections", test_parser_both_redirections);
   RUN_TEST_SUITE("Test 10: Parser - Flags and Options", test_parser_flags_and_options);
+  RUN_TEST_SUITE("Test 11: History - Binary Log", test_history_log);
+  RUN_TEST_SUITE("Test 12: Command Substitution", test_command_substitution);
+  RUN_TEST_SUITE("Test 13: Pipeline Fusion", test_pipeline_fusion);
+  RUN_TEST_SUITE("Test 14: Tracing", test_tracing);
+  RUN_TEST_SUITE("Test 15: Resource Annotations", test_resource_annotations);
+  RUN_TEST_SUITE("Test 16: Fan-out Pipelines", test_fanout);
+  RUN_TEST_SUITE("Test 17: Timeouts", test_timeouts);
+  RUN_TEST_SUITE("Test 18: Metrics", test_metrics);
+  RUN_TEST_SUITE("Test 19: Output Cache", test_output_cache);
+  RUN_TEST_SUITE("Test 20: Builtin Redirection", test_builtin_redirection);
+  RUN_TEST_SUITE("Test 21: Argument Batching", test_argument_batching);
+  RUN_TEST_SUITE("Test 22: Text Filters", test_text_filters);
+  RUN_TEST_SUITE("Test 23: Aliases and Functions", test_names);
+  RUN_TEST_SUITE("Test 24: Session Recording", test_session_recording);
+  RUN_TEST_SUITE("Test 25: Background Job Queue", test_job_queue);
+  RUN_TEST_SUITE("Test 26: Memory Accounting", test_memory_accounting);
+  RUN_TEST_SUITE("Test 27: Here-Documents", test_here_documents);
+  RUN_TEST_SUITE("Test 28: Process Substitution", test_process_substitution);
+  RUN_TEST_SUITE("Test 29: Line Editor", test_line_editor);
   print_test_results();
 
   return test_stats.failed_tests > 0 ? 1 : 0;